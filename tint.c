@@ -27,9 +27,14 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 #include <time.h>
 #include <pwd.h>
 #include <sys/types.h>
@@ -38,6 +43,27 @@
 #include <wchar.h>
 #include <limits.h>
 #include <sys/time.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <signal.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <math.h>
+#include "tintshm.h"
+#include "tintsim.h"
+#include "tintindex.h"
+#include "tintbook.h"
 
 #ifndef bool
 #define bool int
@@ -74,12 +100,12 @@
 /*
  * Initialize random number generator
  */
-void rand_init ()
+void rand_init (unsigned seed)
 {
 #ifdef USE_RAND
-   srand (time (NULL));
+   srand (seed);
 #else
-   srandom (time (NULL));
+   srandom (seed);
 #endif
 }
 
@@ -95,6 +121,16 @@ int rand_value (int range)
 #endif
 }
 
+/*
+ * Get the time of a monotonic clock in microseconds
+ */
+int64_t monotime ()
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC,&ts);
+   return ((int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
 /*
  * Convert an str to long. Returns TRUE if successful,
  * FALSE otherwise.
@@ -107,6 +143,165 @@ bool str2int (int *i,const char *str)
    return TRUE;
 }
 
+/*
+ * Store a 32-bit value in little endian byte order
+ */
+void put_u32 (unsigned char *p,uint32_t value)
+{
+   p[0] = value & 0xff;
+   p[1] = (value >> 8) & 0xff;
+   p[2] = (value >> 16) & 0xff;
+   p[3] = (value >> 24) & 0xff;
+}
+
+/*
+ * Load a 32-bit value stored in little endian byte order
+ */
+uint32_t get_u32 (const unsigned char *p)
+{
+   return ((uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24));
+}
+
+/*
+ * Store a 64-bit value in little endian byte order
+ */
+void put_u64 (unsigned char *p,uint64_t value)
+{
+   put_u32 (p,(uint32_t) value);
+   put_u32 (p + 4,(uint32_t) (value >> 32));
+}
+
+/*
+ * Load a 64-bit value stored in little endian byte order
+ */
+uint64_t get_u64 (const unsigned char *p)
+{
+   return ((uint64_t) get_u32 (p) | ((uint64_t) get_u32 (p + 4) << 32));
+}
+
+/*
+ * Store a value as a zigzag encoded varint. Returns the end of the varint
+ */
+unsigned char *put_varint (unsigned char *p,int64_t value)
+{
+   uint64_t v = ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+   while (v >= 0x80)
+	 {
+		*p++ = (v & 0x7f) | 0x80;
+		v >>= 7;
+	 }
+   *p++ = v;
+   return p;
+}
+
+/*
+ * Load a zigzag encoded varint. Returns the end of the varint, or NULL if
+ * it runs past the end of the buffer
+ */
+const unsigned char *get_varint (const unsigned char *p,const unsigned char *end,int64_t *value)
+{
+   uint64_t v = 0;
+   int shift = 0;
+   do
+	 {
+		if ((p >= end) || (shift > 63)) return NULL;
+		v |= (uint64_t) (*p & 0x7f) << shift;
+		shift += 7;
+	 }
+   while (*p++ & 0x80);
+   *value = (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+   return p;
+}
+
+/*
+ * Calculate the CRC-32 (IEEE 802.3) of a buffer
+ */
+uint32_t checksum (const unsigned char *buf,size_t len)
+{
+   static uint32_t table[256];
+   uint32_t crc = 0xffffffff;
+   size_t i;
+   int j;
+   if (!table[1])
+	 for (i = 0; i < 256; i++)
+	   {
+		  crc = i;
+		  for (j = 0; j < 8; j++) crc = (crc & 1) ? (crc >> 1) ^ 0xedb88320 : crc >> 1;
+		  table[i] = crc;
+	   }
+   crc = 0xffffffff;
+   for (i = 0; i < len; i++) crc = table[(crc ^ buf[i]) & 0xff] ^ (crc >> 8);
+   return (crc ^ 0xffffffff);
+}
+
+/*
+ * Histograms with a fixed number of buckets: values below 8 get a bucket
+ * each, larger ones are kept to within 1/8 of their value
+ */
+
+#define HIST_SUBBITS	3
+#define HIST_BUCKETS	((32 - HIST_SUBBITS + 1) << HIST_SUBBITS)
+
+typedef struct
+{
+   uint64_t count;
+   uint64_t sum;
+   uint32_t max;
+   uint32_t bucket[HIST_BUCKETS];
+} histogram_t;
+
+/*
+ * Add a value to a histogram. Negative values are counted as 0
+ */
+void hist_add (histogram_t *hist,int64_t value)
+{
+   uint32_t v = value < 0 ? 0 : value > UINT32_MAX ? UINT32_MAX : value;
+   int e;
+   hist->count++;
+   hist->sum += v;
+   if (v > hist->max) hist->max = v;
+   if (v < (1u << HIST_SUBBITS))
+	 hist->bucket[v]++;
+   else
+	 {
+		e = 31 - __builtin_clz (v);
+		hist->bucket[((e - HIST_SUBBITS + 1) << HIST_SUBBITS) + ((v >> (e - HIST_SUBBITS)) & ((1 << HIST_SUBBITS) - 1))]++;
+	 }
+}
+
+/*
+ * Add the values of another histogram to a histogram
+ */
+void hist_merge (histogram_t *hist,const histogram_t *other)
+{
+   int b;
+   hist->count += other->count;
+   hist->sum += other->sum;
+   if (other->max > hist->max) hist->max = other->max;
+   for (b = 0; b < HIST_BUCKETS; b++) hist->bucket[b] += other->bucket[b];
+}
+
+/*
+ * Get the value that the given fraction of the values in a histogram do
+ * not exceed (the top of the bucket it falls in, at most the maximum)
+ */
+uint32_t hist_percentile (const histogram_t *hist,double fraction)
+{
+   uint64_t target = (uint64_t) (fraction * hist->count + 0.5),seen = 0;
+   uint64_t top;
+   int b,e;
+   if (target < 1) target = 1;
+   for (b = 0; b < HIST_BUCKETS; b++)
+	 {
+		if ((seen += hist->bucket[b]) < target) continue;
+		if (b < (1 << HIST_SUBBITS)) return (b);
+		e = (b >> HIST_SUBBITS) + HIST_SUBBITS - 1;
+		top = ((uint64_t) ((1 << HIST_SUBBITS) + (b & ((1 << HIST_SUBBITS) - 1))) << (e - HIST_SUBBITS)) + ((uint64_t) 1 << (e - HIST_SUBBITS)) - 1;
+		return (top < hist->max ? top : hist->max);
+	 }
+   return (hist->max);
+}
+
 /*
  * Colors
  */
@@ -139,6 +334,9 @@ bool str2int (int *i,const char *str)
 /* Initialize screen */
 void io_init ();
 
+/* Initialize a screen of the specified size that is drawn, but never shown */
+void io_offscreen (int width,int height);
+
 /* Restore original screen state */
 void io_close ();
 
@@ -152,6 +350,9 @@ void out_setattr (int attr);
 /* Set color */
 void out_setcolor (int fg,int bg);
 
+/* Draw without colors */
+void out_setmono (bool mono);
+
 /* Move cursor to position (x,y) on the screen. Upper corner of screen is (0,0) */
 void out_gotoxy (int x,int y);
 
@@ -164,6 +365,18 @@ void out_printf (char *format, ...);
 /* Refresh screen */
 void out_refresh ();
 
+/* Clear screen */
+void out_clear ();
+
+/* Get the number of bytes written to the terminal so far, or -1 if unknown */
+int64_t out_written ();
+
+/* Get the number of bytes waiting to be sent to the terminal, or -1 if unknown */
+int out_pending ();
+
+/* Check if the terminal can take more output without blocking */
+bool out_ready ();
+
 /* Get the screen width */
 int out_width ();
 
@@ -183,9 +396,32 @@ int in_getch ();
 /* Set keyboard timeout in microseconds */
 void in_timeout (int delay);
 
+/* Make the next in_getch() return ERR after at most delay microseconds, */
+/* even if no timeout occurred by then */
+void in_wakeup (int delay);
+
 /* Empty keyboard buffer */
 void in_flush ();
 
+/* Read a character, waiting at most delay microseconds */
+int in_wait (int delay);
+
+/* Get the time left before in_getch() times out (in microseconds), */
+/* negative if it is overdue */
+int in_remaining ();
+
+/* Get the time the last key in_getch() or in_wait() returned came */
+int64_t in_keytime ();
+
+/* Get a file descriptor that polls readable when a key may have come */
+int in_fd ();
+
+/* Start reading the keyboard on a thread of its own */
+void in_start ();
+
+/* Stop reading the keyboard */
+void in_stop ();
+
 
 /* Number of colors defined in io.h */
 #define NUM_COLORS	8
@@ -209,20 +445,64 @@ static int out_attr;
 /* Current color used on screen */
 static int out_color;
 
+/* Colors are not used */
+static bool out_mono;
+
 /* This is the timeout in microseconds */
 static int in_timetotal;
 
-/* This is the amount of time left to before a timeout occurs (in microseconds) */
-static int in_timeleft;
+/* This is the time the next timeout occurs (in microseconds) */
+static int64_t in_deadline;
+
+/* This is the time the next in_getch() returns at the latest, 0 if unset */
+static int64_t in_wakeuptime;
+
+/* I/O accounting of the thread that draws, to see how much it wrote to the terminal */
+static int out_iofd = -1;
+
+/* Size of the ring of keys on their way from the input thread to the game */
+#define IN_RINGSIZE		256
+
+/* How long an escape waits for the rest of a sequence (in milliseconds) */
+#define IN_ESCDELAY		25
+
+typedef struct
+{
+   int ch;
+   int64_t time;								/* when it came */
+} in_event_t;
+
+/* Keys are read and timestamped on a thread of their own, so that they */
+/* are taken off the terminal when they come even while the game waits */
+/* for a refresh. The thread is the only one that moves the head of the */
+/* ring and the game the only one that moves the tail, so neither waits */
+/* for the other */
+typedef struct
+{
+   in_event_t event[IN_RINGSIZE];
+   unsigned head __attribute__ ((aligned (64)));
+   unsigned tail __attribute__ ((aligned (64)));
+   int64_t keytime;								/* when the last key taken out came */
+   int wake[2];									/* written to after a key is put in */
+   int stop[2];									/* written to when the thread should stop */
+   pthread_t thread;
+   bool running;
+} in_ring_t;
+
+/* The pipes are only there between in_start() and in_stop() */
+static in_ring_t in_ring = { .wake = { -1, -1 }, .stop = { -1, -1 } };
+
+/* The terminal was resized */
+static volatile sig_atomic_t in_resized;
+
 
 /*
  * Init & Close
  */
 
-/* Initialize screen */
-void io_init ()
+/* Set up the screen curses just opened */
+static void io_setup ()
 {
-   initscr ();
    start_color ();
    curs_set (CURSOR_INVISIBLE);
    out_attr = A_NORMAL;
@@ -247,17 +527,46 @@ void io_init ()
    attr_map[ATTR_INVISIBLE] = A_INVIS;
 
   keypad(stdscr, TRUE);
+
+   /* the file stays with the thread that opened it, the one that draws */
+   out_iofd = open ("/proc/thread-self/io",O_RDONLY | O_CLOEXEC);
+}
+
+/* Initialize screen */
+void io_init ()
+{
+   initscr ();
+   io_setup ();
+   in_start ();
+}
+
+/* Initialize a screen of the specified size that is drawn, but never shown. */
+/* Everything goes through curses as usual and is written to /dev/null, so */
+/* that drawing can be timed without a terminal */
+void io_offscreen (int width,int height)
+{
+   FILE *null;
+   if (((null = fopen ("/dev/null","r+")) == NULL) || (newterm ("xterm",null,null) == NULL))
+	 {
+		fprintf (stderr,"Error opening a screen on /dev/null\n");
+		exit (EXIT_FAILURE);
+	 }
+   resizeterm (height,width);
+   io_setup ();
 }
 
 /* Restore original screen state */
 void io_close ()
 {
+   in_stop ();
    echo ();
    attrset (A_NORMAL);
    clear ();
    curs_set (CURSOR_NORMAL);
    refresh ();
    endwin ();
+   if (out_iofd >= 0) close (out_iofd);
+   out_iofd = -1;
 }
 
 /*
@@ -273,11 +582,23 @@ void out_setattr (int attr)
 /* Set color */
 void out_setcolor (int fg,int bg)
 {
+   if (out_mono)
+	 {
+		attrset ((bg != COLOR_BLACK ? A_REVERSE : A_NORMAL) | out_attr);
+		return;
+	 }
    out_color = (color_map[bg] << 3) + color_map[fg];
    init_pair (out_color,color_map[fg],color_map[bg]);
    attrset (COLOR_PAIR (out_color) | out_attr);
 }
 
+/* Draw without colors. Anything with a background color is drawn in */
+/* reverse video instead, which takes far fewer bytes to switch */
+void out_setmono (bool mono)
+{
+   out_mono = mono;
+}
+
 /* Move cursor to position (x,y) on the screen. Upper corner of screen is (0,0) */
 void out_gotoxy (int x,int y)
 {
@@ -306,6 +627,44 @@ void out_refresh ()
    refresh ();
 }
 
+/* Clear screen */
+void out_clear ()
+{
+   clear ();
+}
+
+/* Get the number of bytes the thread that draws wrote so far, or -1 if */
+/* unknown. curses writes straight to the descriptor of the terminal on that */
+/* thread, and the input thread and the hint worker aren't counted, so */
+/* around out_refresh() this is what the frame wrote to the terminal */
+int64_t out_written ()
+{
+   char buf[512],*p;
+   ssize_t len;
+   if ((out_iofd < 0) || ((len = pread (out_iofd,buf,sizeof (buf) - 1,0)) <= 0)) return -1;
+   buf[len] = '\0';
+   if ((p = strstr (buf,"wchar: ")) == NULL) return -1;
+   return (strtoll (p + 7,NULL,10));
+}
+
+/* Get the number of bytes waiting to be sent to the terminal, or -1 if */
+/* unknown. Pseudo terminals always report 0, the writes block instead */
+int out_pending ()
+{
+   int pending;
+   if (ioctl (fileno (stdout),TIOCOUTQ,&pending) < 0) return -1;
+   return (pending);
+}
+
+/* Check if the terminal can take more output without blocking. Once the */
+/* buffers on the way to a slow terminal are full, a refresh would block */
+/* until it drained, which can take seconds */
+bool out_ready ()
+{
+   struct pollfd pfd = { fileno (stdout), POLLOUT, 0 };
+   return (poll (&pfd,1,0) != 0);
+}
+
 /* Get the screen width */
 int out_width ()
 {
@@ -321,90 +680,386 @@ int out_height ()
 /* Beep */
 void out_beep ()
 {
-   beep ();
+   /* beep() writes at once, don't let it wait for a terminal that is behind */
+   if (out_ready ()) beep ();
 }
 
 /*
  * Input
  */
 
-/* Read a character. Please note that you MUST call in_timeout() before in_getch() */
-int in_getch ()
+/* Put a key in the ring. A key that doesn't fit is lost */
+static void in_put (int ch,int64_t time)
+{
+   unsigned head = in_ring.head;
+   if (head - __atomic_load_n (&in_ring.tail,__ATOMIC_ACQUIRE) == IN_RINGSIZE) return;
+   in_ring.event[head % IN_RINGSIZE].ch = ch;
+   in_ring.event[head % IN_RINGSIZE].time = time;
+   __atomic_store_n (&in_ring.head,head + 1,__ATOMIC_RELEASE);
+   if (write (in_ring.wake[1],"",1) < 0) return;	/* a full pipe wakes the game anyway */
+}
+
+/* Key of the last byte of an escape sequence: ESC [ or ESC O followed by */
+/* it. Returns ERR for the keys the game doesn't use */
+static int in_escape (int final,int param)
+{
+   switch (final)
+	 {
+	  case 'A': return (KEY_UP);
+	  case 'B': return (KEY_DOWN);
+	  case 'C': return (KEY_RIGHT);
+	  case 'D': return (KEY_LEFT);
+	  case 'H': return (KEY_HOME);
+	  case 'F': return (KEY_END);
+	  case '~': return (param == 2 ? KEY_IC : param == 3 ? KEY_DC : param == 5 ? KEY_PPAGE : param == 6 ? KEY_NPAGE : ERR);
+	 }
+   return (ERR);
+}
+
+/* Read the keyboard and put the keys in the ring with the time they came. */
+/* The time is taken when a read returns, so keys that come together */
+/* share it. An escape on its own is a key once no more follows it */
+static void *in_thread (void *arg)
+{
+   struct pollfd fds[2] = { { STDIN_FILENO, POLLIN, 0 }, { in_ring.stop[0], POLLIN, 0 } };
+   unsigned char buf[64];
+   ssize_t len,i;
+   int64_t now;
+   int state = 0,param = 0,ch;
+   for (;;)
+	 {
+		if (poll (fds,2,state ? IN_ESCDELAY : -1) < 0)
+		  {
+			 if (errno == EINTR) continue;
+			 break;
+		  }
+		if (fds[1].revents) break;
+		now = monotime ();
+		if (!fds[0].revents)
+		  {
+			 /* the escape was pressed on its own */
+			 if (state == 1) in_put (27,now);
+			 state = 0;
+			 continue;
+		  }
+		if ((len = read (STDIN_FILENO,buf,sizeof (buf))) < 0 && (errno == EINTR)) continue;
+		if (len <= 0) break;
+		for (i = 0; i < len; i++)
+		  {
+			 ch = buf[i];
+			 switch (state)
+			   {
+				case 0:
+				  if (ch == 27) state = 1;
+				  else in_put (ch,now);
+				  break;
+				case 1:
+				  param = 0;
+				  if ((ch == '[') || (ch == 'O')) state = ch == '[' ? 2 : 3;
+				  else
+					{
+					   in_put (27,now);
+					   state = 0;
+					   i--;
+					}
+				  break;
+				default:
+				  /* parameters, then the byte that ends the sequence */
+				  if ((ch >= '0') && (ch <= '9')) param = param * 10 + ch - '0';
+				  else if ((ch >= 0x40) && (ch <= 0x7e))
+					{
+					   if ((ch = in_escape (ch,param)) != ERR) in_put (ch,now);
+					   state = 0;
+					}
+				  else if ((ch < 0x20) || (ch > 0x3f)) state = 0;
+			   }
+		  }
+	 }
+   return (NULL);
+}
+
+/* Tell the game the terminal was resized */
+static void in_sigwinch (int sig)
+{
+   in_resized = 1;
+   if (write (in_ring.wake[1],"",1) < 0) return;
+}
+
+/* Start reading the keyboard on a thread of its own */
+void in_start ()
+{
+   int i;
+   cbreak ();
+   in_ring.head = in_ring.tail = 0;
+   in_ring.keytime = -1;
+   in_resized = 0;
+   if ((pipe (in_ring.wake) < 0) || (pipe (in_ring.stop) < 0))
+	 {
+		endwin ();
+		fprintf (stderr,"Error reading the keyboard: %s\n",strerror (errno));
+		exit (EXIT_FAILURE);
+	 }
+   for (i = 0; i < 2; i++)
+	 {
+		fcntl (in_ring.wake[i],F_SETFL,O_NONBLOCK);
+		fcntl (in_ring.wake[i],F_SETFD,FD_CLOEXEC);
+		fcntl (in_ring.stop[i],F_SETFD,FD_CLOEXEC);
+	 }
+   /* curses finds out about a new size in getch(), which isn't called */
+   signal (SIGWINCH,in_sigwinch);
+   in_ring.running = pthread_create (&in_ring.thread,NULL,in_thread,NULL) == 0;
+}
+
+/* Stop reading the keyboard, if in_start() started it */
+void in_stop ()
+{
+   int i;
+   if (in_ring.running)
+	 {
+		if (write (in_ring.stop[1],"",1) == 1) pthread_join (in_ring.thread,NULL);
+		in_ring.running = FALSE;
+	 }
+   if (in_ring.wake[0] >= 0) signal (SIGWINCH,SIG_DFL);
+   for (i = 0; i < 2; i++)
+	 {
+		if (in_ring.wake[i] >= 0) close (in_ring.wake[i]);
+		if (in_ring.stop[i] >= 0) close (in_ring.stop[i]);
+		in_ring.wake[i] = in_ring.stop[i] = -1;
+	 }
+}
+
+/* Take the next key out of the ring, waiting until the given time at the */
+/* latest. Returns ERR if none came by then */
+static int in_take (int64_t until)
 {
-   struct timeval starttv,endtv;
+   struct pollfd pfd = { in_ring.wake[0], POLLIN, 0 };
+   struct winsize ws;
+   unsigned tail = in_ring.tail;
+   char buf[64];
+   int64_t left;
    int ch;
-   timeout (in_timeleft / 1000);
-   gettimeofday (&starttv,NULL);
-   ch = getch ();
-   gettimeofday (&endtv,NULL);
-   /* Timeout? */
-   if (ch == ERR)
-	 in_timeleft = in_timetotal;
-   /* No? Then calculate time left */
-   else
+   for (;;)
 	 {
-		endtv.tv_sec -= starttv.tv_sec;
-		endtv.tv_usec -= starttv.tv_usec;
-		if (endtv.tv_usec < 0)
+		if (in_resized)
 		  {
-			 endtv.tv_usec += 1000000;
-			 endtv.tv_sec--;
+			 in_resized = 0;
+			 if (ioctl (STDOUT_FILENO,TIOCGWINSZ,&ws) == 0) resizeterm (ws.ws_row,ws.ws_col);
+			 in_ring.keytime = monotime ();
+			 return (KEY_RESIZE);
 		  }
-		in_timeleft -= endtv.tv_usec;
-		if (in_timeleft <= 0) in_timeleft = in_timetotal;
+		if (__atomic_load_n (&in_ring.head,__ATOMIC_ACQUIRE) != tail)
+		  {
+			 ch = in_ring.event[tail % IN_RINGSIZE].ch;
+			 in_ring.keytime = in_ring.event[tail % IN_RINGSIZE].time;
+			 __atomic_store_n (&in_ring.tail,tail + 1,__ATOMIC_RELEASE);
+			 return (ch);
+		  }
+		/* the thread writes to the pipe after it puts a key in, so a key */
+		/* that came while it was emptied is seen before waiting */
+		while (read (in_ring.wake[0],buf,sizeof (buf)) > 0) ;
+		if (__atomic_load_n (&in_ring.head,__ATOMIC_ACQUIRE) != tail) continue;
+		if ((left = until - monotime ()) <= 0) return (ERR);
+		poll (&pfd,1,(left + 999) / 1000);
 	 }
+}
+
+/* Read a character. Please note that you MUST call in_timeout() before in_getch() */
+/* Timeouts are kept on the clock: when one occurs late, the next one is */
+/* still due a full timeout after the previous one was */
+int in_getch ()
+{
+   int64_t until = in_wakeuptime && (in_wakeuptime < in_deadline) ? in_wakeuptime : in_deadline;
+   int ch;
+   in_wakeuptime = 0;
+   ch = in_take (until);
+   /* Timeout? */
+   if ((ch == ERR) && (monotime () >= in_deadline)) in_deadline += in_timetotal;
    return ch;
 }
 
 /* Set keyboard timeout in microseconds */
 void in_timeout (int delay)
 {
-   /* ncurses timeout() function works with milliseconds, not microseconds */
-   in_timetotal = in_timeleft = delay;
+   in_timetotal = delay;
+   in_deadline = monotime () + delay;
+}
+
+/* Make the next in_getch() return ERR after at most delay microseconds, */
+/* even if no timeout occurred by then */
+void in_wakeup (int delay)
+{
+   int64_t t = monotime () + (delay > 0 ? delay : 0);
+   if (!in_wakeuptime || (t < in_wakeuptime)) in_wakeuptime = t;
 }
 
 /* Empty keyboard buffer */
 void in_flush ()
 {
    flushinp ();
+   __atomic_store_n (&in_ring.tail,__atomic_load_n (&in_ring.head,__ATOMIC_ACQUIRE),__ATOMIC_RELEASE);
+}
+
+/* Read a character, waiting at most delay microseconds */
+int in_wait (int delay)
+{
+   return (in_take (monotime () + (delay > 0 ? delay : 0)));
+}
+
+/* Get the time left before in_getch() times out (in microseconds), */
+/* negative if it is overdue */
+int in_remaining ()
+{
+   return (in_deadline - monotime ());
+}
+
+/* Get the time the last key in_getch() or in_wait() returned came */
+int64_t in_keytime ()
+{
+   return (in_ring.keytime);
+}
+
+/* Get a file descriptor that polls readable when a key may have come */
+int in_fd ()
+{
+   return (in_ring.wake[0]);
 }
 
-const char scorefile[] = "/var/games/tint.scores";
+#ifndef SCOREFILE
+#define SCOREFILE "/var/games/tint.scores"
+#endif
+
+#ifndef HISTORYFILE
+#define HISTORYFILE "/var/games/tint.history"
+#endif
+
+#ifndef INDEXFILE
+#define INDEXFILE "/var/games/tint.index"
+#endif
+
+#ifndef STATSFILE
+#define STATSFILE "/var/games/tint.stats"
+#endif
+
+#ifndef SOCKETFILE
+#define SOCKETFILE "/var/games/tint.socket"
+#endif
+
+#ifndef BOOKFILE
+#define BOOKFILE "/var/games/tint.book"
+#endif
+
+const char scorefile[] = SCOREFILE;
+const char historyfile[] = HISTORYFILE;
+const char indexfile[] = INDEXFILE;
+const char statsfile[] = STATSFILE;
+const char socketfile[] = SOCKETFILE;
+const char bookfile[] = BOOKFILE;
 /*
  * Macros
  */
 
-/* Number of shapes in the game */
+/* Number of shapes in the standard set */
 #define NUMSHAPES	7
 
-/* Number of blocks in each shape */
+/* Number of blocks in each shape of the standard set */
 #define NUMBLOCKS	4
 
-/* Number of rows and columns in board */
+/* Most shapes in a set, blocks in a shape and rotations of a shape */
+#define MAXSHAPES		32
+#define MAXBLOCKS		5
+#define MAXROTATIONS	4
+
+/* Most shapes that can be seen ahead of the current one */
+#define MAXPREVIEWS		5
+
+/* Size of the ring of shapes to come: a whole bag is added when fewer */
+/* than MAXPREVIEWS are left (a power of two) */
+#define QUEUESIZE		64
+
+/* Largest box a shape can be drawn in when it appears */
+#define MAXSHAPEWIDTH	MAXBLOCKS
+#define MAXSHAPEHEIGHT	4
+
+/* Number of rows and columns in the default board, walls included. A board */
+/* has a wall on the left, two on the right and two rows of floor */
 #define NUMROWS	23
 #define NUMCOLS	13
 
+/* Room for the largest board */
+#define MAXROWS	64
+#define MAXCOLS	43
+
+/* Size of the playing field */
+#define MINWIDTH	4
+#define MAXWIDTH	(MAXCOLS - 3)
+#define MINHEIGHT	20
+#define MAXHEIGHT	(MAXROWS - 3)
+
 /* Wall id - Arbitrary, but shouldn't have the same value as one of the colors */
 #define WALL 16
 
+/* Garbage id - Blocks pushed up from the bottom by an opponent in versus mode */
+#define GARBAGE 17
+
+/* Mask of a changed row, and of the changed rows when the whole board has */
+/* to be drawn */
+#define ROW(y) ((uint64_t) 1 << (y))
+#define ALLROWS (~(uint64_t) 0)
+
+/* Number of levels in the game */
+#define MINLEVEL	1
+#define MAXLEVEL	9
+
 /*
  * Type definitions
  */
 
-typedef int board_t[NUMCOLS][NUMROWS];
+typedef int board_t[MAXCOLS][MAXROWS];
 
 typedef struct
 {
    int x,y;
 } block_t;
 
+/* A shape as it is defined: its blocks when it appears, relative to the */
+/* block it rotates around, and the way it rotates first */
 typedef struct
 {
    int color;
-   int type;
-   bool flipped;
-   block_t block[NUMBLOCKS];
-} shape_t,shapes_t[NUMSHAPES];
+   bool clockwise;
+   int numblocks;
+   block_t block[MAXBLOCKS];
+} shapedef_t;
+
+/* A shape in one of its rotations */
+typedef struct
+{
+   int color;
+   int numblocks;
+   block_t block[MAXBLOCKS];					/* blocks relative to the centre of rotation */
+   int offset[MAXBLOCKS];						/* the same, as offsets into a board */
+   int left,right,top,bottom;					/* bounding box of the blocks */
+   int next;									/* rotation after rotating once */
+} rotation_t;
+
+typedef struct
+{
+   int color;
+   int y;										/* row the shape appears on */
+   block_t preview;								/* position in the box of the next shape */
+   int numrotations;
+   rotation_t rotation[MAXROTATIONS];
+} shape_t;
+
+/* A set of shapes, with everything the engine needs to know about them */
+/* worked out when the set is made */
+typedef struct
+{
+   int numshapes;
+   int width,height;							/* box the next shape is shown in */
+   int minwidth;								/* narrowest board all shapes fit on */
+   shape_t shape[MAXSHAPES];
+} pieces_t;
 
 typedef struct
 {
@@ -414,6 +1069,7 @@ typedef struct
    int efficiency;
    int droppedlines;
    int currentdroppedlines;
+   int keys;
 } status_t;
 
 typedef struct engine_struct
@@ -422,31 +1078,141 @@ typedef struct engine_struct
    int curx,cury,curx_shadow,cury_shadow;			/* coordinates of current piece */
    int curshape,nextshape;							/* current & next shapes */
    int score;										/* score */
-   int bag_iterator;								/* iterator for randomized bag */
-   int bag[NUMSHAPES];								/* pointer to bag of shapes */
-   shapes_t shapes;									/* shapes */
+   int queue[QUEUESIZE];							/* shapes to come, a bag at a time */
+   unsigned queuehead,queuetail;					/* shapes taken out of and put in the queue */
+   int previews;									/* shapes shown ahead */
+   const pieces_t *pieces;							/* shapes */
+   int rotation;									/* rotation of the current shape */
    board_t board;									/* board */
+   int cols,rows;									/* size of the board, walls included */
+   bool classic;									/* board has the default size */
    status_t status;									/* current status of shapes */
+   int level;										/* current level */
+   int shapecount[MAXSHAPES];						/* number of shapes of each type played */
+   int levelpieces[MAXLEVEL + 1];					/* shapes played before reaching each level */
+   bool shownext;									/* show next shape */
+   int garbage;										/* garbage rows waiting to be added */
+   uint64_t dirty;									/* rows changed since the board was drawn */
+   int faults;										/* shapes placed with more keys than needed */
+   int curx_hint,cury_hint,rotation_hint;			/* place suggested for the current shape, curx_hint < 0 if none */
    void (*score_function)(struct engine_struct *);	/* score function */
 } engine_t;
 
 typedef enum { ACTION_LEFT, ACTION_ROTATE, ACTION_RIGHT, ACTION_DROP, ACTION_DOWN } action_t;
 
-/*
- * Global variables
- */
+/* Most keys it may take to move a shape to the place it rests */
+#define MAXKEYS		255
 
-extern const shapes_t SHAPES;
+/* Most places a shape can rest: each has a blocked row below it */
+#define MAXPLACES	(MAXROTATIONS * MAXCOLS * MAXROWS / 2)
 
-/*
- * Functions
- */
+/* Number of positions of a shape: its rotation, column and row */
+#define NUMSTATES	(MAXROTATIONS * MAXCOLS * MAXROWS)
 
-/*
- * Initialize specified tetris engine
- */
+/* A place a shape can come to rest */
+typedef struct
+{
+   uint8_t x,y,rotation;
+   uint8_t keys;									/* keys to get there, the drop included */
+   uint16_t from;									/* position the shape is dropped from */
+} place_t;
+
+/* The shortest ways to move a shape to every place it can come to rest. */
+/* Positions are kept as a bit for each row, in each rotation and column */
+typedef struct
+{
+   uint64_t fit[MAXROTATIONS][MAXCOLS];			/* positions the shape fits in */
+   uint64_t seen[MAXROTATIONS][MAXCOLS];			/* positions reached */
+   uint8_t keys[NUMSTATES];							/* keys to reach each position */
+   int previous[MAXROTATIONS];						/* rotation before each rotation */
+   int numplaces;
+   place_t place[MAXPLACES];
+} finesse_t;
+
+/* State of a game packed for searches: the board as a bit for each row of */
+/* every column, the current shape and where it is, and how far into the */
+/* queue of the engine the game is. It takes six cache lines where an */
+/* engine takes hundreds, and a search changes it in place */
+typedef struct
+{
+   uint64_t column[MAXCOLS];						/* rows taken in each column, counting the floor and below */
+   uint8_t cols,rows;								/* size of the board, walls included */
+   uint8_t shape,rotation;							/* current shape and its rotation */
+   int8_t x,y;										/* position of the current shape */
+   unsigned queuehead;								/* shapes taken out of the queue */
+   int lines;										/* lines cleared */
+} state_t;
+
+/* What engine_apply() changed on a state. The blocks of the shape follow */
+/* from where it was put, and the rows that were cleared were full */
+typedef struct
+{
+   uint8_t shape,rotation;							/* current shape before, and where it was */
+   int8_t x,y;
+   place_t place;									/* where it was put */
+   uint64_t cleared;								/* rows cleared */
+} undo_t;
+
+/*
+ * Global variables
+ */
+
+extern const shapedef_t TETROMINOES[NUMSHAPES];
+extern const shapedef_t PENTOMINOES[18];
+
+/*
+ * Functions
+ */
+
+/*
+ * Work out the rotations, bounding boxes, offsets and preview positions of
+ * the given shapes once, so that the engine only has to look them up.
+ * Returns FALSE if a shape does not fit on any board
+ */
+bool pieces_make (pieces_t *pieces,const shapedef_t *defs,int n);
+
+/*
+ * Load a set of shapes from a file and make it
+ *
+ * OUTPUT:
+ *   0 = set loaded
+ *  -1 = error reading the file (see errno)
+ *  -2 = the shapes don't fit between the walls of any board
+ *  >0 = line of the file with the first bad shape
+ */
+int pieces_load (pieces_t *pieces,const char *filename);
+
+/*
+ * Look up the built-in set of shapes with the given name, making it the
+ * first time. Returns NULL if there is no such set
+ */
+const pieces_t *pieces_builtin (const char *name);
+
+/*
+ * Initialize specified tetris engine
+ */
 void engine_init (engine_t *engine,void (*score_function)(engine_t *));
 
+/*
+ * Change the size of the playing field of the specified tetris engine. Call
+ * this after engine_init() and before the game starts
+ */
+void engine_resize (engine_t *engine,int width,int height);
+
+/*
+ * Play with another set of shapes on the specified tetris engine. Call this
+ * after engine_init() and before the game starts
+ */
+void engine_pieces (engine_t *engine,const pieces_t *pieces);
+
+/*
+ * Get the shape that comes the given number of shapes after the current
+ * one on the specified tetris engine. 1 is the next shape. The queue holds
+ * at least MAXPREVIEWS shapes, and always the rest of the bag of the last
+ * one
+ */
+int engine_peek (const engine_t *engine,int ahead);
+
 /*
  * Perform the given action on the specified tetris engine
  */
@@ -462,106 +1228,156 @@ void engine_move (engine_t *engine,action_t action);
  */
 int engine_evaluate (engine_t *engine);
 
+/*
+ * Queue garbage rows on the specified tetris engine. They are pushed in below
+ * the resting shapes when the next shape comes to rest without clearing lines
+ */
+void engine_garbage (engine_t *engine,int lines);
+
+/*
+ * Make a compact copy of the state of the specified tetris engine, without
+ * the current shape and its shadow on the board
+ */
+void engine_snapshot (const engine_t *engine,state_t *state);
+
+/*
+ * Put the current shape of a state at a place found by finesse_search(),
+ * clear the full rows and take the next shape out of the queue of the
+ * specified tetris engine. Garbage is left out. What changed is written to
+ * undo. Up to MAXPREVIEWS shapes can be put one after the other before the
+ * queue runs out. Returns the number of lines cleared
+ */
+int engine_apply (const engine_t *engine,state_t *state,const place_t *place,undo_t *undo);
+
+/*
+ * Take back the changes engine_apply() made to a state
+ */
+void engine_undo (const engine_t *engine,state_t *state,const undo_t *undo);
+
+/*
+ * Find the shortest sequence of actions from the position of the current
+ * shape of a state to every place it can come to rest on the board. Without
+ * softdrop, the shape is only moved down by the drop at the end
+ */
+void finesse_search (finesse_t *finesse,const engine_t *engine,const state_t *state,bool softdrop);
+
+/*
+ * Write the actions that move the shape to a place found by finesse_search()
+ * to keys, ending with a drop. Returns the number of actions
+ */
+int finesse_path (const finesse_t *finesse,int place,action_t *keys);
+
+/*
+ * Fewest left, right and rotate actions it takes to put a new shape in the
+ * given rotation and column on an empty board of the specified tetris engine
+ */
+int finesse_min (const engine_t *engine,int shape,int rotation,int x);
+
 /*
  * Global variables
  */
 
-const shapes_t SHAPES =
+const shapedef_t TETROMINOES[NUMSHAPES] =
+{
+   { COLOR_CYAN,    FALSE, 4, { {  1,  0 }, {  0,  0 }, {  0, -1 }, { -1, -1 } } },
+   { COLOR_GREEN,   TRUE,  4, { {  1, -1 }, {  0, -1 }, {  0,  0 }, { -1,  0 } } },
+   { COLOR_YELLOW,  FALSE, 4, { { -1,  0 }, {  0,  0 }, {  1,  0 }, {  0,  1 } } },
+   { COLOR_BLUE,    FALSE, 4, { { -1, -1 }, {  0, -1 }, { -1,  0 }, {  0,  0 } } },
+   { COLOR_MAGENTA, FALSE, 4, { { -1,  1 }, { -1,  0 }, {  0,  0 }, {  1,  0 } } },
+   { COLOR_WHITE,   FALSE, 4, { {  1,  1 }, {  1,  0 }, {  0,  0 }, { -1,  0 } } },
+   { COLOR_RED,     TRUE,  4, { { -1,  0 }, {  0,  0 }, {  1,  0 }, {  2,  0 } } }
+};
+
+/* The eighteen pentominoes, mirror images counted twice since shapes are */
+/* never flipped: F, F', I, L, L', N, N', P, P', T, U, V, W, X, Y, Y', Z, Z' */
+const shapedef_t PENTOMINOES[18] =
 {
-   { COLOR_CYAN,    0, FALSE, { {  1,  0 }, {  0,  0 }, {  0, -1 }, { -1, -1 } } },
-   { COLOR_GREEN,   1, FALSE, { {  1, -1 }, {  0, -1 }, {  0,  0 }, { -1,  0 } } },
-   { COLOR_YELLOW,  2, FALSE, { { -1,  0 }, {  0,  0 }, {  1,  0 }, {  0,  1 } } },
-   { COLOR_BLUE,    3, FALSE, { { -1, -1 }, {  0, -1 }, { -1,  0 }, {  0,  0 } } },
-   { COLOR_MAGENTA, 4, FALSE, { { -1,  1 }, { -1,  0 }, {  0,  0 }, {  1,  0 } } },
-   { COLOR_WHITE,   5, FALSE, { {  1,  1 }, {  1,  0 }, {  0,  0 }, { -1,  0 } } },
-   { COLOR_RED,     6, FALSE, { { -1,  0 }, {  0,  0 }, {  1,  0 }, {  2,  0 } } }
+   { COLOR_CYAN,    FALSE, 5, { {  0, -1 }, {  1, -1 }, { -1,  0 }, {  0,  0 }, {  0,  1 } } },
+   { COLOR_GREEN,   FALSE, 5, { { -1, -1 }, {  0, -1 }, {  0,  0 }, {  1,  0 }, {  0,  1 } } },
+   { COLOR_RED,     FALSE, 5, { { -2,  0 }, { -1,  0 }, {  0,  0 }, {  1,  0 }, {  2,  0 } } },
+   { COLOR_MAGENTA, FALSE, 5, { { -1,  1 }, { -1,  0 }, {  0,  0 }, {  1,  0 }, {  2,  0 } } },
+   { COLOR_WHITE,   FALSE, 5, { {  2,  1 }, { -1,  0 }, {  0,  0 }, {  1,  0 }, {  2,  0 } } },
+   { COLOR_CYAN,    FALSE, 5, { { -1, -1 }, {  0, -1 }, {  0,  0 }, {  1,  0 }, {  2,  0 } } },
+   { COLOR_GREEN,   FALSE, 5, { {  1, -1 }, {  2, -1 }, { -1,  0 }, {  0,  0 }, {  1,  0 } } },
+   { COLOR_BLUE,    FALSE, 5, { { -1,  0 }, {  0,  0 }, {  1,  0 }, { -1,  1 }, {  0,  1 } } },
+   { COLOR_YELLOW,  FALSE, 5, { { -1,  0 }, {  0,  0 }, {  1,  0 }, {  0,  1 }, {  1,  1 } } },
+   { COLOR_YELLOW,  FALSE, 5, { { -1, -1 }, {  0, -1 }, {  1, -1 }, {  0,  0 }, {  0,  1 } } },
+   { COLOR_BLUE,    FALSE, 5, { { -1, -1 }, {  1, -1 }, { -1,  0 }, {  0,  0 }, {  1,  0 } } },
+   { COLOR_MAGENTA, FALSE, 5, { { -1, -1 }, { -1,  0 }, { -1,  1 }, {  0,  1 }, {  1,  1 } } },
+   { COLOR_WHITE,   FALSE, 5, { { -1, -1 }, { -1,  0 }, {  0,  0 }, {  0,  1 }, {  1,  1 } } },
+   { COLOR_RED,     FALSE, 5, { {  0, -1 }, { -1,  0 }, {  0,  0 }, {  1,  0 }, {  0,  1 } } },
+   { COLOR_CYAN,    FALSE, 5, { { -1,  0 }, {  0,  0 }, {  1,  0 }, {  2,  0 }, {  0,  1 } } },
+   { COLOR_GREEN,   FALSE, 5, { { -1,  0 }, {  0,  0 }, {  1,  0 }, {  2,  0 }, {  1,  1 } } },
+   { COLOR_BLUE,    FALSE, 5, { { -1, -1 }, {  0, -1 }, {  0,  0 }, {  0,  1 }, {  1,  1 } } },
+   { COLOR_YELLOW,  FALSE, 5, { {  1, -1 }, {  0, -1 }, {  0,  0 }, {  0,  1 }, { -1,  1 } } }
 };
 
 /*
  * Functions
  */
 
-/* This rotates a shape */
-static void real_rotate (shape_t *shape,bool clockwise)
-{
-   int i,tmp;
-   if (clockwise)
-	 {
-		for (i = 0; i < NUMBLOCKS; i++)
-		  {
-			 tmp = shape->block[i].x;
-			 shape->block[i].x = -shape->block[i].y;
-			 shape->block[i].y = tmp;
-		  }
-	 }
-   else
-	 {
-		for (i = 0; i < NUMBLOCKS; i++)
-		  {
-			 tmp = shape->block[i].x;
-			 shape->block[i].x = shape->block[i].y;
-			 shape->block[i].y = -tmp;
-		  }
-	 }
-}
-
-/* Rotate shapes the way tetris likes it (= not mathematically correct) */
-static void fake_rotate (shape_t *shape)
-{
-   switch (shape->type)
-	 {
-	  case 0:	/* Just rotate this one anti-clockwise and clockwise */
-		if (shape->flipped) real_rotate (shape,TRUE); else real_rotate (shape,FALSE);
-		shape->flipped = !shape->flipped;
-		break;
-	  case 1:	/* Just rotate these two clockwise and anti-clockwise */
-	  case 6:
-		if (shape->flipped) real_rotate (shape,FALSE); else real_rotate (shape,TRUE);
-		shape->flipped = !shape->flipped;
-		break;
-	  case 2:	/* Rotate these three anti-clockwise */
-	  case 4:
-	  case 5:
-		real_rotate (shape,FALSE);
-		break;
-	  case 3:	/* This one is not rotated at all */
-		break;
-	 }
-}
+/* Current shape in its current rotation */
+#define CURRENT(engine) (&(engine)->pieces->shape[(engine)->curshape].rotation[(engine)->rotation])
 
 /* Draw a shape on the board */
-static void drawshape (board_t board,shape_t *shape,int x,int y)
+static void drawshape (board_t board,const rotation_t *shape,int x,int y)
 {
+   int *cell = &board[x][y];
    int i;
-   for (i = 0; i < NUMBLOCKS; i++) board[x + shape->block[i].x][y + shape->block[i].y] = shape->color;
+   for (i = 0; i < shape->numblocks; i++) cell[shape->offset[i]] = shape->color;
 }
 
 /* Erase a shape from the board */
-static void eraseshape (board_t board,shape_t *shape,int x,int y)
+static void eraseshape (board_t board,const rotation_t *shape,int x,int y)
 {
+   int *cell = &board[x][y];
    int i;
-   for (i = 0; i < NUMBLOCKS; i++) board[x + shape->block[i].x][y + shape->block[i].y] = COLOR_BLACK;
+   for (i = 0; i < shape->numblocks; i++) cell[shape->offset[i]] = COLOR_BLACK;
 }
 
 /* Check if shape is allowed to be in this position */
-static bool allowed (board_t board,shape_t *shape,int x,int y)
+static bool allowed (board_t board,const rotation_t *shape,int x,int y)
 {
+   const int *cell = &board[x][y];
    int i,occupied = FALSE;
-   for (i = 0; i < NUMBLOCKS; i++) if (board[x + shape->block[i].x][y + shape->block[i].y]) occupied = TRUE;
+   for (i = 0; i < shape->numblocks; i++) if (cell[shape->offset[i]]) occupied = TRUE;
    return (!occupied);
 }
 
+/* Check if a shape stays between the walls and below the top of the board. */
+/* A shape moved one block at a time can't get further than the walls, so */
+/* only a shape that is rotated has to be checked */
+static bool inside (const engine_t *engine,const rotation_t *shape,int x,int y)
+{
+   return ((x + shape->left >= 1) && (x + shape->right <= engine->cols - 3) &&
+		   (y + shape->top >= 0) && (y + shape->bottom <= engine->rows - 3));
+}
+
 /* Set y coordinate of shadow */
-static void place_shadow_to_bottom (board_t board,shape_t *shape,int x_shadow,int *y_shadow,int y) {
+static void place_shadow_to_bottom (board_t board,const rotation_t *shape,int x_shadow,int *y_shadow,int y) {
    while (allowed(board,shape,x_shadow,y+1)) y++;
    *y_shadow = y;
 }
 
+/* Mark the rows covered by the current shape, its shadow and its hint as changed */
+static void touchshape (engine_t *engine)
+{
+   const rotation_t *shape = CURRENT (engine);
+   const rotation_t *hint = &engine->pieces->shape[engine->curshape].rotation[engine->rotation_hint];
+   int i;
+   for (i = 0; i < shape->numblocks; i++)
+	 {
+		engine->dirty |= ROW (engine->cury + shape->block[i].y);
+		if (engine->shadow) engine->dirty |= ROW (engine->cury_shadow + shape->block[i].y);
+		if (engine->curx_hint >= 0) engine->dirty |= ROW (engine->cury_hint + hint->block[i].y);
+	 }
+}
+
 /* Move the shape left if possible */
 static bool shape_left (engine_t *engine)
 {
    board_t *board = &engine->board;
-   shape_t *shape = &engine->shapes[engine->curshape];
+   const rotation_t *shape = CURRENT (engine);
    bool result = FALSE;
    eraseshape (*board,shape,engine->curx,engine->cury);
    if (engine->shadow) eraseshape (*board,shape,engine->curx_shadow,engine->cury_shadow);
@@ -584,7 +1400,7 @@ static bool shape_left (engine_t *engine)
 static bool shape_right (engine_t *engine)
 {
    board_t *board = &engine->board;
-   shape_t *shape = &engine->shapes[engine->curshape];
+   const rotation_t *shape = CURRENT (engine);
    bool result = FALSE;
    eraseshape (*board,shape,engine->curx,engine->cury);
    if (engine->shadow) eraseshape (*board,shape,engine->curx_shadow,engine->cury_shadow);
@@ -607,16 +1423,15 @@ static bool shape_right (engine_t *engine)
 static bool shape_rotate (engine_t *engine)
 {
    board_t *board = &engine->board;
-   shape_t *shape = &engine->shapes[engine->curshape];
+   const rotation_t *shape = CURRENT (engine);
+   const rotation_t *test = &engine->pieces->shape[engine->curshape].rotation[shape->next];
    bool result = FALSE;
-   shape_t test;
    eraseshape (*board,shape,engine->curx,engine->cury);
    if (engine->shadow) eraseshape (*board,shape,engine->curx_shadow,engine->cury_shadow);
-   memcpy (&test,shape,sizeof (shape_t));
-   fake_rotate (&test);
-   if (allowed (*board,&test,engine->curx,engine->cury))
+   if (inside (engine,test,engine->curx,engine->cury) && allowed (*board,test,engine->curx,engine->cury))
 	 {
-		memcpy (shape,&test,sizeof (shape_t));
+		engine->rotation = shape->next;
+		shape = test;
 		result = TRUE;
 		if (engine->shadow) place_shadow_to_bottom(*board,shape,engine->curx_shadow,&engine->cury_shadow,engine->cury);
 	 }
@@ -629,7 +1444,7 @@ static bool shape_rotate (engine_t *engine)
 static bool shape_down (engine_t *engine)
 {
    board_t *board = &engine->board;
-   shape_t *shape = &engine->shapes[engine->curshape];
+   const rotation_t *shape = CURRENT (engine);
    bool result = FALSE;
    eraseshape (*board,shape,engine->curx,engine->cury);
    if (engine->shadow) eraseshape (*board,shape,engine->curx_shadow,engine->cury_shadow);
@@ -649,7 +1464,7 @@ static bool shape_down (engine_t *engine)
 static bool shape_bottom (engine_t *engine)
 {
    board_t *board = &engine->board;
-   shape_t *shape = &engine->shapes[engine->curshape];
+   const rotation_t *shape = CURRENT (engine);
    bool result = FALSE;
    eraseshape (*board,shape,engine->curx,engine->cury);
    if (engine->shadow) eraseshape (*board,shape,engine->curx_shadow,engine->cury_shadow);
@@ -664,7 +1479,7 @@ static bool shape_bottom (engine_t *engine)
 static int shape_drop (engine_t *engine)
 {
    board_t *board = &engine->board;
-   shape_t *shape = &engine->shapes[engine->curshape];
+   const rotation_t *shape = CURRENT (engine);
    eraseshape (*board,shape,engine->curx,engine->cury);
    int droppedlines = 0;
 
@@ -684,33 +1499,63 @@ static int shape_drop (engine_t *engine)
    return droppedlines;
 }
 
+/*
+ * Everything that walks the whole board is written once for any size and
+ * inlined twice: once with the default size as a constant, so that the
+ * compiler can unroll it, and once for any other size. SIZED() picks the
+ * copy that fits the board of an engine
+ */
+#define SIZED(engine,function,...) ((engine)->classic ? function (__VA_ARGS__,NUMCOLS,NUMROWS) : function (__VA_ARGS__,(engine)->cols,(engine)->rows))
+#define INLINE static inline __attribute__ ((always_inline))
+
+/* Put the walls and the floor around an empty board */
+INLINE void sized_clearboard (board_t board,int cols,int rows)
+{
+   int i;
+   for (i = 0; i < cols; i++) memset (board[i],0,rows * sizeof (int));
+   for (i = 0; i < cols; i++) board[i][rows - 1] = board[i][rows - 2] = WALL;
+   for (i = 0; i < rows; i++) board[0][i] = board[cols - 1][i] = board[cols - 2][i] = WALL;
+}
+
 /* This removes all the rows on the board that is completely filled with blocks */
-static int droplines (board_t board)
-{
-   int i,x,y,ny,status,droppedlines;
-   board_t newboard;
-   /* initialize new board */
-   memset (newboard,0,sizeof (board_t));
-   for (i = 0; i < NUMCOLS; i++) newboard[i][NUMROWS - 1] = newboard[i][NUMROWS - 2] = WALL;
-   for (i = 0; i < NUMROWS; i++) newboard[0][i] = newboard[NUMCOLS - 1][i] = newboard[NUMCOLS - 2][i] = WALL;
-   /* ... */
-   ny = NUMROWS - 3;
+INLINE int sized_droplines (board_t board,int cols,int rows)
+{
+   int x,y,ny,status,droppedlines;
+   /* move the rows that are not full down over the full ones */
+   ny = rows - 3;
    droppedlines = 0;
-   for (y = NUMROWS - 3; y > 0; y--)
+   for (y = rows - 3; y > 0; y--)
 	 {
 		status = 0;
-		for (x = 1; x < NUMCOLS - 2; x++) if (board[x][y]) status++;
-		if (status < NUMCOLS - 3)
+		for (x = 1; x < cols - 2; x++) if (board[x][y]) status++;
+		if (status < cols - 3)
 		  {
-			 for (x = 1; x < NUMCOLS - 2; x++) newboard[x][ny] = board[x][y];
+			 if (ny != y) for (x = 1; x < cols - 2; x++) board[x][ny] = board[x][y];
 			 ny--;
 		  }
 		else droppedlines++;
 	 }
-   memcpy (board,newboard,sizeof (board_t));
+   /* and clear what is left above them */
+   for (y = ny; y >= 0; y--) for (x = 1; x < cols - 2; x++) board[x][y] = 0;
    return droppedlines;
 }
 
+/* Push the resting shapes up and fill the bottom rows with garbage, leaving */
+/* one hole in each row. Returns FALSE if blocks were pushed off the top */
+INLINE bool sized_addgarbage (board_t board,int lines,int cols,int rows)
+{
+   int x,y,hole = 1 + rand_value (cols - 3);
+   bool overflow = FALSE;
+   if (lines > rows - 3) lines = rows - 3;
+   for (y = 1; y <= lines; y++) for (x = 1; x < cols - 2; x++) if (board[x][y]) overflow = TRUE;
+   for (y = 1; y < rows - 2 - lines; y++) for (x = 1; x < cols - 2; x++) board[x][y] = board[x][y + lines];
+   for (y = rows - 2 - lines; y < rows - 2; y++) for (x = 1; x < cols - 2; x++) board[x][y] = x == hole ? COLOR_BLACK : GARBAGE;
+   return (!overflow);
+}
+
+/* Column a new shape starts in */
+#define SPAWNX(engine) (((engine)->cols - 3) / 2)
+
 /* shuffle int array */
 void shuffle (int *array, size_t n)
 {
@@ -725,34 +1570,336 @@ void shuffle (int *array, size_t n)
    }
 }
 
+/* Rotate blocks around the centre of rotation */
+static void rotateblocks (block_t *block,int n,bool clockwise)
+{
+   int i,tmp;
+   if (clockwise)
+	 {
+		for (i = 0; i < n; i++)
+		  {
+			 tmp = block[i].x;
+			 block[i].x = -block[i].y;
+			 block[i].y = tmp;
+		  }
+	 }
+   else
+	 {
+		for (i = 0; i < n; i++)
+		  {
+			 tmp = block[i].x;
+			 block[i].x = block[i].y;
+			 block[i].y = -tmp;
+		  }
+	 }
+}
+
+/* Work out the offsets and the bounding box of a shape in one rotation */
+static void makerotation (rotation_t *rotation,int color,const block_t *block,int n)
+{
+   int i;
+   rotation->color = color;
+   rotation->numblocks = n;
+   rotation->left = rotation->right = block[0].x;
+   rotation->top = rotation->bottom = block[0].y;
+   for (i = 0; i < n; i++)
+	 {
+		rotation->block[i] = block[i];
+		rotation->offset[i] = block[i].x * MAXROWS + block[i].y;
+		if (block[i].x < rotation->left) rotation->left = block[i].x;
+		if (block[i].x > rotation->right) rotation->right = block[i].x;
+		if (block[i].y < rotation->top) rotation->top = block[i].y;
+		if (block[i].y > rotation->bottom) rotation->bottom = block[i].y;
+	 }
+}
+
+/* Check if two rotations look the same, wherever their blocks are */
+static bool lookalike (const rotation_t *a,const rotation_t *b)
+{
+   int i,j;
+   for (i = 0; i < a->numblocks; i++)
+	 {
+		for (j = 0; j < b->numblocks; j++)
+		  if ((a->block[i].x - a->left == b->block[j].x - b->left) && (a->block[i].y - a->top == b->block[j].y - b->top)) break;
+		if (j == b->numblocks) return FALSE;
+	 }
+   return TRUE;
+}
+
+/* Check if every shape of a set fits between the walls when it appears */
+static bool fitsboard (const pieces_t *pieces,int width)
+{
+   const rotation_t *first;
+   int i;
+   for (i = 0; i < pieces->numshapes; i++)
+	 {
+		first = &pieces->shape[i].rotation[0];
+		if ((width / 2 + first->left < 1) || (width / 2 + first->right > width)) return FALSE;
+	 }
+   return TRUE;
+}
+
+/*
+ * Work out the rotations, bounding boxes, offsets and preview positions of
+ * the given shapes once, so that the engine only has to look them up.
+ * Returns FALSE if a shape does not fit on any board
+ */
+bool pieces_make (pieces_t *pieces,const shapedef_t *defs,int n)
+{
+   block_t block[MAXBLOCKS];
+   shape_t *shape;
+   const rotation_t *first;
+   int i,r,width,height;
+   memset (pieces,0,sizeof (pieces_t));
+   pieces->numshapes = n;
+   pieces->width = pieces->height = NUMBLOCKS;
+   for (i = 0; i < n; i++)
+	 {
+		shape = &pieces->shape[i];
+		shape->color = defs[i].color;
+		memcpy (block,defs[i].block,defs[i].numblocks * sizeof (block_t));
+		/* rotate the shape until it looks the way it started */
+		makerotation (&shape->rotation[0],shape->color,block,defs[i].numblocks);
+		for (r = 1; r < MAXROTATIONS; r++)
+		  {
+			 rotateblocks (block,defs[i].numblocks,defs[i].clockwise);
+			 makerotation (&shape->rotation[r],shape->color,block,defs[i].numblocks);
+			 if (lookalike (&shape->rotation[r],&shape->rotation[0])) break;
+			 shape->rotation[r - 1].next = r;
+		  }
+		shape->numrotations = r;
+		shape->rotation[r - 1].next = 0;
+		/* let it appear low enough to be rotated straight away */
+		for (shape->y = 1, r = 0; r < shape->numrotations; r++)
+		  if (-shape->rotation[r].top > shape->y) shape->y = -shape->rotation[r].top;
+		first = &shape->rotation[0];
+		width = first->right - first->left + 1;
+		height = first->bottom - first->top + 1;
+		if ((width > MAXSHAPEWIDTH) || (height > MAXSHAPEHEIGHT)) return FALSE;
+		if ((first->left > 0) || (first->right < 0) || (first->top > 0) || (first->bottom < 0)) return FALSE;
+		if (width > pieces->width) pieces->width = width;
+		if (height > pieces->height) pieces->height = height;
+	 }
+   /* centre the shapes in the box of the next shape, in columns of the screen */
+   for (i = 0; i < n; i++)
+	 {
+		first = &pieces->shape[i].rotation[0];
+		pieces->shape[i].preview.x = pieces->width - (first->right - first->left + 1) - 2 * first->left;
+		pieces->shape[i].preview.y = (pieces->height - (first->bottom - first->top + 1)) / 2 - first->top;
+	 }
+   for (pieces->minwidth = MINWIDTH; pieces->minwidth <= MAXWIDTH; pieces->minwidth++)
+	 if (fitsboard (pieces,pieces->minwidth)) return TRUE;
+   return FALSE;
+}
+
+/*
+ * Load a set of shapes from a file and make it
+ *
+ * OUTPUT:
+ *   0 = set loaded
+ *  -1 = error reading the file (see errno)
+ *  -2 = the shapes don't fit between the walls of any board
+ *  >0 = line of the file with the first bad shape
+ */
+int pieces_load (pieces_t *pieces,const char *filename)
+{
+   static const int colors[] = { COLOR_RED, COLOR_GREEN, COLOR_YELLOW, COLOR_BLUE, COLOR_MAGENTA, COLOR_CYAN, COLOR_WHITE };
+   shapedef_t defs[MAXSHAPES],*def = NULL;
+   block_t centre = { 0, 0 };
+   char buf[256];
+   int i,x,n = 0,line = 0,start = 0,rows = 0,centres = 0;
+   bool end;
+   FILE *f;
+   if ((f = fopen (filename,"r")) == NULL) return (-1);
+   do
+	 {
+		end = fgets (buf,sizeof (buf),f) == NULL;
+		line++;
+		if (!end && (buf[0] == '#')) continue;
+		if (!end) buf[strcspn (buf,"\r\n")] = '\0';
+		/* a blank line or the end of the file ends a shape */
+		if (end || (strspn (buf," \t") == strlen (buf)))
+		  {
+			 if (def == NULL) continue;
+			 if ((centres != 1) || (def->numblocks == 0) || (rows > MAXSHAPEHEIGHT)) break;
+			 for (i = 0; i < def->numblocks; i++)
+			   {
+				  def->block[i].x -= centre.x;
+				  def->block[i].y -= centre.y;
+			   }
+			 def = NULL;
+			 n++;
+			 continue;
+		  }
+		/* a line of the picture of a shape */
+		if (def == NULL)
+		  {
+			 if (n == MAXSHAPES) break;
+			 def = &defs[n];
+			 def->color = colors[n % (sizeof (colors) / sizeof (colors[0]))];
+			 def->clockwise = FALSE;
+			 def->numblocks = 0;
+			 start = line;
+			 rows = centres = 0;
+		  }
+		for (x = 0; buf[x] != '\0'; x++)
+		  {
+			 if (strchr (" \t.",buf[x]) != NULL) continue;
+			 if (((buf[x] != 'X') && (buf[x] != '@')) || (x >= MAXSHAPEWIDTH) || (def->numblocks == MAXBLOCKS)) break;
+			 if (buf[x] == '@')
+			   {
+				  centre.x = x;
+				  centre.y = rows;
+				  centres++;
+			   }
+			 def->block[def->numblocks].x = x;
+			 def->block[def->numblocks++].y = rows;
+		  }
+		if (buf[x] != '\0') break;
+		rows++;
+	 }
+   while (!end);
+   if (ferror (f))
+	 {
+		fclose (f);
+		return (-1);
+	 }
+   fclose (f);
+   if (def != NULL) return (start);
+   if (!end || (n == 0)) return (line);
+   /* every shape read fits in the box of a shape, so the only way */
+   /* making them fails is that no board is wide enough for all of them */
+   return (pieces_make (pieces,defs,n) ? 0 : -2);
+}
+
+/*
+ * Look up the built-in set of shapes with the given name, making it the
+ * first time. Returns NULL if there is no such set
+ */
+const pieces_t *pieces_builtin (const char *name)
+{
+   static pieces_t tetrominoes,pentominoes;
+   if (strcmp (name,"tetrominoes") == 0)
+	 {
+		if (!tetrominoes.numshapes) pieces_make (&tetrominoes,TETROMINOES,NUMSHAPES);
+		return (&tetrominoes);
+	 }
+   if (strcmp (name,"pentominoes") == 0)
+	 {
+		if (!pentominoes.numshapes) pieces_make (&pentominoes,PENTOMINOES,sizeof (PENTOMINOES) / sizeof (PENTOMINOES[0]));
+		return (&pentominoes);
+	 }
+   return (NULL);
+}
+
+/* Put a bag with every shape of the set, in random order, at the end of the queue */
+static void queue_refill (engine_t *engine)
+{
+   int bag[MAXSHAPES],i,n = engine->pieces->numshapes;
+   for (i = 0; i < n; i++) bag[i] = i;
+   shuffle (bag,n);
+   for (i = 0; i < n; i++) engine->queue[engine->queuetail++ % QUEUESIZE] = bag[i];
+}
+
+/* Take the next shape out of the queue, keeping enough shapes in it to */
+/* see MAXPREVIEWS ahead */
+static void queue_next (engine_t *engine)
+{
+   while (engine->queuetail - engine->queuehead <= MAXPREVIEWS) queue_refill (engine);
+   engine->curshape = engine->queue[engine->queuehead++ % QUEUESIZE];
+   engine->nextshape = engine->queue[engine->queuehead % QUEUESIZE];
+}
+
+/* Go back to the shape taken out of the queue before the current one. The */
+/* current shape becomes the next one again. Shapes at the end of the queue */
+/* are dropped if there is no room for both */
+static void queue_back (engine_t *engine,int shape)
+{
+   if (engine->queuetail - (engine->queuehead - 2) > QUEUESIZE) engine->queuetail = engine->queuehead - 2 + QUEUESIZE;
+   engine->queuehead--;
+   engine->queue[(engine->queuehead - 1) % QUEUESIZE] = shape;
+   engine->curshape = shape;
+   engine->nextshape = engine->queue[engine->queuehead % QUEUESIZE];
+}
+
+/* Start a new queue of shapes and take out the first one */
+static void fillbag (engine_t *engine)
+{
+   engine->queuehead = engine->queuetail = 0;
+   queue_next (engine);
+   engine->rotation = 0;
+   engine->cury = engine->cury_shadow = engine->pieces->shape[engine->curshape].y;
+   memset (engine->shapecount,0,sizeof (engine->shapecount));
+   engine->shapecount[engine->curshape]++;
+}
+
 /*
  * Initialize specified tetris engine
  */
 void engine_init (engine_t *engine,void (*score_function)(engine_t *))
 {
-   int i;
    engine->shadow = FALSE;
    engine->score_function = score_function;
+   engine->cols = NUMCOLS;
+   engine->rows = NUMROWS;
+   engine->classic = TRUE;
+   engine->pieces = pieces_builtin ("tetrominoes");
    /* intialize values */
-   engine->curx = 5;
-   engine->cury = 1;
-   engine->curx_shadow = 5;
-   engine->cury_shadow = 1;
-   engine->bag_iterator = 0;
+   engine->curx = SPAWNX (engine);
+   engine->curx_shadow = SPAWNX (engine);
    /* create and randomize bag */
-   for (int j = 0; j < NUMSHAPES; j++) engine->bag[j] = j;
-   shuffle (engine->bag,NUMSHAPES);
-   engine->curshape = engine->bag[engine->bag_iterator%NUMSHAPES];
-   engine->nextshape = engine->bag[(engine->bag_iterator+1)%NUMSHAPES];
-   engine->bag_iterator++;
+   fillbag (engine);
    engine->score = 0;
    engine->status.moves = engine->status.rotations = engine->status.dropcount = engine->status.efficiency = engine->status.droppedlines = 0;
-   /* initialize shapes */
-   memcpy (engine->shapes,SHAPES,sizeof (shapes_t));
+   engine->status.keys = engine->faults = 0;
+   engine->curx_hint = -1;
+   engine->rotation_hint = 0;
+   engine->level = MINLEVEL;
+   memset (engine->levelpieces,0,sizeof (engine->levelpieces));
+   engine->shownext = FALSE;
+   engine->previews = 1;
+   engine->garbage = 0;
+   engine->dirty = ALLROWS;
    /* initialize board */
    memset (engine->board,0,sizeof (board_t));
-   for (i = 0; i < NUMCOLS; i++) engine->board[i][NUMROWS - 1] = engine->board[i][NUMROWS - 2] = WALL;
-   for (i = 0; i < NUMROWS; i++) engine->board[0][i] = engine->board[NUMCOLS - 1][i] = engine->board[NUMCOLS - 2][i] = WALL;
+   SIZED (engine,sized_clearboard,engine->board);
+}
+
+/*
+ * Change the size of the playing field of the specified tetris engine. Call
+ * this after engine_init() and before the game starts
+ */
+void engine_resize (engine_t *engine,int width,int height)
+{
+   engine->cols = width + 3;
+   engine->rows = height + 3;
+   engine->classic = (engine->cols == NUMCOLS) && (engine->rows == NUMROWS);
+   engine->curx = engine->curx_shadow = SPAWNX (engine);
+   engine->dirty = ALLROWS;
+   memset (engine->board,0,sizeof (board_t));
+   SIZED (engine,sized_clearboard,engine->board);
+}
+
+/*
+ * Play with another set of shapes on the specified tetris engine. Call this
+ * after engine_init() and before the game starts
+ */
+void engine_pieces (engine_t *engine,const pieces_t *pieces)
+{
+   if (engine->pieces == pieces) return;
+   engine->pieces = pieces;
+   fillbag (engine);
+}
+
+/*
+ * Get the shape that comes the given number of shapes after the current
+ * one on the specified tetris engine. 1 is the next shape. The queue holds
+ * at least MAXPREVIEWS shapes, and always the rest of the bag of the last
+ * one
+ */
+int engine_peek (const engine_t *engine,int ahead)
+{
+   return (engine->queue[(engine->queuehead + ahead - 1) % QUEUESIZE]);
 }
 
 /*
@@ -760,19 +1907,23 @@ void engine_init (engine_t *engine,void (*score_function)(engine_t *))
  */
 void engine_move (engine_t *engine,action_t action)
 {
+   touchshape (engine);
    switch (action)
 	 {
 		/* move shape to the left if possible */
 	  case ACTION_LEFT:
         if (shape_left (engine)) engine->status.moves++;
+		engine->status.keys++;
 		break;
 		/* rotate shape if possible */
 	  case ACTION_ROTATE:
 		if (shape_rotate (engine)) engine->status.rotations++;
+		engine->status.keys++;
 		break;
 		/* move shape to the right if possible */
 	  case ACTION_RIGHT:
 	    if (shape_right (engine)) engine->status.moves++;
+		engine->status.keys++;
 		break;
 		/* move shape to the down if possible */
 	  case ACTION_DOWN:
@@ -782,6 +1933,7 @@ void engine_move (engine_t *engine,action_t action)
 	  case ACTION_DROP:
 		engine->status.dropcount += shape_drop (engine);
 	 }
+   touchshape (engine);
 }
 
 /*
@@ -794,62 +1946,662 @@ void engine_move (engine_t *engine,action_t action)
  */
 int engine_evaluate (engine_t *engine)
 {
+   touchshape (engine);
    if (shape_bottom (engine))
 	 {
+		engine->curx_hint = -1;
+		/* count a finesse fault if the shape took more keys than it had to */
+		if (engine->status.keys > finesse_min (engine,engine->curshape,engine->rotation,engine->curx)) engine->faults++;
 		/* update status information */
-		int dropped_lines = droplines(engine->board);
+		int dropped_lines = SIZED (engine,sized_droplines,engine->board);
+		bool overflow = FALSE;
 		engine->status.droppedlines += dropped_lines;
 		engine->status.currentdroppedlines = dropped_lines;
+		if (dropped_lines) engine->dirty = ALLROWS;
+		/* push in the garbage sent by opponents */
+		else if (engine->garbage)
+		  {
+			 overflow = !SIZED (engine,sized_addgarbage,engine->board,engine->garbage);
+			 engine->garbage = 0;
+			 engine->dirty = ALLROWS;
+		  }
 		/* increase score */
 		engine->score_function (engine);
-		engine->curx -= 5;
+		engine->curx -= SPAWNX (engine);
 		engine->curx = abs (engine->curx);
-		engine->curx_shadow -= 5;
+		engine->curx_shadow -= SPAWNX (engine);
 		engine->curx_shadow = abs (engine->curx_shadow);
 		engine->status.rotations = 4 - engine->status.rotations;
 		engine->status.rotations = engine->status.rotations > 0 ? 0 : engine->status.rotations;
 		engine->status.efficiency += engine->status.dropcount + engine->status.rotations + (engine->curx - engine->status.moves);
 		engine->status.efficiency >>= 1;
-		engine->status.dropcount = engine->status.rotations = engine->status.moves = 0;
+		engine->status.dropcount = engine->status.rotations = engine->status.moves = engine->status.keys = 0;
 		/* intialize values */
-		engine->curx = 5;
-		engine->cury = 1;
-		engine->curx_shadow = 5;
-		engine->cury_shadow = 1;
-		engine->curshape = engine->bag[engine->bag_iterator%NUMSHAPES];
-		/* shuffle bag before first item in bag would be reused */
-		if ((engine->bag_iterator+1) % NUMSHAPES == 0) shuffle(engine->bag, NUMSHAPES);
-		engine->nextshape = engine->bag[(engine->bag_iterator+1)%NUMSHAPES];
-		engine->bag_iterator++;
-		/* initialize shapes */
-		memcpy (engine->shapes,SHAPES,sizeof (shapes_t));
+		queue_next (engine);
+		engine->rotation = 0;
+		engine->curx = SPAWNX (engine);
+		engine->cury = engine->pieces->shape[engine->curshape].y;
+		engine->curx_shadow = SPAWNX (engine);
+		engine->cury_shadow = engine->cury;
 		/* return games status */
-		return allowed (engine->board,&engine->shapes[engine->curshape],engine->curx,engine->cury) ? 0 : -1;
+		return !overflow && allowed (engine->board,CURRENT (engine),engine->curx,engine->cury) ? 0 : -1;
 	 }
    shape_down (engine);
+   touchshape (engine);
    return 1;
 }
 
 /*
- * Macros
+ * Queue garbage rows on the specified tetris engine. They are pushed in below
+ * the resting shapes when the next shape comes to rest without clearing lines
  */
+void engine_garbage (engine_t *engine,int lines)
+{
+   engine->garbage += lines;
+}
 
-/* Upper left corner of board */
-#define XTOP ((out_width () - NUMROWS - 3) >> 1)
-#define YTOP ((out_height () - NUMCOLS - 9) >> 1)
+/* Make a shape the current shape of a state, where new shapes appear */
+static void state_spawn (const engine_t *engine,state_t *state,int shape)
+{
+   state->shape = shape;
+   state->rotation = 0;
+   state->x = SPAWNX (engine);
+   state->y = engine->pieces->shape[shape].y;
+}
 
-/* Maximum digits in a number (i.e. number of digits in score, */
-/* number of blocks, etc. should not exceed this value */
-#define MAXDIGITS 5
+/*
+ * Make a compact copy of the state of the specified tetris engine, without
+ * the current shape and its shadow on the board
+ */
+void engine_snapshot (const engine_t *engine,state_t *state)
+{
+   const rotation_t *shape = CURRENT (engine);
+   int x,y;
+   for (x = 0; x < engine->cols; x++)
+	 for (y = 0, state->column[x] = ALLROWS << (engine->rows - 2); y < engine->rows - 2; y++)
+	   if (engine->board[x][y]) state->column[x] |= ROW (y);
+   for (x = 0; x < shape->numblocks; x++)
+	 {
+		state->column[engine->curx + shape->block[x].x] &= ~ROW (engine->cury + shape->block[x].y);
+		if (engine->shadow) state->column[engine->curx_shadow + shape->block[x].x] &= ~ROW (engine->cury_shadow + shape->block[x].y);
+	 }
+   state->cols = engine->cols;
+   state->rows = engine->rows;
+   state->shape = engine->curshape;
+   state->rotation = engine->rotation;
+   state->x = engine->curx;
+   state->y = engine->cury;
+   state->queuehead = engine->queuehead;
+   state->lines = engine->status.droppedlines;
+}
 
-/* Number of levels in the game */
-#define MINLEVEL	1
-#define MAXLEVEL	9
+/*
+ * Put the current shape of a state at a place found by finesse_search(),
+ * clear the full rows and take the next shape out of the queue of the
+ * specified tetris engine. Garbage is left out. What changed is written to
+ * undo. Up to MAXPREVIEWS shapes can be put one after the other before the
+ * queue runs out. Returns the number of lines cleared
+ */
+int engine_apply (const engine_t *engine,state_t *state,const place_t *place,undo_t *undo)
+{
+   const rotation_t *shape = &engine->pieces->shape[state->shape].rotation[place->rotation];
+   uint64_t full = ROW (state->rows - 2) - 2,above,cleared;
+   int i,y;
+   undo->shape = state->shape;
+   undo->rotation = state->rotation;
+   undo->x = state->x;
+   undo->y = state->y;
+   undo->place = *place;
+   /* like the engine, empty the hidden top row once the shape comes to */
+   /* rest, whether lines are cleared or not, and look for full rows below it */
+   for (i = 0; i < shape->numblocks; i++) state->column[place->x + shape->block[i].x] |= ROW (place->y + shape->block[i].y) & ~ROW (0);
+   for (i = 1; i < state->cols - 2; i++) full &= state->column[i];
+   /* take them out from the top down, moving the rows above each down */
+   for (undo->cleared = cleared = full; cleared; cleared &= cleared - 1)
+	 {
+		y = __builtin_ctzll (cleared);
+		above = ROW (y) - 1;
+		for (i = 1; i < state->cols - 2; i++)
+		  state->column[i] = ((state->column[i] & above) << 1) | (state->column[i] & ~(above | ROW (y)));
+	 }
+   state->lines += __builtin_popcountll (full);
+   state_spawn (engine,state,engine->queue[state->queuehead++ % QUEUESIZE]);
+   return (__builtin_popcountll (full));
+}
 
-/* This calculates the time allowed to move a shape, before it is moved a row down */
-#define DELAY (1000000 / (level + 2))
+/*
+ * Take back the changes engine_apply() made to a state
+ */
+void engine_undo (const engine_t *engine,state_t *state,const undo_t *undo)
+{
+   const rotation_t *shape = &engine->pieces->shape[undo->shape].rotation[undo->place.rotation];
+   uint64_t above,cleared;
+   int i,y;
+   /* put the full rows back from the bottom up, moving the rows above each up */
+   for (cleared = undo->cleared; cleared; cleared &= ~ROW (y))
+	 {
+		y = 63 - __builtin_clzll (cleared);
+		above = ROW (y) - 1;
+		for (i = 1; i < state->cols - 2; i++)
+		  state->column[i] = ((state->column[i] >> 1) & above) | ROW (y) | (state->column[i] & ~above);
+	 }
+   for (i = 0; i < shape->numblocks; i++) state->column[undo->place.x + shape->block[i].x] &= ~ROW (undo->place.y + shape->block[i].y);
+   state->lines -= __builtin_popcountll (undo->cleared);
+   state->queuehead--;
+   state->shape = undo->shape;
+   state->rotation = undo->rotation;
+   state->x = undo->x;
+   state->y = undo->y;
+}
 
-/* The score is multiplied by this to avoid losing precision */
+/*
+ * Finesse
+ */
+
+/* Index of a position of a shape */
+#define STATE(rotation,x,y) (((rotation) * MAXCOLS + (x)) * MAXROWS + (y))
+
+/* Check if a position has been reached */
+#define SEEN(finesse,rotation,x,y) ((finesse)->seen[rotation][x] & ROW (y))
+
+/*
+ * Find the shortest sequence of actions from the position of the current
+ * shape of a state to every place it can come to rest on the board. Without
+ * softdrop, the shape is only moved down by the drop at the end
+ */
+void finesse_search (finesse_t *finesse,const engine_t *engine,const state_t *state,bool softdrop)
+{
+   const shape_t *current = &engine->pieces->shape[state->shape];
+   const uint64_t *taken = state->column;
+   const rotation_t *r;
+   uint64_t front[2][MAXROTATIONS][MAXCOLS],bits,grown,fit;
+   int i,j,k,n = current->numrotations,best,rotation = state->rotation,x = state->x,y = state->y;
+   /* the rows each rotation fits in, in each column */
+   for (k = 0; k < n; k++)
+	 {
+		r = &current->rotation[k];
+		finesse->previous[r->next] = k;
+		for (i = 0; i < engine->cols; i++)
+		  {
+			 fit = (i + r->left >= 0) && (i + r->right < engine->cols) ? ROW (engine->rows - 2) - 1 : 0;
+			 for (j = 0; fit && (j < r->numblocks); j++)
+			   if (r->block[j].y >= 0) fit &= ~(taken[i + r->block[j].x] >> r->block[j].y);
+			   else fit &= ~(taken[i + r->block[j].x] << -r->block[j].y) & (ALLROWS << -r->block[j].y);
+			 finesse->fit[k][i] = fit;
+		  }
+	 }
+   /* breadth first, all rows of a column at once: each key takes the */
+   /* positions reached with one key less left, right, round or down */
+   memset (finesse->seen,0,sizeof (finesse->seen));
+   memset (front,0,sizeof (front));
+   finesse->seen[rotation][x] = front[0][rotation][x] = ROW (y);
+   finesse->keys[STATE (rotation,x,y)] = 0;
+   for (k = 1, grown = 1; grown && (k < MAXKEYS); k++)
+	 for (i = 0, grown = 0; i < n; i++)
+	   for (j = 1; j < engine->cols - 1; j++)
+		 {
+			bits = front[(k - 1) & 1][i][j - 1] | front[(k - 1) & 1][i][j + 1] | front[(k - 1) & 1][finesse->previous[i]][j];
+			if (softdrop) bits |= front[(k - 1) & 1][i][j] << 1;
+			bits &= finesse->fit[i][j] & ~finesse->seen[i][j];
+			front[k & 1][i][j] = bits;
+			finesse->seen[i][j] |= bits;
+			grown |= bits;
+			for (; bits; bits &= bits - 1) finesse->keys[STATE (i,j,__builtin_ctzll (bits))] = k;
+		 }
+   /* a shape rests where it doesn't fit a row lower, and is best dropped */
+   /* from the position above it that took the fewest keys to reach */
+   finesse->numplaces = 0;
+   for (i = 0; i < n; i++)
+	 for (j = 1; j < engine->cols - 1; j++)
+	   for (bits = softdrop ? finesse->seen[i][j] & ~(finesse->fit[i][j] >> 1) : finesse->seen[i][j]; bits; bits &= bits - 1)
+		 {
+			best = y = __builtin_ctzll (bits);
+			if (!softdrop)
+			  y += __builtin_ctzll (~(finesse->fit[i][j] >> y)) - 1;
+			else for (k = y; (k > 0) && SEEN (finesse,i,j,k - 1); k--)
+			  if (finesse->keys[STATE (i,j,k - 1)] < finesse->keys[STATE (i,j,best)]) best = k - 1;
+			finesse->place[finesse->numplaces].x = j;
+			finesse->place[finesse->numplaces].y = y;
+			finesse->place[finesse->numplaces].rotation = i;
+			finesse->place[finesse->numplaces].keys = finesse->keys[STATE (i,j,best)] + 1;
+			finesse->place[finesse->numplaces++].from = STATE (i,j,best);
+		 }
+}
+
+/*
+ * Write the actions that move the shape to a place found by finesse_search()
+ * to keys, ending with a drop. Returns the number of actions
+ */
+int finesse_path (const finesse_t *finesse,int place,action_t *keys)
+{
+   int i,state = finesse->place[place].from,rotation,x,y,k;
+   keys[finesse->place[place].keys - 1] = ACTION_DROP;
+   /* walk back through positions reached with one key less each */
+   for (i = finesse->place[place].keys - 2; i >= 0; i--)
+	 {
+		y = state % MAXROWS;
+		x = state / MAXROWS % MAXCOLS;
+		rotation = state / MAXROWS / MAXCOLS;
+		k = finesse->keys[state] - 1;
+		if (SEEN (finesse,rotation,x + 1,y) && (finesse->keys[STATE (rotation,x + 1,y)] == k))
+		  {
+			 keys[i] = ACTION_LEFT;
+			 state = STATE (rotation,x + 1,y);
+		  }
+		else if (SEEN (finesse,rotation,x - 1,y) && (finesse->keys[STATE (rotation,x - 1,y)] == k))
+		  {
+			 keys[i] = ACTION_RIGHT;
+			 state = STATE (rotation,x - 1,y);
+		  }
+		else if ((y > 0) && SEEN (finesse,rotation,x,y - 1) && (finesse->keys[STATE (rotation,x,y - 1)] == k))
+		  {
+			 keys[i] = ACTION_DOWN;
+			 state = STATE (rotation,x,y - 1);
+		  }
+		else
+		  {
+			 keys[i] = ACTION_ROTATE;
+			 state = STATE (finesse->previous[rotation],x,y);
+		  }
+	 }
+   return (finesse->place[place].keys);
+}
+
+/*
+ * Fewest left, right and rotate actions it takes to put a new shape in the
+ * given rotation and column on an empty board of the specified tetris engine
+ */
+int finesse_min (const engine_t *engine,int shape,int rotation,int x)
+{
+   /* worked out for one set of shapes and size of board at a time */
+   static struct
+   {
+	  const pieces_t *pieces;
+	  int cols,rows;
+	  uint8_t keys[MAXSHAPES][MAXROTATIONS][MAXCOLS];
+   } empty;
+   static finesse_t finesse;
+   state_t state;
+   const place_t *place;
+   int i,j;
+   if ((empty.pieces != engine->pieces) || (empty.cols != engine->cols) || (empty.rows != engine->rows))
+	 {
+		for (i = 0; i < engine->cols; i++) state.column[i] = (i < 1) || (i >= engine->cols - 2) ? ALLROWS : ALLROWS << (engine->rows - 2);
+		state.cols = engine->cols;
+		state.rows = engine->rows;
+		memset (empty.keys,MAXKEYS,sizeof (empty.keys));
+		for (i = 0; i < engine->pieces->numshapes; i++)
+		  {
+			 state_spawn (engine,&state,i);
+			 finesse_search (&finesse,engine,&state,FALSE);
+			 for (j = 0; j < finesse.numplaces; j++)
+			   {
+				  place = &finesse.place[j];
+				  if (place->keys - 1 < empty.keys[i][place->rotation][place->x]) empty.keys[i][place->rotation][place->x] = place->keys - 1;
+			   }
+		  }
+		empty.pieces = engine->pieces;
+		empty.cols = engine->cols;
+		empty.rows = engine->rows;
+	 }
+   return (empty.keys[shape][rotation][x]);
+}
+
+/*
+ * Opening book
+ */
+
+/* Book the first bag is played from, NULL if there is none */
+static const tintbook_t *book;
+
+/* Check that a place read from the book is on the board and clear of the */
+/* blocks of the specified state, so that a damaged book is not followed */
+static bool book_fits (const engine_t *engine,const state_t *state,const tintbook_place_t *place)
+{
+   const shape_t *shape = &engine->pieces->shape[state->shape];
+   const rotation_t *rotation;
+   int i,x,y;
+   if (place->rotation >= shape->numrotations) return (FALSE);
+   rotation = &shape->rotation[place->rotation];
+   for (i = 0; i < rotation->numblocks; i++)
+	 {
+		x = place->x + rotation->block[i].x;
+		y = place->y + rotation->block[i].y;
+		if ((x < 1) || (x >= state->cols - 2) || (y < 0) || (y >= state->rows - 2) || (state->column[x] & ROW (y))) return (FALSE);
+	 }
+   return (TRUE);
+}
+
+/* Find the place the book has for the current shape of the specified */
+/* tetris engine, whose state is given, among the places the finesse */
+/* search of that state found the shape can get to. The book is only */
+/* followed on the board, with the shapes and with the weights it was made */
+/* for, and as long as every shape of the bag so far went where it says. */
+/* Returns the number of the place, or -1 if it has none */
+static int book_find (const engine_t *engine,const state_t *state,const finesse_t *finesse,const double *weights)
+{
+   const tintbook_entry_t *entry;
+   state_t expected;
+   place_t place;
+   undo_t undo;
+   int i,x,k = engine->queuehead - 1;
+   if ((book == NULL) || (k < 0) || (k >= TINTBOOK_SHAPES) || (engine->cols != book->width + 3) || (engine->rows != book->height + 3) ||
+	   (engine->pieces != pieces_builtin ("tetrominoes")) || memcmp (weights,book->weights,sizeof (book->weights)))
+	 return (-1);
+   entry = &book->entry[tintbook_rank (engine->queue)];
+   /* put the shapes before this one where the book does, on an empty board */
+   memcpy (&expected,state,sizeof (state_t));
+   for (x = 1; x < state->cols - 2; x++) expected.column[x] = ALLROWS << (state->rows - 2);
+   expected.lines = 0;
+   expected.queuehead = 1;
+   state_spawn (engine,&expected,engine->queue[0]);
+   for (i = 0; i < k; i++)
+	 {
+		if (!book_fits (engine,&expected,&entry->place[i])) return (-1);
+		place.x = entry->place[i].x;
+		place.y = entry->place[i].y;
+		place.rotation = entry->place[i].rotation;
+		engine_apply (engine,&expected,&place,&undo);
+	 }
+   for (x = 1; x < state->cols - 2; x++) if (expected.column[x] != state->column[x]) return (-1);
+   /* and this one where it says, if the shape can get there */
+   for (i = 0; i < finesse->numplaces; i++)
+	 if ((finesse->place[i].x == entry->place[k].x) && (finesse->place[i].y == entry->place[k].y) &&
+		 (finesse->place[i].rotation == entry->place[k].rotation))
+	   return (i);
+   return (-1);
+}
+
+/*
+ * Bot
+ */
+
+/* Number of features the bot looks at when it judges a board */
+#define NUMFEATURES	5
+
+/* Weights of the features the bot plays with unless told otherwise: */
+/* aggregate height, full lines, holes, bumpiness and the depth of wells. */
+/* tint-tune looks for better ones */
+#define BOTWEIGHTS	{ -0.510066, 0.760666, -0.35663, -0.184483, 0 }
+
+static double botweights[NUMFEATURES] = BOTWEIGHTS;
+
+typedef struct
+{
+   int piece;				/* shape the plan was made for (shapes taken out of the queue) */
+   int x,y,rotation;		/* where the shape should be before the next key */
+   int numkeys,next;		/* keys that take the shape to its place */
+   action_t keys[MAXKEYS];
+} plan_t;
+
+/* Judge a state in which a shape has just come to rest */
+static double judgestate (const state_t *state,int lines)
+{
+   int x,height[MAXCOLS],low,total = 0,holes = 0,bumpiness = 0,wells = 0;
+   uint64_t taken;
+   for (x = 1; x < state->cols - 2; x++)
+	 {
+		/* the rows between the top one and the floor */
+		taken = state->column[x] & (ROW (state->rows - 2) - 2);
+		height[x] = taken ? state->rows - 2 - __builtin_ctzll (taken) : 0;
+		total += height[x];
+		holes += height[x] - __builtin_popcountll (taken);
+		if (x > 1) bumpiness += abs (height[x] - height[x - 1]);
+	 }
+   /* a well is a column lower than both its neighbours, or a neighbour and the wall */
+   height[0] = height[state->cols - 2] = state->rows;
+   for (x = 1; x < state->cols - 2; x++)
+	 {
+		low = height[x - 1] < height[x + 1] ? height[x - 1] : height[x + 1];
+		if (low > height[x]) wells += low - height[x];
+	 }
+   return (botweights[0] * total + botweights[1] * lines + botweights[2] * holes + botweights[3] * bumpiness + botweights[4] * wells);
+}
+
+/* Find the best place for the current shape among all places it can be */
+/* moved to from where it is now, and the fewest keys that take it there. */
+/* A shape locks as soon as it can't fall, so it is never slid under others */
+static void bot_plan (const engine_t *engine,plan_t *plan)
+{
+   state_t state;
+   undo_t undo;
+   finesse_t finesse;
+   const place_t *place;
+   double value,best = 0;
+   int i,chosen;
+   engine_snapshot (engine,&state);
+   finesse_search (&finesse,engine,&state,FALSE);
+   /* in the opening, the place in the book */
+   if ((chosen = book_find (engine,&state,&finesse,botweights)) < 0)
+	 for (i = 0; i < finesse.numplaces; i++)
+	   {
+		  place = &finesse.place[i];
+		  value = judgestate (&state,engine_apply (engine,&state,place,&undo));
+		  engine_undo (engine,&state,&undo);
+		  if ((chosen < 0) || (value > best) || ((value == best) && (place->keys < finesse.place[chosen].keys)))
+			{
+			   chosen = i;
+			   best = value;
+			}
+	   }
+   plan->piece = engine->queuehead;
+   plan->x = engine->curx;
+   plan->y = engine->cury;
+   plan->rotation = engine->rotation;
+   plan->numkeys = chosen < 0 ? 0 : finesse_path (&finesse,chosen,plan->keys);
+   plan->next = 0;
+}
+
+/* Get the next action of a bot. A new plan is made for every new shape, */
+/* and whenever the shape is not where the plan expects it to be, because */
+/* it fell a row meanwhile */
+static action_t bot_action (const engine_t *engine,plan_t *plan)
+{
+   action_t action;
+   if ((plan->piece != engine->queuehead) || (plan->x != engine->curx) || (plan->y != engine->cury) || (plan->rotation != engine->rotation))
+	 bot_plan (engine,plan);
+   if (plan->next >= plan->numkeys) return (ACTION_DROP);
+   switch (action = plan->keys[plan->next++])
+	 {
+	  case ACTION_LEFT: plan->x--; break;
+	  case ACTION_RIGHT: plan->x++; break;
+	  case ACTION_DOWN: plan->y++; break;
+	  case ACTION_ROTATE: plan->rotation = engine->pieces->shape[engine->curshape].rotation[plan->rotation].next; break;
+	  case ACTION_DROP: break;
+	 }
+   return (action);
+}
+
+/*
+ * Hint
+ */
+
+/* Shapes looked ahead at most */
+#define HINT_MAXDEPTH	4
+
+/* Best places on each level that are looked further ahead from */
+#define HINT_BEAM		6
+
+/* Value of a board on which a shape can't be put anywhere */
+#define HINT_LOST		-1e9
+
+/* How often the game checks for an answer while it waits for one (in microseconds) */
+#define HINT_POLL		10000
+
+/* A search for the best place for the current shape, made on a thread of */
+/* its own so that the game never waits for it */
+typedef struct
+{
+   pthread_t thread;
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   bool running,quit;
+   unsigned asked;						/* request being searched, a new one cancels it */
+   unsigned answered;					/* request the answer is for */
+   engine_t engine;						/* copy of the engine the hint is for */
+   int64_t deadline;					/* time of the next gravity tick */
+   int x,y,rotation;					/* answer: place for the current shape */
+   int depth;							/* shapes looked ahead to find it */
+   int piece,curx,currotation;			/* shape and position asked about (game side) */
+   unsigned shown;						/* request the answer shown is for (game side) */
+} hint_t;
+
+typedef struct
+{
+   hint_t *hint;
+   const engine_t *engine;
+   unsigned request;
+   int64_t deadline;
+   int maxdepth;
+   bool cancelled;
+} hintsearch_t;
+
+/* Check if the search should stop: because the shape moved, or because */
+/* the next gravity tick is due and there is an answer already */
+static bool hint_cancelled (hintsearch_t *s)
+{
+   if (!s->cancelled && ((__atomic_load_n (&s->hint->asked,__ATOMIC_RELAXED) != s->request) ||
+						 ((s->maxdepth > 1) && (monotime () > s->deadline))))
+	 s->cancelled = TRUE;
+   return (s->cancelled);
+}
+
+static double hint_value (hintsearch_t *s,state_t *state,int depth,int lines);
+
+/* Best value of putting the current shape of a state on the board, from */
+/* where it is. Only the best few places are looked further ahead from. */
+/* The place is written to chosen */
+static double hint_best (hintsearch_t *s,state_t *state,int depth,int lines,place_t *chosen)
+{
+   const engine_t *engine = s->engine;
+   finesse_t finesse;
+   undo_t undo;
+   double value[MAXPLACES],best = HINT_LOST,v;
+   int beam[HINT_BEAM],i,j,n = 0;
+   finesse_search (&finesse,engine,state,FALSE);
+   for (i = 0; i < finesse.numplaces; i++)
+	 {
+		if (hint_cancelled (s)) return (best);
+		value[i] = judgestate (state,lines + engine_apply (engine,state,&finesse.place[i],&undo));
+		engine_undo (engine,state,&undo);
+		/* keep the best few in order */
+		for (j = n; (j > 0) && (value[i] > value[beam[j - 1]]); j--) if (j < HINT_BEAM) beam[j] = beam[j - 1];
+		if (j < HINT_BEAM) beam[j] = i;
+		if (n < HINT_BEAM) n++;
+	 }
+   if (depth + 1 >= s->maxdepth) n = n ? 1 : 0;
+   for (i = 0; i < n; i++)
+	 {
+		v = value[beam[i]];
+		if (depth + 1 < s->maxdepth)
+		  {
+			 j = engine_apply (engine,state,&finesse.place[beam[i]],&undo);
+			 v = hint_value (s,state,depth + 1,lines + j);
+			 engine_undo (engine,state,&undo);
+		  }
+		if (!i || (v > best))
+		  {
+			 best = v;
+			 if (chosen != NULL) *chosen = finesse.place[beam[i]];
+		  }
+	 }
+   return (best);
+}
+
+/* Best value of a state the shape after depth others has just appeared in. */
+/* Only the shapes the player can see ahead are known, after that every */
+/* shape is as likely */
+static double hint_value (hintsearch_t *s,state_t *state,int depth,int lines)
+{
+   double sum = 0;
+   int i;
+   if (depth <= s->engine->previews) return (hint_best (s,state,depth,lines,NULL));
+   for (i = 0; i < s->engine->pieces->numshapes; i++)
+	 {
+		state_spawn (s->engine,state,i);
+		sum += hint_best (s,state,depth,lines,NULL);
+	 }
+   return (sum / s->engine->pieces->numshapes);
+}
+
+/* Answer requests for hints, looking one shape further ahead at a time */
+/* for as long as there is time before the shape falls a row */
+static void *hint_thread (void *arg)
+{
+   hintsearch_t s;
+   hint_t *hint = arg;
+   engine_t engine;
+   state_t state;
+   place_t place,best;
+   int depth;
+   s.hint = hint;
+   s.engine = &engine;
+   pthread_mutex_lock (&hint->lock);
+   while (!hint->quit)
+	 {
+		if (hint->answered == hint->asked)
+		  {
+			 pthread_cond_wait (&hint->cond,&hint->lock);
+			 continue;
+		  }
+		memcpy (&engine,&hint->engine,sizeof (engine_t));
+		s.request = hint->asked;
+		s.deadline = hint->deadline;
+		pthread_mutex_unlock (&hint->lock);
+		engine_snapshot (&engine,&state);
+		for (s.maxdepth = 1, s.cancelled = FALSE, depth = 0; s.maxdepth <= HINT_MAXDEPTH; s.maxdepth++)
+		  {
+			 place.keys = 0;
+			 hint_best (&s,&state,0,0,&place);
+			 if (s.cancelled) break;
+			 best = place;
+			 depth = s.maxdepth;
+			 if (monotime () > s.deadline) break;
+		  }
+		pthread_mutex_lock (&hint->lock);
+		if (depth && (hint->asked == s.request))
+		  {
+			 hint->answered = s.request;
+			 hint->x = best.keys ? best.x : -1;
+			 hint->y = best.y;
+			 hint->rotation = best.rotation;
+			 hint->depth = depth;
+		  }
+	 }
+   pthread_mutex_unlock (&hint->lock);
+   return (NULL);
+}
+
+/*
+ * Macros
+ */
+
+/* Upper left corner of board */
+#define XTOP ((out_width () - 2 * boardwidth - 6) >> 1)
+#define YTOP ((out_height () - boardheight - 2) >> 1)
+
+/* Maximum digits in a number (i.e. number of digits in score, */
+/* number of blocks, etc. should not exceed this value */
+#define MAXDIGITS 5
+
+/* This calculates the time allowed to move a shape, before it is moved a row down */
+#define DELAY(level) (1000000 / ((level) + 2))
+
+/* Maximum number of boards in versus mode */
+#define MAXBOARDS 4
+
+/* Memory kept for taking back shapes in practice mode, unless told */
+/* otherwise, and the most that can be asked for (in kilobytes) */
+#define PRACTICE_MEMORY		1024
+#define PRACTICE_MAXMEMORY	(1 << 20)
+
+/* Quality of the rendering, lowered when the terminal can't keep up */
+#define QUALITY_FULL		0				/* every frame, in color */
+#define QUALITY_THROTTLED	1				/* stale frames skipped, statistics updated less often */
+#define QUALITY_MONO		2				/* as above, without colors */
+#define NUMQUALITIES		3
+
+/* The score is multiplied by this to avoid losing precision */
 #define SCOREFACTOR 2
 
 /* This calculates the stored score value */
@@ -859,10 +2611,49 @@ int engine_evaluate (engine_t *engine)
 #define GETSCORE(score) ((score) / SCOREFACTOR)
 
 static bool shownext;
+static int numpreviews = 1;
+static bool showhint;
 static bool dottedlines;
 static bool shadow;
-static int level = MINLEVEL - 1,shapecount[NUMSHAPES];
+static int level = MINLEVEL - 1;
 static char blockchar = ' ';
+static bool listscores;
+static bool liststats;
+static int topscores = 10;
+static const char *scoreuser;
+static bool versusmode;
+static int numbots;
+static const char *broadcastaddr;
+static const char *publishname;
+static const char *profileout;
+static const char *watchaddr;
+static int boardwidth = NUMCOLS - 3;
+static int boardheight = NUMROWS - 3;
+static const char *piecesname;
+static const pieces_t *pieceset;
+static pieces_t custompieces;
+static int practicememory;
+static const char *recordfile;
+static const char *replayfile;
+static const char *botcommand;
+static bool headless;
+static const char *bookname;
+
+/* How well the terminal keeps up with what is drawn */
+typedef struct
+{
+   int quality;
+   bool repaint;							/* boards must be drawn again */
+   int64_t changed;						/* time the quality changed */
+   int64_t behind;						/* time the terminal was last behind */
+   int64_t nextframe;						/* time the next frame may be drawn */
+   int64_t nextstatus;					/* time the statistics are drawn again */
+   int64_t windowstart,windowbytes;		/* bytes written since windowstart */
+   int64_t rate;							/* bytes written per second */
+   int bandwidth;							/* bytes per second the link can take, 0 if unknown */
+} render_t;
+
+static render_t render;
 
 /*
  * Functions
@@ -872,24 +2663,63 @@ static char blockchar = ' ';
  * a block collides at the bottom of the screen (or the top of the heap */
 static void score_function (engine_t *engine)
 {
-   int score = SCOREVAL (level * (engine->status.dropcount + 1));
-   score += SCOREVAL ((level + 10) * engine->status.currentdroppedlines * engine->status.currentdroppedlines);
+   int score = SCOREVAL (engine->level * (engine->status.dropcount + 1));
+   score += SCOREVAL ((engine->level + 10) * engine->status.currentdroppedlines * engine->status.currentdroppedlines);
 
-   if (shownext) score /= 2;
+   if (engine->shownext) score /= 2;
+   if (showhint) score /= 2;
    if (dottedlines) score /= 2;
 
    engine->score += score;
 }
 
-/* Draw the board on the screen */
-static void drawboard (board_t board)
+/* Find the rows the hint covers in each column of the board */
+static void hintmask (const engine_t *engine,uint64_t *mask)
+{
+   const rotation_t *hint = &engine->pieces->shape[engine->curshape].rotation[engine->rotation_hint];
+   int i;
+   memset (mask,0,MAXCOLS * sizeof (uint64_t));
+   if (engine->curx_hint >= 0)
+	 for (i = 0; i < hint->numblocks; i++) mask[engine->curx_hint + hint->block[i].x] |= ROW (engine->cury_hint + hint->block[i].y);
+}
+
+/* Draw the rows of the board that changed with glyphs instead of colors, */
+/* so that the terminal is sent no attributes at all */
+static void drawmono (engine_t *engine,int left,int top)
+{
+   uint64_t hint[MAXCOLS];
+   int x,y,v;
+   hintmask (engine,hint);
+   out_setcolor (COLOR_WHITE,COLOR_BLACK);
+   for (y = 1; y < engine->rows - 1; y++) if (engine->dirty & ROW (y))
+	 {
+		out_gotoxy (left,top + y);
+		for (x = 0; x < engine->cols - 1; x++)
+		  {
+			 v = engine->board[x][y];
+			 out_printf ("%s",v == WALL ? "<>" : v == GARBAGE ? "##" : v ? "[]" : hint[x] & ROW (y) ? "::" : dottedlines ? ". " : "  ");
+		  }
+	 }
+   engine->dirty = 0;
+}
+
+/* Draw the rows of the board that changed since it was last drawn. The */
+/* upper left corner of the board is at (left,top) on the screen */
+static void drawboard (engine_t *engine,int left,int top)
 {
+   uint64_t hint[MAXCOLS];
    int x,y;
    out_setattr (ATTR_OFF);
-   for (y = 1; y < NUMROWS - 1; y++) for (x = 0; x < NUMCOLS - 1; x++)
+   if (render.quality >= QUALITY_MONO)
+	 {
+		drawmono (engine,left,top);
+		return;
+	 }
+   hintmask (engine,hint);
+   for (y = 1; y < engine->rows - 1; y++) if (engine->dirty & ROW (y)) for (x = 0; x < engine->cols - 1; x++)
 	 {
-		out_gotoxy (XTOP + x * 2,YTOP + y);
-		switch (board[x][y])
+		out_gotoxy (left + x * 2,top + y);
+		switch (engine->board[x][y])
 		  {
 			 /* Wall */
 		   case WALL:
@@ -899,9 +2729,23 @@ static void drawboard (board_t board)
 			 out_putch ('>');
 			 out_setattr (ATTR_OFF);
 			 break;
+			 /* Garbage */
+		   case GARBAGE:
+			 out_setcolor (COLOR_BLACK,COLOR_WHITE);
+			 out_putch ('[');
+			 out_putch (']');
+			 break;
 			 /* Background */
 		   case 0:
-			 if (dottedlines)
+			 if (hint[x] & ROW (y))
+			   {
+				  out_setattr (ATTR_BOLD);
+				  out_setcolor (engine->pieces->shape[engine->curshape].color,COLOR_BLACK);
+				  out_putch ('[');
+				  out_putch (']');
+				  out_setattr (ATTR_OFF);
+			   }
+			 else if (dottedlines)
 			   {
 				  out_setcolor (COLOR_BLUE,COLOR_BLACK);
 				  out_putch ('.');
@@ -916,33 +2760,40 @@ static void drawboard (board_t board)
 			 break;
 			 /* Block */
 		   default:
-			 out_setcolor (COLOR_BLACK,board[x][y]);
+			 out_setcolor (COLOR_BLACK,engine->board[x][y]);
 			 out_putch (blockchar);
 			 out_putch (blockchar);
 		  }
 	 }
    out_setattr (ATTR_OFF);
+   engine->dirty = 0;
 }
 
-/* Show the next piece on the screen */
-static void drawnext (int shapenum,int x,int y)
+/* Show the next pieces on the screen, each in a box, two boxes to a row. */
+/* The upper left corner of the first box is at (left,top) */
+static void drawnext (const pieces_t *pieces,const int *shapenum,int count,int left,int top)
 {
-   int i;
-   block_t ofs[NUMSHAPES] =
-	 { { 1,  0 }, { 1,  0 }, { 1, -1 }, { 2,  0 }, { 1, -1 }, { 1, -1 }, { 0, -1 } };
-   out_setcolor (COLOR_BLACK,COLOR_BLACK);
-   for (i = y - 2; i < y + 2; i++)
-	 {
-		out_gotoxy (x - 2,i);
-		out_printf ("        ");
-	 }
-   out_setcolor (COLOR_BLACK,SHAPES[shapenum].color);
-   for (i = 0; i < NUMBLOCKS; i++)
+   const shape_t *shape;
+   int i,j,x,y;
+   for (j = 0; j < count; j++)
 	 {
-		out_gotoxy (x + SHAPES[shapenum].block[i].x * 2 + ofs[shapenum].x,
-					y + SHAPES[shapenum].block[i].y + ofs[shapenum].y);
-		out_putch (' ');
-		out_putch (' ');
+		shape = &pieces->shape[shapenum[j]];
+		x = left + (j & 1) * (2 * pieces->width + 2);
+		y = top + (j >> 1) * (pieces->height + 1);
+		out_setcolor (COLOR_BLACK,COLOR_BLACK);
+		for (i = 0; i < pieces->height; i++)
+		  {
+			 out_gotoxy (x,y + i);
+			 out_printf ("%*s",2 * pieces->width,"");
+		  }
+		out_setcolor (COLOR_BLACK,shape->color);
+		for (i = 0; i < shape->rotation[0].numblocks; i++)
+		  {
+			 out_gotoxy (x + shape->rotation[0].block[i].x * 2 + shape->preview.x,
+						 y + shape->rotation[0].block[i].y + shape->preview.y);
+			 out_putch (' ');
+			 out_putch (' ');
+		  }
 	 }
 }
 
@@ -951,6 +2802,16 @@ static void drawbackground ()
 {
    out_setattr (ATTR_OFF);
    out_setcolor (COLOR_WHITE,COLOR_BLACK);
+   if (practicememory)
+	 {
+		out_gotoxy (1,YTOP + 5);   out_printf ("u/r: Undo/Redo");
+	 }
+   /* several next shapes take the place of the help */
+   if (numpreviews > 1)
+	 {
+		out_gotoxy (3,YTOP + 7);   out_printf ("Next:");
+		return;
+	 }
    out_gotoxy (4,YTOP + 7);   out_printf ("H E L P");
    out_gotoxy (1,YTOP + 9);   out_printf ("p: Pause");
    out_gotoxy (1,YTOP + 10);  out_printf ("j: Left");
@@ -959,37 +2820,31 @@ static void drawbackground ()
    out_gotoxy (1,YTOP + 13);  out_printf ("s: Draw next");
    out_gotoxy (1,YTOP + 14);  out_printf ("d: Toggle lines");
    out_gotoxy (1,YTOP + 15);  out_printf ("a: Speed up");
-   out_gotoxy (1,YTOP + 16);  out_printf ("q: Quit");
-   out_gotoxy (2,YTOP + 17);  out_printf ("SPACE: Drop");
+   out_gotoxy (1,YTOP + 16);  out_printf ("h: Hint");
+   out_gotoxy (1,YTOP + 17);  out_printf ("q: Quit");
+   out_gotoxy (2,YTOP + 18);  out_printf ("SPACE: Drop");
    out_gotoxy (3,YTOP + 19);  out_printf ("Next:");
 }
 
-static int getsum ()
+static int getsum (const engine_t *engine)
 {
    int i,sum = 0;
-   for (i = 0; i < NUMSHAPES; i++) sum += shapecount[i];
+   for (i = 0; i < engine->pieces->numshapes; i++) sum += engine->shapecount[i];
    return (sum);
 }
 
-/* This show the current status of the game */
-static void showstatus (engine_t *engine)
+/* Go to the next level, remembering how many pieces it took to get there */
+static void nextlevel (engine_t *engine)
+{
+   engine->level++;
+   engine->levelpieces[engine->level] = getsum (engine);
+}
+
+/* Show how many shapes of each type of the standard set were played */
+static void drawshapecounts (const engine_t *engine)
 {
    static const int shapenum[NUMSHAPES] = { 4, 6, 5, 1, 0, 3, 2 };
    char tmp[MAXDIGITS + 1];
-   int i,sum = getsum ();
-   out_setattr (ATTR_OFF);
-   out_setcolor (COLOR_WHITE,COLOR_BLACK);
-   out_gotoxy (1,YTOP + 1);   out_printf ("Your level: %d",level);
-   out_gotoxy (1,YTOP + 2);   out_printf ("Full lines: %d",engine->status.droppedlines);
-   out_gotoxy (2,YTOP + 4);   out_printf ("Score");
-   out_setattr (ATTR_BOLD);
-   out_setcolor (COLOR_YELLOW,COLOR_BLACK);
-   out_printf ("  %d",GETSCORE (engine->score));
-   if (shownext) drawnext (engine->nextshape,3,YTOP + 22);
-   out_setattr (ATTR_OFF);
-   out_setcolor (COLOR_WHITE,COLOR_BLACK);
-   out_gotoxy (out_width () - MAXDIGITS - 12,YTOP + 1);
-   out_printf ("STATISTICS");
    out_setcolor (COLOR_BLACK,COLOR_MAGENTA);
    out_gotoxy (out_width () - MAXDIGITS - 17,YTOP + 3);
    out_printf ("      ");
@@ -998,7 +2853,7 @@ static void showstatus (engine_t *engine)
    out_setcolor (COLOR_MAGENTA,COLOR_BLACK);
    out_gotoxy (out_width () - MAXDIGITS - 3,YTOP + 3);
    out_putch ('-');
-   snprintf (tmp,MAXDIGITS + 1,"%d",shapecount[shapenum[0]]);
+   snprintf (tmp,MAXDIGITS + 1,"%d",engine->shapecount[shapenum[0]]);
    out_gotoxy (out_width () - strlen (tmp) - 1,YTOP + 3);
    out_printf ("%s",tmp);
    out_setcolor (COLOR_BLACK,COLOR_RED);
@@ -1007,7 +2862,7 @@ static void showstatus (engine_t *engine)
    out_setcolor (COLOR_RED,COLOR_BLACK);
    out_gotoxy (out_width () - MAXDIGITS - 3,YTOP + 5);
    out_putch ('-');
-   snprintf (tmp,MAXDIGITS + 1,"%d",shapecount[shapenum[1]]);
+   snprintf (tmp,MAXDIGITS + 1,"%d",engine->shapecount[shapenum[1]]);
    out_gotoxy (out_width () - strlen (tmp) - 1,YTOP + 5);
    out_printf ("%s",tmp);
    out_setcolor (COLOR_BLACK,COLOR_WHITE);
@@ -1018,7 +2873,7 @@ static void showstatus (engine_t *engine)
    out_setcolor (COLOR_WHITE,COLOR_BLACK);
    out_gotoxy (out_width () - MAXDIGITS - 3,YTOP + 7);
    out_putch ('-');
-   snprintf (tmp,MAXDIGITS + 1,"%d",shapecount[shapenum[2]]);
+   snprintf (tmp,MAXDIGITS + 1,"%d",engine->shapecount[shapenum[2]]);
    out_gotoxy (out_width () - strlen (tmp) - 1,YTOP + 7);
    out_printf ("%s",tmp);
    out_setcolor (COLOR_BLACK,COLOR_GREEN);
@@ -1029,7 +2884,7 @@ static void showstatus (engine_t *engine)
    out_setcolor (COLOR_GREEN,COLOR_BLACK);
    out_gotoxy (out_width () - MAXDIGITS - 3,YTOP + 9);
    out_putch ('-');
-   snprintf (tmp,MAXDIGITS + 1,"%d",shapecount[shapenum[3]]);
+   snprintf (tmp,MAXDIGITS + 1,"%d",engine->shapecount[shapenum[3]]);
    out_gotoxy (out_width () - strlen (tmp) - 1,YTOP + 9);
    out_printf ("%s",tmp);
    out_setcolor (COLOR_BLACK,COLOR_CYAN);
@@ -1040,7 +2895,7 @@ static void showstatus (engine_t *engine)
    out_setcolor (COLOR_CYAN,COLOR_BLACK);
    out_gotoxy (out_width () - MAXDIGITS - 3,YTOP + 11);
    out_putch ('-');
-   snprintf (tmp,MAXDIGITS + 1,"%d",shapecount[shapenum[4]]);
+   snprintf (tmp,MAXDIGITS + 1,"%d",engine->shapecount[shapenum[4]]);
    out_gotoxy (out_width () - strlen (tmp) - 1,YTOP + 11);
    out_printf ("%s",tmp);
    out_setcolor (COLOR_BLACK,COLOR_BLUE);
@@ -1051,7 +2906,7 @@ static void showstatus (engine_t *engine)
    out_setcolor (COLOR_BLUE,COLOR_BLACK);
    out_gotoxy (out_width () - MAXDIGITS - 3,YTOP + 13);
    out_putch ('-');
-   snprintf (tmp,MAXDIGITS + 1,"%d",shapecount[shapenum[5]]);
+   snprintf (tmp,MAXDIGITS + 1,"%d",engine->shapecount[shapenum[5]]);
    out_gotoxy (out_width () - strlen (tmp) - 1,YTOP + 13);
    out_printf ("%s",tmp);
    out_setattr (ATTR_OFF);
@@ -1063,9 +2918,34 @@ static void showstatus (engine_t *engine)
    out_setcolor (COLOR_YELLOW,COLOR_BLACK);
    out_gotoxy (out_width () - MAXDIGITS - 3,YTOP + 15);
    out_putch ('-');
-   snprintf (tmp,MAXDIGITS + 1,"%d",shapecount[shapenum[6]]);
+   snprintf (tmp,MAXDIGITS + 1,"%d",engine->shapecount[shapenum[6]]);
    out_gotoxy (out_width () - strlen (tmp) - 1,YTOP + 15);
    out_printf ("%s",tmp);
+}
+
+/* This show the current status of the game */
+static void showstatus (engine_t *engine)
+{
+   char tmp[MAXDIGITS + 1];
+   int i,next[MAXPREVIEWS],sum = getsum (engine);
+   out_setattr (ATTR_OFF);
+   out_setcolor (COLOR_WHITE,COLOR_BLACK);
+   out_gotoxy (1,YTOP + 1);   out_printf ("Your level: %d",engine->level);
+   out_gotoxy (1,YTOP + 2);   out_printf ("Full lines: %d",engine->status.droppedlines);
+   out_gotoxy (2,YTOP + 4);   out_printf ("Score");
+   out_setattr (ATTR_BOLD);
+   out_setcolor (COLOR_YELLOW,COLOR_BLACK);
+   out_printf ("  %d",GETSCORE (engine->score));
+   if (engine->shownext)
+	 {
+		for (i = 0; i < engine->previews; i++) next[i] = engine_peek (engine,i + 1);
+		drawnext (engine->pieces,next,engine->previews,1,engine->previews > 1 ? YTOP + 8 : YTOP + 20);
+	 }
+   out_setattr (ATTR_OFF);
+   out_setcolor (COLOR_WHITE,COLOR_BLACK);
+   out_gotoxy (out_width () - MAXDIGITS - 12,YTOP + 1);
+   out_printf ("STATISTICS");
+   if (engine->pieces == pieces_builtin ("tetrominoes")) drawshapecounts (engine);
    out_setcolor (COLOR_WHITE,COLOR_BLACK);
    out_gotoxy (out_width () - MAXDIGITS - 17,YTOP + 17);
    for (i = 0; i < MAXDIGITS + 16; i++) out_putch ('-');
@@ -1088,399 +2968,6519 @@ static void showstatus (engine_t *engine)
    snprintf (tmp,MAXDIGITS + 1,"%d",engine->status.efficiency);
    out_gotoxy (out_width () - strlen (tmp) - 1,YTOP + 21);
    out_printf ("%s",tmp);
+   out_gotoxy (out_width () - MAXDIGITS - 17,YTOP + 22);
+   for (i = 0; i < MAXDIGITS + 16; i++) out_putch (' ');
+   out_gotoxy (out_width () - MAXDIGITS - 17,YTOP + 22);
+   out_printf ("Finesse      :");
+   snprintf (tmp,MAXDIGITS + 1,"%d",engine->faults);
+   out_gotoxy (out_width () - strlen (tmp) - 1,YTOP + 22);
+   out_printf ("%s",tmp);
 }
 
-          /***************************************************************************/
-          /***************************************************************************/
-          /***************************************************************************/
-
-/* Header for scorefile */
-#define SCORE_HEADER	"Tint 0.02b (c) Abraham vd Merwe - Scores"
-
-/* Header for score title */
-static const char scoretitle[] = "\n\t   TINT HIGH SCORES\n\n\tRank   Score        Name\n\n";
-
-/* Length of a player's name */
-#define NAMELEN 20
-
-/* Number of scores allowed in highscore list */
-#define NUMSCORES 10
 
-typedef struct
-{
-   char name[NAMELEN];
-   int score;
-   time_t timestamp;
-} score_t;
+/*
+ * Rendering
+ */
 
-static void getname (char *name)
+/* Time a frame may take to reach the terminal before it is considered behind */
+#define RENDER_STALL	20000
+/* Bytes that may wait to be sent before the terminal is considered behind */
+#define RENDER_BACKLOG	1024
+/* Time the quality stays the same before it is lowered again */
+#define RENDER_SETTLE	1000000
+/* Time the terminal has to keep up before the quality is raised again */
+#define RENDER_RECOVER	5000000
+/* Time over which the byte rate is measured */
+#define RENDER_WINDOW	1000000
+/* Time before trying again when the terminal couldn't take a frame */
+#define RENDER_RETRY	50000
+/* Time between two updates of the statistics when throttled */
+#define STATUS_INTERVAL	500000
+
+static const char *qualitynames[NUMQUALITIES] = { "full", "throttled", "monochrome" };
+
+/* Change the quality of the rendering */
+static void render_quality (int quality,int64_t now)
 {
-   struct passwd *pw = getpwuid (geteuid ());
-
-   fprintf (stderr,"Congratulations! You have a new high score.\n");
-   fprintf (stderr,"Enter your name [%s]: ",pw != NULL ? pw->pw_name : "");
-
-   fgets (name,NAMELEN - 1,stdin);
-   name[strlen (name) - 1] = '\0';
-
-   if (!strlen (name) && pw != NULL)
+   if ((quality >= QUALITY_MONO) != (render.quality >= QUALITY_MONO))
 	 {
-		strncpy (name,pw->pw_name,NAMELEN);
-		name[NAMELEN - 1] = '\0';
+		out_setmono (quality >= QUALITY_MONO);
+		render.repaint = TRUE;
 	 }
+   render.quality = quality;
+   render.changed = now;
+   render.nextstatus = now;
 }
 
-static void err1 ()
+/* The terminal fell behind, lower the quality if it has been a while */
+static void render_behind (int64_t now)
 {
-   fprintf (stderr,"Error creating %s\n",scorefile);
-   exit (EXIT_FAILURE);
+   render.behind = now;
+   if ((render.quality < QUALITY_MONO) && (now - render.changed >= RENDER_SETTLE))
+	 render_quality (render.quality + 1,now);
 }
 
-static void err2 ()
+/* Should a frame be drawn now? Frames drawn while the terminal is still */
+/* busy with the previous one would only be stale by the time they arrive */
+static bool render_frame (int64_t now)
 {
-   fprintf (stderr,"Error writing to %s\n",scorefile);
-   exit (EXIT_FAILURE);
+   if (now < render.nextframe) return FALSE;
+   if (out_ready ()) return TRUE;
+   render_behind (now);
+   render.nextframe = now + RENDER_RETRY;
+   return FALSE;
 }
 
-void showplayerstats (engine_t *engine)
+/* Should the statistics be drawn in this frame? */
+static bool render_status (int64_t now)
 {
-   fprintf (stderr,
-			"\n\t   PLAYER STATISTICS\n\n\t"
-			"Score       %11d\n\t"
-			"Efficiency  %11d\n\t"
-			"Score ratio %11d\n",
-			GETSCORE (engine->score),engine->status.efficiency,GETSCORE (engine->score) / getsum ());
+   if ((render.quality == QUALITY_FULL) || (now >= render.nextstatus))
+	 {
+		render.nextstatus = now + STATUS_INTERVAL;
+		return TRUE;
+	 }
+   return FALSE;
 }
 
-static void createscores (int score)
+/* Account for a frame that wrote bytes to the terminal and took a while to */
+/* refresh. If the terminal fell behind, the next frame waits until it */
+/* caught up and the quality is lowered, otherwise raised after a while. */
+/* Writes only block once the buffers on the way are full, so when the */
+/* bandwidth of the link is known, frames are paced to it as well */
+static void render_update (int64_t took,int64_t bytes,int64_t now)
 {
-   FILE *handle;
+   int pending = out_pending ();
+   if (render.bandwidth > 0)
+	 {
+		if (bytes * 1000000 / render.bandwidth > took) took = bytes * 1000000 / render.bandwidth;
+		render.nextframe = now + took;
+	 }
+   if (now - render.windowstart >= RENDER_WINDOW)
+	 {
+		render.rate = render.windowbytes * 1000000 / (now - render.windowstart);
+		render.windowstart = now;
+		render.windowbytes = 0;
+	 }
+   render.windowbytes += bytes;
+   if ((took > RENDER_STALL) || (pending > RENDER_BACKLOG))
+	 {
+		render_behind (now);
+		/* give the terminal as long as this frame took, or as long as */
+		/* the bytes still waiting need at the current rate */
+		render.nextframe = now + took;
+		if ((pending > 0) && (render.rate > 0)) render.nextframe += (int64_t) pending * 1000000 / render.rate;
+	 }
+   else if ((render.quality > QUALITY_FULL) && (now - render.behind >= RENDER_RECOVER) && (now - render.changed >= RENDER_RECOVER))
+	 render_quality (render.quality - 1,now);
+}
+
+/*
+ * Profiling
+ */
+
+/* Stages of the main loop that are timed (in microseconds) or counted */
+#define STAGE_INPUT		0						/* waiting for a key or a gravity tick */
+#define STAGE_MOVE		1						/* engine_move () */
+#define STAGE_EVALUATE	2						/* engine_evaluate () */
+#define STAGE_STATUS	3						/* showstatus () */
+#define STAGE_BOARD		4						/* drawboard () */
+#define STAGE_REFRESH	5						/* out_refresh () */
+#define STAGE_KEY		6						/* from a key coming to the refresh showing it */
+#define STAGE_JITTER	7						/* how late gravity ticks are */
+#define STAGE_BYTES		8						/* bytes written to the terminal per frame */
+#define STAGE_BOT		9						/* from asking a bot over the protocol to its answer */
+#define NUMSTAGES		10
+
+static const char *stagenames[NUMSTAGES] =
+{
+   "input_wait", "engine_move", "engine_evaluate", "showstatus", "drawboard",
+   "out_refresh", "key_to_refresh", "gravity_jitter", "terminal_bytes", "bot_decision"
+};
+
+static histogram_t profile[NUMSTAGES];
+static bool showprofile;
+
+/* Record how long a stage took since start. Returns the time now, which is */
+/* where the next stage starts */
+static int64_t profile_stage (int stage,int64_t start)
+{
+   int64_t now = monotime ();
+   hist_add (&profile[stage],now - start);
+   return (now);
+}
+
+/* Perform an action on a tetris engine, recording how long it took */
+static void profile_move (engine_t *engine,action_t action)
+{
+   int64_t start = monotime ();
+   engine_move (engine,action);
+   profile_stage (STAGE_MOVE,start);
+}
+
+/* Refresh the screen, recording how long it took and how many bytes it */
+/* wrote to the terminal, and let the rendering adapt to how well the */
+/* terminal keeps up. Only what is written during the refresh is counted, */
+/* so that replays, logs and spectators written between frames aren't taken */
+/* for output to the terminal. Returns the time now */
+static int64_t profile_refresh ()
+{
+   int64_t start = monotime (),before = out_written (),written,bytes = 0,now;
+   out_refresh ();
+   if ((before >= 0) && ((written = out_written ()) >= 0)) hist_add (&profile[STAGE_BYTES],bytes = written - before);
+   now = profile_stage (STAGE_REFRESH,start);
+   render_update (now - start,bytes,now);
+   return (now);
+}
+
+/* Draw the profile in the upper left corner of the screen */
+static void drawprofile ()
+{
+   int i;
+   out_setattr (ATTR_OFF);
+   out_setcolor (COLOR_BLACK,COLOR_CYAN);
+   out_gotoxy (0,0);
+   out_printf (" %-16s %8s %8s %8s %8s ","stage","count","p50","p99","max");
+   out_setcolor (COLOR_WHITE,COLOR_BLUE);
+   for (i = 0; i < NUMSTAGES; i++)
+	 {
+		out_gotoxy (0,i + 1);
+		out_printf (" %-16s %8llu %8u %8u %8u ",stagenames[i],(unsigned long long) profile[i].count,
+					hist_percentile (&profile[i],0.5),hist_percentile (&profile[i],0.99),profile[i].max);
+	 }
+   out_gotoxy (0,i + 1);
+   out_printf (" %-16s %8lld B/s %-22s ","terminal",(long long) render.rate,qualitynames[render.quality]);
+   out_setcolor (COLOR_WHITE,COLOR_BLACK);
+}
+
+/* Write the profile to a file as JSON. Returns FALSE if it couldn't be written */
+static bool saveprofile (const char *filename)
+{
+   FILE *fp;
+   int i;
+   if ((fp = fopen (filename,"w")) == NULL) return FALSE;
+   fprintf (fp,"{\n");
+   for (i = 0; i < NUMSTAGES; i++)
+	 fprintf (fp,"  \"%s\": { \"unit\": \"%s\", \"count\": %llu, \"mean\": %.1f, \"p50\": %u, \"p99\": %u, \"max\": %u }%s\n",
+			  stagenames[i],i == STAGE_BYTES ? "bytes" : "us",(unsigned long long) profile[i].count,
+			  profile[i].count ? (double) profile[i].sum / profile[i].count : 0.0,
+			  hist_percentile (&profile[i],0.5),hist_percentile (&profile[i],0.99),profile[i].max,
+			  i < NUMSTAGES - 1 ? "," : "");
+   fprintf (fp,"}\n");
+   return (fclose (fp) == 0);
+}
+
+          /***************************************************************************/
+          /***************************************************************************/
+          /***************************************************************************/
+
+/* Header of the old scorefile (native int and time_t, variable length names) */
+#define SCORE_HEADER	"Tint 0.02b (c) Abraham vd Merwe - Scores"
+
+/* Magic and version of the fixed width scorefile */
+#define SCORE_MAGIC		"TINTSCOR"
+#define SCORE_VERSION	2
+
+/* Header for score title */
+static const char scoretitle[] = "\n\t   TINT HIGH SCORES\n\n\tRank   Score        Name\n\n";
+
+/* Length of a player's name */
+#define NAMELEN 20
+
+/* Number of scores allowed in highscore list */
+#define NUMSCORES 10
+
+/* The header is the magic, version, number of records, record size and the */
+/* checksum of the records. Each record is a NUL padded name, a 32-bit score */
+/* and a 64-bit timestamp, all stored in little endian byte order */
+#define SCORE_HDRSIZE	24
+#define SCORE_RECSIZE	(NAMELEN + 12)
+#define SCORE_FILESIZE	(SCORE_HDRSIZE + NUMSCORES * SCORE_RECSIZE)
+
+/* Result of reading the scorefile */
+#define SCORES_OK		0
+#define SCORES_NONE		1
+#define SCORES_BAD		2
+
+typedef struct
+{
+   char name[NAMELEN];
+   int score;
+   time_t timestamp;
+} score_t;
+
+static void getname (char *name)
+{
+   struct passwd *pw = getpwuid (geteuid ());
+
+   fprintf (stderr,"Congratulations! You have a new high score.\n");
+   fprintf (stderr,"Enter your name [%s]: ",pw != NULL ? pw->pw_name : "");
+
+   if (fgets (name,NAMELEN - 1,stdin) == NULL) *name = '\0';
+   name[strcspn (name,"\n")] = '\0';
+
+   if (!strlen (name) && pw != NULL)
+	 {
+		strncpy (name,pw->pw_name,NAMELEN);
+		name[NAMELEN - 1] = '\0';
+	 }
+}
+
+static void err1 ()
+{
+   fprintf (stderr,"Error creating %s\n",scorefile);
+   exit (EXIT_FAILURE);
+}
+
+static void err2 ()
+{
+   fprintf (stderr,"Error writing to %s\n",scorefile);
+   exit (EXIT_FAILURE);
+}
+
+void showplayerstats (engine_t *engine)
+{
+   fprintf (stderr,
+			"\n\t   PLAYER STATISTICS\n\n\t"
+			"Score       %11d\n\t"
+			"Efficiency  %11d\n\t"
+			"Score ratio %11d\n\t"
+			"Finesse     %11d\n",
+			GETSCORE (engine->score),engine->status.efficiency,GETSCORE (engine->score) / getsum (engine),engine->faults);
+}
+
+/* Fill the highscore list with empty entries */
+static void clearscores (score_t *scores)
+{
+   int i;
+   for (i = 0; i < NUMSCORES; i++)
+	 {
+		strcpy (scores[i].name,"None");
+		scores[i].score = -1;
+		scores[i].timestamp = 0;
+	 }
+}
+
+/* Parse a scorefile in the old format. Returns TRUE if successful, FALSE otherwise */
+static bool loadlegacy (const unsigned char *buf,size_t len,score_t *scores)
+{
+   size_t pos = strlen (SCORE_HEADER);
    int i,j;
+   if ((len < pos) || (memcmp (buf,SCORE_HEADER,pos) != 0)) return FALSE;
+   for (i = 0; i < NUMSCORES; i++)
+	 {
+		for (j = 0; (pos < len) && (buf[pos] != '\0'); j++, pos++)
+		  {
+			 if (j >= NAMELEN - 2) return FALSE;
+			 scores[i].name[j] = (char) buf[pos];
+		  }
+		if (pos++ >= len) return FALSE;
+		scores[i].name[j] = '\0';
+		if (pos + sizeof (int) + sizeof (time_t) > len) return FALSE;
+		memcpy (&(scores[i].score),buf + pos,sizeof (int));
+		pos += sizeof (int);
+		memcpy (&(scores[i].timestamp),buf + pos,sizeof (time_t));
+		pos += sizeof (time_t);
+	 }
+   return TRUE;
+}
+
+/* Parse a highscore list in the fixed width format. Returns SCORES_OK if */
+/* successful, SCORES_BAD otherwise */
+static int decodescores (const unsigned char *buf,size_t len,score_t *scores)
+{
+   const unsigned char *rec;
+   int i;
+   clearscores (scores);
+   if ((len != SCORE_FILESIZE) ||
+	   (memcmp (buf,SCORE_MAGIC,strlen (SCORE_MAGIC)) != 0) ||
+	   (get_u32 (buf + 8) != SCORE_VERSION) ||
+	   (get_u32 (buf + 12) != NUMSCORES) ||
+	   (get_u32 (buf + 16) != SCORE_RECSIZE) ||
+	   (get_u32 (buf + 20) != checksum (buf + SCORE_HDRSIZE,NUMSCORES * SCORE_RECSIZE)))
+	 return SCORES_BAD;
+   for (i = 0; i < NUMSCORES; i++)
+	 {
+		rec = buf + SCORE_HDRSIZE + i * SCORE_RECSIZE;
+		memcpy (scores[i].name,rec,NAMELEN);
+		scores[i].name[NAMELEN - 1] = '\0';
+		scores[i].score = (int32_t) get_u32 (rec + NAMELEN);
+		scores[i].timestamp = (time_t) (int64_t) get_u64 (rec + NAMELEN + 4);
+	 }
+   return SCORES_OK;
+}
+
+/* Read the highscore list. Returns SCORES_OK if successful, SCORES_NONE if */
+/* there is no scorefile yet, or SCORES_BAD if the scorefile is damaged */
+static int loadscores (score_t *scores)
+{
+   FILE *handle;
+   unsigned char buf[2 * SCORE_FILESIZE];
+   size_t len;
+   clearscores (scores);
+   if ((handle = fopen (scorefile,"r")) == NULL) return SCORES_NONE;
+   len = fread (buf,1,sizeof (buf),handle);
+   fclose (handle);
+   if (len == 0) return SCORES_NONE;
+   /* Scorefiles written by older versions are converted on the next save */
+   if (loadlegacy (buf,len,scores)) return SCORES_OK;
+   return (decodescores (buf,len,scores));
+}
+
+/* Make a rename in the directory of the given file durable */
+static void syncdir (const char *filename)
+{
+   char dirname[PATH_MAX];
+   char *slash;
+   int fd;
+   snprintf (dirname,sizeof (dirname),"%s",filename);
+   if ((slash = strrchr (dirname,'/')) == NULL) strcpy (dirname,".");
+   else if (slash == dirname) slash[1] = '\0';
+   else *slash = '\0';
+   if ((fd = open (dirname,O_RDONLY)) < 0) return;
+   fsync (fd);
+   close (fd);
+}
+
+/* Write a buffer to a temporary file and atomically replace the given file with */
+/* it, so that readers never see a partially written file. Returns TRUE if */
+/* successful, FALSE otherwise */
+static bool replacefile (const char *filename,const void *buf,size_t len)
+{
+   char tmpname[PATH_MAX];
+   int fd;
+   snprintf (tmpname,sizeof (tmpname),"%s.%ld",filename,(long) getpid ());
+   if ((fd = open (tmpname,O_WRONLY | O_CREAT | O_TRUNC,0664)) < 0) return FALSE;
+   if ((write (fd,buf,len) != (ssize_t) len) || (fsync (fd) < 0))
+	 {
+		close (fd);
+		unlink (tmpname);
+		return FALSE;
+	 }
+   close (fd);
+   if (rename (tmpname,filename) < 0)
+	 {
+		unlink (tmpname);
+		return FALSE;
+	 }
+   syncdir (filename);
+   return TRUE;
+}
+
+/* Take an exclusive lock for a read-modify-write cycle of the given file. The */
+/* lock lives in a separate file since the file itself may be replaced. Returns */
+/* the descriptor to close to release the lock, or -1 if unsuccessful */
+static int lockfile (const char *filename)
+{
+   char lockname[PATH_MAX];
+   int fd;
+   snprintf (lockname,sizeof (lockname),"%s.lock",filename);
+   if ((fd = open (lockname,O_RDWR | O_CREAT,0664)) < 0) return -1;
+   while (flock (fd,LOCK_EX) < 0)
+	 if (errno != EINTR)
+	   {
+		  close (fd);
+		  return -1;
+	   }
+   return fd;
+}
+
+/* Convert the highscore list to the fixed width format */
+static void encodescores (unsigned char *buf,const score_t *scores)
+{
+   unsigned char *rec;
+   int i;
+   memset (buf,0,SCORE_FILESIZE);
+   memcpy (buf,SCORE_MAGIC,strlen (SCORE_MAGIC));
+   put_u32 (buf + 8,SCORE_VERSION);
+   put_u32 (buf + 12,NUMSCORES);
+   put_u32 (buf + 16,SCORE_RECSIZE);
+   for (i = 0; i < NUMSCORES; i++)
+	 {
+		rec = buf + SCORE_HDRSIZE + i * SCORE_RECSIZE;
+		memcpy (rec,scores[i].name,strnlen (scores[i].name,NAMELEN - 1));
+		put_u32 (rec + NAMELEN,(uint32_t) scores[i].score);
+		put_u64 (rec + NAMELEN + 4,(uint64_t) scores[i].timestamp);
+	 }
+   put_u32 (buf + 20,checksum (buf + SCORE_HDRSIZE,NUMSCORES * SCORE_RECSIZE));
+}
+
+/* Write the highscore list */
+static void storescores (const score_t *scores)
+{
+   unsigned char buf[SCORE_FILESIZE];
+   encodescores (buf,scores);
+   if (!replacefile (scorefile,buf,sizeof (buf))) err2 ();
+}
+
+/* Lock the scorefile */
+static int lockscores ()
+{
+   int fd;
+   if ((fd = lockfile (scorefile)) < 0) err1 ();
+   return fd;
+}
+
+/* Move a damaged scorefile out of the way instead of silently overwriting it */
+static void badscores ()
+{
+   char badname[PATH_MAX];
+   snprintf (badname,sizeof (badname),"%s.bad",scorefile);
+   fprintf (stderr,"Warning: %s is damaged, moving it to %s\n",scorefile,badname);
+   rename (scorefile,badname);
+}
+
+static int cmpscores (const void *a,const void *b)
+{
+   int result;
+   result = (int) ((score_t *) a)->score - (int) ((score_t *) b)->score;
+   /* a < b */
+   if (result < 0) return 1;
+   /* a > b */
+   if (result > 0) return -1;
+   /* a = b */
+   result = (time_t) ((score_t *) a)->timestamp - (time_t) ((score_t *) b)->timestamp;
+   /* a is older */
+   if (result < 0) return -1;
+   /* b is older */
+   if (result > 0) return 1;
+   /* timestamps is equal */
+   return 0;
+}
+
+/* Show the highscore list, marking the entry added at the given time */
+static void showscores (const score_t *scores,time_t tmp)
+{
+   int i = 0,j;
+   fprintf (stderr,"%s",scoretitle);
+   while ((i < NUMSCORES) && (scores[i].score != -1))
+	 {
+		j = (tmp != 0) && (scores[i].timestamp == tmp) ? '*' : ' ';
+		fprintf (stderr,"\t %2d%c %7d        %s\n",i + 1,j,scores[i].score,scores[i].name);
+		i++;
+	 }
+   fprintf (stderr,"\n");
+}
+
+static void savescores (int score)
+{
+   int fd;
    score_t scores[NUMSCORES];
-   char header[strlen (SCORE_HEADER)+1];
-   if (score == 0) return;	/* No need saving this */
-   for (i = 1; i < NUMSCORES; i++)
+   char name[NAMELEN];
+   time_t tmp = 0;
+   /* The scorefile is only ever replaced atomically, so it is safe to peek at */
+   /* it without the lock. This way nobody waits while the player is typing */
+   if ((loadscores (scores) == SCORES_NONE) && (score == 0)) return;	/* No need saving this */
+   if (score > scores[NUMSCORES - 1].score)
+	 {
+		getname (name);
+		fd = lockscores ();
+		/* Somebody else might have updated the list in the meantime */
+		if (loadscores (scores) == SCORES_BAD) badscores ();
+		if (score > scores[NUMSCORES - 1].score)
+		  {
+			 strcpy (scores[NUMSCORES - 1].name,name);
+			 scores[NUMSCORES - 1].score = score;
+			 scores[NUMSCORES - 1].timestamp = tmp = time (NULL);
+			 qsort (scores,NUMSCORES,sizeof (score_t),cmpscores);
+			 storescores (scores);
+		  }
+		close (fd);
+	 }
+   showscores (scores,tmp);
+}
+
+          /***************************************************************************/
+          /***************************************************************************/
+          /***************************************************************************/
+
+/* Magic and version of the game history and its index */
+#define HISTORY_MAGIC	"TINTHIST"
+#define INDEX_MAGIC		"TINTINDX"
+#define HISTORY_VERSION	1
+
+/* The history starts with the magic, version and record size, followed by one */
+/* record per game: a NUL padded name, the score, starting level and number of */
+/* lines as 32-bit values, a 64-bit timestamp and the checksum of the record */
+#define HISTORY_HDRSIZE	16
+#define HISTORY_RECSIZE	(NAMELEN + 24)
+
+/* The index starts with the magic, version, history record size, the number of */
+/* games it covers and the number of entries in it, followed by the game numbers */
+/* sorted in each of the orders below */
+#define INDEX_HDRSIZE	24
+
+/* Orders kept in the index */
+#define ORDER_SCORE		0						/* best score first */
+#define ORDER_LEVEL		1						/* by starting level, then best score */
+#define ORDER_USER		2						/* by name, then best score */
+#define NUMORDERS		3
+
+/* The index is rebuilt once this many games were added after it. This bounds */
+/* the number of games a lookup has to sort */
+#define MAXTAIL			1024
+
+/* Address of a game in the mapped history, and the number of a game there */
+#define GAMEREC(lb,n) ((lb)->history + HISTORY_HDRSIZE + (size_t) (n) * HISTORY_RECSIZE)
+#define GAMENUM(lb,rec) ((uint64_t) ((rec) - GAMEREC (lb,0)) / HISTORY_RECSIZE)
+
+/* Number of the n-th game that isn't in the history yet, after every game */
+/* that is, so that equal games are ranked in the order they were recorded */
+#define PENDINGNUM(n) ((uint64_t) UINT32_MAX + 1 + (n))
+
+typedef struct
+{
+   char name[NAMELEN];
+   int score;
+   int level;
+   int lines;
+   time_t timestamp;
+} game_t;
+
+typedef struct
+{
+   const unsigned char *games;					/* game numbers (32-bit little endian) */
+   uint32_t n;									/* number of games */
+} gamelist_t;
+
+typedef struct
+{
+   const unsigned char *history;				/* mapped history */
+   size_t historylen;
+   const unsigned char *index;					/* mapped index */
+   size_t indexlen;
+   unsigned char *tail;							/* sorted games not in the index yet */
+   uint32_t count;								/* number of games in the history */
+   uint32_t indexed;							/* number of games covered by the index */
+   gamelist_t lists[NUMORDERS][2];				/* index and tail lists in every order */
+} leaderboard_t;
+
+/* Name of the player as recorded in the game history */
+static void getplayer (char *name,uid_t uid)
+{
+   struct passwd *pw = getpwuid (uid);
+   if (pw != NULL) snprintf (name,NAMELEN,"%.*s",NAMELEN - 1,pw->pw_name);
+   else snprintf (name,NAMELEN,"%ld",(long) uid);
+}
+
+/* Convert a game to a history record */
+static void encodegame (unsigned char *rec,const game_t *game)
+{
+   memset (rec,0,HISTORY_RECSIZE);
+   memcpy (rec,game->name,strnlen (game->name,NAMELEN - 1));
+   put_u32 (rec + NAMELEN,(uint32_t) game->score);
+   put_u32 (rec + NAMELEN + 4,(uint32_t) game->level);
+   put_u32 (rec + NAMELEN + 8,(uint32_t) game->lines);
+   put_u64 (rec + NAMELEN + 12,(uint64_t) game->timestamp);
+   put_u32 (rec + NAMELEN + 20,checksum (rec,NAMELEN + 20));
+}
+
+/* Convert a history record to a game */
+static void decodegame (const unsigned char *rec,game_t *game)
+{
+   memcpy (game->name,rec,NAMELEN);
+   game->name[NAMELEN - 1] = '\0';
+   game->score = (int32_t) get_u32 (rec + NAMELEN);
+   game->level = (int32_t) get_u32 (rec + NAMELEN + 4);
+   game->lines = (int32_t) get_u32 (rec + NAMELEN + 8);
+   game->timestamp = (time_t) (int64_t) get_u64 (rec + NAMELEN + 12);
+}
+
+/* Compare the primary keys of two history records in the given order */
+static int cmpkeys (int order,const unsigned char *a,const unsigned char *b)
+{
+   int32_t x,y;
+   if (order == ORDER_USER) return memcmp (a,b,NAMELEN);
+   if (order != ORDER_LEVEL) return 0;
+   x = (int32_t) get_u32 (a + NAMELEN + 4);
+   y = (int32_t) get_u32 (b + NAMELEN + 4);
+   return (x < y ? -1 : x > y);
+}
+
+/* Compare two history records in the given order. Games with the same key */
+/* are sorted like the highscore list, and older records come first */
+static int cmpgames (int order,const unsigned char *a,uint64_t na,const unsigned char *b,uint64_t nb)
+{
+   int64_t x,y;
+   int result;
+   if ((result = cmpkeys (order,a,b)) != 0) return result;
+   /* higher score first */
+   x = (int32_t) get_u32 (a + NAMELEN);
+   y = (int32_t) get_u32 (b + NAMELEN);
+   if (x != y) return (x > y ? -1 : 1);
+   /* older game first */
+   x = (int64_t) get_u64 (a + NAMELEN + 12);
+   y = (int64_t) get_u64 (b + NAMELEN + 12);
+   if (x != y) return (x < y ? -1 : 1);
+   /* older record first */
+   return (na < nb ? -1 : na > nb);
+}
+
+/* Map a whole file read-only. Returns NULL if it doesn't exist or is empty */
+static const unsigned char *mapfile (const char *filename,size_t *len)
+{
+   struct stat st;
+   void *addr;
+   int fd;
+   if ((fd = open (filename,O_RDONLY)) < 0) return NULL;
+   if ((fstat (fd,&st) < 0) || (st.st_size == 0))
+	 {
+		close (fd);
+		return NULL;
+	 }
+   addr = mmap (NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+   close (fd);
+   if (addr == MAP_FAILED) return NULL;
+   *len = st.st_size;
+   return addr;
+}
+
+/* Count the games in a sorted list that come before the given record. If keyonly */
+/* is set only the primary keys are compared, and if after is set games with an */
+/* equal key are counted as well */
+static uint32_t countbefore (const leaderboard_t *lb,const gamelist_t *list,int order,const unsigned char *rec,uint64_t number,bool keyonly,bool after)
+{
+   uint32_t lo = 0,hi = list->n,mid,game;
+   int result;
+   while (lo < hi)
+	 {
+		mid = lo + ((hi - lo) >> 1);
+		game = get_u32 (list->games + 4 * (size_t) mid);
+		result = keyonly ? cmpkeys (order,GAMEREC (lb,game),rec) : cmpgames (order,GAMEREC (lb,game),game,rec,number);
+		if ((result < 0) || (after && (result == 0))) lo = mid + 1; else hi = mid;
+	 }
+   return lo;
+}
+
+/* Context of sortgames(), since qsort() doesn't pass one to the comparison */
+static const leaderboard_t *sort_lb;
+static int sort_order;
+
+static int cmpsort (const void *a,const void *b)
+{
+   return cmpgames (sort_order,GAMEREC (sort_lb,*(const uint32_t *) a),*(const uint32_t *) a,GAMEREC (sort_lb,*(const uint32_t *) b),*(const uint32_t *) b);
+}
+
+static void closeleaderboard (leaderboard_t *lb)
+{
+   if (lb->history != NULL) munmap ((void *) lb->history,lb->historylen);
+   if (lb->index != NULL) munmap ((void *) lb->index,lb->indexlen);
+   free (lb->tail);
+   memset (lb,0,sizeof (leaderboard_t));
+}
+
+/* Map the game history and its index, and sort the games that were added after */
+/* the index was built. Returns TRUE if successful, FALSE otherwise */
+static bool openleaderboard (leaderboard_t *lb)
+{
+   uint32_t i,j,n,*games;
+   int order;
+   memset (lb,0,sizeof (leaderboard_t));
+   /* The index must be mapped first, so that it never covers more than the history */
+   if ((lb->index = mapfile (indexfile,&lb->indexlen)) != NULL)
+	 {
+		if ((lb->indexlen < INDEX_HDRSIZE) ||
+			(memcmp (lb->index,INDEX_MAGIC,strlen (INDEX_MAGIC)) != 0) ||
+			(get_u32 (lb->index + 8) != HISTORY_VERSION) ||
+			(get_u32 (lb->index + 12) != HISTORY_RECSIZE) ||
+			(lb->indexlen != INDEX_HDRSIZE + (size_t) NUMORDERS * 4 * get_u32 (lb->index + 20)))
+		  {
+			 munmap ((void *) lb->index,lb->indexlen);
+			 lb->index = NULL;
+		  }
+	 }
+   if (((lb->history = mapfile (historyfile,&lb->historylen)) == NULL) ||
+	   (lb->historylen < HISTORY_HDRSIZE) ||
+	   (memcmp (lb->history,HISTORY_MAGIC,strlen (HISTORY_MAGIC)) != 0) ||
+	   (get_u32 (lb->history + 8) != HISTORY_VERSION) ||
+	   (get_u32 (lb->history + 12) != HISTORY_RECSIZE))
+	 {
+		closeleaderboard (lb);
+		return FALSE;
+	 }
+   lb->count = (lb->historylen - HISTORY_HDRSIZE) / HISTORY_RECSIZE;
+   if ((lb->index != NULL) && (get_u32 (lb->index + 16) <= lb->count))
+	 {
+		/* A damaged index that names games it doesn't cover isn't used */
+		n = get_u32 (lb->index + 20);
+		for (i = 0; (i < NUMORDERS * n) && (get_u32 (lb->index + INDEX_HDRSIZE + 4 * (size_t) i) < get_u32 (lb->index + 16)); i++) ;
+		if (i == NUMORDERS * n)
+		  {
+			 lb->indexed = get_u32 (lb->index + 16);
+			 for (order = 0; order < NUMORDERS; order++)
+			   {
+				  lb->lists[order][0].games = lb->index + INDEX_HDRSIZE + (size_t) order * 4 * n;
+				  lb->lists[order][0].n = n;
+			   }
+		  }
+	 }
+   /* Sort the games in the tail, skipping partially written ones */
+   if ((games = malloc (sizeof (uint32_t) * (lb->count - lb->indexed + 1))) == NULL ||
+	   (lb->tail = malloc ((size_t) NUMORDERS * 4 * (lb->count - lb->indexed + 1))) == NULL)
+	 {
+		free (games);
+		closeleaderboard (lb);
+		return FALSE;
+	 }
+   for (i = lb->indexed, n = 0; i < lb->count; i++)
+	 if (get_u32 (GAMEREC (lb,i) + NAMELEN + 20) == checksum (GAMEREC (lb,i),NAMELEN + 20)) games[n++] = i;
+   sort_lb = lb;
+   for (order = 0; order < NUMORDERS; order++)
+	 {
+		sort_order = order;
+		qsort (games,n,sizeof (uint32_t),cmpsort);
+		for (j = 0; j < n; j++) put_u32 (lb->tail + 4 * ((size_t) order * n + j),games[j]);
+		lb->lists[order][1].games = lb->tail + (size_t) order * 4 * n;
+		lb->lists[order][1].n = n;
+	 }
+   free (games);
+   return TRUE;
+}
+
+/* Return the next game of two merged sorted lists, or -1 if both are exhausted */
+static int64_t nextgame (const leaderboard_t *lb,int order,uint32_t pos[2],const uint32_t end[2])
+{
+   const gamelist_t *list = lb->lists[order];
+   uint32_t a,b;
+   if (pos[0] >= end[0] && pos[1] >= end[1]) return -1;
+   if (pos[1] >= end[1]) return get_u32 (list[0].games + 4 * (size_t) pos[0]++);
+   if (pos[0] >= end[0]) return get_u32 (list[1].games + 4 * (size_t) pos[1]++);
+   a = get_u32 (list[0].games + 4 * (size_t) pos[0]);
+   b = get_u32 (list[1].games + 4 * (size_t) pos[1]);
+   if (cmpgames (order,GAMEREC (lb,a),a,GAMEREC (lb,b),b) < 0)
+	 {
+		pos[0]++;
+		return a;
+	 }
+   pos[1]++;
+   return b;
+}
+
+/* Fold the tail into the index. Must be called with the history locked */
+static bool rebuildindex (const leaderboard_t *lb)
+{
+   unsigned char *buf;
+   uint32_t pos[2],end[2],i,n;
+   size_t len;
+   bool result;
+   int order;
+   n = lb->lists[0][0].n + lb->lists[0][1].n;
+   len = INDEX_HDRSIZE + (size_t) NUMORDERS * 4 * n;
+   if ((buf = malloc (len)) == NULL) return FALSE;
+   memset (buf,0,INDEX_HDRSIZE);
+   memcpy (buf,INDEX_MAGIC,strlen (INDEX_MAGIC));
+   put_u32 (buf + 8,HISTORY_VERSION);
+   put_u32 (buf + 12,HISTORY_RECSIZE);
+   put_u32 (buf + 16,lb->count);
+   put_u32 (buf + 20,n);
+   for (order = 0; order < NUMORDERS; order++)
+	 {
+		pos[0] = pos[1] = 0;
+		end[0] = lb->lists[order][0].n;
+		end[1] = lb->lists[order][1].n;
+		for (i = 0; i < n; i++)
+		  put_u32 (buf + INDEX_HDRSIZE + 4 * ((size_t) order * n + i),(uint32_t) nextgame (lb,order,pos,end));
+	 }
+   result = replacefile (indexfile,buf,len);
+   free (buf);
+   return result;
+}
+
+/* Number of games the index covers, from its header. Returns 0 if there is */
+/* no index or it isn't one */
+static uint32_t indexedgames (void)
+{
+   unsigned char hdr[INDEX_HDRSIZE];
+   int fd;
+   bool ok;
+   if ((fd = open (indexfile,O_RDONLY)) < 0) return 0;
+   ok = (read (fd,hdr,INDEX_HDRSIZE) == INDEX_HDRSIZE) &&
+	 (memcmp (hdr,INDEX_MAGIC,strlen (INDEX_MAGIC)) == 0) &&
+	 (get_u32 (hdr + 8) == HISTORY_VERSION) &&
+	 (get_u32 (hdr + 12) == HISTORY_RECSIZE);
+   close (fd);
+   return (ok ? get_u32 (hdr + 16) : 0);
+}
+
+/* Append a batch of finished games to the history. Returns TRUE if successful, */
+/* FALSE otherwise */
+static bool appendhistory (const game_t *games,int n)
+{
+   unsigned char *buf;
+   leaderboard_t lb;
+   struct stat st;
+   size_t len = 0;
+   uint32_t count = 0,indexed;
+   bool ok = TRUE;
+   int i,fd,lock;
+   if ((lock = lockfile (historyfile)) < 0)
+	 {
+		fprintf (stderr,"Error locking %s\n",historyfile);
+		return FALSE;
+	 }
+   if (((fd = open (historyfile,O_WRONLY | O_APPEND | O_CREAT,0664)) < 0) || (fstat (fd,&st) < 0) ||
+	   ((buf = malloc (HISTORY_HDRSIZE + (size_t) n * HISTORY_RECSIZE)) == NULL))
+	 {
+		fprintf (stderr,"Error writing to %s\n",historyfile);
+		if (fd >= 0) close (fd);
+		close (lock);
+		return FALSE;
+	 }
+   /* A new history starts with its header, and a record that was only partially */
+   /* written by a crashed writer is cut off */
+   if (st.st_size < HISTORY_HDRSIZE)
+	 {
+		ok = (ftruncate (fd,0) == 0);
+		memset (buf,0,HISTORY_HDRSIZE);
+		memcpy (buf,HISTORY_MAGIC,strlen (HISTORY_MAGIC));
+		put_u32 (buf + 8,HISTORY_VERSION);
+		put_u32 (buf + 12,HISTORY_RECSIZE);
+		len = HISTORY_HDRSIZE;
+	 }
+   else if ((st.st_size - HISTORY_HDRSIZE) % HISTORY_RECSIZE)
+	 ok = (ftruncate (fd,st.st_size - (st.st_size - HISTORY_HDRSIZE) % HISTORY_RECSIZE) == 0);
+   for (i = 0; i < n; i++, len += HISTORY_RECSIZE) encodegame (buf + len,games + i);
+   ok = ok && (write (fd,buf,len) == (ssize_t) len) && (fsync (fd) == 0) && (fstat (fd,&st) == 0);
+   if (ok) count = (st.st_size - HISTORY_HDRSIZE) / HISTORY_RECSIZE;
+   close (fd);
+   free (buf);
+   if (!ok) fprintf (stderr,"Error writing to %s\n",historyfile);
+   /* Fold the new games into the index once enough of them have piled up. */
+   /* Until then only the header of the index is read, so that a save */
+   /* doesn't sort the games that aren't in it yet */
+   else if ((indexed = indexedgames ()) > count) indexed = 0;
+   if (ok && (count - indexed >= MAXTAIL) && openleaderboard (&lb))
+	 {
+		if ((lb.count - lb.indexed >= MAXTAIL) && !rebuildindex (&lb))
+		  fprintf (stderr,"Error writing to %s\n",indexfile);
+		closeleaderboard (&lb);
+	 }
+   close (lock);
+   return ok;
+}
+
+/* Append a finished game of the current player to the history */
+static void savehistory (int score,int level,int lines)
+{
+   game_t game;
+   getplayer (game.name,getuid ());
+   game.score = score;
+   game.level = level;
+   game.lines = lines;
+   game.timestamp = time (NULL);
+   appendhistory (&game,1);
+}
+
+/* Print a line of the leaderboard */
+static void showgame (uint32_t rank,const unsigned char *rec)
+{
+   char date[16];
+   game_t game;
+   decodegame (rec,&game);
+   strftime (date,sizeof (date),"%Y-%m-%d",localtime (&game.timestamp));
+   fprintf (stderr,"\t%6u %9d %5d %6d  %s  %s\n",rank,game.score,game.level,game.lines,date,game.name);
+}
+
+/* Print the title of the leaderboard */
+static void showleadertitle (int level)
+{
+   fprintf (stderr,"\n\t   TINT LEADERBOARD");
+   if (level) fprintf (stderr," (LEVEL %d)",level);
+   fprintf (stderr,"\n\n\t  Rank     Score Level  Lines  Date        Name\n\n");
+}
+
+/* Rank of a game among those in the leaderboard ranked against it: those */
+/* started at the given level, or all of them (level 0). The game doesn't */
+/* have to be in the leaderboard itself, in which case its number is one */
+/* given by PENDINGNUM() */
+static uint32_t rankgame (const leaderboard_t *lb,int level,const unsigned char *rec,uint64_t number)
+{
+   unsigned char key[HISTORY_RECSIZE];
+   int order = level ? ORDER_LEVEL : ORDER_SCORE;
+   uint32_t rank = 1;
+   int i;
+   memset (key,0,sizeof (key));
+   put_u32 (key + NAMELEN + 4,(uint32_t) level);
+   for (i = 0; i < 2; i++)
+	 {
+		rank += countbefore (lb,&lb->lists[order][i],order,rec,number,FALSE,FALSE);
+		if (level) rank -= countbefore (lb,&lb->lists[order][i],order,key,0,TRUE,FALSE);
+	 }
+   return rank;
+}
+
+/* Find the best games, either of everyone or of one player, optionally only */
+/* for games started at the given level (0 = all levels). Up to top games and */
+/* their ranks are stored in games and ranks, and the number of games ranked */
+/* against each other in total. Returns the number of games found */
+static int queryleaderboard (const leaderboard_t *lb,int top,const char *user,int level,const unsigned char **games,uint32_t *ranks,uint32_t *total)
+{
+   unsigned char key[HISTORY_RECSIZE];
+   uint32_t start[2],pos[2],end[2];
+   int order = level ? ORDER_LEVEL : ORDER_SCORE;
+   int64_t game;
+   int i,found = 0;
+   /* Find the games that are ranked against each other */
+   memset (key,0,sizeof (key));
+   put_u32 (key + NAMELEN + 4,(uint32_t) level);
+   for (i = 0; i < 2; i++)
+	 {
+		start[i] = pos[i] = level ? countbefore (lb,&lb->lists[order][i],order,key,0,TRUE,FALSE) : 0;
+		end[i] = level ? countbefore (lb,&lb->lists[order][i],order,key,0,TRUE,TRUE) : lb->lists[order][i].n;
+	 }
+   *total = end[0] - start[0] + end[1] - start[1];
+   if (user == NULL)
+	 {
+		for ( ; (found < top) && ((game = nextgame (lb,order,pos,end)) >= 0); found++)
+		  {
+			 games[found] = GAMEREC (lb,game);
+			 ranks[found] = found + 1;
+		  }
+		return found;
+	 }
+   /* The games of one player are next to each other, best one first */
+   snprintf ((char *) key,NAMELEN,"%s",user);
+   for (i = 0; i < 2; i++)
+	 {
+		pos[i] = countbefore (lb,&lb->lists[ORDER_USER][i],ORDER_USER,key,0,TRUE,FALSE);
+		end[i] = countbefore (lb,&lb->lists[ORDER_USER][i],ORDER_USER,key,0,TRUE,TRUE);
+	 }
+   while ((found < top) && ((game = nextgame (lb,ORDER_USER,pos,end)) >= 0))
+	 {
+		games[found] = GAMEREC (lb,game);
+		if (level && (cmpkeys (ORDER_LEVEL,games[found],key) != 0)) continue;
+		ranks[found] = countbefore (lb,&lb->lists[order][0],order,games[found],game,FALSE,FALSE) - start[0] +
+		  countbefore (lb,&lb->lists[order][1],order,games[found],game,FALSE,FALSE) - start[1] + 1;
+		found++;
+	 }
+   return found;
+}
+
+/* Show the best games, either of everyone or of one player */
+static void showleaderboard (int top,const char *user,int level)
+{
+   const unsigned char **games;
+   leaderboard_t lb;
+   uint32_t *ranks,total;
+   int i,found;
+   if (!openleaderboard (&lb))
+	 {
+		fprintf (stderr,"No games recorded in %s\n",historyfile);
+		return;
+	 }
+   if (((games = malloc (top * sizeof (*games))) == NULL) || ((ranks = malloc (top * sizeof (*ranks))) == NULL))
+	 {
+		fprintf (stderr,"Out of memory\n");
+		exit (EXIT_FAILURE);
+	 }
+   found = queryleaderboard (&lb,top,user,level,games,ranks,&total);
+   showleadertitle (level);
+   for (i = 0; i < found; i++) showgame (ranks[i],games[i]);
+   if ((user != NULL) && !found) fprintf (stderr,"\tNo games recorded for %s\n",user);
+   fprintf (stderr,"\n\t%u games ranked\n\n",total);
+   free (games);
+   free (ranks);
+   closeleaderboard (&lb);
+}
+
+          /***************************************************************************/
+          /***************************************************************************/
+          /***************************************************************************/
+
+/* Magic and version of the statistics log */
+#define STATS_MAGIC		"TINTSTAT"
+#define STATS_VERSION	1
+
+/* Columns of the statistics log. Every value is a signed 64-bit integer */
+#define ST_TIME			0						/* start of the game (seconds since the epoch) */
+#define ST_UID			1						/* user id of the player */
+#define ST_DURATION		2						/* length of the game in seconds */
+#define ST_STARTLEVEL	3						/* starting level */
+#define ST_LEVEL		4						/* level at the end of the game */
+#define ST_SCORE		5						/* score */
+#define ST_LINES		6						/* number of full lines */
+#define ST_EFFICIENCY	7						/* efficiency */
+#define ST_QUIT			8						/* 1 if the player quit, 0 if the board filled up */
+#define ST_SHAPES		9						/* number of pieces of each shape */
+#define ST_LEVELS		(ST_SHAPES + NUMSHAPES)	/* pieces played before reaching level 2 .. MAXLEVEL */
+#define ST_NUMCOLS		(ST_LEVELS + MAXLEVEL - 1)
+
+/* The log starts with the magic, version and number of columns, followed by */
+/* blocks of up to this many games. Games are staged in a separate tail file */
+/* with fixed width rows until there are enough of them to fill a block */
+#define STATS_HDRSIZE	16
+#define STATS_BLOCKROWS	1024
+
+/* Each block starts with its magic, number of games, number of the first game */
+/* and the length and checksum of the data, followed by the end offset of each */
+/* column in the data. Columns are stored one after the other, each value as */
+/* the zigzag varint of its difference from the previous value in the column */
+#define BLOCK_MAGIC		0x4b4c4254				/* "TBLK" */
+#define BLOCK_HDRSIZE	(24 + 4 * ST_NUMCOLS)
+
+/* The tail starts with the magic, version, number of columns and the number */
+/* of its first game, followed by the games as little endian 64-bit values */
+#define TAIL_HDRSIZE	24
+#define TAIL_ROWSIZE	(8 * ST_NUMCOLS)
+
+typedef struct
+{
+   int64_t col[ST_NUMCOLS];
+} stats_t;
+
+typedef struct
+{
+   uint64_t games;								/* number of games */
+   int64_t sum[ST_NUMCOLS];						/* sum of every column */
+   int64_t best;								/* best score */
+   uint64_t reached[MAXLEVEL + 1];				/* games that reached each level */
+   uint64_t started[MAXLEVEL + 1];				/* games started below each level */
+} statsum_t;
+
+static const char shapenames[NUMSHAPES] = { 'Z', 'S', 'T', 'O', 'L', 'J', 'I' };
+
+/* Name of the tail of the statistics log */
+static void tailname (char *name,size_t len)
+{
+   snprintf (name,len,"%s.tail",statsfile);
+}
+
+/* Encode a block of games. Returns the length of the block */
+static size_t encodeblock (unsigned char *buf,const stats_t *rows,int n,uint64_t first)
+{
+   unsigned char *p = buf + BLOCK_HDRSIZE;
+   int64_t prev;
+   int i,j;
+   for (j = 0; j < ST_NUMCOLS; j++)
+	 {
+		for (i = 0, prev = 0; i < n; prev = rows[i++].col[j]) p = put_varint (p,rows[i].col[j] - prev);
+		put_u32 (buf + 24 + 4 * j,p - buf - BLOCK_HDRSIZE);
+	 }
+   put_u32 (buf,BLOCK_MAGIC);
+   put_u32 (buf + 4,n);
+   put_u64 (buf + 8,first);
+   put_u32 (buf + 16,p - buf - BLOCK_HDRSIZE);
+   put_u32 (buf + 20,checksum (buf + BLOCK_HDRSIZE,p - buf - BLOCK_HDRSIZE));
+   return (p - buf);
+}
+
+/* Write the header of an empty tail starting at the given game */
+static void encodetail (unsigned char *buf,uint64_t first)
+{
+   memset (buf,0,TAIL_HDRSIZE);
+   memcpy (buf,STATS_MAGIC,strlen (STATS_MAGIC));
+   put_u32 (buf + 8,STATS_VERSION);
+   put_u32 (buf + 12,ST_NUMCOLS);
+   put_u64 (buf + 16,first);
+}
+
+/* Walk the blocks of a mapped statistics log. Returns the number of games in */
+/* the blocks, or -1 if the log is damaged. A block cut off at the end of the */
+/* log by a writer that crashed ends the walk, and where the blocks read whole */
+/* end is stored in end. If a block is given, it is called with the start and */
+/* number of games of every block after its checksum was verified. Writers */
+/* only need the headers */
+static int64_t walkblocks (const unsigned char *log,size_t len,size_t *end,void (*block)(void *,const unsigned char *,uint32_t),void *arg)
+{
+   size_t pos = STATS_HDRSIZE;
+   uint64_t games = 0;
+   uint32_t n,datalen;
+   *end = 0;
+   if (len < STATS_HDRSIZE) return 0;
+   if ((memcmp (log,STATS_MAGIC,strlen (STATS_MAGIC)) != 0) ||
+	   (get_u32 (log + 8) != STATS_VERSION) ||
+	   (get_u32 (log + 12) != ST_NUMCOLS))
+	 return -1;
+   while (pos + BLOCK_HDRSIZE <= len)
+	 {
+		n = get_u32 (log + pos + 4);
+		datalen = get_u32 (log + pos + 16);
+		if ((get_u32 (log + pos) != BLOCK_MAGIC) || (get_u64 (log + pos + 8) != games)) return -1;
+		if (pos + BLOCK_HDRSIZE + datalen > len) break;
+		if ((block != NULL) && (get_u32 (log + pos + 20) != checksum (log + pos + BLOCK_HDRSIZE,datalen))) return -1;
+		if (block != NULL) block (arg,log + pos,n);
+		games += n;
+		pos += BLOCK_HDRSIZE + datalen;
+	 }
+   *end = pos;
+   return ((int64_t) games);
+}
+
+/* Store games as fixed width rows */
+static void encoderows (unsigned char *buf,const stats_t *rows,int n)
+{
+   int i,j;
+   for (i = 0; i < n; i++)
+	 for (j = 0; j < ST_NUMCOLS; j++)
+	   put_u64 (buf + (size_t) i * TAIL_ROWSIZE + 8 * j,(uint64_t) rows[i].col[j]);
+}
+
+/* Append a batch of finished games to the statistics log. Returns TRUE if */
+/* successful, FALSE otherwise */
+static bool appendstats (const stats_t *rows,int n)
+{
+   unsigned char hdr[TAIL_HDRSIZE],*buf = NULL;
+   char tail[PATH_MAX];
+   const unsigned char *log;
+   stats_t *staged = NULL;
+   size_t loglen,logend,len;
+   int64_t blocked = 0;
+   uint64_t first,taillen,skip,i,done;
+   struct stat st;
+   bool ok = FALSE;
+   int j,fd = -1,logfd = -1,lock;
+   tailname (tail,sizeof (tail));
+   if ((lock = lockfile (statsfile)) < 0)
+	 {
+		fprintf (stderr,"Error locking %s\n",statsfile);
+		return FALSE;
+	 }
+   /* Find out how many games made it into blocks already */
+   if ((log = mapfile (statsfile,&loglen)) != NULL)
+	 {
+		blocked = walkblocks (log,loglen,&logend,NULL,NULL);
+		munmap ((void *) log,loglen);
+		if (blocked < 0)
+		  {
+			 fprintf (stderr,"Error reading %s\n",statsfile);
+			 close (lock);
+			 return FALSE;
+		  }
+		/* A block that was only partially written by a crashed writer is cut off */
+		if ((logend < loglen) && (truncate (statsfile,logend) < 0))
+		  {
+			 fprintf (stderr,"Error writing to %s\n",statsfile);
+			 close (lock);
+			 return FALSE;
+		  }
+	 }
+   if (((fd = open (tail,O_RDWR | O_CREAT,0664)) < 0) || (fstat (fd,&st) < 0)) goto done;
+   /* Start a new tail if there is none yet or it doesn't fit the blocks */
+   if ((st.st_size < TAIL_HDRSIZE) || (pread (fd,hdr,TAIL_HDRSIZE,0) != TAIL_HDRSIZE) ||
+	   (memcmp (hdr,STATS_MAGIC,strlen (STATS_MAGIC)) != 0) || (get_u32 (hdr + 12) != ST_NUMCOLS) ||
+	   ((int64_t) get_u64 (hdr + 16) > blocked) ||
+	   ((int64_t) (get_u64 (hdr + 16) + (st.st_size - TAIL_HDRSIZE) / TAIL_ROWSIZE) < blocked))
+	 {
+		encodetail (hdr,blocked);
+		st.st_size = TAIL_HDRSIZE;
+		if ((ftruncate (fd,0) < 0) || (pwrite (fd,hdr,TAIL_HDRSIZE,0) != TAIL_HDRSIZE)) goto done;
+	 }
+   first = get_u64 (hdr + 16);
+   taillen = (st.st_size - TAIL_HDRSIZE) / TAIL_ROWSIZE;
+   if (taillen + n < STATS_BLOCKROWS + (blocked - first))
+	 {
+		/* Not enough games for a block yet, so they just go to the tail */
+		if ((buf = malloc ((size_t) n * TAIL_ROWSIZE)) == NULL) goto done;
+		encoderows (buf,rows,n);
+		len = (size_t) n * TAIL_ROWSIZE;
+		ok = (pwrite (fd,buf,len,TAIL_HDRSIZE + taillen * TAIL_ROWSIZE) == (ssize_t) len) && (fsync (fd) == 0);
+		goto done;
+	 }
+   /* Collect the games of the tail that are not in a block yet (the ones before */
+   /* were moved into a block by a writer that crashed before it could cut the */
+   /* tail), followed by the new ones */
+   skip = blocked - first;
+   len = BLOCK_HDRSIZE + (size_t) (taillen + n) * TAIL_ROWSIZE * 2;
+   if (((staged = malloc (sizeof (stats_t) * (taillen + n))) == NULL) || ((buf = malloc (len)) == NULL)) goto done;
+   if (pread (fd,buf,taillen * TAIL_ROWSIZE,TAIL_HDRSIZE) != (ssize_t) (taillen * TAIL_ROWSIZE)) goto done;
+   for (i = skip; i < taillen; i++)
+	 for (j = 0; j < ST_NUMCOLS; j++)
+	   staged[i - skip].col[j] = (int64_t) get_u64 (buf + i * TAIL_ROWSIZE + 8 * j);
+   memcpy (staged + taillen - skip,rows,sizeof (stats_t) * n);
+   len = taillen - skip + n;
+   /* Append full blocks to the log */
+   if ((logfd = open (statsfile,O_WRONLY | O_APPEND | O_CREAT,0664)) < 0) goto done;
+   if (blocked == 0)
+	 {
+		memset (hdr,0,STATS_HDRSIZE);
+		memcpy (hdr,STATS_MAGIC,strlen (STATS_MAGIC));
+		put_u32 (hdr + 8,STATS_VERSION);
+		put_u32 (hdr + 12,ST_NUMCOLS);
+		if ((ftruncate (logfd,0) < 0) || (write (logfd,hdr,STATS_HDRSIZE) != STATS_HDRSIZE)) goto done;
+	 }
+   for (done = 0; len - done >= STATS_BLOCKROWS; done += STATS_BLOCKROWS, blocked += STATS_BLOCKROWS)
+	 {
+		i = encodeblock (buf,staged + done,STATS_BLOCKROWS,blocked);
+		if (write (logfd,buf,i) != (ssize_t) i) goto done;
+	 }
+   if (fsync (logfd) < 0) goto done;
+   /* Replace the tail with the games left over */
+   encodetail (buf,blocked);
+   encoderows (buf + TAIL_HDRSIZE,staged + done,len - done);
+   ok = replacefile (tail,buf,TAIL_HDRSIZE + (len - done) * TAIL_ROWSIZE);
+done:
+   if (!ok) fprintf (stderr,"Error writing to %s\n",statsfile);
+   if (logfd >= 0) close (logfd);
+   if (fd >= 0) close (fd);
+   free (staged);
+   free (buf);
+   close (lock);
+   return ok;
+}
+
+/* Add a game to the statistics */
+static void addstats (statsum_t *sum,const int64_t *col)
+{
+   int j;
+   sum->games++;
+   for (j = 0; j < ST_NUMCOLS; j++) sum->sum[j] += col[j];
+   if (col[ST_SCORE] > sum->best) sum->best = col[ST_SCORE];
+   for (j = 2; j <= MAXLEVEL; j++)
+	 if (col[ST_STARTLEVEL] < j)
+	   {
+		  sum->started[j]++;
+		  if (col[ST_LEVELS + j - 2]) sum->reached[j]++;
+	   }
+}
+
+/* Context of sumblock() */
+typedef struct
+{
+   statsum_t *sum;
+   int64_t uid;									/* only count games of this user, or -1 */
+   uint64_t need;								/* columns the query uses, a bit for each */
+   int64_t *cols;								/* decoded columns of a block */
+} sumctx_t;
+
+_Static_assert (ST_NUMCOLS <= 64,"too many columns for the mask of sumctx_t");
+
+/* Add the games of a block to the statistics. Only the columns the query */
+/* uses are decoded, and the others are counted as 0 */
+static void sumblock (void *arg,const unsigned char *block,uint32_t n)
+{
+   sumctx_t *ctx = arg;
+   const unsigned char *data = block + BLOCK_HDRSIZE,*p,*end;
+   int64_t value,row[ST_NUMCOLS],*cols = ctx->cols;
+   uint32_t i,start;
+   int j;
+   for (j = 0; j < ST_NUMCOLS; j++)
+	 {
+		if (!(ctx->need & (1ull << j)) && ((j != ST_UID) || (ctx->uid < 0))) continue;
+		start = j ? get_u32 (block + 24 + 4 * (j - 1)) : 0;
+		p = data + start;
+		end = data + get_u32 (block + 24 + 4 * j);
+		for (i = 0, value = 0; i < n; i++)
+		  {
+			 if ((p = get_varint (p,end,&cols[(size_t) j * STATS_BLOCKROWS + i])) == NULL) return;
+			 cols[(size_t) j * STATS_BLOCKROWS + i] = value += cols[(size_t) j * STATS_BLOCKROWS + i];
+		  }
+		/* Skip the rest of the block if none of its games were played by the user */
+		if ((j == ST_UID) && (ctx->uid >= 0))
+		  {
+			 for (i = 0; (i < n) && (cols[(size_t) ST_UID * STATS_BLOCKROWS + i] != ctx->uid); i++) ;
+			 if (i == n) return;
+		  }
+	 }
+   for (i = 0; i < n; i++)
+	 {
+		if ((ctx->uid >= 0) && (cols[(size_t) ST_UID * STATS_BLOCKROWS + i] != ctx->uid)) continue;
+		for (j = 0; j < ST_NUMCOLS; j++) row[j] = ctx->need & (1ull << j) ? cols[(size_t) j * STATS_BLOCKROWS + i] : 0;
+		addstats (ctx->sum,row);
+	 }
+}
+
+/* Collect the statistics of the game just played */
+static void getstats (stats_t *stats,const engine_t *engine,int startlevel,time_t starttime,bool quit)
+{
+   int j;
+   memset (stats,0,sizeof (stats_t));
+   stats->col[ST_TIME] = starttime;
+   stats->col[ST_UID] = getuid ();
+   stats->col[ST_DURATION] = time (NULL) - starttime;
+   stats->col[ST_STARTLEVEL] = startlevel;
+   stats->col[ST_LEVEL] = engine->level;
+   stats->col[ST_SCORE] = GETSCORE (engine->score);
+   stats->col[ST_LINES] = engine->status.droppedlines;
+   stats->col[ST_EFFICIENCY] = engine->status.efficiency;
+   stats->col[ST_QUIT] = quit;
+   for (j = 0; j < NUMSHAPES; j++) stats->col[ST_SHAPES + j] = engine->shapecount[j];
+   for (j = startlevel + 1; j <= engine->level; j++) stats->col[ST_LEVELS + j - 2] = engine->levelpieces[j];
+}
+
+/* Show statistics of every game in the statistics log, or of one player */
+static void showstats (const char *user)
+{
+   const unsigned char *log = NULL,*tail;
+   char name[PATH_MAX];
+   size_t loglen = 0,logend,taillen = 0,i;
+   int64_t blocked = 0,row[ST_NUMCOLS];
+   struct passwd *pw;
+   statsum_t sum;
+   sumctx_t ctx;
+   int j;
+   memset (&sum,0,sizeof (sum));
+   ctx.sum = &sum;
+   ctx.uid = -1;
+   /* everything but when the games were played and the levels they ended at */
+   ctx.need = ((1ull << ST_NUMCOLS) - 1) & ~((1ull << ST_TIME) | (1ull << ST_LEVEL));
+   if (user != NULL)
+	 {
+		if ((pw = getpwnam (user)) == NULL)
+		  {
+			 fprintf (stderr,"Unknown user %s\n",user);
+			 exit (EXIT_FAILURE);
+		  }
+		ctx.uid = pw->pw_uid;
+	 }
+   if ((ctx.cols = malloc (sizeof (int64_t) * ST_NUMCOLS * STATS_BLOCKROWS)) == NULL)
+	 {
+		fprintf (stderr,"Out of memory\n");
+		exit (EXIT_FAILURE);
+	 }
+   if (((log = mapfile (statsfile,&loglen)) != NULL) && (((blocked = walkblocks (log,loglen,&logend,sumblock,&ctx)) < 0) || (logend < loglen)))
+	 fprintf (stderr,"Warning: %s is damaged\n",statsfile);
+   /* Games that didn't fill a block yet */
+   tailname (name,sizeof (name));
+   if (((tail = mapfile (name,&taillen)) != NULL) && (taillen >= TAIL_HDRSIZE) &&
+	   (memcmp (tail,STATS_MAGIC,strlen (STATS_MAGIC)) == 0) && (get_u32 (tail + 12) == ST_NUMCOLS))
+	 for (i = 0; i < (taillen - TAIL_HDRSIZE) / TAIL_ROWSIZE; i++)
+	   {
+		  if ((int64_t) (get_u64 (tail + 16) + i) < blocked) continue;
+		  for (j = 0; j < ST_NUMCOLS; j++) row[j] = (int64_t) get_u64 (tail + TAIL_HDRSIZE + i * TAIL_ROWSIZE + 8 * j);
+		  if ((ctx.uid < 0) || (row[ST_UID] == ctx.uid)) addstats (&sum,row);
+	   }
+   if (log != NULL) munmap ((void *) log,loglen);
+   if (tail != NULL) munmap ((void *) tail,taillen);
+   free (ctx.cols);
+   fprintf (stderr,"\n\t   TINT STATISTICS");
+   if (user != NULL) fprintf (stderr," (%s)",user);
+   fprintf (stderr,"\n\n");
+   if (!sum.games)
+	 {
+		fprintf (stderr,"\tNo games recorded\n\n");
+		return;
+	 }
+   fprintf (stderr,"\tGames              %12llu\n",(unsigned long long) sum.games);
+   fprintf (stderr,"\tQuit                %10.1f%%\n",100.0 * sum.sum[ST_QUIT] / sum.games);
+   fprintf (stderr,"\tBest score         %12lld\n",(long long) sum.best);
+   fprintf (stderr,"\tAverage score        %10.1f\n",(double) sum.sum[ST_SCORE] / sum.games);
+   fprintf (stderr,"\tAverage lines        %10.1f\n",(double) sum.sum[ST_LINES] / sum.games);
+   fprintf (stderr,"\tAverage efficiency   %10.1f\n",(double) sum.sum[ST_EFFICIENCY] / sum.games);
+   fprintf (stderr,"\tAverage length       %9.1fs\n",(double) sum.sum[ST_DURATION] / sum.games);
+   for (j = 0, row[0] = 0; j < NUMSHAPES; j++) row[0] += sum.sum[ST_SHAPES + j];
+   fprintf (stderr,"\tAverage pieces       %10.1f\n",(double) row[0] / sum.games);
+   if (row[0]) fprintf (stderr,"\tScore ratio          %10.1f\n",(double) sum.sum[ST_SCORE] / row[0]);
+   fprintf (stderr,"\n\tPiece distribution\n\n");
+   for (j = 0; j < NUMSHAPES; j++)
+	 fprintf (stderr,"\t  %c                  %9.2f%%\n",shapenames[j],row[0] ? 100.0 * sum.sum[ST_SHAPES + j] / row[0] : 0.0);
+   fprintf (stderr,"\n\tLevel     Reached   Pieces to reach\n\n");
+   for (j = 2; j <= MAXLEVEL; j++)
+	 if (sum.started[j])
+	   fprintf (stderr,"\t  %d      %6.1f%%   %10.1f\n",j,100.0 * sum.reached[j] / sum.started[j],
+				sum.reached[j] ? (double) sum.sum[ST_LEVELS + j - 2] / sum.reached[j] : 0.0);
+   fprintf (stderr,"\n");
+}
+
+          /***************************************************************************/
+          /***************************************************************************/
+          /***************************************************************************/
+
+/* Requests understood by the score daemon */
+#define MSG_SCORES		1						/* get the highscore list */
+#define MSG_SUBMIT		2						/* submit a finished game */
+#define MSG_QUERY		3						/* query the leaderboard */
+#define MSG_STATS		4						/* submit the statistics of a finished game */
+
+/* A request is the type, score, starting level, number of lines and number of */
+/* games wanted as 32-bit values, followed by a NUL padded name: the name for */
+/* the highscore list with MSG_SUBMIT, or the player to look up with MSG_QUERY */
+#define MSG_REQSIZE		(NAMELEN + 20)
+
+/* MSG_STATS is followed by a row of the statistics log instead. It isn't answered */
+#define MSG_STATSIZE	(4 + TAIL_ROWSIZE)
+#define MSG_MAXREQ		MSG_STATSIZE
+
+/* The reply to MSG_SCORES and MSG_SUBMIT is the highscore list in the fixed */
+/* width format, followed by the 64-bit timestamp of the entry just added */
+#define MSG_SCORESIZE	(SCORE_FILESIZE + 8)
+
+/* The reply to MSG_QUERY is the number of games found and the number of games */
+/* ranked, followed by the rank and history record of every game found */
+#define MSG_MAXGAMES	256
+#define MSG_QUERYSIZE	(8 + MSG_MAXGAMES * (4 + HISTORY_RECSIZE))
+
+/* Time a client waits for the daemon before giving up (in seconds) */
+#define MSG_TIMEOUT		2
+
+/* Submitted games are written once the oldest one has waited this long (in */
+/* milliseconds), or once this many of them have piled up */
+#define FLUSHDELAY		250
+#define MAXBATCH		256
+
+/* Maximum number of clients connected at the same time */
+#define MAXCLIENTS		64
+
+typedef struct
+{
+   score_t scores[NUMSCORES];					/* highscore list as seen by clients */
+   score_t added[MAXBATCH];						/* highscores not written yet */
+   game_t games[MAXBATCH];						/* games not written yet */
+   stats_t stats[MAXBATCH];						/* statistics not written yet */
+   int nadded,ngames,nstats;
+   struct timeval due;							/* when pending games must be written */
+   leaderboard_t lb;							/* mapped leaderboard */
+   bool mapped;
+   off_t historylen;							/* size of the history when mapped */
+   ino_t indexino;								/* inode of the index when mapped */
+} tintd_t;
+
+static volatile sig_atomic_t tintd_quit;
+
+/* Connect to the score daemon. Returns the socket, or -1 if it isn't running */
+static int connectdaemon ()
+{
+   struct sockaddr_un addr;
+   struct timeval tv = { MSG_TIMEOUT, 0 };
+   int fd;
+   if ((fd = socket (AF_UNIX,SOCK_SEQPACKET,0)) < 0) return -1;
+   memset (&addr,0,sizeof (addr));
+   addr.sun_family = AF_UNIX;
+   snprintf (addr.sun_path,sizeof (addr.sun_path),"%s",socketfile);
+   setsockopt (fd,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof (tv));
+   setsockopt (fd,SOL_SOCKET,SO_SNDTIMEO,&tv,sizeof (tv));
+   if (connect (fd,(struct sockaddr *) &addr,sizeof (addr)) < 0)
+	 {
+		close (fd);
+		return -1;
+	 }
+   return fd;
+}
+
+/* Send a request to the score daemon. Returns TRUE if successful, FALSE otherwise */
+static bool senddaemon (int fd,int type,int score,int level,int lines,int top,const char *name)
+{
+   unsigned char req[MSG_REQSIZE];
+   memset (req,0,sizeof (req));
+   put_u32 (req,type);
+   put_u32 (req + 4,(uint32_t) score);
+   put_u32 (req + 8,(uint32_t) level);
+   put_u32 (req + 12,(uint32_t) lines);
+   put_u32 (req + 16,(uint32_t) top);
+   if (name != NULL) memcpy (req + 20,name,strnlen (name,NAMELEN - 1));
+   return (send (fd,req,sizeof (req),MSG_NOSIGNAL) == sizeof (req));
+}
+
+/* Receive the highscore list from the score daemon. Returns the timestamp of */
+/* the entry just added (0 if none), or -1 if unsuccessful */
+static time_t recvscores (int fd,score_t *scores)
+{
+   unsigned char reply[MSG_SCORESIZE];
+   if ((recv (fd,reply,sizeof (reply),0) != sizeof (reply)) ||
+	   (decodescores (reply,SCORE_FILESIZE,scores) != SCORES_OK))
+	 return -1;
+   return ((time_t) (int64_t) get_u64 (reply + SCORE_FILESIZE));
+}
+
+/* Save a finished game through the score daemon. Returns FALSE if the daemon */
+/* isn't running, in which case the caller has to write the files itself */
+static bool submitscores (int score,int level,int lines)
+{
+   score_t scores[NUMSCORES];
+   char name[NAMELEN] = "";
+   time_t tmp;
+   int fd;
+   if ((fd = connectdaemon ()) < 0) return FALSE;
+   if (!senddaemon (fd,MSG_SCORES,0,0,0,0,NULL) || (recvscores (fd,scores) < 0))
+	 {
+		close (fd);
+		return FALSE;
+	 }
+   if (score > scores[NUMSCORES - 1].score) getname (name);
+   if (!senddaemon (fd,MSG_SUBMIT,score,level,lines,0,name))
+	 {
+		close (fd);
+		return FALSE;
+	 }
+   /* The game is in the daemon's hands now, even if the reply gets lost */
+   if ((tmp = recvscores (fd,scores)) >= 0) showscores (scores,tmp);
+   close (fd);
+   return TRUE;
+}
+
+/* Save the statistics of a finished game, through the score daemon if it is running */
+static void savestats (const stats_t *stats)
+{
+   unsigned char req[MSG_STATSIZE];
+   bool sent;
+   int fd;
+   if ((fd = connectdaemon ()) >= 0)
+	 {
+		put_u32 (req,MSG_STATS);
+		encoderows (req + 4,stats,1);
+		sent = (send (fd,req,sizeof (req),MSG_NOSIGNAL) == sizeof (req));
+		close (fd);
+		if (sent) return;
+	 }
+   appendstats (stats,1);
+}
+
+/* Show the leaderboard through the score daemon. Returns FALSE if the daemon */
+/* isn't running, in which case the caller has to read the files itself */
+static bool querydaemon (int top,const char *user,int level)
+{
+   unsigned char *reply;
+   const unsigned char *entry;
+   ssize_t len;
+   uint32_t i,found;
+   int fd;
+   if ((top > MSG_MAXGAMES) || ((fd = connectdaemon ()) < 0)) return FALSE;
+   if ((reply = malloc (MSG_QUERYSIZE)) == NULL)
+	 {
+		close (fd);
+		return FALSE;
+	 }
+   len = senddaemon (fd,MSG_QUERY,0,level,0,top,user) ? recv (fd,reply,MSG_QUERYSIZE,0) : -1;
+   close (fd);
+   if ((len < 8) || ((size_t) len != 8 + (size_t) get_u32 (reply) * (4 + HISTORY_RECSIZE)))
+	 {
+		free (reply);
+		return FALSE;
+	 }
+   found = get_u32 (reply);
+   showleadertitle (level);
+   for (i = 0, entry = reply + 8; i < found; i++, entry += 4 + HISTORY_RECSIZE)
+	 showgame (get_u32 (entry),entry + 4);
+   if ((user != NULL) && !found) fprintf (stderr,"\tNo games recorded for %s\n",user);
+   fprintf (stderr,"\n\t%u games ranked\n\n",get_u32 (reply + 4));
+   free (reply);
+   return TRUE;
+}
+
+/* Map the leaderboard again if it changed on disk since it was last mapped */
+static void tintd_remap (tintd_t *d)
+{
+   struct stat st,ist;
+   if (stat (historyfile,&st) < 0) st.st_size = 0;
+   if (stat (indexfile,&ist) < 0) ist.st_ino = 0;
+   if (d->mapped && (st.st_size == d->historylen) && (ist.st_ino == d->indexino)) return;
+   if (d->mapped) closeleaderboard (&d->lb);
+   d->mapped = openleaderboard (&d->lb);
+   d->historylen = st.st_size;
+   d->indexino = ist.st_ino;
+}
+
+/* Write the pending games and highscores to disk */
+static void tintd_flush (tintd_t *d)
+{
+   unsigned char buf[SCORE_FILESIZE];
+   score_t scores[NUMSCORES];
+   int i,fd;
+   if (d->ngames) appendhistory (d->games,d->ngames);
+   if (d->nstats) appendstats (d->stats,d->nstats);
+   /* queries find the games just written on disk from now on */
+   if (d->ngames) tintd_remap (d);
+   d->ngames = d->nstats = 0;
+   if (!d->nadded) return;
+   if ((fd = lockfile (scorefile)) < 0)
+	 {
+		fprintf (stderr,"Error locking %s\n",scorefile);
+		return;
+	 }
+   /* Players that couldn't reach us might have updated the list in the meantime */
+   if (loadscores (scores) == SCORES_BAD) badscores ();
+   for (i = 0; i < d->nadded; i++)
+	 if (d->added[i].score > scores[NUMSCORES - 1].score)
+	   {
+		  scores[NUMSCORES - 1] = d->added[i];
+		  qsort (scores,NUMSCORES,sizeof (score_t),cmpscores);
+	   }
+   encodescores (buf,scores);
+   if (replacefile (scorefile,buf,sizeof (buf))) memcpy (d->scores,scores,sizeof (scores));
+   else fprintf (stderr,"Error writing to %s\n",scorefile);
+   d->nadded = 0;
+   close (fd);
+}
+
+/* Answer a leaderboard query like queryleaderboard(), with the games that */
+/* weren't written yet ranked among those on disk */
+static int tintd_query (tintd_t *d,int top,const char *user,int level,const unsigned char **games,uint32_t *ranks,uint32_t *total)
+{
+   static unsigned char pending[MAXBATCH][HISTORY_RECSIZE];
+   const unsigned char *ranked[MAXBATCH],*mapped[MSG_MAXGAMES];
+   uint64_t rankednum[MAXBATCH],number;
+   uint32_t mappedranks[MSG_MAXGAMES];
+   int i,j,k,n = 0,order = level ? ORDER_LEVEL : ORDER_SCORE,nmapped = 0,found = 0;
+   *total = 0;
+   if (d->mapped) nmapped = queryleaderboard (&d->lb,top,user,level,mapped,mappedranks,total);
+   /* the pending games ranked against each other, best first */
+   for (i = 0; i < d->ngames; i++)
+	 if (!level || (d->games[i].level == level))
+	   {
+		  encodegame (pending[i],&d->games[i]);
+		  for (j = n++; (j > 0) && (cmpgames (order,pending[i],PENDINGNUM (i),ranked[j - 1],rankednum[j - 1]) < 0); j--)
+			{
+			   ranked[j] = ranked[j - 1];
+			   rankednum[j] = rankednum[j - 1];
+			}
+		  ranked[j] = pending[i];
+		  rankednum[j] = PENDINGNUM (i);
+	   }
+   *total += n;
+   /* merge them with the games found on disk, each moved down by the */
+   /* pending games that are better */
+   for (i = j = 0; found < top; )
+	 {
+		while ((j < n) && (user != NULL) && strncmp ((const char *) ranked[j],user,NAMELEN)) j++;
+		if ((i < nmapped) && ((j == n) || (cmpgames (order,mapped[i],GAMENUM (&d->lb,mapped[i]),ranked[j],rankednum[j]) < 0)))
+		  {
+			 games[found] = mapped[i];
+			 number = GAMENUM (&d->lb,mapped[i]);
+			 ranks[found] = mappedranks[i++];
+		  }
+		else if (j < n)
+		  {
+			 games[found] = ranked[j];
+			 number = rankednum[j];
+			 ranks[found] = d->mapped ? rankgame (&d->lb,level,ranked[j],number) : 1;
+			 j++;
+		  }
+		else break;
+		for (k = 0; (k < n) && (cmpgames (order,ranked[k],rankednum[k],games[found],number) < 0); k++) ranks[found]++;
+		found++;
+	 }
+   return found;
+}
+
+/* Make room for one more pending submission, and start the clock on the batch */
+/* if it is the first one */
+static void tintd_pending (tintd_t *d)
+{
+   if ((d->ngames == MAXBATCH) || (d->nstats == MAXBATCH)) tintd_flush (d);
+   if (d->ngames || d->nstats) return;
+   gettimeofday (&d->due,NULL);
+   d->due.tv_usec += FLUSHDELAY * 1000;
+   d->due.tv_sec += d->due.tv_usec / 1000000;
+   d->due.tv_usec %= 1000000;
+}
+
+/* Handle a request of a client. Returns FALSE if the client should be dropped */
+static bool tintd_request (tintd_t *d,int fd,const unsigned char *req,ssize_t len)
+{
+   static unsigned char reply[MSG_QUERYSIZE];
+   const unsigned char *games[MSG_MAXGAMES];
+   uint32_t ranks[MSG_MAXGAMES],total;
+   char name[NAMELEN];
+   size_t replylen;
+   int i,j,found;
+   time_t tmp = 0;
+   bool peer = FALSE;
+#ifdef SO_PEERCRED
+   struct ucred cred;
+   socklen_t credlen = sizeof (cred);
+   /* The logs record who really played, not what they claim */
+   peer = (getsockopt (fd,SOL_SOCKET,SO_PEERCRED,&cred,&credlen) == 0);
+#endif
+   if ((len < 4) || (len != ((get_u32 (req) == MSG_STATS) ? MSG_STATSIZE : MSG_REQSIZE))) return FALSE;
+   memcpy (name,req + 20,NAMELEN);
+   name[NAMELEN - 1] = '\0';
+   switch (get_u32 (req))
+	 {
+	  case MSG_STATS:
+		tintd_pending (d);
+		for (j = 0; j < ST_NUMCOLS; j++) d->stats[d->nstats].col[j] = (int64_t) get_u64 (req + 4 + 8 * j);
+#ifdef SO_PEERCRED
+		if (peer) d->stats[d->nstats].col[ST_UID] = cred.uid;
+#endif
+		d->nstats++;
+		return TRUE;
+	  case MSG_SUBMIT:
+		tintd_pending (d);
+#ifdef SO_PEERCRED
+		if (peer) getplayer (d->games[d->ngames].name,cred.uid);
+#endif
+		if (!peer) strcpy (d->games[d->ngames].name,*name ? name : "unknown");
+		d->games[d->ngames].score = (int32_t) get_u32 (req + 4);
+		d->games[d->ngames].level = (int32_t) get_u32 (req + 8);
+		d->games[d->ngames].lines = (int32_t) get_u32 (req + 12);
+		d->games[d->ngames].timestamp = time (NULL);
+		if (*name && (d->games[d->ngames].score > d->scores[NUMSCORES - 1].score))
+		  {
+			 strcpy (d->scores[NUMSCORES - 1].name,name);
+			 d->scores[NUMSCORES - 1].score = d->games[d->ngames].score;
+			 d->scores[NUMSCORES - 1].timestamp = tmp = d->games[d->ngames].timestamp;
+			 d->added[d->nadded++] = d->scores[NUMSCORES - 1];
+			 qsort (d->scores,NUMSCORES,sizeof (score_t),cmpscores);
+		  }
+		d->ngames++;
+		/* fall through */
+	  case MSG_SCORES:
+		encodescores (reply,d->scores);
+		put_u64 (reply + SCORE_FILESIZE,(uint64_t) tmp);
+		replylen = MSG_SCORESIZE;
+		break;
+	  case MSG_QUERY:
+		/* Answers include every game submitted so far, written or not */
+		i = (int32_t) get_u32 (req + 16);
+		found = tintd_query (d,i < 1 ? 1 : i > MSG_MAXGAMES ? MSG_MAXGAMES : i,*name ? name : NULL,(int32_t) get_u32 (req + 8),games,ranks,&total);
+		put_u32 (reply,found);
+		put_u32 (reply + 4,total);
+		for (i = 0, replylen = 8; i < found; i++, replylen += 4 + HISTORY_RECSIZE)
+		  {
+			 put_u32 (reply + replylen,ranks[i]);
+			 memcpy (reply + replylen + 4,games[i],HISTORY_RECSIZE);
+		  }
+		break;
+	  default:
+		return FALSE;
+	 }
+   /* Never wait for a client that doesn't read its replies */
+   return (send (fd,reply,replylen,MSG_DONTWAIT | MSG_NOSIGNAL) == (ssize_t) replylen);
+}
+
+static void tintd_signal (int sig)
+{
+   tintd_quit = TRUE;
+}
+
+/*
+ * Score daemon: collects finished games from local players, writes them to
+ * disk in batches and answers leaderboard queries from memory
+ */
+int tintd_main (int argc,char *argv[])
+{
+   struct pollfd fds[MAXCLIENTS + 1];
+   unsigned char req[MSG_MAXREQ + 1];
+   struct sockaddr_un addr;
+   struct timeval now;
+   bool foreground = FALSE;
+   tintd_t *d;
+   int i,nfds,timeout;
+   ssize_t len;
+   for (i = 1; i < argc; i++)
+	 {
+		if (strcmp (argv[i],"-f") == 0) foreground = TRUE;
+		else
+		  {
+			 fprintf (stderr,"USAGE: tintd [-f]\n");
+			 fprintf (stderr,"  -f           Stay in the foreground\n");
+			 exit (EXIT_FAILURE);
+		  }
+	 }
+   if ((i = connectdaemon ()) >= 0)
+	 {
+		fprintf (stderr,"tintd is already running on %s\n",socketfile);
+		exit (EXIT_FAILURE);
+	 }
+   /* Remove a socket left behind by a daemon that died */
+   unlink (socketfile);
+   memset (&addr,0,sizeof (addr));
+   addr.sun_family = AF_UNIX;
+   snprintf (addr.sun_path,sizeof (addr.sun_path),"%s",socketfile);
+   if (((fds[0].fd = socket (AF_UNIX,SOCK_SEQPACKET,0)) < 0) ||
+	   (bind (fds[0].fd,(struct sockaddr *) &addr,sizeof (addr)) < 0) ||
+	   (chmod (socketfile,0666) < 0) ||
+	   (listen (fds[0].fd,MAXCLIENTS) < 0))
+	 {
+		fprintf (stderr,"Error listening on %s: %s\n",socketfile,strerror (errno));
+		exit (EXIT_FAILURE);
+	 }
+   fds[0].events = POLLIN;
+   nfds = 1;
+   if ((d = calloc (1,sizeof (tintd_t))) == NULL)
+	 {
+		fprintf (stderr,"Out of memory\n");
+		exit (EXIT_FAILURE);
+	 }
+   if (loadscores (d->scores) == SCORES_BAD) fprintf (stderr,"Warning: %s is damaged\n",scorefile);
+   tintd_remap (d);
+   signal (SIGINT,tintd_signal);
+   signal (SIGTERM,tintd_signal);
+   signal (SIGPIPE,SIG_IGN);
+   if (!foreground && (daemon (1,0) < 0))
+	 {
+		fprintf (stderr,"Error detaching from terminal: %s\n",strerror (errno));
+		exit (EXIT_FAILURE);
+	 }
+   while (!tintd_quit)
+	 {
+		/* Sleep until a client needs us or pending games are due */
+		timeout = -1;
+		if (d->ngames || d->nstats)
+		  {
+			 gettimeofday (&now,NULL);
+			 timeout = (d->due.tv_sec - now.tv_sec) * 1000 + (d->due.tv_usec - now.tv_usec) / 1000;
+			 if (timeout < 0) timeout = 0;
+		  }
+		if ((poll (fds,nfds,timeout) < 0) && (errno != EINTR)) break;
+		for (i = nfds - 1; i > 0; i--)
+		  {
+			 if (!fds[i].revents) continue;
+			 len = (fds[i].revents & POLLIN) ? recv (fds[i].fd,req,sizeof (req),MSG_DONTWAIT) : 0;
+			 if ((len < 0) && ((errno == EAGAIN) || (errno == EINTR))) continue;
+			 if ((len <= 0) || !tintd_request (d,fds[i].fd,req,len))
+			   {
+				  close (fds[i].fd);
+				  fds[i] = fds[--nfds];
+			   }
+		  }
+		if (fds[0].revents & POLLIN)
+		  {
+			 if ((i = accept (fds[0].fd,NULL,NULL)) >= 0)
+			   {
+				  if (nfds <= MAXCLIENTS)
+					{
+					   fds[nfds].fd = i;
+					   fds[nfds++].events = POLLIN;
+					}
+				  else close (i);
+			   }
+		  }
+		if (d->ngames || d->nstats)
+		  {
+			 gettimeofday (&now,NULL);
+			 if ((d->ngames >= MAXBATCH) || (d->nstats >= MAXBATCH) || timercmp (&now,&d->due,>=)) tintd_flush (d);
+		  }
+	 }
+   tintd_flush (d);
+   close (fds[0].fd);
+   unlink (socketfile);
+   exit (EXIT_SUCCESS);
+}
+
+          /***************************************************************************/
+          /***************************************************************************/
+          /***************************************************************************/
+
+static void showhelp ()
+{
+   fprintf (stderr,"USAGE: tint [-h] [-l level] [-n [count]] [-d] [-b char] [-s] [-W width] [-H height]\n");
+   fprintf (stderr,"            [--practice [kb]] [--record file] [--book file] [--bot-protocol command [--headless]]\n");
+   fprintf (stderr,"       tint --scores [-l level] [--top count] [--user name]\n");
+   fprintf (stderr,"       tint --stats [--user name]\n");
+   fprintf (stderr,"       tint [--versus] [--bots count] [--pieces set] [--book file] [-l level] [-n] [-d] [-b char] [-s]\n");
+   fprintf (stderr,"       tint --watch address\n");
+   fprintf (stderr,"       tint --replay file [--headless]\n");
+   fprintf (stderr,"  -h           Show this help message\n");
+   fprintf (stderr,"  -l <level>   Specify the starting level (%d-%d)\n",MINLEVEL,MAXLEVEL);
+   fprintf (stderr,"  -n [count]   Draw next shape, or this many shapes ahead (up to %d)\n",MAXPREVIEWS);
+   fprintf (stderr,"  -d           Draw vertical dotted lines\n");
+   fprintf (stderr,"  -b <char>    Use this character to draw blocks instead of spaces\n");
+   fprintf (stderr,"  -s           Draw shadow of shape\n");
+   fprintf (stderr,"  -W <width>   Width of the board (%d-%d, default %d)\n",MINWIDTH,MAXWIDTH,NUMCOLS - 3);
+   fprintf (stderr,"  -H <height>  Height of the board (%d-%d, default %d)\n",MINHEIGHT,MAXHEIGHT,NUMROWS - 3);
+   fprintf (stderr,"  --scores     Show the leaderboard of all recorded games and exit\n");
+   fprintf (stderr,"  --top <n>    Number of games to show on the leaderboard (default %d)\n",NUMSCORES);
+   fprintf (stderr,"  --user <name> Show the best games and rank of this player\n");
+   fprintf (stderr,"  --stats      Show statistics of all recorded games and exit\n");
+   fprintf (stderr,"  --versus     Play against another player on the same keyboard\n");
+   fprintf (stderr,"  --bots <n>   Play against this many computer players\n");
+   fprintf (stderr,"  --broadcast <address> Let spectators watch the game on this address\n");
+   fprintf (stderr,"  --watch <address> Watch a game broadcast on this address\n");
+   fprintf (stderr,"               (the path of a UNIX socket, or [host:]port for TCP)\n");
+   fprintf (stderr,"  --publish <name> Publish the game in this shared memory segment\n");
+   fprintf (stderr,"  --profile-out <file> Write latency percentiles of the game to this file\n");
+   fprintf (stderr,"  --pieces <set> Play with tetrominoes, pentominoes or the shapes in this file\n");
+   fprintf (stderr,"  --bandwidth <n> Draw no more than n bytes per second\n");
+   fprintf (stderr,"  --practice [kb] Let shapes be taken back, keeping up to kb kilobytes of them (default %d)\n",PRACTICE_MEMORY);
+   fprintf (stderr,"  --record <file> Record the game to this file\n");
+   fprintf (stderr,"  --replay <file> Play back a recorded game\n");
+   fprintf (stderr,"  --book <file> Let bots and hints play the first bag from this opening book\n");
+   fprintf (stderr,"  --bot-protocol <command> Let this program play, talking to it through pipes\n");
+   fprintf (stderr,"  --headless   Play without a terminal, as fast as the program answers or\n");
+   fprintf (stderr,"               the replay can be drawn\n");
+   exit (EXIT_FAILURE);
+}
+
+/* Find a set of shapes by name, or read it from the file of that name. */
+/* Exits with a message if it can't be read */
+static const pieces_t *usepieces (const char *name)
+{
+   const pieces_t *pieces;
+   int line;
+   if ((pieces = pieces_builtin (name)) != NULL) return (pieces);
+   if ((line = pieces_load (&custompieces,name)) == -1)
+	 {
+		fprintf (stderr,"Error reading %s: %s\n",name,strerror (errno));
+		exit (EXIT_FAILURE);
+	 }
+   if (line == -2)
+	 {
+		fprintf (stderr,"%s: The shapes don't fit on a board up to %d columns wide\n",name,MAXWIDTH);
+		exit (EXIT_FAILURE);
+	 }
+   if (line > 0)
+	 {
+		fprintf (stderr,"%s:%d: Invalid shape\n",name,line);
+		exit (EXIT_FAILURE);
+	 }
+   return (&custompieces);
+}
+
+static void parse_options (int argc,char *argv[])
+{
+   int i = 1,count;
+   while (i < argc)
+	 {
+		/* Help? */
+		if (strcmp (argv[i],"-h") == 0)
+		  showhelp ();
+		/* Level? */
+		else if (strcmp (argv[i],"-l") == 0)
+		  {
+			 i++;
+			 if (i >= argc || !str2int (&level,argv[i])) showhelp ();
+			 if ((level < MINLEVEL) || (level > MAXLEVEL))
+			   {
+				  fprintf (stderr,"You must specify a level between %d and %d\n",MINLEVEL,MAXLEVEL);
+				  exit (EXIT_FAILURE);
+			   }
+		  }
+		/* Show next? */
+		else if (strcmp (argv[i],"-n") == 0)
+		  {
+			 shownext = TRUE;
+			 /* the count is optional, and str2int() sets it even if the */
+			 /* next option isn't one */
+			 if ((i + 1 < argc) && str2int (&count,argv[i + 1]))
+			   {
+				  i++;
+				  if ((count < 1) || (count > MAXPREVIEWS))
+					{
+					   fprintf (stderr,"You can see between 1 and %d shapes ahead\n",MAXPREVIEWS);
+					   exit (EXIT_FAILURE);
+					}
+				  numpreviews = count;
+			   }
+		  }
+		else if(strcmp(argv[i],"-d")==0)
+		  dottedlines = TRUE;
+		else if(strcmp(argv[i], "-b")==0)
+		  {
+		    i++;
+		    if (i >= argc || strlen(argv[i]) < 1) showhelp();
+		    blockchar = argv[i][0];
+		  }
+		else if (strcmp (argv[i],"-s") == 0)
+            shadow = TRUE;
+		/* Board size? */
+		else if (strcmp (argv[i],"-W") == 0)
+		  {
+			 i++;
+			 if (i >= argc || !str2int (&boardwidth,argv[i])) showhelp ();
+			 if ((boardwidth < MINWIDTH) || (boardwidth > MAXWIDTH))
+			   {
+				  fprintf (stderr,"You must specify a width between %d and %d\n",MINWIDTH,MAXWIDTH);
+				  exit (EXIT_FAILURE);
+			   }
+		  }
+		else if (strcmp (argv[i],"-H") == 0)
+		  {
+			 i++;
+			 if (i >= argc || !str2int (&boardheight,argv[i])) showhelp ();
+			 if ((boardheight < MINHEIGHT) || (boardheight > MAXHEIGHT))
+			   {
+				  fprintf (stderr,"You must specify a height between %d and %d\n",MINHEIGHT,MAXHEIGHT);
+				  exit (EXIT_FAILURE);
+			   }
+		  }
+		/* Leaderboard? */
+		else if (strcmp (argv[i],"--scores") == 0)
+		  listscores = TRUE;
+		else if (strcmp (argv[i],"--stats") == 0)
+		  liststats = TRUE;
+		else if (strcmp (argv[i],"--top") == 0)
+		  {
+			 i++;
+			 if (i >= argc || !str2int (&topscores,argv[i]) || topscores < 1) showhelp ();
+		  }
+		else if (strcmp (argv[i],"--user") == 0)
+		  {
+			 i++;
+			 if (i >= argc) showhelp ();
+			 scoreuser = argv[i];
+		  }
+		/* Versus mode? */
+		else if (strcmp (argv[i],"--versus") == 0)
+		  versusmode = TRUE;
+		else if (strcmp (argv[i],"--bots") == 0)
+		  {
+			 i++;
+			 if (i >= argc || !str2int (&numbots,argv[i]) || numbots < 1) showhelp ();
+		  }
+		/* Spectators? */
+		else if (strcmp (argv[i],"--broadcast") == 0)
+		  {
+			 i++;
+			 if (i >= argc) showhelp ();
+			 broadcastaddr = argv[i];
+		  }
+		else if (strcmp (argv[i],"--publish") == 0)
+		  {
+			 i++;
+			 if (i >= argc) showhelp ();
+			 publishname = argv[i];
+		  }
+		else if (strcmp (argv[i],"--watch") == 0)
+		  {
+			 i++;
+			 if (i >= argc) showhelp ();
+			 watchaddr = argv[i];
+		  }
+		/* Profile? */
+		else if (strcmp (argv[i],"--profile-out") == 0)
+		  {
+			 i++;
+			 if (i >= argc) showhelp ();
+			 profileout = argv[i];
+		  }
+		/* Other shapes? */
+		else if (strcmp (argv[i],"--pieces") == 0)
+		  {
+			 i++;
+			 if (i >= argc) showhelp ();
+			 piecesname = argv[i];
+		  }
+		/* Slow link? */
+		else if (strcmp (argv[i],"--bandwidth") == 0)
+		  {
+			 i++;
+			 if (i >= argc || !str2int (&render.bandwidth,argv[i]) || render.bandwidth < 1) showhelp ();
+		  }
+		/* Practice? */
+		else if (strcmp (argv[i],"--practice") == 0)
+		  {
+			 practicememory = PRACTICE_MEMORY;
+			 /* like the count of -n, the size is optional */
+			 if ((i + 1 < argc) && str2int (&count,argv[i + 1]))
+			   {
+				  i++;
+				  if ((count < 1) || (count > PRACTICE_MAXMEMORY))
+					{
+					   fprintf (stderr,"Practice mode can keep between 1 and %d kilobytes\n",PRACTICE_MAXMEMORY);
+					   exit (EXIT_FAILURE);
+					}
+				  practicememory = count;
+			   }
+		  }
+		/* Replays? */
+		else if (strcmp (argv[i],"--record") == 0)
+		  {
+			 i++;
+			 if (i >= argc) showhelp ();
+			 recordfile = argv[i];
+		  }
+		else if (strcmp (argv[i],"--replay") == 0)
+		  {
+			 i++;
+			 if (i >= argc) showhelp ();
+			 replayfile = argv[i];
+		  }
+		/* Played by another program? */
+		else if (strcmp (argv[i],"--bot-protocol") == 0)
+		  {
+			 i++;
+			 if (i >= argc) showhelp ();
+			 botcommand = argv[i];
+		  }
+		else if (strcmp (argv[i],"--headless") == 0)
+		  headless = TRUE;
+		/* Opening book? */
+		else if (strcmp (argv[i],"--book") == 0)
+		  {
+			 i++;
+			 if (i >= argc) showhelp ();
+			 bookname = argv[i];
+		  }
+		else
+		  {
+			 fprintf (stderr,"Invalid option -- %s\n",argv[i]);
+			 showhelp ();
+		  }
+		i++;
+	 }
+   if ((versusmode ? 2 : 1) + numbots > MAXBOARDS)
+	 {
+		fprintf (stderr,"There is room for at most %d boards\n",MAXBOARDS);
+		exit (EXIT_FAILURE);
+	 }
+   if (practicememory && (versusmode || numbots))
+	 {
+		fprintf (stderr,"Practice mode is for one player\n");
+		exit (EXIT_FAILURE);
+	 }
+   if ((recordfile != NULL) && (versusmode || numbots))
+	 {
+		fprintf (stderr,"Only games of one player can be recorded\n");
+		exit (EXIT_FAILURE);
+	 }
+   if ((botcommand != NULL) && (versusmode || numbots))
+	 {
+		fprintf (stderr,"A bot over the protocol plays alone\n");
+		exit (EXIT_FAILURE);
+	 }
+   if (headless && (botcommand == NULL) && (replayfile == NULL))
+	 {
+		fprintf (stderr,"Only a replay or a game played over the bot protocol can be headless\n");
+		exit (EXIT_FAILURE);
+	 }
+   pieceset = usepieces (piecesname != NULL ? piecesname : "tetrominoes");
+   if (boardwidth < pieceset->minwidth)
+	 {
+		fprintf (stderr,"These shapes need a board at least %d wide\n",pieceset->minwidth);
+		exit (EXIT_FAILURE);
+	 }
+}
+
+static void choose_level ()
+{
+   char buf[NAMELEN];
+
+   do
+	 {
+		fprintf (stderr,"Choose a level to start [%d-%d]: ",MINLEVEL,MAXLEVEL);
+		fgets (buf,NAMELEN - 1,stdin);
+		buf[strlen (buf) - 1] = '\0';
+	 }
+   while (!str2int (&level,buf) || level < MINLEVEL || level > MAXLEVEL);
+}
+
+/*
+ * Practice
+ */
+
+/* What a shape changed when it came to rest, kept so that practice mode can */
+/* take it back and put it down again. It is followed by the number and the */
+/* cells of every row that was cleared, and by its size again so that the */
+/* records can be walked both ways */
+typedef struct
+{
+   uint16_t size;								/* size of the record, rows included */
+   uint8_t shape,rotation,x,y;					/* shape and where it came to rest */
+   uint8_t numcleared;							/* rows cleared */
+   uint8_t levels;								/* levels gone up */
+   int score;									/* points earned */
+   int faults;									/* finesse faults made */
+   status_t status;							/* change of the status */
+} lock_t;
+
+/* Room the rows of a record take: a shape can clear every row it is in */
+#define LOCK_MAXROWS	(MAXBLOCKS * (MAXCOLS - 2))
+
+/* Largest record */
+#define LOCK_MAXSIZE	(sizeof (lock_t) + LOCK_MAXROWS + sizeof (uint16_t))
+
+/* Records of the shapes that can be taken back and put down again, in a */
+/* ring buffer. Offsets count every byte ever written to it */
+typedef struct
+{
+   unsigned char *buffer;						/* NULL unless practicing */
+   size_t size;
+   uint64_t first;								/* oldest record */
+   uint64_t last;								/* end of the records that can be taken back */
+   uint64_t end;								/* end of the records that can be put down again */
+} practice_t;
+
+static practice_t practice;
+
+/* Keep records in this many kilobytes. Returns FALSE if out of memory */
+static bool practice_init (int kilobytes)
+{
+   practice.size = (size_t) kilobytes << 10;
+   practice.first = practice.last = practice.end = 0;
+   return ((practice.buffer = malloc (practice.size)) != NULL);
+}
+
+/* Copy bytes to (or from) the ring buffer, from the given offset on */
+static void practice_copy (uint64_t offset,void *data,size_t n,bool write)
+{
+   size_t at = offset % practice.size,part = n < practice.size - at ? n : practice.size - at;
+   if (write)
+	 {
+		memcpy (practice.buffer + at,data,part);
+		memcpy (practice.buffer,(unsigned char *) data + part,n - part);
+	 }
+   else
+	 {
+		memcpy (data,practice.buffer + at,part);
+		memcpy ((unsigned char *) data + part,practice.buffer,n - part);
+	 }
+}
+
+/* Add (or subtract) a change of the status */
+static void status_add (status_t *status,const status_t *change,int sign)
+{
+   status->moves += sign * change->moves;
+   status->rotations += sign * change->rotations;
+   status->dropcount += sign * change->dropcount;
+   status->efficiency += sign * change->efficiency;
+   status->droppedlines += sign * change->droppedlines;
+   status->currentdroppedlines += sign * change->currentdroppedlines;
+   status->keys += sign * change->keys;
+}
+
+/* Note what the current shape may change if it comes to rest: the score */
+/* and status as they are, and the full rows. Only rows the shape is in */
+/* can be full, since the others would have been cleared already */
+static void practice_before (const engine_t *engine,lock_t *lock,unsigned char *rows)
+{
+   const rotation_t *shape = CURRENT (engine);
+   int x,y;
+   lock->shape = engine->curshape;
+   lock->rotation = engine->rotation;
+   lock->x = engine->curx;
+   lock->y = engine->cury;
+   lock->numcleared = 0;
+   lock->levels = engine->level;
+   lock->score = engine->score;
+   lock->faults = engine->faults;
+   lock->status = engine->status;
+   for (y = engine->cury + shape->top > 1 ? engine->cury + shape->top : 1; y <= engine->cury + shape->bottom; y++)
+	 {
+		for (x = 1; (x < engine->cols - 2) && engine->board[x][y]; x++) ;
+		if (x < engine->cols - 2) continue;
+		*rows++ = y;
+		for (x = 1; x < engine->cols - 2; x++) *rows++ = engine->board[x][y];
+		lock->numcleared++;
+	 }
+}
+
+/* Keep the record of a shape that came to rest, forgetting the shapes that */
+/* were taken back, and the oldest ones if there is no room */
+static void practice_record (const engine_t *engine,lock_t *lock,const unsigned char *rows)
+{
+   unsigned char record[LOCK_MAXSIZE];
+   size_t n = lock->numcleared * (engine->cols - 2);
+   status_t before = lock->status;
+   uint16_t size = sizeof (lock_t) + n + sizeof (size),oldest;
+   lock->size = size;
+   lock->levels = engine->level - lock->levels;
+   lock->score = engine->score - lock->score;
+   lock->faults = engine->faults - lock->faults;
+   lock->status = engine->status;
+   status_add (&lock->status,&before,-1);
+   memcpy (record,lock,sizeof (lock_t));
+   memcpy (record + sizeof (lock_t),rows,n);
+   memcpy (record + sizeof (lock_t) + n,&size,sizeof (size));
+   for (practice.end = practice.last; practice.last + size - practice.first > practice.size; practice.first += oldest)
+	 practice_copy (practice.first,&oldest,sizeof (oldest),FALSE);
+   practice_copy (practice.last,record,size,TRUE);
+   practice.last = practice.end = practice.last + size;
+}
+
+/* Let the current shape start again where new shapes appear */
+static void practice_spawn (engine_t *engine)
+{
+   const rotation_t *shape;
+   engine->rotation = 0;
+   engine->curx = engine->curx_shadow = SPAWNX (engine);
+   engine->cury = engine->cury_shadow = engine->pieces->shape[engine->curshape].y;
+   engine->status.moves = engine->status.rotations = engine->status.dropcount = engine->status.keys = 0;
+   engine->curx_hint = -1;
+   engine->dirty = ALLROWS;
+   shape = CURRENT (engine);
+   if (engine->shadow)
+	 {
+		place_shadow_to_bottom (engine->board,shape,engine->curx_shadow,&engine->cury_shadow,engine->cury);
+		drawshape (engine->board,shape,engine->curx_shadow,engine->cury_shadow);
+	 }
+   drawshape (engine->board,shape,engine->curx,engine->cury);
+}
+
+/* Take back the last shape that came to rest, which becomes the current */
+/* shape again. Returns FALSE if there is none left to take back */
+static bool practice_undo (engine_t *engine)
+{
+   unsigned char record[LOCK_MAXSIZE];
+   const unsigned char *row;
+   const rotation_t *shape = CURRENT (engine);
+   lock_t lock;
+   uint16_t size;
+   int i,x;
+   if (practice.last == practice.first) return (FALSE);
+   practice_copy (practice.last - sizeof (size),&size,sizeof (size),FALSE);
+   practice_copy (practice.last - size,record,size,FALSE);
+   memcpy (&lock,record,sizeof (lock_t));
+   eraseshape (engine->board,shape,engine->curx,engine->cury);
+   if (engine->shadow) eraseshape (engine->board,shape,engine->curx_shadow,engine->cury_shadow);
+   engine->shapecount[engine->curshape]--;
+   /* put the cleared rows back from the bottom up, moving the rows above each up */
+   for (i = lock.numcleared - 1; i >= 0; i--)
+	 for (x = 1, row = record + sizeof (lock_t) + i * (engine->cols - 2); x < engine->cols - 2; x++)
+	   {
+		  memmove (&engine->board[x][0],&engine->board[x][1],row[0] * sizeof (int));
+		  engine->board[x][row[0]] = row[x];
+	   }
+   eraseshape (engine->board,&engine->pieces->shape[lock.shape].rotation[lock.rotation],lock.x,lock.y);
+   engine->score -= lock.score;
+   engine->faults -= lock.faults;
+   engine->level -= lock.levels;
+   status_add (&engine->status,&lock.status,-1);
+   queue_back (engine,lock.shape);
+   practice_spawn (engine);
+   practice.last -= size;
+   return (TRUE);
+}
+
+/* Put the last shape that was taken back where it came to rest before. */
+/* Returns FALSE if there is none */
+static bool practice_redo (engine_t *engine)
+{
+   const rotation_t *shape = CURRENT (engine);
+   lock_t lock;
+   if (practice.last == practice.end) return (FALSE);
+   practice_copy (practice.last,&lock,sizeof (lock_t),FALSE);
+   eraseshape (engine->board,shape,engine->curx,engine->cury);
+   if (engine->shadow) eraseshape (engine->board,shape,engine->curx_shadow,engine->cury_shadow);
+   drawshape (engine->board,&engine->pieces->shape[lock.shape].rotation[lock.rotation],lock.x,lock.y);
+   SIZED (engine,sized_droplines,engine->board);
+   engine->score += lock.score;
+   engine->faults += lock.faults;
+   status_add (&engine->status,&lock.status,1);
+   if (lock.levels)
+	 {
+		engine->level += lock.levels;
+		engine->levelpieces[engine->level] = getsum (engine);
+	 }
+   queue_next (engine);
+   engine->shapecount[engine->curshape]++;
+   practice_spawn (engine);
+   practice.last += lock.size;
+   return (TRUE);
+}
+
+/* Let the shape fall one row. When it comes to rest, go to the next level */
+/* if enough lines were cleared and count the shape that was released */
+static int gravity (engine_t *engine)
+{
+   int64_t start = monotime ();
+   unsigned char rows[LOCK_MAXROWS];
+   lock_t lock;
+   int result;
+   if (practice.buffer != NULL) practice_before (engine,&lock,rows);
+   result = engine_evaluate (engine);
+   profile_stage (STAGE_EVALUATE,start);
+   if ((result <= 0) && (engine->level < MAXLEVEL) && ((engine->status.droppedlines / 10) > engine->level)) nextlevel (engine);
+   if (result == 0) engine->shapecount[engine->curshape]++;
+   if ((result == 0) && (practice.buffer != NULL)) practice_record (engine,&lock,rows);
+   return (result);
+}
+
+static bool evaluate (engine_t *engine)
+{
+	int oldlevel = engine->level;
+	bool finished = gravity (engine) < 0;
+	if (!finished && (engine->level != oldlevel)) in_timeout (DELAY (engine->level));
+    return finished;
+}
+
+static hint_t hint;
+
+/* Ask for a hint whenever a new shape appears or the shape is moved, which */
+/* cancels the search for the previous one, and show the answer once there */
+/* is one. The search may go on until the deadline. The game never waits */
+/* for it, but wakes up now and then to check if it is done */
+static void hint_update (engine_t *engine,int64_t deadline)
+{
+   static finesse_t finesse;
+   state_t state;
+   int i;
+   if (!showhint) return;
+   if (!hint.running)
+	 {
+		pthread_mutex_init (&hint.lock,NULL);
+		pthread_cond_init (&hint.cond,NULL);
+		if (pthread_create (&hint.thread,NULL,hint_thread,&hint))
+		  {
+			 showhint = FALSE;
+			 out_beep ();
+			 return;
+		  }
+		hint.running = TRUE;
+	 }
+   if (pthread_mutex_trylock (&hint.lock))
+	 {
+		in_wakeup (HINT_POLL);
+		return;
+	 }
+   if ((hint.piece != engine->queuehead) || (hint.curx != engine->curx) || (hint.currotation != engine->rotation))
+	 {
+		hint.piece = engine->queuehead;
+		hint.curx = engine->curx;
+		hint.currotation = engine->rotation;
+		memcpy (&hint.engine,engine,sizeof (engine_t));
+		hint.deadline = deadline;
+		__atomic_add_fetch (&hint.asked,1,__ATOMIC_RELAXED);
+		/* the book answers at once, without searching */
+		engine_snapshot (engine,&state);
+		if ((book != NULL) && (engine->queuehead <= TINTBOOK_SHAPES))
+		  {
+			 finesse_search (&finesse,engine,&state,FALSE);
+			 i = book_find (engine,&state,&finesse,botweights);
+		  }
+		else i = -1;
+		if (i >= 0)
+		  {
+			 hint.x = finesse.place[i].x;
+			 hint.y = finesse.place[i].y;
+			 hint.rotation = finesse.place[i].rotation;
+			 hint.depth = TINTBOOK_SHAPES - state.queuehead + 1;
+			 hint.answered = hint.asked;
+		  }
+		else pthread_cond_signal (&hint.cond);
+	 }
+   if ((hint.answered == hint.asked) && (hint.shown != hint.answered))
+	 {
+		hint.shown = hint.answered;
+		touchshape (engine);
+		engine->curx_hint = hint.x;
+		engine->cury_hint = hint.y;
+		engine->rotation_hint = hint.rotation;
+		touchshape (engine);
+	 }
+   if (hint.answered != hint.asked) in_wakeup (HINT_POLL);
+   pthread_mutex_unlock (&hint.lock);
+}
+
+/* Show or hide hints */
+static void hint_toggle (engine_t *engine)
+{
+   if ((showhint = !showhint)) return;
+   touchshape (engine);
+   engine->curx_hint = -1;
+   hint.piece = -1;
+}
+
+/* Stop the thread looking for hints */
+static void hint_stop ()
+{
+   if (!hint.running) return;
+   pthread_mutex_lock (&hint.lock);
+   hint.quit = TRUE;
+   pthread_cond_signal (&hint.cond);
+   pthread_mutex_unlock (&hint.lock);
+   pthread_join (hint.thread,NULL);
+   hint.running = FALSE;
+}
+
+/*
+ * Replays
+ */
+
+/* A replay starts with the magic, version, seed of the random numbers, */
+/* kilobytes kept for practice mode (0 if not practicing), starting level, */
+/* width and height of the board, shapes shown ahead, options and the NUL */
+/* padded name of the set of shapes. What follows is an event for every key */
+/* that changed the game and every gravity tick: its code and the time since */
+/* the previous event in milliseconds, as a varint */
+#define REPLAY_MAGIC	"TINTRPL"
+#define REPLAY_VERSION	1
+#define REPLAY_NAMELEN	64
+#define REPLAY_HDRSIZE	(32 + REPLAY_NAMELEN)
+
+/* Options of a replay */
+#define REPLAY_SHADOW	1
+#define REPLAY_NEXT		2
+#define REPLAY_LINES	4
+
+/* Events, after the actions */
+#define EVENT_TICK		5						/* gravity */
+#define EVENT_UNDO		6						/* shape taken back in practice mode */
+#define EVENT_REDO		7						/* shape put down again */
+#define EVENT_LEVEL		8						/* next level */
+#define EVENT_NEXT		9						/* next shape shown */
+#define EVENT_HINT		10						/* hint shown or hidden */
+#define EVENT_LINES		11						/* dotted lines shown or hidden */
+#define NUMEVENTS		12
+
+typedef struct
+{
+   FILE *handle;								/* NULL unless recording */
+   int64_t time;								/* time of the last event */
+} recorder_t;
+
+typedef struct
+{
+   const unsigned char *data;
+   size_t len;
+   const unsigned char *next;					/* next event */
+   unsigned seed;
+   int practice,level,width,height,previews,options;
+   char pieces[REPLAY_NAMELEN];
+} replay_t;
+
+static recorder_t recorder;
+
+/* Start recording a game to the given file. Returns FALSE if it can't be */
+/* created */
+static bool record_open (const char *filename,unsigned seed)
+{
+   unsigned char header[REPLAY_HDRSIZE];
+   memset (header,0,sizeof (header));
+   memcpy (header,REPLAY_MAGIC,strlen (REPLAY_MAGIC));
+   put_u32 (header + 8,REPLAY_VERSION);
+   put_u32 (header + 12,seed);
+   put_u32 (header + 16,practicememory);
+   header[20] = level;
+   header[21] = boardwidth;
+   header[22] = boardheight;
+   header[23] = numpreviews;
+   header[24] = (shadow ? REPLAY_SHADOW : 0) | (shownext ? REPLAY_NEXT : 0) | (dottedlines ? REPLAY_LINES : 0);
+   strncpy ((char *) header + 32,piecesname != NULL ? piecesname : "tetrominoes",REPLAY_NAMELEN - 1);
+   if ((recorder.handle = fopen (filename,"w")) == NULL) return (FALSE);
+   recorder.time = monotime ();
+   return (fwrite (header,REPLAY_HDRSIZE,1,recorder.handle) == 1);
+}
+
+/* Record an event. Only whole milliseconds are taken off the time of the */
+/* last one, so that the times don't drift */
+static void record_event (int event)
+{
+   unsigned char buf[16],*p = buf;
+   int64_t ms = (monotime () - recorder.time) / 1000;
+   *p++ = event;
+   p = put_varint (p,ms);
+   recorder.time += ms * 1000;
+   fwrite (buf,p - buf,1,recorder.handle);
+}
+
+/* Finish the recording. Returns FALSE if it couldn't be written */
+static bool record_close ()
+{
+   bool ok = !ferror (recorder.handle);
+   if (fclose (recorder.handle)) ok = FALSE;
+   recorder.handle = NULL;
+   return (ok);
+}
+
+/* Map a replay and read its header. Returns FALSE if it can't be read or */
+/* isn't one */
+static bool replay_open (replay_t *replay,const char *filename)
+{
+   const unsigned char *h;
+   if ((h = replay->data = mapfile (filename,&replay->len)) == NULL) return (FALSE);
+   if ((replay->len < REPLAY_HDRSIZE) || memcmp (h,REPLAY_MAGIC,strlen (REPLAY_MAGIC)) || (get_u32 (h + 8) != REPLAY_VERSION) ||
+	   (h[20] < MINLEVEL) || (h[20] > MAXLEVEL) || (h[21] < MINWIDTH) || (h[21] > MAXWIDTH) ||
+	   (h[22] < MINHEIGHT) || (h[22] > MAXHEIGHT) || (h[23] < 1) || (h[23] > MAXPREVIEWS) ||
+	   (get_u32 (h + 16) > PRACTICE_MAXMEMORY) || (h[32 + REPLAY_NAMELEN - 1] != '\0'))
+	 {
+		munmap ((void *) h,replay->len);
+		errno = EINVAL;
+		return (FALSE);
+	 }
+   replay->seed = get_u32 (h + 12);
+   replay->practice = get_u32 (h + 16);
+   replay->level = h[20];
+   replay->width = h[21];
+   replay->height = h[22];
+   replay->previews = h[23];
+   replay->options = h[24];
+   memcpy (replay->pieces,h + 32,REPLAY_NAMELEN);
+   replay->next = h + REPLAY_HDRSIZE;
+   return (TRUE);
+}
+
+/* Unmap a replay */
+static void replay_close (replay_t *replay)
+{
+   munmap ((void *) replay->data,replay->len);
+}
+
+/* Set up the game of a replay on the specified tetris engine, as it was */
+/* when it was recorded. Returns FALSE if it can't be */
+static bool replay_start (const replay_t *replay,engine_t *engine)
+{
+   boardwidth = replay->width;
+   boardheight = replay->height;
+   level = replay->level;
+   numpreviews = replay->previews;
+   shadow = (replay->options & REPLAY_SHADOW) != 0;
+   shownext = (replay->options & REPLAY_NEXT) != 0;
+   dottedlines = (replay->options & REPLAY_LINES) != 0;
+   pieceset = usepieces (replay->pieces);
+   if ((boardwidth < pieceset->minwidth) || ((practicememory = replay->practice) && !practice_init (practicememory))) return (FALSE);
+   rand_init (replay->seed);
+   engine_init (engine,score_function);
+   engine_resize (engine,boardwidth,boardheight);
+   engine_pieces (engine,pieceset);
+   engine->level = level;
+   engine->shadow = shadow;
+   engine->shownext = shownext;
+   engine->previews = numpreviews;
+   return (TRUE);
+}
+
+/* Read the next event of a replay and the time since the previous one (in */
+/* milliseconds). Returns FALSE at the end of the replay, or if it is damaged */
+static bool replay_next (replay_t *replay,int *event,int64_t *ms)
+{
+   const unsigned char *end = replay->data + replay->len,*p;
+   if ((replay->next >= end) || (*replay->next >= NUMEVENTS) || ((p = get_varint (replay->next + 1,end,ms)) == NULL)) return (FALSE);
+   *event = *replay->next;
+   replay->next = p;
+   return (TRUE);
+}
+
+/* Apply an event to the game, recording it if the game is recorded. */
+/* Returns TRUE if the game is over */
+static bool play (engine_t *engine,int event)
+{
+   if (recorder.handle != NULL) record_event (event);
+   switch (event)
+	 {
+	  case EVENT_TICK:
+		return (evaluate (engine));
+	  case EVENT_UNDO:
+	  case EVENT_REDO:
+		if (!(event == EVENT_UNDO ? practice_undo (engine) : practice_redo (engine))) out_beep ();
+		in_timeout (DELAY (engine->level));
+		hint.piece = -1;
+		break;
+	  case EVENT_LEVEL:
+		if (engine->level < MAXLEVEL)
+		  {
+			 nextlevel (engine);
+			 in_timeout (DELAY (engine->level));
+		  }
+		else out_beep ();
+		break;
+	  case EVENT_NEXT:
+		engine->shownext = TRUE;
+		break;
+	  case EVENT_HINT:
+		hint_toggle (engine);
+		break;
+	  case EVENT_LINES:
+		dottedlines = !dottedlines;
+		engine->dirty = ALLROWS;
+		break;
+	  default:
+		profile_move (engine,event);
+	 }
+   return (FALSE);
+}
+
+/* Play a recorded game back at the speed it was played. Press q to stop. */
+/* A headless replay is played back as fast as it can be drawn, to time */
+/* the game and the drawing */
+static void replay (const char *filename)
+{
+   replay_t replay;
+   engine_t engine;
+   int64_t due,now,ms,start;
+   int event,ch,events;
+   bool finished = FALSE,stopped = FALSE;
+   if (!replay_open (&replay,filename))
+	 {
+		fprintf (stderr,"Error reading %s: %s\n",filename,errno ? strerror (errno) : "Empty file");
+		exit (EXIT_FAILURE);
+	 }
+   if (!replay_start (&replay,&engine))
+	 {
+		fprintf (stderr,"Error starting the game recorded in %s\n",filename);
+		exit (EXIT_FAILURE);
+	 }
+   if (headless)
+	 {
+		io_offscreen (2 * MAXWIDTH + 48,MAXHEIGHT + 3);
+		drawbackground ();
+		start = monotime ();
+		for (events = 0; !finished && replay_next (&replay,&event,&ms); events++)
+		  {
+			 finished = play (&engine,event);
+			 showstatus (&engine);
+			 drawboard (&engine,XTOP,YTOP);
+			 out_refresh ();
+		  }
+		now = monotime ();
+		io_close ();
+		replay_close (&replay);
+		printf ("%s: %d events, %d shapes, score %d in %.3f s\n",filename,events,getsum (&engine),GETSCORE (engine.score),(now - start) / 1e6);
+		return;
+	 }
+   io_init ();
+   if (!engine.classic && ((out_width () < 2 * boardwidth + 48) || (out_height () < boardheight + 3)))
+	 {
+		io_close ();
+		fprintf (stderr,"The terminal is too small for a %dx%d board\n",boardwidth,boardheight);
+		exit (EXIT_FAILURE);
+	 }
+   drawbackground ();
+   for (due = monotime (); !finished && !stopped && replay_next (&replay,&event,&ms); finished = play (&engine,event))
+	 for (due += ms * 1000; !stopped && ((now = monotime ()) < due); )
+	   {
+		  showstatus (&engine);
+		  drawboard (&engine,XTOP,YTOP);
+		  out_refresh ();
+		  if ((ch = in_wait (due - now)) == 'q') stopped = TRUE;
+		  else if (ch == KEY_RESIZE)
+			{
+			   out_clear ();
+			   drawbackground ();
+			   engine.dirty = ALLROWS;
+			}
+	   }
+   if (!stopped)
+	 {
+		showstatus (&engine);
+		drawboard (&engine,XTOP,YTOP);
+		out_setcolor (COLOR_WHITE,COLOR_BLACK);
+		out_gotoxy ((out_width () - 36) / 2,out_height () - 2);
+		out_printf ("End of replay - Press any key to exit");
+		out_refresh ();
+		while (in_wait (1000000) == ERR) ;
+	 }
+   io_close ();
+   replay_close (&replay);
+   if (!stopped) showplayerstats (&engine);
+}
+
+          /***************************************************************************/
+          /***************************************************************************/
+          /***************************************************************************/
+
+/*
+ * Bot protocol
+ *
+ * With --bot-protocol, the player's board is played by another program,
+ * which talks to the game a line at a time through a pipe to its standard
+ * input and one from its standard output. Numbers are in decimal unless
+ * said otherwise, columns count from 1 at the left wall and rows from 0,
+ * the row above the board, down. When the game starts, the bot is sent
+ *
+ *    tint <version> <width> <height> <shapes> <previews>
+ *
+ * and for every rotation of every shape, the blocks relative to the block
+ * it rotates around and the rotation after rotating once
+ *
+ *    shape <shape> <rotation> <next> <x> <y> <x> <y> ...
+ *
+ * Whenever a new shape appears, the bot is sent where it is, the shapes
+ * after it, the garbage waiting and the rows of the board, top to bottom,
+ * in hexadecimal, with a bit for every column that is taken, column 1 in
+ * the lowest bit
+ *
+ *    piece <number> <shape> <rotation> <x> <y> queue <shape> ... garbage <rows> board <row> ...
+ *
+ * and answers with the keys for it on one line, as letters: l (left),
+ * r (right), t (turn), s (soft drop, a row down) and h (hard drop). Keys
+ * after a hard drop are ignored. Without a hard drop, the shape goes on
+ * falling, or is dropped when the game is headless. An answer of quit ends
+ * the game. When the game is over, the bot is sent
+ *
+ *    over <score> <lines> <shapes>
+ *
+ * and its pipes are closed.
+ */
+
+#define PROTOCOL_VERSION	1
+
+/* Longest answer of a bot */
+#define PROTOCOL_MAXLINE	4096
+
+typedef struct
+{
+   pid_t pid;									/* bot, 0 if there is none */
+   int in,out;									/* pipes from and to the bot */
+   char buf[PROTOCOL_MAXLINE];					/* what was read from the bot */
+   int len,used;								/* bytes in it, and of them the last line */
+   int piece;									/* shape the bot was last asked about */
+   bool quit;									/* the bot ended the game */
+   const char *error;							/* why the bot stopped playing, NULL if it didn't */
+} protocol_t;
+
+static protocol_t protocol;
+
+/* Send a message to the bot. Returns FALSE if the bot is gone */
+static bool protocol_send (const char *buf,int len)
+{
+   int n;
+   while (len > 0)
+	 {
+		if ((n = write (protocol.out,buf,len)) < 0)
+		  {
+			 if (errno == EINTR) continue;
+			 return (FALSE);
+		  }
+		buf += n;
+		len -= n;
+	 }
+   return (TRUE);
+}
+
+/* Read a line from the bot, without the newline. Returns NULL if the bot */
+/* is gone or the line is too long */
+static char *protocol_read ()
+{
+   char *end;
+   int n;
+   protocol.len -= protocol.used;
+   memmove (protocol.buf,protocol.buf + protocol.used,protocol.len);
+   while ((end = memchr (protocol.buf,'\n',protocol.len)) == NULL)
+	 {
+		if (protocol.len == sizeof (protocol.buf)) return (NULL);
+		if ((n = read (protocol.in,protocol.buf + protocol.len,sizeof (protocol.buf) - protocol.len)) < 0 && (errno == EINTR)) continue;
+		if (n <= 0) return (NULL);
+		protocol.len += n;
+	 }
+   *end = '\0';
+   protocol.used = end + 1 - protocol.buf;
+   if ((end > protocol.buf) && (end[-1] == '\r')) end[-1] = '\0';
+   return (protocol.buf);
+}
+
+/* Start the bot and tell it about the game on the specified tetris engine. */
+/* Unless the game is headless, what the bot writes to its standard error */
+/* is thrown away, so that it doesn't mess up the screen. Returns FALSE if */
+/* the bot can't be started */
+static bool protocol_open (const engine_t *engine,const char *command,bool quiet)
+{
+   const rotation_t *rotation;
+   char buf[256];
+   int in[2],out[2],i,j,k,len,null;
+   if (pipe (in) < 0) return (FALSE);
+   if (pipe (out) < 0)
+	 {
+		close (in[0]);
+		close (in[1]);
+		return (FALSE);
+	 }
+   if ((protocol.pid = fork ()) == 0)
+	 {
+		dup2 (out[0],STDIN_FILENO);
+		dup2 (in[1],STDOUT_FILENO);
+		if (quiet && ((null = open ("/dev/null",O_WRONLY)) >= 0)) dup2 (null,STDERR_FILENO);
+		close (in[0]);
+		close (in[1]);
+		close (out[0]);
+		close (out[1]);
+		execl ("/bin/sh","sh","-c",command,(char *) NULL);
+		_exit (127);
+	 }
+   close (in[1]);
+   close (out[0]);
+   protocol.in = in[0];
+   protocol.out = out[1];
+   if (protocol.pid < 0)
+	 {
+		close (protocol.in);
+		close (protocol.out);
+		protocol.pid = 0;
+		return (FALSE);
+	 }
+   /* a bot that is gone shows up as an error writing to it */
+   signal (SIGPIPE,SIG_IGN);
+   protocol.piece = -1;
+   len = snprintf (buf,sizeof (buf),"tint %d %d %d %d %d\n",PROTOCOL_VERSION,engine->cols - 3,engine->rows - 3,
+				   engine->pieces->numshapes,engine->previews);
+   if (!protocol_send (buf,len)) return (FALSE);
+   for (i = 0; i < engine->pieces->numshapes; i++)
+	 for (j = 0; j < engine->pieces->shape[i].numrotations; j++)
+	   {
+		  rotation = &engine->pieces->shape[i].rotation[j];
+		  len = snprintf (buf,sizeof (buf),"shape %d %d %d",i,j,rotation->next);
+		  for (k = 0; k < rotation->numblocks; k++)
+			len += snprintf (buf + len,sizeof (buf) - len," %d %d",rotation->block[k].x,rotation->block[k].y);
+		  len += snprintf (buf + len,sizeof (buf) - len,"\n");
+		  if (!protocol_send (buf,len)) return (FALSE);
+	   }
+   return (TRUE);
+}
+
+/* Ask the bot where to put the current shape of the specified tetris */
+/* engine and press the keys it answers with. How long the bot took to */
+/* answer is added to the profile. Returns TRUE if the game is over, or the */
+/* bot stopped playing */
+static bool protocol_turn (engine_t *engine,bool headless)
+{
+   char buf[128 + MAXPREVIEWS * 4 + MAXHEIGHT * 12],*line;
+   state_t state;
+   int64_t start;
+   int i,x,len;
+   uint64_t row;
+   bool dropped = FALSE,finished = FALSE;
+   protocol.piece = engine->queuehead;
+   engine_snapshot (engine,&state);
+   len = snprintf (buf,sizeof (buf),"piece %u %d %d %d %d queue",engine->queuehead,engine->curshape,engine->rotation,engine->curx,engine->cury);
+   for (i = 1; i <= engine->previews; i++) len += snprintf (buf + len,sizeof (buf) - len," %d",engine_peek (engine,i));
+   len += snprintf (buf + len,sizeof (buf) - len," garbage %d board",engine->garbage);
+   for (i = 1; i < engine->rows - 2; i++)
+	 {
+		for (x = 1, row = 0; x < engine->cols - 2; x++) if (state.column[x] & ROW (i)) row |= (uint64_t) 1 << (x - 1);
+		len += snprintf (buf + len,sizeof (buf) - len," %llx",(unsigned long long) row);
+	 }
+   len += snprintf (buf + len,sizeof (buf) - len,"\n");
+   start = monotime ();
+   if (!protocol_send (buf,len) || ((line = protocol_read ()) == NULL))
+	 {
+		protocol.error = "The bot stopped answering";
+		return (TRUE);
+	 }
+   profile_stage (STAGE_BOT,start);
+   if (strcmp (line,"quit") == 0)
+	 {
+		protocol.quit = TRUE;
+		return (TRUE);
+	 }
+   for (i = 0; !dropped && line[i]; i++)
+	 switch (line[i])
+	   {
+		case 'l': play (engine,ACTION_LEFT); break;
+		case 'r': play (engine,ACTION_RIGHT); break;
+		case 't': play (engine,ACTION_ROTATE); break;
+		case 's': play (engine,ACTION_DOWN); break;
+		case 'h': dropped = TRUE; break;
+		case ' ': break;
+		default:
+		  protocol.error = "The bot answered with a key that doesn't exist";
+		  return (TRUE);
+	   }
+   if (dropped || headless)
+	 {
+		play (engine,ACTION_DROP);
+		finished = play (engine,EVENT_TICK);
+	 }
+   return (finished);
+}
+
+/* Tell the bot the game on the specified tetris engine is over and wait */
+/* for it to exit. Prints how the game went and how long the bot took to */
+/* decide */
+static void protocol_close (const engine_t *engine)
+{
+   const histogram_t *hist = &profile[STAGE_BOT];
+   char buf[128];
+   int len,status;
+   if (protocol.error == NULL)
+	 {
+		len = snprintf (buf,sizeof (buf),"over %d %d %d\n",GETSCORE (engine->score),engine->status.droppedlines,getsum (engine));
+		protocol_send (buf,len);
+	 }
+   close (protocol.out);
+   close (protocol.in);
+   waitpid (protocol.pid,&status,0);
+   protocol.pid = 0;
+   if (protocol.error != NULL) fprintf (stderr,"%s\n",protocol.error);
+   printf ("Score %d, %d lines, %d shapes. %llu decisions in %.3f s: p50 %u us, p99 %u us, max %u us\n",
+		   GETSCORE (engine->score),engine->status.droppedlines,getsum (engine),(unsigned long long) hist->count,
+		   hist->sum / 1e6,hist_percentile (hist,0.5),hist_percentile (hist,0.99),hist->max);
+}
+
+          /***************************************************************************/
+          /***************************************************************************/
+          /***************************************************************************/
+
+/* Frame types of the spectator stream */
+#define FRAME_KEY		1						/* snapshot of every board */
+#define FRAME_DELTA		2						/* what changed since the previous frame */
+
+/* A frame starts with the length of what follows the header and its type */
+#define FRAME_HDRSIZE	5
+
+/* State of a board sent to spectators next to its cells */
+#define WF_HUMAN		0						/* human player, -1 for a bot */
+#define WF_CURX			1						/* position of the current shape */
+#define WF_CURY			2
+#define WF_CURSHAPE		3						/* current & next shapes */
+#define WF_NEXTSHAPE	4
+#define WF_SCORE		5						/* score */
+#define WF_LEVEL		6						/* level */
+#define WF_LINES		7						/* full lines */
+#define WF_GARBAGE		8						/* garbage rows waiting */
+#define WF_SHOWNEXT		9						/* next shape is shown */
+#define WF_FINISHED		10						/* board is full */
+#define NUMFIELDS		11
+
+/* Largest frame: every field and every cell changed on every board */
+#define FRAME_MAXSIZE	(FRAME_HDRSIZE + 1 + MAXBOARDS * (4 + NUMFIELDS * 10 + 3 + NUMCOLS * NUMROWS * 3))
+
+/* Frames kept for spectators that fall behind. A spectator further behind */
+/* than this has frames dropped and starts again from a snapshot */
+#define WATCH_FRAMES	64
+
+/* Most frames handed to the kernel at once */
+#define WATCH_IOV		16
+
+/* Maximum number of spectators */
+#define MAXSPECTATORS	64
+
+typedef struct
+{
+   int32_t field[NUMFIELDS];
+   int board[NUMCOLS][NUMROWS];			/* spectators only see default boards */
+} view_t;
+
+typedef struct
+{
+   int refs;								/* references from the ring and spectators */
+   bool key;								/* snapshot instead of changes */
+   size_t len;								/* length of the frame */
+   unsigned char data[];					/* encoded frame */
+} frame_t;
+
+typedef struct
+{
+   int fd;									/* socket */
+   bool synced;							/* got a snapshot and every frame since */
+   uint64_t seq;							/* next frame to send */
+   frame_t *frame;							/* frame partly sent, NULL if none */
+   size_t sent;							/* bytes of it sent */
+} spectator_t;
+
+typedef struct
+{
+   int fd;									/* listening socket, -1 if not broadcasting */
+   const char *addr;						/* address it listens on */
+   int n;									/* number of boards */
+   bool wantkey;							/* a spectator is waiting for a snapshot */
+   uint64_t seq;							/* number of frames made so far */
+   frame_t *ring[WATCH_FRAMES];				/* last frames made */
+   view_t sent[MAXBOARDS];					/* boards as of the last frame */
+   view_t next[MAXBOARDS];					/* boards as they are now */
+   int nspectators;
+   spectator_t spectators[MAXSPECTATORS];
+} broadcast_t;
+
+static broadcast_t broadcast = { -1 };
+
+/* Open a socket for the spectator stream. The address is the path of a UNIX */
+/* socket if it contains a slash, or [host:]port for TCP (localhost by default) */
+static int watchsocket (const char *addr,bool server)
+{
+   struct sockaddr_un un;
+   struct addrinfo hints,*ai,*p;
+   const char *port = strrchr (addr,':');
+   char host[NI_MAXHOST] = "localhost";
+   int fd = -1,on = 1;
+   if (strchr (addr,'/') != NULL)
+	 {
+		memset (&un,0,sizeof (un));
+		un.sun_family = AF_UNIX;
+		snprintf (un.sun_path,sizeof (un.sun_path),"%s",addr);
+		if ((fd = socket (AF_UNIX,SOCK_STREAM,0)) < 0) return -1;
+		if (server) unlink (addr);
+		if (server ?
+			(bind (fd,(struct sockaddr *) &un,sizeof (un)) < 0) || (chmod (addr,0666) < 0) || (listen (fd,MAXSPECTATORS) < 0) :
+			(connect (fd,(struct sockaddr *) &un,sizeof (un)) < 0))
+		  {
+			 close (fd);
+			 return -1;
+		  }
+		return fd;
+	 }
+   if (port != NULL)
+	 {
+		snprintf (host,sizeof (host),"%.*s",(int) (port - addr),addr);
+		port++;
+	 }
+   else port = addr;
+   memset (&hints,0,sizeof (hints));
+   hints.ai_family = AF_UNSPEC;
+   hints.ai_socktype = SOCK_STREAM;
+   if (getaddrinfo (host,port,&hints,&ai) != 0)
+	 {
+		errno = EINVAL;
+		return -1;
+	 }
+   for (p = ai; p != NULL; p = p->ai_next)
+	 {
+		if ((fd = socket (p->ai_family,p->ai_socktype,p->ai_protocol)) < 0) continue;
+		if (server) setsockopt (fd,SOL_SOCKET,SO_REUSEADDR,&on,sizeof (on));
+		if (server ?
+			(bind (fd,p->ai_addr,p->ai_addrlen) == 0) && (listen (fd,MAXSPECTATORS) == 0) :
+			(connect (fd,p->ai_addr,p->ai_addrlen) == 0))
+		  break;
+		close (fd);
+		fd = -1;
+	 }
+   freeaddrinfo (ai);
+   return fd;
+}
+
+/* Start broadcasting n boards. Returns FALSE if the address can't be used */
+static bool broadcast_open (broadcast_t *bc,const char *addr,int n)
+{
+   memset (bc,0,sizeof (broadcast_t));
+   if ((bc->fd = watchsocket (addr,TRUE)) < 0) return FALSE;
+   fcntl (bc->fd,F_SETFL,fcntl (bc->fd,F_GETFL) | O_NONBLOCK);
+   bc->addr = addr;
+   bc->n = n;
+   return TRUE;
+}
+
+/* Stop broadcasting */
+static void broadcast_close (broadcast_t *bc)
+{
+   int i;
+   if (bc->fd < 0) return;
+   for (i = 0; i < bc->nspectators; i++) close (bc->spectators[i].fd);
+   close (bc->fd);
+   if (strchr (bc->addr,'/') != NULL) unlink (bc->addr);
+   bc->fd = -1;
+}
+
+/* Record the current state of a board */
+static void broadcast_board (broadcast_t *bc,int i,const engine_t *engine,int human,bool finished)
+{
+   view_t *view = bc->next + i;
+   int x;
+   if (bc->fd < 0) return;
+   view->field[WF_HUMAN] = human;
+   view->field[WF_CURX] = engine->curx;
+   view->field[WF_CURY] = engine->cury;
+   view->field[WF_CURSHAPE] = engine->curshape;
+   view->field[WF_NEXTSHAPE] = engine->nextshape;
+   view->field[WF_SCORE] = GETSCORE (engine->score);
+   view->field[WF_LEVEL] = engine->level;
+   view->field[WF_LINES] = engine->status.droppedlines;
+   view->field[WF_GARBAGE] = engine->garbage;
+   view->field[WF_SHOWNEXT] = engine->shownext;
+   view->field[WF_FINISHED] = finished;
+   for (x = 0; x < NUMCOLS; x++) memcpy (view->board[x],engine->board[x],sizeof (view->board[x]));
+}
+
+static void dropframe (frame_t *frame)
+{
+   if (!--frame->refs) free (frame);
+}
+
+/* Put a frame in the ring, dropping the oldest one */
+static void pushframe (broadcast_t *bc,frame_t *frame,unsigned char *end,int type)
+{
+   frame_t **slot = bc->ring + bc->seq++ % WATCH_FRAMES;
+   frame->refs = 1;
+   frame->key = type == FRAME_KEY;
+   frame->len = end - frame->data;
+   put_u32 (frame->data,frame->len - FRAME_HDRSIZE);
+   frame->data[4] = type;
+   if (*slot != NULL) dropframe (*slot);
+   *slot = frame;
+}
+
+/* Encode a snapshot of every board */
+static void encodekey (broadcast_t *bc,frame_t *frame)
+{
+   unsigned char *p = frame->data + FRAME_HDRSIZE;
+   const int *cell;
+   int i,j;
+   *p++ = bc->n;
+   for (i = 0; i < bc->n; i++)
+	 {
+		for (j = 0; j < NUMFIELDS; j++) p = put_varint (p,bc->next[i].field[j]);
+		cell = &bc->next[i].board[0][0];
+		for (j = 0; j < NUMCOLS * NUMROWS; j++) *p++ = cell[j];
+	 }
+   pushframe (bc,frame,p,FRAME_KEY);
+}
+
+/* Encode what changed on every board since the last frame: the fields that */
+/* changed, then the cells as the distance from the previous one and a value. */
+/* Returns FALSE if nothing changed */
+static bool encodedelta (broadcast_t *bc,frame_t *frame)
+{
+   unsigned char *p = frame->data + FRAME_HDRSIZE + 1;
+   const int *old,*new;
+   int i,j,last,changed,mask;
+   frame->data[FRAME_HDRSIZE] = 0;
+   for (i = 0; i < bc->n; i++)
+	 {
+		old = &bc->sent[i].board[0][0];
+		new = &bc->next[i].board[0][0];
+		for (mask = j = 0; j < NUMFIELDS; j++) if (bc->sent[i].field[j] != bc->next[i].field[j]) mask |= 1 << j;
+		changed = 0;
+		if (memcmp (old,new,sizeof (bc->next[i].board))) for (j = 0; j < NUMCOLS * NUMROWS; j++) if (old[j] != new[j]) changed++;
+		if (!mask && !changed) continue;
+		frame->data[FRAME_HDRSIZE]++;
+		*p++ = i;
+		p = put_varint (p,mask);
+		for (j = 0; j < NUMFIELDS; j++) if (mask & (1 << j)) p = put_varint (p,bc->next[i].field[j]);
+		p = put_varint (p,changed);
+		for (last = j = 0; changed; j++) if (old[j] != new[j])
+		  {
+			 p = put_varint (p,j - last);
+			 *p++ = new[j];
+			 last = j;
+			 changed--;
+		  }
+	 }
+   if (!frame->data[FRAME_HDRSIZE]) return FALSE;
+   pushframe (bc,frame,p,FRAME_DELTA);
+   return TRUE;
+}
+
+/* Send a spectator as much of the stream as its socket takes without */
+/* blocking. The frames are handed to the kernel straight from the ring. */
+/* Returns FALSE if the spectator went away */
+static bool pumpspectator (broadcast_t *bc,spectator_t *s)
+{
+   struct iovec iov[WATCH_IOV];
+   struct msghdr msg;
+   frame_t *frame;
+   uint64_t oldest = bc->seq > WATCH_FRAMES ? bc->seq - WATCH_FRAMES : 0,seq;
+   ssize_t len;
+   size_t left;
+   int count;
+   while (TRUE)
+	 {
+		/* a spectator that fell behind drops frames up to the newest snapshot */
+		if ((s->frame == NULL) && (!s->synced || (s->seq < oldest)))
+		  {
+			 for (seq = bc->seq; (seq > oldest) && !bc->ring[(seq - 1) % WATCH_FRAMES]->key; seq--) ;
+			 if (seq == oldest)
+			   {
+				  s->synced = FALSE;
+				  bc->wantkey = TRUE;
+				  return TRUE;
+			   }
+			 s->frame = bc->ring[(seq - 1) % WATCH_FRAMES];
+			 s->frame->refs++;
+			 s->sent = 0;
+			 s->seq = seq;
+			 s->synced = TRUE;
+		  }
+		count = 0;
+		if (s->frame != NULL)
+		  {
+			 iov[count].iov_base = s->frame->data + s->sent;
+			 iov[count++].iov_len = s->frame->len - s->sent;
+		  }
+		/* the frames after a partly sent one may have left the ring, in which */
+		/* case only that one is finished and the spectator resyncs after it */
+		for (seq = s->seq; (s->seq >= oldest) && (seq < bc->seq) && (count < WATCH_IOV); seq++)
+		  {
+			 frame = bc->ring[seq % WATCH_FRAMES];
+			 if (frame->key) continue;
+			 iov[count].iov_base = frame->data;
+			 iov[count++].iov_len = frame->len;
+		  }
+		if (!count) return TRUE;
+		memset (&msg,0,sizeof (msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+		if ((len = sendmsg (s->fd,&msg,MSG_DONTWAIT | MSG_NOSIGNAL)) < 0) return ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR));
+		/* skip past what the kernel took */
+		left = len;
+		if (s->frame != NULL)
+		  {
+			 if (left < s->frame->len - s->sent)
+			   {
+				  s->sent += left;
+				  return TRUE;
+			   }
+			 left -= s->frame->len - s->sent;
+			 dropframe (s->frame);
+			 s->frame = NULL;
+		  }
+		for (; s->seq < seq; s->seq++)
+		  {
+			 frame = bc->ring[s->seq % WATCH_FRAMES];
+			 if (frame->key) continue;
+			 if (left < frame->len)
+			   {
+				  if (!left) return TRUE;
+				  s->frame = frame;
+				  s->frame->refs++;
+				  s->sent = left;
+				  s->seq++;
+				  return TRUE;
+			   }
+			 left -= frame->len;
+		  }
+	 }
+}
+
+/* Finish a tick: encode the changes once for all spectators, a snapshot if */
+/* one is waiting for it, take on new spectators and send what each can take */
+static void broadcast_flush (broadcast_t *bc)
+{
+   frame_t *frame;
+   int i,fd,on = 1;
+   if (bc->fd < 0) return;
+   if ((frame = malloc (sizeof (frame_t) + FRAME_MAXSIZE)) != NULL && !encodedelta (bc,frame)) free (frame);
+   memcpy (bc->sent,bc->next,sizeof (bc->sent));
+   if (bc->wantkey && ((frame = malloc (sizeof (frame_t) + FRAME_MAXSIZE)) != NULL))
+	 {
+		encodekey (bc,frame);
+		bc->wantkey = FALSE;
+	 }
+   while ((fd = accept4 (bc->fd,NULL,NULL,SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+	 {
+		if (bc->nspectators < MAXSPECTATORS)
+		  {
+			 setsockopt (fd,IPPROTO_TCP,TCP_NODELAY,&on,sizeof (on));
+			 memset (bc->spectators + bc->nspectators,0,sizeof (spectator_t));
+			 bc->spectators[bc->nspectators++].fd = fd;
+		  }
+		else close (fd);
+	 }
+   for (i = bc->nspectators - 1; i >= 0; i--) if (!pumpspectator (bc,bc->spectators + i))
+	 {
+		close (bc->spectators[i].fd);
+		if (bc->spectators[i].frame != NULL) dropframe (bc->spectators[i].frame);
+		bc->spectators[i] = bc->spectators[--bc->nspectators];
+	 }
+}
+
+          /***************************************************************************/
+          /***************************************************************************/
+          /***************************************************************************/
+
+/* The layout in tintshm.h has to match the board */
+_Static_assert ((NUMCOLS == TINTSHM_COLS) && (NUMROWS == TINTSHM_ROWS),"board size differs from tintshm.h");
+_Static_assert ((WALL == TINTSHM_WALL) && (GARBAGE == TINTSHM_GARBAGE),"block ids differ from tintshm.h");
+_Static_assert (MAXBOARDS <= TINTSHM_MAXBOARDS,"too many boards for tintshm.h");
+
+typedef struct
+{
+   tintshm_t *shm;							/* segment, NULL if not publishing */
+   char name[NAME_MAX];						/* name of the segment */
+   tintshm_snapshot_t next;					/* state collected during this tick */
+} publish_t;
+
+static publish_t publish;
+
+/* Record the current state of a board */
+static void publish_board (publish_t *pub,int i,const engine_t *engine,bool finished)
+{
+   tintshm_board_t *b = pub->next.board + i;
+   int x;
+   if (pub->shm == NULL) return;
+   b->curx = engine->curx;
+   b->cury = engine->cury;
+   b->curshape = engine->curshape;
+   b->nextshape = engine->nextshape;
+   b->score = GETSCORE (engine->score);
+   b->level = engine->level;
+   b->moves = engine->status.moves;
+   b->rotations = engine->status.rotations;
+   b->dropcount = engine->status.dropcount;
+   b->efficiency = engine->status.efficiency;
+   b->droppedlines = engine->status.droppedlines;
+   b->currentdroppedlines = engine->status.currentdroppedlines;
+   b->garbage = engine->garbage;
+   b->finished = finished;
+   for (x = 0; x < NUMCOLS; x++) memcpy (b->board[x],engine->board[x],sizeof (b->board[x]));
+}
+
+/* Finish a tick: copy the state into the segment inside the seqlock. */
+/* Readers that see an odd or changed sequence number try again */
+static void publish_flush (publish_t *pub)
+{
+   uint32_t seq;
+   if (pub->shm == NULL) return;
+   pub->next.tick++;
+   seq = pub->shm->seq;
+   __atomic_store_n (&pub->shm->seq,seq + 1,__ATOMIC_RELAXED);
+   __atomic_thread_fence (__ATOMIC_RELEASE);
+   memcpy (&pub->shm->snapshot,&pub->next,sizeof (tintshm_snapshot_t));
+   __atomic_store_n (&pub->shm->seq,seq + 2,__ATOMIC_RELEASE);
+}
+
+/* Create the shared memory segment to publish n boards in. Returns FALSE */
+/* if it can't be created */
+static bool publish_open (publish_t *pub,const char *name,int n)
+{
+   void *p = MAP_FAILED;
+   int fd;
+   memset (pub,0,sizeof (publish_t));
+   tintshm_name (pub->name,sizeof (pub->name),name);
+   if ((fd = shm_open (pub->name,O_RDWR | O_CREAT | O_TRUNC,0644)) < 0) return FALSE;
+   if ((ftruncate (fd,sizeof (tintshm_t)) < 0) ||
+	   ((p = mmap (NULL,sizeof (tintshm_t),PROT_READ | PROT_WRITE,MAP_SHARED,fd,0)) == MAP_FAILED))
+	 {
+		close (fd);
+		shm_unlink (pub->name);
+		return FALSE;
+	 }
+   close (fd);
+   pub->shm = p;
+   pub->shm->version = TINTSHM_VERSION;
+   pub->shm->size = sizeof (tintshm_t);
+   pub->shm->pid = getpid ();
+   pub->next.running = 1;
+   pub->next.nboards = n;
+   publish_flush (pub);
+   memcpy (pub->shm->magic,TINTSHM_MAGIC,sizeof (pub->shm->magic));
+   return TRUE;
+}
+
+/* Tell readers the game has ended and remove the segment */
+static void publish_close (publish_t *pub)
+{
+   if (pub->shm == NULL) return;
+   pub->next.running = 0;
+   publish_flush (pub);
+   munmap (pub->shm,sizeof (tintshm_t));
+   shm_unlink (pub->name);
+   pub->shm = NULL;
+}
+
+/* Hand the state of a board to spectators and shared memory readers */
+static void share_board (int i,const engine_t *engine,int human,bool finished)
+{
+   broadcast_board (&broadcast,i,engine,human,finished);
+   publish_board (&publish,i,engine,finished);
+}
+
+/* Finish a tick for spectators and shared memory readers */
+static void share_flush ()
+{
+   broadcast_flush (&broadcast);
+   publish_flush (&publish);
+}
+
+/* Stop sharing the game */
+static void share_close ()
+{
+   broadcast_close (&broadcast);
+   publish_close (&publish);
+}
+
+          /***************************************************************************/
+          /***************************************************************************/
+          /***************************************************************************/
+
+/* Time between two actions of a bot (in microseconds) */
+#define BOTDELAY 100000
+
+/* Width of a board on the screen, including its status */
+#define BOARDWIDTH(engine) (((engine)->cols - 1) * 2 + 11)
+
+/* Status shown next to each board, only drawn again when it changes */
+#define SHOW_LEVEL		0
+#define SHOW_LINES		1
+#define SHOW_SCORE		2
+#define SHOW_GARBAGE	3
+#define SHOW_NEXT		4
+#define SHOW_FINISHED	5
+#define NUMSHOWN		6
+
+typedef struct
+{
+   engine_t engine;
+   int human;								/* human player (0 or 1), -1 for a bot */
+   plan_t plan;								/* where the bot is taking the shape */
+   int64_t due;								/* time of the next gravity step */
+   int64_t botdue;							/* time of the next action of the bot */
+   bool finished;							/* board is full */
+   int target;								/* opponent that gets the next garbage */
+   int left,top;							/* upper left corner on the screen */
+   int shown[NUMSHOWN];						/* status as it was last drawn */
+} player_t;
+
+typedef struct
+{
+   int ch;									/* key */
+   int human;								/* human player */
+   action_t action;							/* action */
+   bool lock;								/* let the shape come to rest at once */
+} keymap_t;
+
+/* Keys of the players on the left and the right side of the keyboard. */
+/* A player alone against bots can use both */
+static const keymap_t versuskeys[] =
+{
+   { 'a',       0, ACTION_LEFT,   FALSE },
+   { 'w',       0, ACTION_ROTATE, FALSE },
+   { 'd',       0, ACTION_RIGHT,  FALSE },
+   { 's',       0, ACTION_DROP,   TRUE  },
+   { 'j',       1, ACTION_LEFT,   FALSE },
+   { KEY_LEFT,  1, ACTION_LEFT,   FALSE },
+   { 'k',       1, ACTION_ROTATE, FALSE },
+   { KEY_UP,    1, ACTION_ROTATE, FALSE },
+   { 'l',       1, ACTION_RIGHT,  FALSE },
+   { KEY_RIGHT, 1, ACTION_RIGHT,  FALSE },
+   { KEY_DOWN,  1, ACTION_DROP,   FALSE },
+   { ' ',       1, ACTION_DROP,   TRUE  }
+};
+
+/* Help shown below the boards for one or two human players */
+static const char *versushelp[2] =
+{
+   "j k l: Left Rotate Right   SPACE: Drop   p: Pause   q: Quit",
+   "a w d s: Left Rotate Right Drop   j k l SPACE: Left Rotate Right Drop   p: Pause   q: Quit"
+};
+
+/* Garbage rows sent to an opponent for clearing 0 to 5 lines at once */
+static const int garbagelines[MAXBLOCKS + 1] = { 0, 0, 1, 2, 4, 5 };
+
+/* Place the boards next to each other in the middle of the screen, with */
+/* a line of help below them */
+static void versus_layout (player_t *players,int n,int humans,const char *help)
+{
+   const engine_t *engine = &players[0].engine;
+   int i,j,left = (out_width () - n * BOARDWIDTH (engine)) >> 1,top = (out_height () - engine->rows - 1) >> 1;
+   out_clear ();
+   out_setattr (ATTR_OFF);
+   out_setcolor (COLOR_WHITE,COLOR_BLACK);
+   for (i = 0; i < n; i++)
+	 {
+		players[i].left = left + i * BOARDWIDTH (engine);
+		players[i].top = top;
+		players[i].engine.dirty = ALLROWS;
+		for (j = 0; j < NUMSHOWN; j++) players[i].shown[j] = -1;
+		out_gotoxy (players[i].left + (engine->cols - 1) * 2 + 1,top + 1);
+		if (players[i].human < 0) out_printf ("Bot %d",i - humans + 1);
+		else out_printf ("Player %d",players[i].human + 1);
+	 }
+   out_gotoxy (left,top + engine->rows);
+   out_printf ("%s",help);
+}
+
+/* Draw the parts of the status of a board that changed */
+static void versus_status (player_t *p)
+{
+   int shown[NUMSHOWN],x = p->left + (p->engine.cols - 1) * 2 + 1;
+   shown[SHOW_LEVEL] = p->engine.level;
+   shown[SHOW_LINES] = p->engine.status.droppedlines;
+   shown[SHOW_SCORE] = GETSCORE (p->engine.score);
+   shown[SHOW_GARBAGE] = p->engine.garbage;
+   shown[SHOW_NEXT] = p->engine.shownext ? p->engine.nextshape : -1;
+   shown[SHOW_FINISHED] = p->finished;
+   out_setattr (ATTR_OFF);
+   out_setcolor (COLOR_WHITE,COLOR_BLACK);
+   if (shown[SHOW_LEVEL] != p->shown[SHOW_LEVEL])
+	 {
+		out_gotoxy (x,p->top + 3);
+		out_printf ("Level %-4d",shown[SHOW_LEVEL]);
+	 }
+   if (shown[SHOW_LINES] != p->shown[SHOW_LINES])
+	 {
+		out_gotoxy (x,p->top + 4);
+		out_printf ("Lines %-4d",shown[SHOW_LINES]);
+	 }
+   if (shown[SHOW_SCORE] != p->shown[SHOW_SCORE])
+	 {
+		out_gotoxy (x,p->top + 6);
+		out_printf ("Score");
+		out_gotoxy (x,p->top + 7);
+		out_setattr (ATTR_BOLD);
+		out_setcolor (COLOR_YELLOW,COLOR_BLACK);
+		out_printf ("%-10d",shown[SHOW_SCORE]);
+		out_setattr (ATTR_OFF);
+		out_setcolor (COLOR_WHITE,COLOR_BLACK);
+	 }
+   if (shown[SHOW_GARBAGE] != p->shown[SHOW_GARBAGE])
+	 {
+		out_gotoxy (x,p->top + 9);
+		if (shown[SHOW_GARBAGE]) out_printf ("Garbage %-2d",shown[SHOW_GARBAGE]);
+		else out_printf ("          ");
+	 }
+   if (shown[SHOW_FINISHED] != p->shown[SHOW_FINISHED])
+	 {
+		out_gotoxy (x,p->top + 17);
+		out_setattr (ATTR_BOLD);
+		out_setcolor (COLOR_RED,COLOR_BLACK);
+		out_printf (shown[SHOW_FINISHED] ? "GAME OVER" : "         ");
+		out_setattr (ATTR_OFF);
+	 }
+   if ((shown[SHOW_NEXT] != p->shown[SHOW_NEXT]) && (shown[SHOW_NEXT] >= 0)) drawnext (p->engine.pieces,&shown[SHOW_NEXT],1,x + 5 - p->engine.pieces->width,p->top + 11);
+   memcpy (p->shown,shown,sizeof (shown));
+}
+
+/* Draw what changed on all boards and show it in one go. Returns the time */
+/* the screen was refreshed */
+static int64_t versus_draw (player_t *players,int n)
+{
+   int64_t start = monotime (),board = 0,status = 0,now;
+   int i,j;
+   for (i = 0; i < n; i++)
+	 {
+		if (render.repaint)
+		  {
+			 players[i].engine.dirty = ALLROWS;
+			 for (j = 0; j < NUMSHOWN; j++) players[i].shown[j] = -1;
+		  }
+		if (players[i].engine.dirty) drawboard (&players[i].engine,players[i].left,players[i].top);
+		board += (now = monotime ()) - start;
+		versus_status (players + i);
+		status += (start = monotime ()) - now;
+	 }
+   render.repaint = FALSE;
+   hist_add (&profile[STAGE_BOARD],board);
+   hist_add (&profile[STAGE_STATUS],status);
+   if (showprofile) drawprofile ();
+   return (profile_refresh ());
+}
+
+/* Let the shape of a board fall one row. When lines are cleared, garbage */
+/* waiting for the board is cancelled first and the rest is sent to the */
+/* next opponent still playing */
+static void versus_step (player_t *players,int n,int i,int64_t now)
+{
+   player_t *p = players + i;
+   int result = gravity (&p->engine),lines,cancel,j;
+   /* gravity keeps to the clock, even when the board is late */
+   p->due = (p->due < now ? p->due : now) + DELAY (p->engine.level);
+   if (result < 0) p->finished = TRUE;
+   if (result != 0) return;
+   lines = garbagelines[p->engine.status.currentdroppedlines];
+   cancel = lines < p->engine.garbage ? lines : p->engine.garbage;
+   p->engine.garbage -= cancel;
+   if (!(lines -= cancel)) return;
+   for (j = 1; j < n; j++)
+	 {
+		p->target = (p->target + 1) % n;
+		if ((p->target != i) && !players[p->target].finished)
+		  {
+			 engine_garbage (&players[p->target].engine,lines);
+			 break;
+		  }
+	 }
+}
+
+/* Let a bot make its next move. Returns TRUE if the shape was dropped */
+static bool versus_bot (player_t *p)
+{
+   engine_t *engine = &p->engine;
+   action_t action = bot_action (engine,&p->plan);
+   profile_move (engine,action);
+   return (action == ACTION_DROP);
+}
+
+/* Hand a key to the board of the human player it belongs to */
+static void versus_key (player_t *players,int n,int humans,int ch,int64_t now)
+{
+   size_t k;
+   int i,human;
+   for (k = 0; k < sizeof (versuskeys) / sizeof (versuskeys[0]); k++) if (versuskeys[k].ch == ch)
+	 {
+		human = versuskeys[k].human < humans ? versuskeys[k].human : humans - 1;
+		for (i = 0; i < n; i++) if ((players[i].human == human) && !players[i].finished)
+		  {
+			 profile_move (&players[i].engine,versuskeys[k].action);
+			 if (versuskeys[k].lock) versus_step (players,n,i,now);
+		  }
+		return;
+	 }
+   out_beep ();
+}
+
+/* Play with two or more boards side by side until one is left. All boards */
+/* share one gravity scheduler and are drawn in one pass */
+static void versus (int humans,int bots)
+{
+   player_t players[MAXBOARDS];
+   int n = humans + bots,alive = n,i,ch;
+   int64_t now = monotime (),next,start,keytime = -1;
+   bool quit = FALSE,skipped;
+   for (i = 0; i < n; i++)
+	 {
+		engine_init (&players[i].engine,score_function);
+		engine_resize (&players[i].engine,boardwidth,boardheight);
+		engine_pieces (&players[i].engine,pieceset);
+		players[i].engine.level = level;
+		players[i].engine.shadow = shadow;
+		players[i].engine.shownext = shownext;
+		players[i].human = i < humans ? i : -1;
+		players[i].plan.piece = -1;
+		players[i].due = now + DELAY (level);
+		players[i].botdue = now + BOTDELAY;
+		players[i].finished = FALSE;
+		players[i].target = i;
+	 }
+   io_init ();
+   if ((out_width () < n * BOARDWIDTH (&players[0].engine)) || (out_height () < players[0].engine.rows + 1))
+	 {
+		io_close ();
+		fprintf (stderr,"The terminal is too small for %d boards\n",n);
+		exit (EXIT_FAILURE);
+	 }
+   versus_layout (players,n,humans,versushelp[humans - 1]);
+   while ((alive > 1) && !quit)
+	 {
+		/* draw unless the terminal or gravity is behind */
+		for (start = monotime (),i = 0; i < n; i++) if (!players[i].finished && (players[i].due <= start)) break;
+		skipped = (i < n) || !render_frame (start);
+		if (!skipped)
+		  {
+			 start = versus_draw (players,n);
+			 if (keytime >= 0) hist_add (&profile[STAGE_KEY],start - keytime);
+			 keytime = -1;
+		  }
+		for (i = 0; i < n; i++) share_board (i,&players[i].engine,players[i].human,players[i].finished);
+		share_flush ();
+		/* wait for a key until the next board is due, or the frame that */
+		/* was skipped can be drawn */
+		next = skipped ? render.nextframe : INT64_MAX;
+		for (i = 0; i < n; i++) if (!players[i].finished)
+		  {
+			 if (players[i].due < next) next = players[i].due;
+			 if ((players[i].human < 0) && (players[i].botdue < next)) next = players[i].botdue;
+		  }
+		start = monotime ();
+		ch = in_wait (next - start);
+		now = profile_stage (STAGE_INPUT,start);
+		if ((ch != ERR) && (keytime < 0)) keytime = in_keytime ();
+		switch (ch)
+		  {
+		   case ERR:
+			 break;
+		   case 'q':
+			 quit = TRUE;
+			 break;
+		   case 'p':
+			 out_setcolor (COLOR_WHITE,COLOR_BLACK);
+			 out_gotoxy ((out_width () - 34) / 2,out_height () - 1);
+			 out_printf ("Paused - Press any key to continue");
+			 while (in_wait (1000000) == ERR) ;
+			 in_flush ();
+			 out_gotoxy ((out_width () - 34) / 2,out_height () - 1);
+			 out_printf ("                                  ");
+			 next = monotime () - now;
+			 for (i = 0; i < n; i++)
+			   {
+				  players[i].due += next;
+				  players[i].botdue += next;
+			   }
+			 now += next;
+			 break;
+		   case 'o':
+			 if ((showprofile = !showprofile)) break;
+			 /* fall through */
+		   case KEY_RESIZE:
+			 versus_layout (players,n,humans,versushelp[humans - 1]);
+			 break;
+		   default:
+			 versus_key (players,n,humans,ch,now);
+		  }
+		for (i = 0; i < n; i++)
+		  {
+			 if (!players[i].finished && (players[i].human < 0) && (players[i].botdue <= now))
+			   {
+				  if (versus_bot (players + i)) versus_step (players,n,i,now);
+				  players[i].botdue = now + BOTDELAY;
+			   }
+			 if (!players[i].finished && (players[i].due <= now))
+			   {
+				  hist_add (&profile[STAGE_JITTER],now - players[i].due);
+				  versus_step (players,n,i,now);
+			   }
+		  }
+		for (alive = i = 0; i < n; i++) if (!players[i].finished) alive++;
+	 }
+   versus_draw (players,n);
+   for (i = 0; i < n; i++) share_board (i,&players[i].engine,players[i].human,players[i].finished);
+   share_flush ();
+   share_close ();
+   io_close ();
+   if ((profileout != NULL) && !saveprofile (profileout))
+	 fprintf (stderr,"Error writing %s: %s\n",profileout,strerror (errno));
+   fprintf (stderr,"\n\t   VERSUS\n\n");
+   for (i = 0; i < n; i++)
+	 {
+		if (players[i].human < 0) fprintf (stderr,"\tBot %d   ",i - humans + 1);
+		else fprintf (stderr,"\tPlayer %d",players[i].human + 1);
+		fprintf (stderr,"  %6d points %4d lines%s\n",GETSCORE (players[i].engine.score),players[i].engine.status.droppedlines,
+				 (alive == 1) && !players[i].finished ? "  WINNER" : "");
+	 }
+}
+
+/* Set a field of a board watched from the spectator stream */
+static bool watchfield (player_t *p,int field,int64_t value)
+{
+   if ((value < INT_MIN) || (value > INT_MAX)) return FALSE;
+   switch (field)
+	 {
+	  case WF_HUMAN: p->human = value; break;
+	  case WF_CURX: p->engine.curx = value; break;
+	  case WF_CURY: p->engine.cury = value; break;
+	  case WF_CURSHAPE:
+	  case WF_NEXTSHAPE:
+		if ((value < 0) || (value >= p->engine.pieces->numshapes)) return FALSE;
+		if (field == WF_CURSHAPE) p->engine.curshape = value; else p->engine.nextshape = value;
+		break;
+	  case WF_SCORE: p->engine.score = SCOREVAL (value); break;
+	  case WF_LEVEL: p->engine.level = value; break;
+	  case WF_LINES: p->engine.status.droppedlines = value; break;
+	  case WF_GARBAGE: p->engine.garbage = value; break;
+	  case WF_SHOWNEXT: p->engine.shownext = value != 0; break;
+	  case WF_FINISHED: p->finished = value != 0; break;
+	 }
+   return TRUE;
+}
+
+/* Set a cell of a board watched from the spectator stream */
+static bool watchcell (player_t *p,int64_t i,int64_t value)
+{
+   if ((i < 0) || (i >= NUMCOLS * NUMROWS)) return FALSE;
+   if ((value < 0) || ((value >= NUM_COLORS) && (value != WALL) && (value != GARBAGE))) return FALSE;
+   p->engine.board[i / NUMROWS][i % NUMROWS] = value;
+   p->engine.dirty |= ROW (i % NUMROWS);
+   return TRUE;
+}
+
+/* Apply a frame of the spectator stream. Returns the number of boards, or */
+/* -1 if the frame is damaged */
+static int watchframe (player_t *players,int n,int type,const unsigned char *p,const unsigned char *end)
+{
+   int64_t value,mask,count,cell;
+   int i,j,boards;
+   if ((p >= end) || ((type != FRAME_KEY) && (type != FRAME_DELTA))) return -1;
+   boards = *p++;
+   if ((type == FRAME_KEY) ? (boards < 1) || (boards > MAXBOARDS) : (n < 1)) return -1;
+   if (type == FRAME_KEY)
+	 {
+		n = boards;
+		memset (players,0,sizeof (player_t) * n);
+		for (i = 0; i < n; i++)
+		  {
+			 players[i].engine.pieces = pieces_builtin ("tetrominoes");
+			 for (j = 0; j < NUMFIELDS; j++)
+			   if (((p = get_varint (p,end,&value)) == NULL) || !watchfield (players + i,j,value)) return -1;
+			 if (end - p < NUMCOLS * NUMROWS) return -1;
+			 for (j = 0; j < NUMCOLS * NUMROWS; j++) if (!watchcell (players + i,j,*p++)) return -1;
+		  }
+		return (p == end ? n : -1);
+	 }
+   while (boards--)
+	 {
+		if ((p >= end) || ((i = *p++) >= n) || ((p = get_varint (p,end,&mask)) == NULL)) return -1;
+		for (j = 0; j < NUMFIELDS; j++) if (mask & (1 << j))
+		  if (((p = get_varint (p,end,&value)) == NULL) || !watchfield (players + i,j,value)) return -1;
+		if ((p = get_varint (p,end,&count)) == NULL) return -1;
+		for (cell = 0; count > 0; count--)
+		  {
+			 if (((p = get_varint (p,end,&value)) == NULL) || (p >= end)) return -1;
+			 cell += value;
+			 if (!watchcell (players + i,cell,*p++)) return -1;
+		  }
+	 }
+   return (p == end ? n : -1);
+}
+
+/* Watch a game broadcast by another tint until it ends or q is pressed */
+static void watch (const char *addr)
+{
+   player_t players[MAXBOARDS];
+   struct pollfd fds[2];
+   unsigned char *buf;
+   size_t have = 0,size = 2 * FRAME_MAXSIZE,len,pos;
+   ssize_t got;
+   int fd,n = 0,humans,i,ch = ERR;
+   bool damaged = FALSE;
+   if ((fd = watchsocket (addr,FALSE)) < 0)
+	 {
+		fprintf (stderr,"Error connecting to %s: %s\n",addr,strerror (errno));
+		exit (EXIT_FAILURE);
+	 }
+   if ((buf = malloc (size)) == NULL)
+	 {
+		fprintf (stderr,"Out of memory\n");
+		exit (EXIT_FAILURE);
+	 }
+   io_init ();
+   out_gotoxy (0,0);
+   out_printf ("Waiting for %s ...",addr);
+   out_refresh ();
+   fds[0].fd = fd;
+   fds[1].fd = in_fd ();
+   fds[0].events = fds[1].events = POLLIN;
+   while (ch != 'q')
+	 {
+		if ((poll (fds,2,-1) < 0) && (errno != EINTR)) break;
+		if (fds[1].revents && ((ch = in_wait (0)) == KEY_RESIZE) && n)
+		  {
+			 for (humans = i = 0; i < n; i++) if (players[i].human >= 0) humans++;
+			 versus_layout (players,n,humans,"q: Quit");
+		  }
+		if (!fds[0].revents) continue;
+		if ((got = read (fd,buf + have,size - have)) <= 0) break;
+		have += got;
+		/* apply every complete frame, then draw once */
+		for (pos = 0; (have - pos >= FRAME_HDRSIZE) && (have - pos >= FRAME_HDRSIZE + (len = get_u32 (buf + pos))); pos += FRAME_HDRSIZE + len)
+		  {
+			 if ((len > FRAME_MAXSIZE) || ((n = watchframe (players,n,buf[pos + 4],buf + pos + FRAME_HDRSIZE,buf + pos + FRAME_HDRSIZE + len)) < 0))
+			   {
+				  damaged = TRUE;
+				  break;
+			   }
+			 if (buf[pos + 4] == FRAME_KEY)
+			   {
+				  for (humans = i = 0; i < n; i++) if (players[i].human >= 0) humans++;
+				  versus_layout (players,n,humans,"q: Quit");
+			   }
+		  }
+		if (damaged || ((have - pos >= FRAME_HDRSIZE) && (get_u32 (buf + pos) > FRAME_MAXSIZE))) break;
+		memmove (buf,buf + pos,have - pos);
+		have -= pos;
+		if (n) versus_draw (players,n);
+	 }
+   io_close ();
+   close (fd);
+   free (buf);
+   if (damaged) fprintf (stderr,"The stream from %s is damaged\n",addr);
+   else if (ch != 'q') fprintf (stderr,"The game on %s has ended\n",addr);
+}
+
+          /***************************************************************************/
+          /***************************************************************************/
+          /***************************************************************************/
+
+int tint_main (int argc,char *argv[])
+{
+   bool finished,standard,recorded,quit = FALSE;
+   int ch = ERR,startlevel;
+   int64_t start,now,due,keytime = -1;
+   time_t starttime;
+   unsigned seed = time (NULL);
+   stats_t stats;
+   engine_t engine;
+   /* Initialize */
+   rand_init (seed);						/* must be called before engine_init () */
+   engine_init (&engine,score_function);	/* must be called before using engine.curshape */
+   finished = shownext = shadow = FALSE;
+   parse_options (argc,argv);				/* must be called after initializing variables */
+   if (listscores)
+	 {
+		if (!querydaemon (topscores,scoreuser,level)) showleaderboard (topscores,scoreuser,level);
+		exit (EXIT_SUCCESS);
+	 }
+   if (liststats)
+	 {
+		showstats (scoreuser);
+		exit (EXIT_SUCCESS);
+	 }
+   if (watchaddr != NULL)
+	 {
+		watch (watchaddr);
+		exit (EXIT_SUCCESS);
+	 }
+   if (replayfile != NULL)
+	 {
+		replay (replayfile);
+		exit (EXIT_SUCCESS);
+	 }
+   /* without --book, the book is used if there is one */
+   if (((book = tintbook_open (bookname != NULL ? bookname : bookfile)) == NULL) && (bookname != NULL))
+	 {
+		fprintf (stderr,"%s is not an opening book\n",bookname);
+		exit (EXIT_FAILURE);
+	 }
+   engine_resize (&engine,boardwidth,boardheight);
+   engine_pieces (&engine,pieceset);
+   standard = engine.classic && (pieceset == pieces_builtin ("tetrominoes")) && !practicememory && (botcommand == NULL);
+   if (!standard && ((broadcastaddr != NULL) || (publishname != NULL)))
+	 {
+		fprintf (stderr,"Spectators and shared memory need a board of the default size and the standard shapes\n");
+		exit (EXIT_FAILURE);
+	 }
+   if (level < MINLEVEL)
+	 {
+		if (headless) level = MINLEVEL;
+		else choose_level ();
+	 }
+   if ((broadcastaddr != NULL) && !broadcast_open (&broadcast,broadcastaddr,(versusmode ? 2 : 1) + numbots))
+	 {
+		fprintf (stderr,"Error listening on %s: %s\n",broadcastaddr,strerror (errno));
+		exit (EXIT_FAILURE);
+	 }
+   if ((publishname != NULL) && !publish_open (&publish,publishname,(versusmode ? 2 : 1) + numbots))
+	 {
+		fprintf (stderr,"Error creating shared memory %s: %s\n",publishname,strerror (errno));
+		share_close ();
+		exit (EXIT_FAILURE);
+	 }
+   if (versusmode || numbots)
+	 {
+		versus (versusmode ? 2 : 1,numbots);
+		exit (EXIT_SUCCESS);
+	 }
+   if (practicememory && !practice_init (practicememory))
+	 {
+		fprintf (stderr,"Not enough memory to practice\n");
+		exit (EXIT_FAILURE);
+	 }
+   if ((recordfile != NULL) && (strlen (pieceset == &custompieces ? piecesname : "") >= REPLAY_NAMELEN))
+	 {
+		fprintf (stderr,"The name of the shapes is too long to record\n");
+		exit (EXIT_FAILURE);
+	 }
+   if ((recordfile != NULL) && !record_open (recordfile,seed))
+	 {
+		fprintf (stderr,"Error creating %s: %s\n",recordfile,strerror (errno));
+		exit (EXIT_FAILURE);
+	 }
+   engine.level = startlevel = level;
+   engine.shadow = shadow;
+   engine.shownext = shownext;
+   engine.previews = numpreviews;
+   starttime = time (NULL);
+   if ((botcommand != NULL) && !protocol_open (&engine,botcommand,!headless))
+	 {
+		fprintf (stderr,"Error starting %s: %s\n",botcommand,strerror (errno));
+		exit (EXIT_FAILURE);
+	 }
+   /* without a terminal, the bot plays as fast as it answers */
+   if (headless)
+	 {
+		while (!protocol_turn (&engine,TRUE)) ;
+		if ((recorder.handle != NULL) && !record_close ()) fprintf (stderr,"Error writing %s\n",recordfile);
+		protocol_close (&engine);
+		if ((profileout != NULL) && !saveprofile (profileout))
+		  fprintf (stderr,"Error writing %s: %s\n",profileout,strerror (errno));
+		exit (protocol.error == NULL ? EXIT_SUCCESS : EXIT_FAILURE);
+	 }
+   io_init ();
+   if (!engine.classic && ((out_width () < 2 * boardwidth + 48) || (out_height () < boardheight + 3)))
+	 {
+		io_close ();
+		fprintf (stderr,"The terminal is too small for a %dx%d board\n",boardwidth,boardheight);
+		exit (EXIT_FAILURE);
+	 }
+   drawbackground ();
+   in_timeout (DELAY (engine.level));
+   /* Main loop */
+   do
+	 {
+		/* a bot playing over the protocol is asked about every new shape */
+		if ((protocol.pid > 0) && (protocol.piece != (int) engine.queuehead) && protocol_turn (&engine,FALSE)) break;
+		hint_update (&engine,monotime () + in_remaining ());
+		/* draw shape, unless the terminal or gravity is behind */
+		start = monotime ();
+		if (!render_frame (start)) in_wakeup (render.nextframe - start);
+		else if (in_remaining () > 0)
+		  {
+			 if (render_status (start)) showstatus (&engine);
+			 start = profile_stage (STAGE_STATUS,start);
+			 if (render.repaint) engine.dirty = ALLROWS;
+			 render.repaint = FALSE;
+			 drawboard (&engine,XTOP,YTOP);
+			 start = profile_stage (STAGE_BOARD,start);
+			 if (showprofile) drawprofile ();
+			 start = profile_refresh ();
+			 if (keytime >= 0) hist_add (&profile[STAGE_KEY],start - keytime);
+			 keytime = -1;
+		  }
+		share_board (0,&engine,0,FALSE);
+		share_flush ();
+		/* Check if user pressed a key */
+		start = monotime ();
+		due = start + in_remaining ();
+		ch = in_getch ();
+		now = profile_stage (STAGE_INPUT,start);
+		if (ch != ERR)
+		  {
+			 if (keytime < 0) keytime = in_keytime ();
+			 switch (ch)
+			   {
+				case 'j':
+				case KEY_LEFT:
+				  play (&engine,ACTION_LEFT);
+				  break;
+				case 'k':
+				case KEY_UP:
+				case '\n':
+				  play (&engine,ACTION_ROTATE);
+				  break;
+				case 'l':
+				case KEY_RIGHT:
+				  play (&engine,ACTION_RIGHT);
+				  break;
+				case KEY_DOWN:
+				  play (&engine,ACTION_DROP);
+				  break;
+				case ' ':
+				  play (&engine,ACTION_DROP);
+				  finished = play (&engine,EVENT_TICK);	/* prevent key press after drop */
+				  break;
+				  /* show next piece */
+				case 's':
+				  play (&engine,EVENT_NEXT);
+				  break;
+				  /* toggle the hint */
+				case 'h':
+				  play (&engine,EVENT_HINT);
+				  break;
+				  /* toggle dotted lines */
+				case 'd':
+				  play (&engine,EVENT_LINES);
+				  break;
+				  /* take a shape back, or put it down again */
+				case 'u':
+				case 'r':
+				  if (practice.buffer != NULL) play (&engine,ch == 'u' ? EVENT_UNDO : EVENT_REDO);
+				  else out_beep ();
+				  break;
+				  /* toggle the profile */
+				case 'o':
+				  if ((showprofile = !showprofile)) break;
+				  out_clear ();
+				  drawbackground ();
+				  engine.dirty = ALLROWS;
+				  break;
+				  /* next level */
+				case 'a':
+				  play (&engine,EVENT_LEVEL);
+				  break;
+				  /* quit */
+				case 'q':
+				  finished = quit = TRUE;
+				  break;
+				  /* pause */
+				case 'p':
+				  out_setcolor (COLOR_WHITE,COLOR_BLACK);
+				  out_gotoxy ((out_width () - 34) / 2,out_height () - 2);
+				  out_printf ("Paused - Press any key to continue");
+				  while ((ch = in_getch ()) == ERR) ;	/* Wait for a key to be pressed */
+				  in_flush ();							/* Clear keyboard buffer */
+				  in_timeout (DELAY (engine.level));		/* Don't catch up on the pause */
+				  out_gotoxy ((out_width () - 34) / 2,out_height () - 2);
+				  out_printf ("                                  ");
+				  break;
+				  /* terminal resized */
+				case KEY_RESIZE:
+				  out_clear ();
+				  drawbackground ();
+				  engine.dirty = ALLROWS;
+				  break;
+				  /* unknown keypress */
+				default:
+				  out_beep ();
+			   }
+			 in_flush ();
+		  }
+		else if (now >= due)
+		  {
+			 hist_add (&profile[STAGE_JITTER],now - due);
+			 finished = play (&engine,EVENT_TICK);
+		  }
+	 }
+   while (!finished);
+   /* the player or the bot quit, rather than losing the game */
+   quit = quit || protocol.quit;
+   hint_stop ();
+   recorded = (recorder.handle == NULL) || record_close ();
+   share_board (0,&engine,0,!quit);
+   share_flush ();
+   share_close ();
+   /* Restore console settings and exit */
+   io_close ();
+   if (protocol.pid > 0) protocol_close (&engine);
+   if ((profileout != NULL) && !saveprofile (profileout))
+	 fprintf (stderr,"Error writing %s: %s\n",profileout,strerror (errno));
+   if (!recorded) fprintf (stderr,"Error writing %s\n",recordfile);
+   /* games on other boards or with other shapes can't be compared, so they */
+   /* are not recorded */
+   if (standard)
+	 {
+		getstats (&stats,&engine,startlevel,starttime,quit);
+		savestats (&stats);
+	 }
+   /* Don't bother the player if he want's to quit */
+   if (!quit)
+	 {
+		showplayerstats (&engine);
+		if (standard && !submitscores (GETSCORE (engine.score),startlevel,engine.status.droppedlines))
+		  {
+			 savescores (GETSCORE (engine.score));
+			 savehistory (GETSCORE (engine.score),startlevel,engine.status.droppedlines);
+		  }
+	 }
+   exit (EXIT_SUCCESS);
+}
+
+/*
+ * Simulator
+ */
+
+/* Size of the buffer each worker writes its samples through */
+#define SIM_BUFSIZE	(1 << 20)
+
+/* Shapes a game is cut short after, unless told otherwise */
+#define SIM_MAXPIECES	1000
+
+/* Most worker processes */
+#define SIM_MAXWORKERS	256
+
+/* Describe the position of the current shape of the specified tetris engine */
+static void sim_sample (const engine_t *engine,tintsim_sample_t *sample)
+{
+   const rotation_t *shape = CURRENT (engine);
+   int i,x,y,n = engine->pieces->numshapes;
+   memset (sample,0,sizeof (tintsim_sample_t));
+   for (y = 0; y < TINTSIM_ROWS; y++)
+	 for (x = 0; x < TINTSIM_COLS; x++)
+	   if (engine->board[x + 1][y + 1]) sample->board[y] |= 1 << x;
+   /* the shape itself is on the board as well */
+   for (i = 0; i < shape->numblocks; i++)
+	 if (engine->cury + shape->block[i].y > 0)
+	   sample->board[engine->cury + shape->block[i].y - 1] &= ~(1 << (engine->curx + shape->block[i].x - 1));
+   for (i = engine->queuehead % n + 1; i < n; i++) sample->bag |= 1u << engine_peek (engine,i - engine->queuehead % n + 1);
+   sample->current = engine->curshape;
+   sample->next = engine->nextshape;
+}
+
+/* Let the bot play games and write a sample for every shape it places to */
+/* a file of its own. Returns the number of samples written, -1 if an */
+/* error occurred */
+static long sim_worker (const char *filename,const pieces_t *pieces,int games,int maxpieces,unsigned seed)
+{
+   tintsim_sample_t *game;
+   engine_t engine;
+   plan_t plan;
+   action_t action;
+   FILE *fp;
+   long count = 0;
+   int i,j,n,lines;
+   bool lost;
+   if ((game = malloc (maxpieces * sizeof (tintsim_sample_t))) == NULL) return (-1);
+   if ((fp = fopen (filename,"w")) == NULL)
+	 {
+		free (game);
+		return (-1);
+	 }
+   setvbuf (fp,NULL,_IOFBF,SIM_BUFSIZE);
+   rand_init (seed);
+   for (i = 0; i < games; i++)
+	 {
+		engine_init (&engine,score_function);
+		engine_pieces (&engine,pieces);
+		plan.piece = -1;
+		for (n = 0, lost = FALSE; !lost && (n < maxpieces); n++)
+		  {
+			 sim_sample (&engine,&game[n]);
+			 do engine_move (&engine,action = bot_action (&engine,&plan)); while (action != ACTION_DROP);
+			 game[n].x = engine.curx - 1;
+			 game[n].y = engine.cury - 1;
+			 game[n].rotation = engine.rotation;
+			 lost = engine_evaluate (&engine) < 0;
+			 game[n].lines = engine.status.currentdroppedlines;
+		  }
+		/* the outcome is only known once the game is over */
+		for (j = n - 1, lines = 0; j >= 0; j--)
+		  {
+			 lines += game[j].lines;
+			 game[j].linesafter = lines;
+			 game[j].piecesleft = n - 1 - j;
+			 game[j].lost = lost;
+		  }
+		if (fwrite (game,sizeof (tintsim_sample_t),n,fp) != (size_t) n) break;
+		count += n;
+	 }
+   free (game);
+   return (fclose (fp) == 0 && i == games ? count : -1);
+}
+
+/* Append a shard to the file being exported and remove it. Returns the */
+/* number of samples in it, -1 if an error occurred */
+static long sim_merge (int fd,const char *shard)
+{
+   static char buf[SIM_BUFSIZE];
+   ssize_t len = 0;
+   off_t size = 0;
+   int in;
+   if ((in = open (shard,O_RDONLY)) < 0) return (-1);
+   while ((len = read (in,buf,sizeof (buf))) > 0)
+	 {
+		if (write (fd,buf,len) != len) break;
+		size += len;
+	 }
+   close (in);
+   unlink (shard);
+   return (len == 0 ? size / sizeof (tintsim_sample_t) : -1);
+}
+
+static void sim_usage ()
+{
+   fprintf (stderr,"USAGE: tint-sim --export file [-j workers] [-g games] [-p count] [-s seed] [--pieces set]\n");
+   fprintf (stderr,"  --export <file> Write a training sample for every shape the bots place to this file\n");
+   fprintf (stderr,"  -j <workers> Number of games played at the same time (default: one per processor)\n");
+   fprintf (stderr,"  -g <games>   Number of games to play (default 100)\n");
+   fprintf (stderr,"  -p <count>   End a game after this many shapes (default %d)\n",SIM_MAXPIECES);
+   fprintf (stderr,"  -s <seed>    Seed of the random number generator\n");
+   fprintf (stderr,"  --pieces <set> Play with tetrominoes or pentominoes\n");
+   exit (EXIT_FAILURE);
+}
+
+/*
+ * Simulator: bots play games in worker processes of their own, each writing
+ * samples to a shard of its own, and the shards are merged at the end
+ */
+int tintsim_main (int argc,char *argv[])
+{
+   const char *filename = NULL,*piecesname = "tetrominoes";
+   const pieces_t *pieces;
+   char shard[PATH_MAX];
+   tintsim_t header;
+   pid_t pid[SIM_MAXWORKERS];
+   int64_t start,played,merged;
+   long count = 0,n;
+   int i,fd,status,workers = sysconf (_SC_NPROCESSORS_ONLN),games = 100,maxpieces = SIM_MAXPIECES,seed = time (NULL);
+   bool ok = TRUE;
+   for (i = 1; i < argc; i++)
+	 {
+		if ((strcmp (argv[i],"--export") == 0) && (i + 1 < argc)) filename = argv[++i];
+		else if ((strcmp (argv[i],"--pieces") == 0) && (i + 1 < argc)) piecesname = argv[++i];
+		else if ((strcmp (argv[i],"-j") == 0) && (i + 1 < argc))
+		  {
+			 if (!str2int (&workers,argv[++i]) || (workers < 1) || (workers > SIM_MAXWORKERS)) sim_usage ();
+		  }
+		else if ((strcmp (argv[i],"-g") == 0) && (i + 1 < argc))
+		  {
+			 if (!str2int (&games,argv[++i]) || (games < 1)) sim_usage ();
+		  }
+		else if ((strcmp (argv[i],"-p") == 0) && (i + 1 < argc))
+		  {
+			 if (!str2int (&maxpieces,argv[++i]) || (maxpieces < 1) || (maxpieces > UINT16_MAX)) sim_usage ();
+		  }
+		else if ((strcmp (argv[i],"-s") == 0) && (i + 1 < argc))
+		  {
+			 if (!str2int (&seed,argv[++i])) sim_usage ();
+		  }
+		else sim_usage ();
+	 }
+   if (filename == NULL) sim_usage ();
+   if ((pieces = pieces_builtin (piecesname)) == NULL)
+	 {
+		fprintf (stderr,"Unknown set of shapes %s\n",piecesname);
+		exit (EXIT_FAILURE);
+	 }
+   if (workers > games) workers = games;
+   if (workers > SIM_MAXWORKERS) workers = SIM_MAXWORKERS;
+   start = monotime ();
+   for (i = 0; i < workers; i++)
+	 {
+		snprintf (shard,sizeof (shard),"%s.%d",filename,i);
+		if ((pid[i] = fork ()) == 0)
+		  _exit (sim_worker (shard,pieces,games / workers + (i < games % workers),maxpieces,seed + i) < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+		if (pid[i] < 0)
+		  {
+			 fprintf (stderr,"Error starting a worker: %s\n",strerror (errno));
+			 exit (EXIT_FAILURE);
+		  }
+	 }
+   for (i = 0; i < workers; i++)
+	 if ((waitpid (pid[i],&status,0) < 0) || !WIFEXITED (status) || (WEXITSTATUS (status) != EXIT_SUCCESS)) ok = FALSE;
+   played = monotime ();
+   /* the header is written again once the samples are counted */
+   memset (&header,0,sizeof (header));
+   memcpy (header.magic,TINTSIM_MAGIC,8);
+   header.version = TINTSIM_VERSION;
+   header.stride = sizeof (tintsim_sample_t);
+   snprintf (header.pieces,sizeof (header.pieces),"%s",piecesname);
+   if ((fd = open (filename,O_WRONLY | O_CREAT | O_TRUNC,0644)) < 0 || (write (fd,&header,sizeof (header)) != sizeof (header))) ok = FALSE;
+   for (i = 0; i < workers; i++)
+	 {
+		snprintf (shard,sizeof (shard),"%s.%d",filename,i);
+		if (!ok) unlink (shard);
+		else if ((n = sim_merge (fd,shard)) < 0) ok = FALSE;
+		else count += n;
+	 }
+   header.count = count;
+   if (!ok || (pwrite (fd,&header,sizeof (header),0) != sizeof (header)) || (close (fd) < 0))
+	 {
+		fprintf (stderr,"Error exporting to %s\n",filename);
+		unlink (filename);
+		exit (EXIT_FAILURE);
+	 }
+   merged = monotime ();
+   printf ("%ld samples from %d games in %.2f s with %d workers: %.0f samples/s, %.1f MB/s (merging took %.2f s)\n",
+		   count,games,(merged - start) / 1e6,workers,count * 1e6 / (merged - start),
+		   count * sizeof (tintsim_sample_t) / (double) (merged - start),(merged - played) / 1e6);
+   exit (EXIT_SUCCESS);
+}
+
+/*
+ * Tuner
+ */
+
+/* Candidates, games each one plays and shapes a game is cut short after, */
+/* unless told otherwise */
+#define TUNE_POPULATION	32
+#define TUNE_GAMES		8
+#define TUNE_MAXPIECES	500
+
+/* Most candidates */
+#define TUNE_MAXPOPULATION	256
+
+/* Best candidates that go on to the next generation as they are */
+#define TUNE_ELITE		2
+
+/* Candidates drawn to pick a parent from */
+#define TUNE_TOURNAMENT	4
+
+/* How much a child's weights are changed (standard deviation) */
+#define TUNE_MUTATION	0.1
+
+typedef struct
+{
+   double weights[NUMFEATURES];
+   double fitness;							/* average lines cleared */
+} candidate_t;
+
+typedef struct
+{
+   int generation;							/* generations played so far */
+   unsigned seed;							/* shapes of the first generation */
+   uint64_t random;						/* state of the random numbers of the tuner */
+   int population;
+   candidate_t candidate[TUNE_MAXPOPULATION];
+} tune_t;
+
+/* Random number between 0 and 1. The games have random numbers of their */
+/* own, so that every candidate gets the same shapes */
+static double tune_random (tune_t *tune)
+{
+   tune->random ^= tune->random >> 12;
+   tune->random ^= tune->random << 25;
+   tune->random ^= tune->random >> 27;
+   return ((tune->random * 2685821657736338717ull >> 11) / 9007199254740992.0);
+}
+
+/* Random number with a normal distribution (near enough) */
+static double tune_gaussian (tune_t *tune)
+{
+   double sum = -6;
+   int i;
+   for (i = 0; i < 12; i++) sum += tune_random (tune);
+   return (sum);
+}
+
+/* Scale weights so that the largest is 1. Only how they compare matters */
+static void tune_normalize (double *weights)
+{
+   double max = 0;
+   int i;
+   for (i = 0; i < NUMFEATURES; i++)
+	 {
+		if (weights[i] > max) max = weights[i];
+		if (-weights[i] > max) max = -weights[i];
+	 }
+   if (max > 0) for (i = 0; i < NUMFEATURES; i++) weights[i] /= max;
+}
+
+/* Let the bot play a game on the shapes the seed gives. Returns the */
+/* number of lines it cleared */
+static int tune_game (const pieces_t *pieces,int maxpieces,unsigned seed)
+{
+   engine_t engine;
+   plan_t plan;
+   action_t action;
+   int n;
+   rand_init (seed);
+   engine_init (&engine,score_function);
+   engine_pieces (&engine,pieces);
+   plan.piece = -1;
+   for (n = 0; n < maxpieces; n++)
+	 {
+		do engine_move (&engine,action = bot_action (&engine,&plan)); while (action != ACTION_DROP);
+		if (engine_evaluate (&engine) < 0) break;
+	 }
+   return (engine.status.droppedlines);
+}
+
+static int tune_compare (const void *a,const void *b)
+{
+   double fa = ((const candidate_t *) a)->fitness,fb = ((const candidate_t *) b)->fitness;
+   return (fa < fb) - (fa > fb);
+}
+
+/* Play the games of a generation in worker processes, each taking every */
+/* so many candidates and sending back how well they did through a pipe */
+static bool tune_play (tune_t *tune,const pieces_t *pieces,int workers,int games,int maxpieces)
+{
+   struct { int candidate; double fitness; } result;
+   pid_t pid[SIM_MAXWORKERS];
+   int i,j,fd[2],status,received = 0;
+   bool ok = TRUE;
+   if (pipe (fd) < 0) return (FALSE);
+   for (i = 0; i < workers; i++)
+	 {
+		if ((pid[i] = fork ()) == 0)
+		  {
+			 close (fd[0]);
+			 for (result.candidate = i; result.candidate < tune->population; result.candidate += workers)
+			   {
+				  memcpy (botweights,tune->candidate[result.candidate].weights,sizeof (botweights));
+				  for (j = 0, result.fitness = 0; j < games; j++)
+					result.fitness += tune_game (pieces,maxpieces,tune->seed + tune->generation * games + j);
+				  result.fitness /= games;
+				  /* writes this small are never split up, so the workers can share the pipe */
+				  if (write (fd[1],&result,sizeof (result)) != sizeof (result)) _exit (EXIT_FAILURE);
+			   }
+			 _exit (EXIT_SUCCESS);
+		  }
+		if (pid[i] < 0) break;
+	 }
+   close (fd[1]);
+   workers = i;
+   while (read (fd[0],&result,sizeof (result)) == sizeof (result))
+	 {
+		tune->candidate[result.candidate].fitness = result.fitness;
+		received++;
+	 }
+   close (fd[0]);
+   for (i = 0; i < workers; i++)
+	 if ((waitpid (pid[i],&status,0) < 0) || !WIFEXITED (status) || (WEXITSTATUS (status) != EXIT_SUCCESS)) ok = FALSE;
+   return (ok && (received == tune->population));
+}
+
+/* Pick the best of a few candidates drawn at random */
+static const candidate_t *tune_tournament (tune_t *tune)
+{
+   const candidate_t *best = NULL,*c;
+   int i;
+   for (i = 0; i < TUNE_TOURNAMENT; i++)
+	 {
+		c = &tune->candidate[(int) (tune_random (tune) * tune->population)];
+		if ((best == NULL) || (c->fitness > best->fitness)) best = c;
+	 }
+   return (best);
+}
+
+/* Breed the next generation. The best candidates go on as they are, the */
+/* others are replaced by children of two parents, whose weights are mixed */
+/* in proportion to how well they did and then changed a little */
+static void tune_breed (tune_t *tune)
+{
+   candidate_t next[TUNE_MAXPOPULATION];
+   const candidate_t *a,*b;
+   double share;
+   int i,j;
+   qsort (tune->candidate,tune->population,sizeof (candidate_t),tune_compare);
+   memcpy (next,tune->candidate,TUNE_ELITE * sizeof (candidate_t));
+   for (i = TUNE_ELITE; i < tune->population; i++)
+	 {
+		a = tune_tournament (tune);
+		b = tune_tournament (tune);
+		share = a->fitness + b->fitness > 0 ? a->fitness / (a->fitness + b->fitness) : 0.5;
+		for (j = 0; j < NUMFEATURES; j++)
+		  next[i].weights[j] = share * a->weights[j] + (1 - share) * b->weights[j] + TUNE_MUTATION * tune_gaussian (tune);
+		tune_normalize (next[i].weights);
+		next[i].fitness = 0;
+	 }
+   memcpy (tune->candidate,next,tune->population * sizeof (candidate_t));
+   tune->generation++;
+}
+
+/* Save the population, so that the tuner can go on where it left off */
+static bool tune_save (const tune_t *tune,const char *filename)
+{
+   char buf[TUNE_MAXPOPULATION * (NUMFEATURES + 1) * 26 + 128];
+   int i,j,len;
+   len = snprintf (buf,sizeof (buf),"tint-tune 1\n%d %u %llu %d\n",
+				   tune->generation,tune->seed,(unsigned long long) tune->random,tune->population);
+   for (i = 0; i < tune->population; i++)
+	 {
+		len += snprintf (buf + len,sizeof (buf) - len,"%.17g",tune->candidate[i].fitness);
+		for (j = 0; j < NUMFEATURES; j++) len += snprintf (buf + len,sizeof (buf) - len," %.17g",tune->candidate[i].weights[j]);
+		len += snprintf (buf + len,sizeof (buf) - len,"\n");
+	 }
+   return (replacefile (filename,buf,len));
+}
+
+/* Load a population saved by tune_save(). Returns 1 if successful, 0 if */
+/* there is none, -1 if the file is not valid */
+static int tune_load (tune_t *tune,const char *filename)
+{
+   unsigned long long random;
+   FILE *fp;
+   int i,j,ok;
+   if ((fp = fopen (filename,"r")) == NULL) return (errno == ENOENT ? 0 : -1);
+   ok = (fscanf (fp,"tint-tune 1 %d %u %llu %d",&tune->generation,&tune->seed,&random,&tune->population) == 4) &&
+	 (tune->population > TUNE_ELITE) && (tune->population <= TUNE_MAXPOPULATION);
+   for (i = 0; ok && (i < tune->population); i++)
+	 {
+		ok = fscanf (fp,"%lf",&tune->candidate[i].fitness) == 1;
+		for (j = 0; ok && (j < NUMFEATURES); j++) ok = fscanf (fp,"%lf",&tune->candidate[i].weights[j]) == 1;
+	 }
+   fclose (fp);
+   tune->random = random;
+   return (ok ? 1 : -1);
+}
+
+static void tune_usage ()
+{
+   fprintf (stderr,"USAGE: tint-tune --checkpoint file [-j workers] [-P population] [-g games] [-p count] [-G generations] [-s seed] [--pieces set]\n");
+   fprintf (stderr,"  --checkpoint <file> Save the population to this file after every generation,\n");
+   fprintf (stderr,"               and go on from it if it exists\n");
+   fprintf (stderr,"  -j <workers> Number of games played at the same time (default: one per processor)\n");
+   fprintf (stderr,"  -P <count>   Number of candidates (default %d)\n",TUNE_POPULATION);
+   fprintf (stderr,"  -g <games>   Games each candidate plays per generation (default %d)\n",TUNE_GAMES);
+   fprintf (stderr,"  -p <count>   End a game after this many shapes (default %d)\n",TUNE_MAXPIECES);
+   fprintf (stderr,"  -G <count>   Stop after this many generations (default: never)\n");
+   fprintf (stderr,"  -s <seed>    Seed of the random number generators\n");
+   fprintf (stderr,"  --pieces <set> Play with tetrominoes or pentominoes\n");
+   exit (EXIT_FAILURE);
+}
+
+/*
+ * Tuner: looks for better weights for the bot with a genetic algorithm.
+ * Every candidate plays the same shapes in a generation, and the games are
+ * shared out between worker processes
+ */
+int tinttune_main (int argc,char *argv[])
+{
+   const char *filename = NULL,*piecesname = "tetrominoes";
+   const pieces_t *pieces;
+   static tune_t tune;
+   int64_t start,took;
+   double sum;
+   int i,j,workers = sysconf (_SC_NPROCESSORS_ONLN),population = TUNE_POPULATION,games = TUNE_GAMES,
+	 maxpieces = TUNE_MAXPIECES,generations = 0,seed = time (NULL);
+   for (i = 1; i < argc; i++)
+	 {
+		if ((strcmp (argv[i],"--checkpoint") == 0) && (i + 1 < argc)) filename = argv[++i];
+		else if ((strcmp (argv[i],"--pieces") == 0) && (i + 1 < argc)) piecesname = argv[++i];
+		else if ((strcmp (argv[i],"-j") == 0) && (i + 1 < argc))
+		  {
+			 if (!str2int (&workers,argv[++i]) || (workers < 1) || (workers > SIM_MAXWORKERS)) tune_usage ();
+		  }
+		else if ((strcmp (argv[i],"-P") == 0) && (i + 1 < argc))
+		  {
+			 if (!str2int (&population,argv[++i]) || (population <= TUNE_ELITE) || (population > TUNE_MAXPOPULATION)) tune_usage ();
+		  }
+		else if ((strcmp (argv[i],"-g") == 0) && (i + 1 < argc))
+		  {
+			 if (!str2int (&games,argv[++i]) || (games < 1)) tune_usage ();
+		  }
+		else if ((strcmp (argv[i],"-p") == 0) && (i + 1 < argc))
+		  {
+			 if (!str2int (&maxpieces,argv[++i]) || (maxpieces < 1)) tune_usage ();
+		  }
+		else if ((strcmp (argv[i],"-G") == 0) && (i + 1 < argc))
+		  {
+			 if (!str2int (&generations,argv[++i]) || (generations < 1)) tune_usage ();
+		  }
+		else if ((strcmp (argv[i],"-s") == 0) && (i + 1 < argc))
+		  {
+			 if (!str2int (&seed,argv[++i])) tune_usage ();
+		  }
+		else tune_usage ();
+	 }
+   if (filename == NULL) tune_usage ();
+   if ((pieces = pieces_builtin (piecesname)) == NULL)
+	 {
+		fprintf (stderr,"Unknown set of shapes %s\n",piecesname);
+		exit (EXIT_FAILURE);
+	 }
+   switch (tune_load (&tune,filename))
+	 {
+	  case -1:
+		fprintf (stderr,"Error reading %s\n",filename);
+		exit (EXIT_FAILURE);
+	  case 0:
+		/* the weights the bot has now, and others at random */
+		tune.seed = seed;
+		tune.random = seed | 1;
+		tune.population = population;
+		memcpy (tune.candidate[0].weights,botweights,sizeof (botweights));
+		for (i = 1; i < population; i++)
+		  for (j = 0; j < NUMFEATURES; j++) tune.candidate[i].weights[j] = 2 * tune_random (&tune) - 1;
+		for (i = 0; i < population; i++) tune_normalize (tune.candidate[i].weights);
+		break;
+	  default:
+		printf ("Going on from generation %d in %s\n",tune.generation,filename);
+	 }
+   if (workers > tune.population) workers = tune.population;
+   for (i = 0; !generations || (i < generations); i++)
+	 {
+		start = monotime ();
+		if (!tune_play (&tune,pieces,workers,games,maxpieces))
+		  {
+			 fprintf (stderr,"Error playing generation %d\n",tune.generation);
+			 exit (EXIT_FAILURE);
+		  }
+		took = monotime () - start;
+		for (j = 0, sum = 0; j < tune.population; j++) sum += tune.candidate[j].fitness;
+		tune_breed (&tune);
+		printf ("generation %d: best %.1f lines, mean %.1f, %.1f games/s, weights {",
+				tune.generation,tune.candidate[0].fitness,sum / tune.population,tune.population * games * 1e6 / took);
+		for (j = 0; j < NUMFEATURES; j++) printf ("%s%.6f",j ? ", " : " ",tune.candidate[0].weights[j]);
+		printf (" }\n");
+		fflush (stdout);
+		if (!tune_save (&tune,filename))
+		  {
+			 fprintf (stderr,"Error writing %s: %s\n",filename,strerror (errno));
+			 exit (EXIT_FAILURE);
+		  }
+	 }
+   exit (EXIT_SUCCESS);
+}
+
+/*
+ * Oracle
+ */
+
+/* Action sequences checked and steps a sequence has at most, unless told */
+/* otherwise */
+#define ORACLE_CASES	1000
+#define ORACLE_MAXSTEPS	1000
+
+/* Steps besides the actions of the engine: a gravity tick and garbage */
+#define ORACLE_TICK		5
+#define ORACLE_GARBAGE	6
+
+/* Size of the state of each random number generator */
+#define ORACLE_RANDOMSIZE	256
+
+/* The engine as plainly as it can be written, to check the engine against. */
+/* The resting blocks are kept apart from the shape, every rule is worked */
+/* out again from the cells at each step, and the queue is just a list. It */
+/* has its own shapes and turns them itself, so that a mistake in the */
+/* tables of the engine isn't made on both sides */
+typedef struct
+{
+   bool tetrominoes;								/* the shapes of tint, or pentominoes */
+   int numshapes;
+   int cols,rows;
+   bool shadow,shownext;
+   int level;
+   int cell[MAXCOLS][MAXROWS];						/* resting blocks, walls and floor */
+   int shape,rotation,x,y;
+   int color,numblocks;
+   block_t block[MAXBLOCKS];						/* blocks of the shape as it is turned now */
+   int shadowy;									/* row the shadow is drawn on */
+   bool drawn;										/* shape on the board, once it has moved */
+   int queue[2 * MAXSHAPES + MAXPREVIEWS];
+   int queued;
+   int score,garbage;
+   status_t status;
+} oracle_t;
+
+/* One step of a sequence: an action, a tick or arg rows of garbage */
+typedef struct
+{
+   uint8_t what,arg;
+} step_t;
+
+/* Everything a sequence starts from, worked out from its seed */
+typedef struct
+{
+   unsigned seed;
+   const pieces_t *pieces;
+   int width,height,level;
+   bool shadow,shownext;
+   int numsteps;
+   bool over;										/* game over at the last step */
+   step_t step[ORACLE_MAXSTEPS];
+} oracle_case_t;
+
+/* The tetrominoes as tint always had them, numbered as the engine numbers */
+/* them: their color and their blocks around the one they rotate about */
+static const struct
+{
+   int color;
+   block_t block[NUMBLOCKS];
+} oracle_tetrominoes[NUMSHAPES] =
+{
+   { COLOR_CYAN,    { {  1,  0 }, {  0,  0 }, {  0, -1 }, { -1, -1 } } },
+   { COLOR_GREEN,   { {  1, -1 }, {  0, -1 }, {  0,  0 }, { -1,  0 } } },
+   { COLOR_YELLOW,  { { -1,  0 }, {  0,  0 }, {  1,  0 }, {  0,  1 } } },
+   { COLOR_BLUE,    { { -1, -1 }, {  0, -1 }, { -1,  0 }, {  0,  0 } } },
+   { COLOR_MAGENTA, { { -1,  1 }, { -1,  0 }, {  0,  0 }, {  1,  0 } } },
+   { COLOR_WHITE,   { {  1,  1 }, {  1,  0 }, {  0,  0 }, { -1,  0 } } },
+   { COLOR_RED,     { { -1,  0 }, {  0,  0 }, {  1,  0 }, {  2,  0 } } }
+};
+
+/* States of the random number generators of the engine and the oracle, so */
+/* that each deals its own shapes and garbage from the same seed */
+static char oracle_state[2][ORACLE_RANDOMSIZE];
+
+static const char *oracle_steps[] = { "left", "rotate", "right", "drop", "down", "tick", "garbage" };
+
+/* Random number within range for making up sequences, apart from the */
+/* ones the games deal their shapes with */
+static int oracle_random (uint64_t *random,int range)
+{
+   *random ^= *random >> 12;
+   *random ^= *random << 25;
+   *random ^= *random >> 27;
+   return ((int) ((*random * 2685821657736338717ull >> 32) % range));
+}
+
+/* Check if a shape fits on the board at this position */
+static bool oracle_fits (const oracle_t *oracle,const block_t *block,int x,int y)
+{
+   int i,bx,by;
+   for (i = 0; i < oracle->numblocks; i++)
+	 {
+		bx = x + block[i].x;
+		by = y + block[i].y;
+		if ((bx < 1) || (bx > oracle->cols - 3) || (by < 0) || (by > oracle->rows - 3) || oracle->cell[bx][by]) return (FALSE);
+	 }
+   return (TRUE);
+}
+
+/* This rotates blocks */
+static void oracle_turn (block_t *block,int n,bool clockwise)
+{
+   int i,tmp;
+   for (i = 0; i < n; i++)
+	 {
+		tmp = block[i].x;
+		block[i].x = clockwise ? -block[i].y : block[i].y;
+		block[i].y = clockwise ? tmp : -tmp;
+	 }
+}
+
+/* Check if blocks look like the pentomino they were turned from */
+static bool oracle_unturned (const block_t *block,int shape)
+{
+   const shapedef_t *def = &PENTOMINOES[shape];
+   int i,j,dx = INT_MAX,dy = INT_MAX,ex = INT_MAX,ey = INT_MAX;
+   for (i = 0; i < def->numblocks; i++)
+	 {
+		if (block[i].x < dx) dx = block[i].x;
+		if (block[i].y < dy) dy = block[i].y;
+		if (def->block[i].x < ex) ex = def->block[i].x;
+		if (def->block[i].y < ey) ey = def->block[i].y;
+	 }
+   for (i = 0; i < def->numblocks; i++)
+	 {
+		for (j = 0; (j < def->numblocks) && ((block[i].x - dx != def->block[j].x - ex) || (block[i].y - dy != def->block[j].y - ey)); j++) ;
+		if (j == def->numblocks) return (FALSE);
+	 }
+   return (TRUE);
+}
+
+/* Rotate the blocks of the current shape the way tetris likes it (= not */
+/* mathematically correct), as tint always did. A pentomino turns the way */
+/* it is defined to until it looks the way it started, and then starts */
+/* again from its definition */
+static void oracle_rotate (const oracle_t *oracle,block_t *block,int *rotation)
+{
+   if (!oracle->tetrominoes)
+	 {
+		oracle_turn (block,oracle->numblocks,PENTOMINOES[oracle->shape].clockwise);
+		if (!oracle_unturned (block,oracle->shape)) (*rotation)++;
+		else
+		  {
+			 memcpy (block,PENTOMINOES[oracle->shape].block,oracle->numblocks * sizeof (block_t));
+			 *rotation = 0;
+		  }
+		return;
+	 }
+   switch (oracle->shape)
+	 {
+	  case 0:	/* Just rotate this one anti-clockwise and clockwise */
+		oracle_turn (block,NUMBLOCKS,*rotation);
+		*rotation = !*rotation;
+		break;
+	  case 1:	/* Just rotate these two clockwise and anti-clockwise */
+	  case 6:
+		oracle_turn (block,NUMBLOCKS,!*rotation);
+		*rotation = !*rotation;
+		break;
+	  case 2:	/* Rotate these three anti-clockwise */
+	  case 4:
+	  case 5:
+		oracle_turn (block,NUMBLOCKS,FALSE);
+		*rotation = (*rotation + 1) % 4;
+		break;
+	  case 3:	/* This one is not rotated at all */
+		break;
+	 }
+}
+
+/* Move the shadow as far down as the shape fits */
+static void oracle_shadow (oracle_t *oracle)
+{
+   if (!oracle->shadow) return;
+   for (oracle->shadowy = oracle->y; oracle_fits (oracle,oracle->block,oracle->x,oracle->shadowy + 1); oracle->shadowy++) ;
+}
+
+/* shuffle int array, as tint always did */
+static void oracle_shuffle (int *array,size_t n)
+{
+   size_t i,j;
+   int t;
+   for (i = 0; i < n - 1; i++)
+	 {
+		j = i + rand_value ((int) (n - i));
+		t = array[j];
+		array[j] = array[i];
+		array[i] = t;
+	 }
+}
+
+/* Take the next shape, putting a bag of every shape in the queue whenever */
+/* it runs low. Tetrominoes appear on the second row, and pentominoes low */
+/* enough to be turned every way */
+static void oracle_next (oracle_t *oracle)
+{
+   block_t block[MAXBLOCKS];
+   int i,n = oracle->numshapes,rotation;
+   while (oracle->queued <= MAXPREVIEWS)
+	 {
+		for (i = 0; i < n; i++) oracle->queue[oracle->queued + i] = i;
+		oracle_shuffle (oracle->queue + oracle->queued,n);
+		oracle->queued += n;
+	 }
+   oracle->shape = oracle->queue[0];
+   memmove (oracle->queue,oracle->queue + 1,--oracle->queued * sizeof (int));
+   oracle->rotation = 0;
+   oracle->x = (oracle->cols - 3) / 2;
+   oracle->y = 1;
+   if (oracle->tetrominoes)
+	 {
+		oracle->color = oracle_tetrominoes[oracle->shape].color;
+		oracle->numblocks = NUMBLOCKS;
+		memcpy (oracle->block,oracle_tetrominoes[oracle->shape].block,sizeof (oracle_tetrominoes[0].block));
+	 }
+   else
+	 {
+		oracle->color = PENTOMINOES[oracle->shape].color;
+		oracle->numblocks = PENTOMINOES[oracle->shape].numblocks;
+		memcpy (oracle->block,PENTOMINOES[oracle->shape].block,oracle->numblocks * sizeof (block_t));
+		memcpy (block,oracle->block,sizeof (block));
+		rotation = 0;
+		do
+		  {
+			 for (i = 0; i < oracle->numblocks; i++) if (-block[i].y > oracle->y) oracle->y = -block[i].y;
+			 oracle_rotate (oracle,block,&rotation);
+		  }
+		while (rotation);
+	 }
+   oracle->shadowy = oracle->y;
+   oracle->drawn = FALSE;
+}
+
+static void oracle_init (oracle_t *oracle,const oracle_case_t *c)
+{
+   int x,y;
+   memset (oracle,0,sizeof (oracle_t));
+   oracle->tetrominoes = c->pieces == pieces_builtin ("tetrominoes");
+   oracle->numshapes = oracle->tetrominoes ? NUMSHAPES : sizeof (PENTOMINOES) / sizeof (PENTOMINOES[0]);
+   oracle->cols = c->width + 3;
+   oracle->rows = c->height + 3;
+   oracle->shadow = c->shadow;
+   oracle->shownext = c->shownext;
+   oracle->level = c->level;
+   for (x = 0; x < oracle->cols; x++)
+	 for (y = 0; y < oracle->rows; y++)
+	   if ((x == 0) || (x >= oracle->cols - 2) || (y >= oracle->rows - 2)) oracle->cell[x][y] = WALL;
+   oracle_next (oracle);
+}
+
+static void oracle_move (oracle_t *oracle,action_t action)
+{
+   block_t block[MAXBLOCKS];
+   int rotation = oracle->rotation;
+   oracle->drawn = TRUE;
+   switch (action)
+	 {
+	  case ACTION_LEFT:
+	  case ACTION_RIGHT:
+		oracle->status.keys++;
+		if (oracle_fits (oracle,oracle->block,oracle->x + (action == ACTION_LEFT ? -1 : 1),oracle->y))
+		  {
+			 oracle->x += action == ACTION_LEFT ? -1 : 1;
+			 oracle->status.moves++;
+			 oracle_shadow (oracle);
+		  }
+		break;
+	  case ACTION_ROTATE:
+		oracle->status.keys++;
+		memcpy (block,oracle->block,sizeof (block));
+		oracle_rotate (oracle,block,&rotation);
+		if (oracle_fits (oracle,block,oracle->x,oracle->y))
+		  {
+			 memcpy (oracle->block,block,sizeof (block));
+			 oracle->rotation = rotation;
+			 oracle->status.rotations++;
+			 oracle_shadow (oracle);
+		  }
+		break;
+	  case ACTION_DOWN:
+		if (oracle_fits (oracle,oracle->block,oracle->x,oracle->y + 1))
+		  {
+			 oracle->y++;
+			 oracle->status.moves++;
+			 oracle_shadow (oracle);
+		  }
+		break;
+	  case ACTION_DROP:
+		/* with a shadow, the shape goes where the shadow is, even if the */
+		/* shadow hasn't been worked out since the shape appeared */
+		if (oracle->shadow)
+		  {
+			 oracle->status.dropcount += oracle->shadowy - oracle->y;
+			 oracle->y = oracle->shadowy;
+		  }
+		else while (oracle_fits (oracle,oracle->block,oracle->x,oracle->y + 1))
+		  {
+			 oracle->y++;
+			 oracle->status.dropcount++;
+		  }
+	 }
+}
+
+/* Let the shape fall a row, or put it to rest. Returns what engine_evaluate() does */
+static int oracle_tick (oracle_t *oracle)
+{
+   int i,x,y,ny,lines = 0,score,rotations,hole;
+   bool full,overflow = FALSE;
+   oracle->drawn = TRUE;
+   if (oracle_fits (oracle,oracle->block,oracle->x,oracle->y + 1))
+	 {
+		oracle->y++;
+		oracle_shadow (oracle);
+		return (1);
+	 }
+   for (i = 0; i < oracle->numblocks; i++) oracle->cell[oracle->x + oracle->block[i].x][oracle->y + oracle->block[i].y] = oracle->color;
+   /* rows that are not full move down over the full ones, and everything */
+   /* above them is emptied, the hidden top row included */
+   for (y = ny = oracle->rows - 3; y > 0; y--)
+	 {
+		for (x = 1, full = TRUE; x < oracle->cols - 2; x++) if (!oracle->cell[x][y]) full = FALSE;
+		if (full) lines++;
+		else
+		  {
+			 for (x = 1; x < oracle->cols - 2; x++) oracle->cell[x][ny] = oracle->cell[x][y];
+			 ny--;
+		  }
+	 }
+   for (y = 0; y <= ny; y++) for (x = 1; x < oracle->cols - 2; x++) oracle->cell[x][y] = 0;
+   oracle->status.droppedlines += lines;
+   oracle->status.currentdroppedlines = lines;
+   /* garbage only comes in when no lines were cleared */
+   if (!lines && oracle->garbage)
+	 {
+		hole = 1 + rand_value (oracle->cols - 3);
+		if (oracle->garbage > oracle->rows - 3) oracle->garbage = oracle->rows - 3;
+		for (y = 1; y < oracle->rows - 2; y++)
+		  for (x = 1; x < oracle->cols - 2; x++)
+			{
+			   if ((y <= oracle->garbage) && oracle->cell[x][y]) overflow = TRUE;
+			   if (y < oracle->rows - 2 - oracle->garbage) oracle->cell[x][y] = oracle->cell[x][y + oracle->garbage];
+			   else oracle->cell[x][y] = x == hole ? 0 : GARBAGE;
+			}
+		oracle->garbage = 0;
+	 }
+   score = SCOREVAL (oracle->level * (oracle->status.dropcount + 1)) + SCOREVAL ((oracle->level + 10) * lines * lines);
+   oracle->score += oracle->shownext ? score / 2 : score;
+   rotations = 4 - oracle->status.rotations;
+   if (rotations > 0) rotations = 0;
+   oracle->status.efficiency = (oracle->status.efficiency + oracle->status.dropcount + rotations +
+								abs (oracle->x - (oracle->cols - 3) / 2) - oracle->status.moves) >> 1;
+   oracle->status.moves = oracle->status.rotations = oracle->status.dropcount = oracle->status.keys = 0;
+   oracle_next (oracle);
+   return (!overflow && oracle_fits (oracle,oracle->block,oracle->x,oracle->y) ? 0 : -1);
+}
+
+/* What the board of the engine should look like: the resting blocks, and */
+/* the shadow and the shape once the shape has moved */
+static void oracle_view (const oracle_t *oracle,board_t view)
+{
+   int i;
+   for (i = 0; i < oracle->cols; i++) memcpy (view[i],oracle->cell[i],oracle->rows * sizeof (int));
+   if (oracle->drawn)
+	 for (i = 0; i < oracle->numblocks; i++)
+	   {
+		  if (oracle->shadow) view[oracle->x + oracle->block[i].x][oracle->shadowy + oracle->block[i].y] = oracle->color;
+		  view[oracle->x + oracle->block[i].x][oracle->y + oracle->block[i].y] = oracle->color;
+	   }
+}
+
+/* Character a cell is printed as */
+static char oracle_glyph (int cell)
+{
+   return (cell == WALL ? '#' : cell == GARBAGE ? '=' : (cell >= 0) && (cell < 8) ? ".1234567"[cell] : '?');
+}
+
+/* Print the board of the engine and the oracle next to each other */
+static void oracle_board (char *buf,size_t size,const engine_t *engine,const oracle_t *oracle,board_t view)
+{
+   int x,y,len = snprintf (buf,size,"  engine%*s oracle\n",oracle->cols - 3,"");
+   for (y = 0; (y < oracle->rows - 1) && (len < size); y++)
+	 {
+		len += snprintf (buf + len,size - len,"  ");
+		for (x = 0; x < oracle->cols - 1; x++) buf[len++] = oracle_glyph (engine->board[x][y]);
+		len += snprintf (buf + len,size - len,"  ");
+		for (x = 0; x < oracle->cols - 1; x++) buf[len++] = oracle_glyph (view[x][y]);
+		len += snprintf (buf + len,size - len,"\n");
+	 }
+}
+
+/* Compare the engine with the oracle. Returns FALSE and describes the */
+/* first difference if they don't agree */
+static bool oracle_compare (const engine_t *engine,const oracle_t *oracle,char *buf,size_t size)
+{
+   static board_t view;
+   const int values[][2] =
+	 {
+		{ engine->curshape, oracle->shape },
+		{ engine->nextshape, oracle->queue[0] },
+		{ engine->rotation, oracle->rotation },
+		{ engine->curx, oracle->x },
+		{ engine->cury, oracle->y },
+		{ oracle->shadow ? engine->cury_shadow : 0, oracle->shadow ? oracle->shadowy : 0 },
+		{ engine->score, oracle->score },
+		{ engine->garbage, oracle->garbage },
+		{ engine->status.moves, oracle->status.moves },
+		{ engine->status.rotations, oracle->status.rotations },
+		{ engine->status.dropcount, oracle->status.dropcount },
+		{ engine->status.efficiency, oracle->status.efficiency },
+		{ engine->status.droppedlines, oracle->status.droppedlines },
+		{ engine->status.currentdroppedlines, oracle->status.currentdroppedlines },
+		{ engine->status.keys, oracle->status.keys }
+	 };
+   static const char *names[] =
+	 {
+		"shape", "next shape", "rotation", "column", "row", "shadow row", "score", "garbage",
+		"moves", "rotations", "dropcount", "efficiency", "droppedlines", "currentdroppedlines", "keys"
+	 };
+   int i,x,y,len;
+   oracle_view (oracle,view);
+   for (x = 0; x < oracle->cols; x++)
+	 if (memcmp (engine->board[x],view[x],oracle->rows * sizeof (int)))
+	   {
+		  for (y = 0; engine->board[x][y] == view[x][y]; y++) ;
+		  if (buf != NULL)
+			{
+			   len = snprintf (buf,size,"board at column %d, row %d: engine %d, oracle %d\n",x,y,engine->board[x][y],view[x][y]);
+			   oracle_board (buf + len,size - len,engine,oracle,view);
+			}
+		  return (FALSE);
+	   }
+   for (i = 0; i < sizeof (values) / sizeof (values[0]); i++)
+	 if (values[i][0] != values[i][1])
+	   {
+		  if (buf != NULL) snprintf (buf,size,"%s: engine %d, oracle %d\n",names[i],values[i][0],values[i][1]);
+		  return (FALSE);
+	   }
+   return (TRUE);
+}
+
+/* Start the game of a sequence on the engine */
+static void oracle_start (engine_t *engine,const oracle_case_t *c)
+{
+   memset (engine,0,sizeof (engine_t));
+   engine_init (engine,score_function);
+   engine_resize (engine,c->width,c->height);
+   engine_pieces (engine,c->pieces);
+   engine->shadow = c->shadow;
+   engine->shownext = c->shownext;
+   engine->level = c->level;
+   /* deal the first bag again, from the random numbers of the engine */
+   initstate (c->seed,oracle_state[0],ORACLE_RANDOMSIZE);
+   fillbag (engine);
+}
+
+/* Play a step on the engine. Returns what engine_evaluate() does for a */
+/* tick, 1 for anything else */
+static int oracle_play (engine_t *engine,const step_t *step)
+{
+   setstate (oracle_state[0]);
+   if (step->what == ORACLE_TICK) return (engine_evaluate (engine));
+   if (step->what == ORACLE_GARBAGE) engine_garbage (engine,step->arg);
+   else engine_move (engine,step->what);
+   return (1);
+}
+
+/* Check that engine_apply() puts the shape where the engine just put it to */
+/* rest, from the state before, and that engine_undo() takes it back. */
+/* Returns FALSE and describes the difference in buf unless it is NULL */
+static bool oracle_apply (const engine_t *engine,const state_t *before,char *buf,size_t size)
+{
+   const place_t place = { before->x, before->y, before->rotation };
+   state_t state = *before,after;
+   undo_t undo;
+   int i,lines;
+   engine_snapshot (engine,&after);
+   lines = engine_apply (engine,&state,&place,&undo);
+   for (i = 1; (i < state.cols - 2) && (state.column[i] == after.column[i]); i++) ;
+   if ((i < state.cols - 2) || (lines != engine->status.currentdroppedlines) || (state.lines != after.lines) ||
+	   (state.shape != after.shape) || (state.rotation != after.rotation) || (state.x != after.x) || (state.y != after.y))
+	 {
+		if (buf != NULL) snprintf (buf,size,"engine_apply() left a different board or shape than the engine\n");
+		return (FALSE);
+	 }
+   engine_undo (engine,&state,&undo);
+   for (i = 1; (i < state.cols - 2) && (state.column[i] == before->column[i]); i++) ;
+   if ((i < state.cols - 2) || (state.lines != before->lines) || (state.queuehead != before->queuehead) ||
+	   (state.shape != before->shape) || (state.rotation != before->rotation) || (state.x != before->x) || (state.y != before->y))
+	 {
+		if (buf != NULL) snprintf (buf,size,"engine_undo() didn't take back what engine_apply() did\n");
+		return (FALSE);
+	 }
+   return (TRUE);
+}
+
+/* Play steps on the engine and the oracle side by side. Returns the number */
+/* of steps after which they first disagreed (0 if they already did when */
+/* the game started), or -1 if they never did. The difference is described */
+/* in buf unless it is NULL */
+static int oracle_run (const oracle_case_t *c,const step_t *step,int n,char *buf,size_t size)
+{
+   static engine_t engine;
+   static oracle_t oracle;
+   state_t before;
+   int i,result,expected;
+   bool apply;
+   oracle_start (&engine,c);
+   initstate (c->seed,oracle_state[1],ORACLE_RANDOMSIZE);
+   oracle_init (&oracle,c);
+   if (!oracle_compare (&engine,&oracle,buf,size)) return (0);
+   for (i = 0; i < n; i++)
+	 {
+		/* engine_apply() leaves garbage out, so only shapes put to rest */
+		/* without any waiting are checked against it */
+		if ((apply = (step[i].what == ORACLE_TICK) && !engine.garbage)) engine_snapshot (&engine,&before);
+		result = oracle_play (&engine,&step[i]);
+		if (apply && !result && !oracle_apply (&engine,&before,buf,size)) return (i + 1);
+		setstate (oracle_state[1]);
+		expected = 1;
+		if (step[i].what == ORACLE_TICK) expected = oracle_tick (&oracle);
+		else if (step[i].what == ORACLE_GARBAGE) oracle.garbage += step[i].arg;
+		else oracle_move (&oracle,step[i].what);
+		if (result != expected)
+		  {
+			 if (buf != NULL) snprintf (buf,size,"engine_evaluate() returned %d, oracle %d\n",result,expected);
+			 return (i + 1);
+		  }
+		if (!oracle_compare (&engine,&oracle,buf,size)) return (i + 1);
+		if (result < 0) break;
+	 }
+   return (-1);
+}
+
+/* Add a step to a sequence and play it on the engine. Returns FALSE once */
+/* the sequence is long enough or the game is over */
+static bool oracle_add (oracle_case_t *c,engine_t *engine,int maxsteps,int what,int arg)
+{
+   if ((c->numsteps >= maxsteps) || c->over) return (FALSE);
+   c->step[c->numsteps].what = what;
+   c->step[c->numsteps].arg = arg;
+   c->over = oracle_play (engine,&c->step[c->numsteps++]) < 0;
+   return (!c->over);
+}
+
+/* Work out the board, the options and the steps of a sequence from its */
+/* seed. The steps are played on the engine as they are made up, so that */
+/* the bot can take some of the shapes to good places and lines get cleared */
+static void oracle_make (oracle_case_t *c,unsigned seed,int maxsteps)
+{
+   static engine_t engine;
+   uint64_t random = seed * 2685821657736338717ull | 1;
+   plan_t plan;
+   action_t action;
+   int n,r;
+   c->seed = seed;
+   c->pieces = pieces_builtin (oracle_random (&random,4) ? "tetrominoes" : "pentominoes");
+   /* half the games on the default board, which the engine has a copy of */
+   /* its board code for */
+   c->width = oracle_random (&random,2) ? NUMCOLS - 3 : c->pieces->minwidth + oracle_random (&random,MAXWIDTH - c->pieces->minwidth + 1);
+   c->height = c->width == NUMCOLS - 3 ? NUMROWS - 3 : MINHEIGHT + oracle_random (&random,MAXHEIGHT - MINHEIGHT + 1);
+   c->level = MINLEVEL + oracle_random (&random,MAXLEVEL);
+   c->shadow = oracle_random (&random,2);
+   c->shownext = oracle_random (&random,2);
+   c->numsteps = 0;
+   c->over = FALSE;
+   oracle_start (&engine,c);
+   plan.piece = -1;
+   while ((c->numsteps < maxsteps) && !c->over)
+	 {
+		r = oracle_random (&random,100);
+		if (r < 4) oracle_add (c,&engine,maxsteps,ORACLE_GARBAGE,1 + oracle_random (&random,4));
+		/* a key or tick at random */
+		else if (r < 30) oracle_add (c,&engine,maxsteps,oracle_random (&random,ORACLE_GARBAGE),0);
+		/* a shape taken where the bot would put it, now and then falling a row */
+		else if (r < 70)
+		  do
+			{
+			   if (!oracle_random (&random,8) && !oracle_add (c,&engine,maxsteps,ORACLE_TICK,0)) break;
+			   action = bot_action (&engine,&plan);
+			}
+		  while (oracle_add (c,&engine,maxsteps,action,0) && (action != ACTION_DROP));
+		/* a shape taken to a column at random */
+		else
+		  {
+			 for (n = oracle_random (&random,MAXROTATIONS); n && oracle_add (c,&engine,maxsteps,ACTION_ROTATE,0); n--) ;
+			 r = oracle_random (&random,2) ? ACTION_LEFT : ACTION_RIGHT;
+			 for (n = oracle_random (&random,c->width / 2 + 2); n && oracle_add (c,&engine,maxsteps,r,0); n--) ;
+			 for (n = oracle_random (&random,3); n && oracle_add (c,&engine,maxsteps,ORACLE_TICK,0); n--) ;
+			 oracle_add (c,&engine,maxsteps,ACTION_DROP,0);
+		  }
+		oracle_add (c,&engine,maxsteps,ORACLE_TICK,0);
+	 }
+}
+
+/* Take out as many steps as possible while the engine and the oracle still */
+/* disagree, first in large chunks and then in smaller ones. Returns the */
+/* number of steps left */
+static int oracle_minimize (const oracle_case_t *c,step_t *step,int n)
+{
+   static step_t test[ORACLE_MAXSTEPS];
+   int i,chunk,result;
+   for (chunk = n / 2; chunk > 0; chunk /= 2)
+	 for (i = 0; i + chunk <= n; )
+	   {
+		  memcpy (test,step,i * sizeof (step_t));
+		  memcpy (test + i,step + i + chunk,(n - i - chunk) * sizeof (step_t));
+		  if ((result = oracle_run (c,test,n - chunk,NULL,0)) >= 0)
+			{
+			   memcpy (step,test,result * sizeof (step_t));
+			   n = result;
+			}
+		  else i += chunk;
+	   }
+   return (n);
+}
+
+/* Print a sequence the engine and the oracle disagree on */
+static void oracle_report (const oracle_case_t *c,int diverged)
+{
+   static step_t step[ORACLE_MAXSTEPS];
+   char buf[MAXCOLS * 2 * MAXROWS + 4096];
+   int i,n;
+   memcpy (step,c->step,diverged * sizeof (step_t));
+   n = oracle_minimize (c,step,diverged);
+   oracle_run (c,step,n,buf,sizeof (buf));
+   printf ("Sequence %u disagrees after %d steps: %dx%d board, %s, level %d%s%s\n",
+		   c->seed,diverged,c->width,c->height,c->pieces == pieces_builtin ("tetrominoes") ? "tetrominoes" : "pentominoes",
+		   c->level,c->shadow ? ", shadow" : "",c->shownext ? ", next shape" : "");
+   printf ("  %d steps do it as well:",n);
+   for (i = 0; i < n; i++)
+	 if (step[i].what == ORACLE_GARBAGE) printf (" garbage %d",step[i].arg);
+	 else printf (" %s",oracle_steps[step[i].what]);
+   printf ("\n  %s",buf);
+   printf ("  Check it again with: tint-oracle -s %u -g 1 -p %d\n",c->seed,diverged);
+   fflush (stdout);
+}
+
+/* Check the sequences from seed on, every so many of them. The number of */
+/* sequences and steps checked is written to fd. Returns FALSE at the first */
+/* one the engine and the oracle disagree on */
+static bool oracle_worker (int fd,unsigned seed,int cases,int every,int maxsteps)
+{
+   static oracle_case_t c;
+   long count[2] = { 0, 0 };
+   int i,diverged;
+   for (i = 0; i < cases; i += every)
+	 {
+		oracle_make (&c,seed + i,maxsteps);
+		diverged = oracle_run (&c,c.step,c.numsteps,NULL,0);
+		if (diverged >= 0)
+		  {
+			 oracle_report (&c,diverged);
+			 return (FALSE);
+		  }
+		count[0]++;
+		count[1] += c.numsteps;
+	 }
+   /* a write this small to a pipe is atomic, so the workers share one */
+   return (write (fd,count,sizeof (count)) == sizeof (count));
+}
+
+/* Number of ticks of the spectator stream check, and the frames they can make */
+#define ORACLE_WATCHTICKS	1000
+#define ORACLE_WATCHFRAMES	(2 * (ORACLE_WATCHTICKS + 4 * WATCH_FRAMES))
+
+/* Check if the boards a spectator sees are the ones broadcast */
+static bool oracle_sameboards (const player_t *players,const view_t *view,int n)
+{
+   int i,x;
+   for (i = 0; i < n; i++)
+	 {
+		if ((players[i].human != view[i].field[WF_HUMAN]) || (players[i].engine.curx != view[i].field[WF_CURX]) ||
+			(players[i].engine.cury != view[i].field[WF_CURY]) || (players[i].engine.curshape != view[i].field[WF_CURSHAPE]) ||
+			(players[i].engine.nextshape != view[i].field[WF_NEXTSHAPE]) || (GETSCORE (players[i].engine.score) != view[i].field[WF_SCORE]) ||
+			(players[i].engine.level != view[i].field[WF_LEVEL]) || (players[i].engine.status.droppedlines != view[i].field[WF_LINES]) ||
+			(players[i].engine.garbage != view[i].field[WF_GARBAGE]))
+		  return (FALSE);
+		for (x = 0; x < NUMCOLS; x++) if (memcmp (players[i].engine.board[x],view[i].board[x],sizeof (view[i].board[x]))) return (FALSE);
+	 }
+   return (TRUE);
+}
+
+/* Read what the broadcast sent the spectator so far and apply every complete */
+/* frame, as watch() does. After each frame the boards have to be the ones of */
+/* a frame made no earlier than the one matched before. Returns the number */
+/* of boards, or -1 if the stream is damaged or out of order */
+static int oracle_watch (int fd,player_t *players,int n,unsigned char *buf,size_t *have,view_t (*made)[2],uint64_t nummade,uint64_t *at)
+{
+   size_t len,pos;
+   ssize_t got;
+   while ((got = recv (fd,buf + *have,2 * FRAME_MAXSIZE - *have,MSG_DONTWAIT)) > 0) *have += got;
+   for (pos = 0; (*have - pos >= FRAME_HDRSIZE) && (*have - pos >= FRAME_HDRSIZE + (len = get_u32 (buf + pos))); pos += FRAME_HDRSIZE + len)
+	 {
+		if ((len > FRAME_MAXSIZE) || ((n = watchframe (players,n,buf[pos + 4],buf + pos + FRAME_HDRSIZE,buf + pos + FRAME_HDRSIZE + len)) < 0))
+		  return (-1);
+		while ((*at < nummade) && !oracle_sameboards (players,made[*at],n)) (*at)++;
+		if (*at == nummade) return (-1);
+	 }
+   if ((*have - pos >= FRAME_HDRSIZE) && (get_u32 (buf + pos) > FRAME_MAXSIZE)) return (-1);
+   memmove (buf,buf + pos,*have - pos);
+   *have -= pos;
+   return (n);
+}
+
+/* Change boards at random every tick and broadcast them to a spectator */
+/* that stops reading in the middle of a frame for longer than the ring */
+/* holds frames, and check that it only ever sees boards that were */
+/* broadcast, in order, and ends up with the last ones. Returns FALSE if not */
+static bool oracle_spectator (unsigned seed)
+{
+   static broadcast_t bc;
+   static player_t players[MAXBOARDS];
+   static unsigned char buf[2 * FRAME_MAXSIZE];
+   static view_t made[ORACLE_WATCHFRAMES][2];
+   spectator_t *s = bc.spectators;
+   uint64_t random = seed * 2654435761u + 1,seq,at = 0;
+   size_t have = 0;
+   int i,j,k,x,tick,fd[2],n = 0,size = 1,stalled = -1;
+   bool ok = TRUE;
+   memset (&bc,0,sizeof (bc));
+   bc.n = 2;
+   /* a socket nobody connects to, so that no other spectators turn up */
+   if ((bc.fd = socket (AF_UNIX,SOCK_STREAM | SOCK_NONBLOCK,0)) < 0) return (FALSE);
+   if (socketpair (AF_UNIX,SOCK_STREAM,0,fd) < 0)
+	 {
+		close (bc.fd);
+		return (FALSE);
+	 }
+   setsockopt (fd[0],SOL_SOCKET,SO_SNDBUF,&size,sizeof (size));
+   s->fd = fd[0];
+   bc.nspectators = 1;
+   for (tick = 0; ok && (tick < ORACLE_WATCHTICKS + 4 * WATCH_FRAMES); tick++)
+	 {
+		if (tick < ORACLE_WATCHTICKS)
+		  for (i = 0; i < bc.n; i++)
+			{
+			   for (j = 0; j < NUMFIELDS; j++) if (!oracle_random (&random,4))
+				 bc.next[i].field[j] = oracle_random (&random,(j == WF_CURSHAPE) || (j == WF_NEXTSHAPE) ? NUMSHAPES : 1000);
+			   for (k = oracle_random (&random,NUMCOLS * NUMROWS / 2); k > 0; k--)
+				 {
+					x = oracle_random (&random,NUMCOLS * NUMROWS);
+					bc.next[i].board[x / NUMROWS][x % NUMROWS] = oracle_random (&random,NUM_COLORS);
+				 }
+			}
+		seq = bc.seq;
+		broadcast_flush (&bc);
+		for (; seq < bc.seq; seq++) memcpy (made[seq],bc.sent,sizeof (made[seq]));
+		/* a quarter of the way through, read now and then so that frames */
+		/* pile up and go out many at once, until the kernel takes part of */
+		/* one. Then stop reading until the ring went round twice */
+		if ((stalled < 0) && (tick >= ORACLE_WATCHTICKS / 4) && (s->frame != NULL) && s->sent) stalled = tick;
+		if ((tick < ORACLE_WATCHTICKS / 4) || (stalled < 0 ? !(tick % 16) : tick > stalled + 2 * WATCH_FRAMES))
+		  ok = (n = oracle_watch (fd[1],players,n,buf,&have,made,bc.seq,&at)) >= 0;
+	 }
+   if (!ok) printf ("Spectator stream check %u: the spectator saw boards that weren't broadcast\n",seed);
+   else if (stalled < 0)
+	 {
+		printf ("Spectator stream check %u never stalled in the middle of a frame\n",seed);
+		ok = FALSE;
+	 }
+   else if ((n != bc.n) || have || (s->frame != NULL) || (s->seq != bc.seq) || !oracle_sameboards (players,bc.sent,n))
+	 {
+		printf ("Spectator stream check %u: the spectator didn't catch up\n",seed);
+		ok = FALSE;
+	 }
+   close (fd[0]);
+   close (fd[1]);
+   close (bc.fd);
+   if (s->frame != NULL) dropframe (s->frame);
+   for (i = 0; i < WATCH_FRAMES; i++) if (bc.ring[i] != NULL) dropframe (bc.ring[i]);
+   return (ok);
+}
+
+static void oracle_usage ()
+{
+   fprintf (stderr,"USAGE: tint-oracle [-j workers] [-g count] [-p count] [-s seed]\n");
+   fprintf (stderr,"  -j <workers> Number of sequences checked at the same time (default: one per processor)\n");
+   fprintf (stderr,"  -g <count>   Number of sequences to check (default %d)\n",ORACLE_CASES);
+   fprintf (stderr,"  -p <count>   Most steps in a sequence (default %d)\n",ORACLE_MAXSTEPS);
+   fprintf (stderr,"  -s <seed>    Seed of the first sequence\n");
+   exit (EXIT_FAILURE);
+}
+
+/*
+ * Oracle: plays random sequences of actions, gravity ticks and garbage on
+ * the engine and on a plain copy of its rules, and checks the board, the
+ * score and the status after every step, and engine_apply() and
+ * engine_undo() whenever a shape comes to rest. The first sequence they disagree
+ * on is cut down to as few steps as possible and printed. It then checks
+ * that a spectator that stalls ends up with the boards that were broadcast
+ */
+int tintoracle_main (int argc,char *argv[])
+{
+   pid_t pid[SIM_MAXWORKERS];
+   long count[2],cases = 0,steps = 0;
+   int64_t start,took;
+   int i,fd[2],status,workers = sysconf (_SC_NPROCESSORS_ONLN),numcases = ORACLE_CASES,maxsteps = ORACLE_MAXSTEPS,seed = time (NULL);
+   bool ok = TRUE;
+   for (i = 1; i < argc; i++)
+	 {
+		if ((strcmp (argv[i],"-j") == 0) && (i + 1 < argc))
+		  {
+			 if (!str2int (&workers,argv[++i]) || (workers < 1) || (workers > SIM_MAXWORKERS)) oracle_usage ();
+		  }
+		else if ((strcmp (argv[i],"-g") == 0) && (i + 1 < argc))
+		  {
+			 if (!str2int (&numcases,argv[++i]) || (numcases < 1)) oracle_usage ();
+		  }
+		else if ((strcmp (argv[i],"-p") == 0) && (i + 1 < argc))
+		  {
+			 if (!str2int (&maxsteps,argv[++i]) || (maxsteps < 1) || (maxsteps > ORACLE_MAXSTEPS)) oracle_usage ();
+		  }
+		else if ((strcmp (argv[i],"-s") == 0) && (i + 1 < argc))
+		  {
+			 if (!str2int (&seed,argv[++i])) oracle_usage ();
+		  }
+		else oracle_usage ();
+	 }
+   if (workers > numcases) workers = numcases;
+   if (workers > SIM_MAXWORKERS) workers = SIM_MAXWORKERS;
+   if (pipe (fd) < 0)
+	 {
+		fprintf (stderr,"Error starting the workers: %s\n",strerror (errno));
+		exit (EXIT_FAILURE);
+	 }
+   start = monotime ();
+   for (i = 0; i < workers; i++)
+	 {
+		if ((pid[i] = fork ()) == 0)
+		  {
+			 close (fd[0]);
+			 _exit (oracle_worker (fd[1],seed + i,numcases - i,workers,maxsteps) ? EXIT_SUCCESS : EXIT_FAILURE);
+		  }
+		if (pid[i] < 0)
+		  {
+			 fprintf (stderr,"Error starting a worker: %s\n",strerror (errno));
+			 exit (EXIT_FAILURE);
+		  }
+	 }
+   close (fd[1]);
+   while (read (fd[0],count,sizeof (count)) == sizeof (count))
+	 {
+		cases += count[0];
+		steps += count[1];
+	 }
+   close (fd[0]);
+   for (i = 0; i < workers; i++)
+	 if ((waitpid (pid[i],&status,0) < 0) || !WIFEXITED (status) || (WEXITSTATUS (status) != EXIT_SUCCESS)) ok = FALSE;
+   took = monotime () - start;
+   if (!ok || !oracle_spectator (seed))
+	 {
+		fprintf (stderr,"The sequences were made up from seed %d on\n",seed);
+		exit (EXIT_FAILURE);
+	 }
+   printf ("%ld sequences of up to %d steps agree (%ld steps in %.2f s with %d workers, %.0f steps/s)\n",
+		   cases,maxsteps,steps,took / 1e6,workers,steps * 1e6 / took);
+   exit (EXIT_SUCCESS);
+}
+
+/*
+ * Index of positions
+ */
+
+/* Most replays in an index */
+#define INDEX_MAXGAMES	(1 << 24)
+
+/* Add an entry to the shard of a worker. Returns FALSE if it can't be written */
+static bool index_add (FILE *fp,uint64_t hash,uint32_t game,uint32_t piece)
+{
+   tintindex_entry_t entry = { hash, game, piece };
+   return (fwrite (&entry,sizeof (entry),1,fp) == 1);
+}
+
+/* Play a replay back without drawing it and add the board after every */
+/* shape that came to rest to the shard of a worker. Returns the number of */
+/* entries added, -1 if the replay can't be read */
+static long index_replay (FILE *fp,const char *filename,uint32_t game)
+{
+   replay_t replay;
+   engine_t engine;
+   state_t state;
+   uint64_t row[MAXHEIGHT];
+   int64_t ms;
+   int event,x,y,width,height,stack[TINTINDEX_TOPOUTSHAPES + 1];
+   unsigned first,last;
+   long count = 0;
+   bool finished = FALSE,ok = TRUE;
+   if (!replay_open (&replay,filename)) return (-1);
+   if (!replay_start (&replay,&engine))
+	 {
+		replay_close (&replay);
+		return (-1);
+	 }
+   width = engine.cols - 3;
+   height = engine.rows - 3;
+   first = last = engine.queuehead;
+   while (ok && !finished && replay_next (&replay,&event,&ms))
+	 {
+		/* what is shown doesn't change the board */
+		if ((event == EVENT_NEXT) || (event == EVENT_HINT) || (event == EVENT_LINES)) continue;
+		finished = play (&engine,event);
+		/* shapes taken back in practice mode are indexed again when they */
+		/* are put down again */
+		if (engine.queuehead <= last)
+		  {
+			 last = engine.queuehead;
+			 continue;
+		  }
+		last = engine.queuehead;
+		/* the next shape isn't on the board yet, unless it didn't fit */
+		engine_snapshot (&engine,&state);
+		for (y = 0; y < height; y++)
+		  for (x = 0, row[y] = 0; x < width; x++)
+			if (finished ? engine.board[x + 1][y + 1] : state.column[x + 1] & ROW (y + 1)) row[y] |= 1ull << x;
+		/* keep the heights since the one the top out is indexed by */
+		stack[(last - first) % (TINTINDEX_TOPOUTSHAPES + 1)] = tintindex_height (width,height,row);
+		ok = index_add (fp,tintindex_board (width,height,row),game,last - first) &&
+		  index_add (fp,tintindex_surface (width,height,row),game,last - first);
+		count += 2;
+	 }
+   if (ok && finished && (last - first > TINTINDEX_TOPOUTSHAPES))
+	 {
+		ok = index_add (fp,tintindex_topout (width,height,stack[(last - first - TINTINDEX_TOPOUTSHAPES) % (TINTINDEX_TOPOUTSHAPES + 1)]),game,last - first);
+		count++;
+	 }
+   replay_close (&replay);
+   /* every replay starts afresh, practicing or not */
+   free (practice.buffer);
+   practice.buffer = NULL;
+   return (ok ? count : -1);
+}
+
+/* Index every replay from the first on, skipping as many as there are */
+/* workers after each one, to a shard of its own. Returns the number of */
+/* entries written, -1 if an error occurred */
+static long index_worker (const char *shard,char **name,int numgames,int first,int workers)
+{
+   FILE *fp;
+   long count = 0,n;
+   int i;
+   if ((fp = fopen (shard,"w")) == NULL) return (-1);
+   setvbuf (fp,NULL,_IOFBF,SIM_BUFSIZE);
+   for (i = first; i < numgames; i += workers)
+	 {
+		if ((n = index_replay (fp,name[i],i)) < 0)
+		  {
+			 fprintf (stderr,"Error reading %s: %s\n",name[i],errno ? strerror (errno) : "Not a replay");
+			 fclose (fp);
+			 return (-1);
+		  }
+		count += n;
+	 }
+   return (fclose (fp) == 0 ? count : -1);
+}
+
+/* Compare entries by their hash, then where they are */
+static int index_compare (const void *a,const void *b)
+{
+   const tintindex_entry_t *x = a,*y = b;
+   if (x->hash != y->hash) return (x->hash < y->hash ? -1 : 1);
+   if (x->game != y->game) return (x->game < y->game ? -1 : 1);
+   return (x->piece < y->piece ? -1 : x->piece > y->piece);
+}
+
+/* Read the shards of the workers into memory and remove them. Returns the */
+/* entries, NULL if an error occurred */
+static tintindex_entry_t *index_load (const char *filename,int workers,uint64_t count)
+{
+   tintindex_entry_t *entry;
+   char shard[PATH_MAX];
+   size_t len = 0;
+   ssize_t n = 0;
+   int i,fd;
+   if ((entry = malloc (count * sizeof (tintindex_entry_t) + 1)) == NULL) return (NULL);
+   for (i = 0; i < workers; i++)
+	 {
+		snprintf (shard,sizeof (shard),"%s.%d",filename,i);
+		if ((fd = open (shard,O_RDONLY)) < 0) break;
+		while ((len < count * sizeof (tintindex_entry_t)) && ((n = read (fd,(char *) entry + len,count * sizeof (tintindex_entry_t) - len)) > 0))
+		  len += n;
+		close (fd);
+		unlink (shard);
+		if (n < 0) break;
+	 }
+   if ((i < workers) || (len != count * sizeof (tintindex_entry_t)))
+	 {
+		free (entry);
+		return (NULL);
+	 }
+   return (entry);
+}
+
+/* Write an index of sorted entries. Returns FALSE if it can't be written */
+static bool index_write (const char *filename,char **name,int numgames,const tintindex_entry_t *entry,uint64_t count)
+{
+   tintindex_t header;
+   uint64_t *bucket,offset,i,b;
+   FILE *fp;
+   int n;
+   bool ok;
+   memset (&header,0,sizeof (header));
+   memcpy (header.magic,TINTINDEX_MAGIC,8);
+   header.version = TINTINDEX_VERSION;
+   header.numgames = numgames;
+   header.numentries = count;
+   /* about four entries a bucket */
+   while ((header.bits < 40) && ((4ull << header.bits) < count)) header.bits++;
+   if ((bucket = malloc (((1ull << header.bits) + 1) * sizeof (uint64_t))) == NULL) return (FALSE);
+   for (b = i = 0; b < (1ull << header.bits); b++)
+	 {
+		bucket[b] = i;
+		while ((i < count) && ((header.bits ? entry[i].hash >> (64 - header.bits) : 0) == b)) i++;
+	 }
+   bucket[b] = count;
+   header.names = sizeof (header);
+   for (n = 0, offset = header.names + numgames * sizeof (uint64_t); n < numgames; n++) offset += strlen (name[n]) + 1;
+   header.buckets = (offset + 7) & ~7ull;
+   header.entries = header.buckets + ((1ull << header.bits) + 1) * sizeof (uint64_t);
+   header.size = header.entries + count * sizeof (tintindex_entry_t);
+   if ((fp = fopen (filename,"w")) == NULL)
+	 {
+		free (bucket);
+		return (FALSE);
+	 }
+   setvbuf (fp,NULL,_IOFBF,SIM_BUFSIZE);
+   fwrite (&header,sizeof (header),1,fp);
+   for (n = 0, offset = header.names + numgames * sizeof (uint64_t); n < numgames; n++)
+	 {
+		fwrite (&offset,sizeof (offset),1,fp);
+		offset += strlen (name[n]) + 1;
+	 }
+   for (n = 0; n < numgames; n++) fwrite (name[n],strlen (name[n]) + 1,1,fp);
+   for ( ; offset < header.buckets; offset++) fputc ('\0',fp);
+   fwrite (bucket,sizeof (uint64_t),(1ull << header.bits) + 1,fp);
+   fwrite (entry,sizeof (tintindex_entry_t),count,fp);
+   free (bucket);
+   ok = !ferror (fp);
+   return (fclose (fp) == 0 && ok);
+}
+
+static void index_usage ()
+{
+   fprintf (stderr,"USAGE: tint-index -o file [-j workers] replay ...\n");
+   fprintf (stderr,"  -o <file>    Write the index to this file\n");
+   fprintf (stderr,"  -j <workers> Number of replays indexed at the same time (default: one per processor)\n");
+   fprintf (stderr,"  replay       A replay to index, or - to read the names of replays from the standard input\n");
+   exit (EXIT_FAILURE);
+}
+
+/*
+ * Indexer: workers play the replays back without drawing them, each
+ * writing the hashes of the positions to a shard of its own. The shards
+ * are read back, sorted by hash and written out as a table the query tool
+ * maps
+ */
+int tintindex_main (int argc,char *argv[])
+{
+   const char *filename = NULL;
+   char shard[PATH_MAX],**name,line[PATH_MAX];
+   tintindex_entry_t *entry;
+   pid_t pid[SIM_MAXWORKERS];
+   int64_t start,played,sorted;
+   long count = 0,n;
+   int i,len,status,numgames = 0,workers = sysconf (_SC_NPROCESSORS_ONLN),fd[2];
+   bool ok = TRUE;
+   if ((name = malloc (INDEX_MAXGAMES * sizeof (char *))) == NULL)
+	 {
+		fprintf (stderr,"Out of memory\n");
+		exit (EXIT_FAILURE);
+	 }
+   for (i = 1; i < argc; i++)
+	 {
+		if ((strcmp (argv[i],"-o") == 0) && (i + 1 < argc)) filename = argv[++i];
+		else if ((strcmp (argv[i],"-j") == 0) && (i + 1 < argc))
+		  {
+			 if (!str2int (&workers,argv[++i]) || (workers < 1) || (workers > SIM_MAXWORKERS)) index_usage ();
+		  }
+		else if (strcmp (argv[i],"-") == 0)
+		  while ((numgames < INDEX_MAXGAMES) && (fgets (line,sizeof (line),stdin) != NULL))
+			{
+			   if ((len = strlen (line)) && (line[len - 1] == '\n')) line[--len] = '\0';
+			   if (len && ((name[numgames++] = strdup (line)) == NULL)) index_usage ();
+			}
+		else if ((argv[i][0] == '-') || (numgames == INDEX_MAXGAMES)) index_usage ();
+		else name[numgames++] = argv[i];
+	 }
+   if ((filename == NULL) || !numgames) index_usage ();
+   if (workers > numgames) workers = numgames;
+   if (pipe (fd) < 0)
+	 {
+		fprintf (stderr,"Error starting the workers: %s\n",strerror (errno));
+		exit (EXIT_FAILURE);
+	 }
+   start = monotime ();
+   for (i = 0; i < workers; i++)
+	 {
+		snprintf (shard,sizeof (shard),"%s.%d",filename,i);
+		if ((pid[i] = fork ()) == 0)
+		  {
+			 close (fd[0]);
+			 n = index_worker (shard,name,numgames,i,workers);
+			 _exit (n >= 0 && write (fd[1],&n,sizeof (n)) == sizeof (n) ? EXIT_SUCCESS : EXIT_FAILURE);
+		  }
+		if (pid[i] < 0)
+		  {
+			 fprintf (stderr,"Error starting a worker: %s\n",strerror (errno));
+			 exit (EXIT_FAILURE);
+		  }
+	 }
+   close (fd[1]);
+   while (read (fd[0],&n,sizeof (n)) == sizeof (n)) count += n;
+   close (fd[0]);
+   for (i = 0; i < workers; i++)
+	 if ((waitpid (pid[i],&status,0) < 0) || !WIFEXITED (status) || (WEXITSTATUS (status) != EXIT_SUCCESS)) ok = FALSE;
+   played = monotime ();
+   if (!ok || ((entry = index_load (filename,workers,count)) == NULL))
+	 {
+		for (i = 0; i < workers; i++)
+		  {
+			 snprintf (shard,sizeof (shard),"%s.%d",filename,i);
+			 unlink (shard);
+		  }
+		fprintf (stderr,"Error indexing the replays\n");
+		exit (EXIT_FAILURE);
+	 }
+   qsort (entry,count,sizeof (tintindex_entry_t),index_compare);
+   sorted = monotime ();
+   if (!index_write (filename,name,numgames,entry,count))
+	 {
+		fprintf (stderr,"Error writing %s: %s\n",filename,strerror (errno));
+		unlink (filename);
+		exit (EXIT_FAILURE);
+	 }
+   printf ("%ld positions from %d replays in %.2f s with %d workers (playing back took %.2f s, sorting %.2f s)\n",
+		   count,numgames,(monotime () - start) / 1e6,workers,(played - start) / 1e6,(sorted - played) / 1e6);
+   exit (EXIT_SUCCESS);
+}
+
+/*
+ * Arena
+ */
+
+/* Matches each pair of policies plays and shapes each bot places before a */
+/* match is a draw, unless told otherwise */
+#define ARENA_GAMES		20
+#define ARENA_MAXPIECES	500
+
+/* Most policies in a tournament */
+#define ARENA_MAXPOLICIES	16
+
+/* Rating of a policy that does as well as it does badly, and most rounds */
+/* the ratings are worked out in */
+#define ARENA_RATING		1500
+#define ARENA_ITERATIONS	10000
+
+#define ARENA_RANDOMSIZE	256
+
+typedef struct
+{
+   char name[16];
+   double weights[NUMFEATURES];
+   int depth;								/* shapes looked at, the current one and those after it */
+} policy_t;
+
+/* Policies that play unless others are asked for. The first two judge */
+/* boards with the weights the bot plays with */
+static const policy_t arenapolicies[] =
+{
+   { "greedy", BOTWEIGHTS, 1 },
+   { "lookahead", BOTWEIGHTS, 2 },
+   { "flat", { -0.3, 0.5, -0.5, -0.6, -0.1 }, 1 },
+   { "digger", { -0.2, 1, -0.8, -0.1, 0 }, 1 }
+};
+
+typedef struct
+{
+   int8_t winner;							/* 0 or 1, -1 for a draw */
+   bool played;
+   int pieces;								/* shapes placed on both boards */
+   int sent[2];							/* garbage rows sent */
+} arenamatch_t;
+
+/* State the workers share: the next match to play, the results and the */
+/* times of the decisions of each policy, kept by every worker apart */
+typedef struct
+{
+   unsigned next;
+   arenamatch_t *match;
+   histogram_t *decisions;					/* [worker][policy] */
+} arena_t;
+
+/* Find the best place for the current shape the way a policy does, and */
+/* the keys that take it there */
+static void arena_plan (const policy_t *policy,const engine_t *engine,plan_t *plan)
+{
+   static hint_t hint;
+   hintsearch_t s;
+   state_t state;
+   finesse_t finesse;
+   place_t place;
+   int i;
+   memcpy (botweights,policy->weights,sizeof (botweights));
+   if (policy->depth <= 1)
 	 {
-		strcpy (scores[i].name,"None");
-		scores[i].score = -1;
-		scores[i].timestamp = 0;
+		bot_plan (engine,plan);
+		return;
 	 }
-   getname (scores[0].name);
-   scores[0].score = score;
-   scores[0].timestamp = time (NULL);
-   if ((handle = fopen (scorefile,"w")) == NULL) err1 ();
-   strcpy (header,SCORE_HEADER);
-   i = fwrite (header,strlen (SCORE_HEADER),1,handle);
-   if (i != 1) err2 ();
-   for (i = 0; i < NUMSCORES; i++)
+   engine_snapshot (engine,&state);
+   finesse_search (&finesse,engine,&state,FALSE);
+   /* in the opening, the place in the book, as the bot plays, and */
+   /* otherwise the search of the hints, with all the time it needs */
+   if ((i = book_find (engine,&state,&finesse,botweights)) < 0)
 	 {
-		j = fwrite (scores[i].name,strlen (scores[i].name) + 1,1,handle);
-		if (j != 1) err2 ();
-		j = fwrite (&(scores[i].score),sizeof (int),1,handle);
-		if (j != 1) err2 ();
-		j = fwrite (&(scores[i].timestamp),sizeof (time_t),1,handle);
-		if (j != 1) err2 ();
+		hint.asked = 0;
+		s.hint = &hint;
+		s.engine = engine;
+		s.request = 0;
+		s.deadline = INT64_MAX;
+		s.maxdepth = policy->depth;
+		s.cancelled = FALSE;
+		place.keys = 0;
+		hint_best (&s,&state,0,0,&place);
+		for (i = 0; (i < finesse.numplaces) && ((finesse.place[i].x != place.x) || (finesse.place[i].y != place.y) ||
+												(finesse.place[i].rotation != place.rotation)); i++) ;
 	 }
-   fclose (handle);
+   plan->piece = engine->queuehead;
+   plan->x = engine->curx;
+   plan->y = engine->cury;
+   plan->rotation = engine->rotation;
+   plan->numkeys = i < finesse.numplaces ? finesse_path (&finesse,i,plan->keys) : 0;
+   plan->next = 0;
+}
 
-   fprintf (stderr,"%s",scoretitle);
-   fprintf (stderr,"\t  1* %7d        %s\n\n",score,scores[0].name);
+/* Play a match between two policies on the same shapes. Each places a */
+/* shape in turn, and clearing lines sends garbage to the other, as in */
+/* versus mode. The time each decision took is added to the histograms */
+static void arena_play (arenamatch_t *match,const policy_t **policy,histogram_t **decisions,unsigned seed,int first,int maxpieces)
+{
+   static char random[3][ARENA_RANDOMSIZE];
+   engine_t engine[2];
+   plan_t plan[2];
+   action_t action;
+   int64_t start;
+   int i,k,n,lines,cancel;
+   memset (match,0,sizeof (arenamatch_t));
+   match->winner = -1;
+   /* the shapes of both boards come from random numbers of their own, */
+   /* seeded the same, and the holes in the garbage from others */
+   initstate (seed ^ 0x5bd1e995,random[2],ARENA_RANDOMSIZE);
+   for (i = 0; i < 2; i++)
+	 {
+		initstate (seed,random[i],ARENA_RANDOMSIZE);
+		engine_init (&engine[i],score_function);
+		engine_pieces (&engine[i],pieces_builtin ("tetrominoes"));
+		plan[i].piece = -1;
+	 }
+   for (n = 0; (n < maxpieces) && (match->winner < 0); n++)
+	 for (k = 0; (k < 2) && (match->winner < 0); k++)
+	   {
+		  i = first ^ k;
+		  start = monotime ();
+		  arena_plan (policy[i],&engine[i],&plan[i]);
+		  hist_add (decisions[i],monotime () - start);
+		  do engine_move (&engine[i],action = bot_action (&engine[i],&plan[i])); while (action != ACTION_DROP);
+		  /* deal the shapes before the garbage comes in, so that both */
+		  /* boards get the same ones */
+		  setstate (random[i]);
+		  while (engine[i].queuetail - engine[i].queuehead <= MAXPREVIEWS + 1) queue_refill (&engine[i]);
+		  setstate (random[2]);
+		  match->pieces++;
+		  if (engine_evaluate (&engine[i]) < 0)
+			{
+			   match->winner = !i;
+			   break;
+			}
+		  lines = garbagelines[engine[i].status.currentdroppedlines];
+		  cancel = lines < engine[i].garbage ? lines : engine[i].garbage;
+		  engine[i].garbage -= cancel;
+		  if ((lines -= cancel))
+			{
+			   engine_garbage (&engine[!i],lines);
+			   match->sent[i] += lines;
+			}
+	   }
+   match->played = TRUE;
 }
 
-static int cmpscores (const void *a,const void *b)
+/* Play matches until there are none left. Every pair of policies plays */
+/* the same seeds, and who goes first changes from one to the next */
+static void arena_worker (arena_t *arena,const policy_t *policies,int numpolicies,int worker,int games,int maxpieces,unsigned seed)
 {
-   int result;
-   result = (int) ((score_t *) a)->score - (int) ((score_t *) b)->score;
-   /* a < b */
-   if (result < 0) return 1;
-   /* a > b */
-   if (result > 0) return -1;
-   /* a = b */
-   result = (time_t) ((score_t *) a)->timestamp - (time_t) ((score_t *) b)->timestamp;
-   /* a is older */
-   if (result < 0) return -1;
-   /* b is older */
-   if (result > 0) return 1;
-   /* timestamps is equal */
-   return 0;
+   const policy_t *policy[2];
+   histogram_t *decisions[2];
+   unsigned m,pair,numpairs = numpolicies * (numpolicies - 1) / 2;
+   int a,b;
+   while ((m = __atomic_fetch_add (&arena->next,1,__ATOMIC_RELAXED)) < numpairs * games)
+	 {
+		for (pair = m / games, a = 0; pair >= (unsigned) (numpolicies - 1 - a); pair -= numpolicies - 1 - a, a++) ;
+		b = a + 1 + pair;
+		policy[0] = &policies[a];
+		policy[1] = &policies[b];
+		decisions[0] = &arena->decisions[worker * numpolicies + a];
+		decisions[1] = &arena->decisions[worker * numpolicies + b];
+		arena_play (&arena->match[m],policy,decisions,seed + m % games,m % games & 1,maxpieces);
+	 }
 }
 
-static void savescores (int score)
+/* Read a policy: the name of one of the policies that play by default, */
+/* or a new name followed by its weights and optionally its depth, as in */
+/* name:w1,w2,w3,w4,w5:depth. Returns FALSE if it isn't one */
+static bool arena_policy (policy_t *policy,const char *str)
 {
-   FILE *handle;
-   int i,j,ch;
-   score_t scores[NUMSCORES];
-   char header[strlen (SCORE_HEADER)+1];
-   time_t tmp = 0;
-   if ((handle = fopen (scorefile,"r")) == NULL)
+   const char *colon = strchr (str,':');
+   size_t i,len = colon != NULL ? (size_t) (colon - str) : strlen (str);
+   int n,used;
+   if (!len || (len >= sizeof (policy->name))) return (FALSE);
+   if (colon == NULL)
 	 {
-		createscores (score);
-		return;
+		for (i = 0; i < sizeof (arenapolicies) / sizeof (arenapolicies[0]); i++)
+		  if (strcmp (arenapolicies[i].name,str) == 0)
+			{
+			   *policy = arenapolicies[i];
+			   return (TRUE);
+			}
+		return (FALSE);
 	 }
-   i = fread (header,strlen (SCORE_HEADER),1,handle);
-   if ((i != 1) || (strncmp (SCORE_HEADER,header,strlen (SCORE_HEADER)) != 0))
+   memset (policy,0,sizeof (policy_t));
+   memcpy (policy->name,str,len);
+   policy->depth = 1;
+   for (str = colon + 1, n = 0; n < NUMFEATURES; n++, str += used)
 	 {
-		createscores (score);
-		return;
+		if (n && (*str++ != ',')) return (FALSE);
+		if (sscanf (str,"%lf%n",&policy->weights[n],&used) != 1) return (FALSE);
 	 }
-   for (i = 0; i < NUMSCORES; i++)
+   if (*str == '\0') return (TRUE);
+   return ((sscanf (str,":%d%n",&policy->depth,&used) == 1) && (str[used] == '\0') && (policy->depth >= 1) && (policy->depth <= HINT_MAXDEPTH));
+}
+
+static void arena_usage ()
+{
+   unsigned i;
+   fprintf (stderr,"USAGE: tint-arena [-j workers] [-g games] [-p count] [-s seed] [-o book] [-b policy ...]\n");
+   fprintf (stderr,"  -j <workers> Number of matches played at the same time (default: one per processor)\n");
+   fprintf (stderr,"  -g <games>   Number of matches each pair of policies plays (default %d)\n",ARENA_GAMES);
+   fprintf (stderr,"  -p <count>   Call a match a draw after each bot placed this many shapes (default %d)\n",ARENA_MAXPIECES);
+   fprintf (stderr,"  -s <seed>    Seed of the shapes of the first match of each pair\n");
+   fprintf (stderr,"  -o <book>    Let the policies that judge boards like the book play the first bag from it, at any depth\n");
+   fprintf (stderr,"  -b <policy>  Let this policy play: one of");
+   for (i = 0; i < sizeof (arenapolicies) / sizeof (arenapolicies[0]); i++) fprintf (stderr," %s",arenapolicies[i].name);
+   fprintf (stderr,",\n               or name:weights[:depth], with the %d weights of the bot separated by commas\n",NUMFEATURES);
+   exit (EXIT_FAILURE);
+}
+
+/* Rate the policies on all the results at once, with the model Elo is */
+/* built on: the strengths, 10 to the rating over 400, are improved in */
+/* rounds until every policy is expected to score the points it did. Each */
+/* policy also gets a draw against one of ARENA_RATING, so that one that */
+/* won or lost every match still gets a rating */
+static void arena_rate (double *rating,double points[][ARENA_MAXPOLICIES],int numpolicies,int games)
+{
+   double strength[ARENA_MAXPOLICIES],next[ARENA_MAXPOLICIES],scored,expected,change;
+   int i,j,k;
+   for (i = 0; i < numpolicies; i++) strength[i] = 1;
+   for (k = 0; k < ARENA_ITERATIONS; k++)
+	 {
+		for (i = 0; i < numpolicies; i++)
+		  {
+			 scored = 0.5;
+			 expected = 1 / (strength[i] + 1);
+			 for (j = 0; j < numpolicies; j++)
+			   if (j != i)
+				 {
+					scored += points[i][j];
+					expected += games / (strength[i] + strength[j]);
+				 }
+			 next[i] = scored / expected;
+		  }
+		for (i = 0, change = 0; i < numpolicies; i++)
+		  {
+			 if (fabs (log (next[i] / strength[i])) > change) change = fabs (log (next[i] / strength[i]));
+			 strength[i] = next[i];
+		  }
+		if (change < 1e-12) break;
+	 }
+   for (i = 0; i < numpolicies; i++) rating[i] = ARENA_RATING + 400 * log10 (strength[i]);
+}
+
+/*
+ * Arena: every pair of policies plays a number of matches, in worker
+ * processes that take the next match as soon as they are done with one.
+ * The ratings are worked out from all the results at once, so they don't
+ * depend on the order the matches were played in
+ */
+int tintarena_main (int argc,char *argv[])
+{
+   policy_t policies[ARENA_MAXPOLICIES];
+   pid_t pid[SIM_MAXWORKERS];
+   arena_t *arena;
+   histogram_t *hist;
+   const arenamatch_t *match;
+   double rating[ARENA_MAXPOLICIES],points[ARENA_MAXPOLICIES][ARENA_MAXPOLICIES];
+   long pieces = 0;
+   size_t size;
+   int64_t start,took;
+   int i,j,a,b,status,numpolicies = 0,numpairs,nummatches,workers = sysconf (_SC_NPROCESSORS_ONLN),games = ARENA_GAMES,maxpieces = ARENA_MAXPIECES,seed = time (NULL);
+   int result[ARENA_MAXPOLICIES][3],sent[ARENA_MAXPOLICIES];
+   bool ok = TRUE;
+   for (i = 1; i < argc; i++)
 	 {
-		j = 0;
-		while ((ch = fgetc (handle)) != '\0')
+		if ((strcmp (argv[i],"-j") == 0) && (i + 1 < argc))
 		  {
-			 if ((ch == EOF) || (j >= NAMELEN - 2))
+			 if (!str2int (&workers,argv[++i]) || (workers < 1) || (workers > SIM_MAXWORKERS)) arena_usage ();
+		  }
+		else if ((strcmp (argv[i],"-g") == 0) && (i + 1 < argc))
+		  {
+			 if (!str2int (&games,argv[++i]) || (games < 1)) arena_usage ();
+		  }
+		else if ((strcmp (argv[i],"-p") == 0) && (i + 1 < argc))
+		  {
+			 if (!str2int (&maxpieces,argv[++i]) || (maxpieces < 1)) arena_usage ();
+		  }
+		else if ((strcmp (argv[i],"-s") == 0) && (i + 1 < argc))
+		  {
+			 if (!str2int (&seed,argv[++i])) arena_usage ();
+		  }
+		else if ((strcmp (argv[i],"-b") == 0) && (i + 1 < argc) && (numpolicies < ARENA_MAXPOLICIES))
+		  {
+			 if (!arena_policy (&policies[numpolicies++],argv[++i])) arena_usage ();
+		  }
+		else if ((strcmp (argv[i],"-o") == 0) && (i + 1 < argc))
+		  {
+			 if ((book = tintbook_open (argv[++i])) == NULL)
 			   {
-				  createscores (score);
-				  return;
+				  fprintf (stderr,"%s is not an opening book\n",argv[i]);
+				  exit (EXIT_FAILURE);
 			   }
-			 scores[i].name[j++] = (char) ch;
 		  }
-		scores[i].name[j] = '\0';
-		j = fread (&(scores[i].score),sizeof (int),1,handle);
-		if (j != 1)
+		else arena_usage ();
+	 }
+   if (!numpolicies)
+	 for (numpolicies = 0; numpolicies < (int) (sizeof (arenapolicies) / sizeof (arenapolicies[0])); numpolicies++)
+	   policies[numpolicies] = arenapolicies[numpolicies];
+   if (numpolicies < 2)
+	 {
+		fprintf (stderr,"It takes two policies to play a match\n");
+		exit (EXIT_FAILURE);
+	 }
+   numpairs = numpolicies * (numpolicies - 1) / 2;
+   nummatches = numpairs * games;
+   if (workers > nummatches) workers = nummatches;
+   size = sizeof (arena_t) + nummatches * sizeof (arenamatch_t) + workers * numpolicies * sizeof (histogram_t);
+   if ((arena = mmap (NULL,size,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_ANONYMOUS,-1,0)) == MAP_FAILED)
+	 {
+		fprintf (stderr,"Error sharing memory with the workers: %s\n",strerror (errno));
+		exit (EXIT_FAILURE);
+	 }
+   arena->decisions = (histogram_t *) (arena + 1);
+   arena->match = (arenamatch_t *) (arena->decisions + workers * numpolicies);
+   start = monotime ();
+   for (i = 0; i < workers; i++)
+	 {
+		if ((pid[i] = fork ()) == 0)
 		  {
-			 createscores (score);
-			 return;
+			 arena_worker (arena,policies,numpolicies,i,games,maxpieces,seed);
+			 _exit (EXIT_SUCCESS);
 		  }
-		j = fread (&(scores[i].timestamp),sizeof (time_t),1,handle);
-		if (j != 1)
+		if (pid[i] < 0)
 		  {
-			 createscores (score);
-			 return;
+			 fprintf (stderr,"Error starting a worker: %s\n",strerror (errno));
+			 exit (EXIT_FAILURE);
 		  }
 	 }
-   fclose (handle);
-   if (score > scores[NUMSCORES - 1].score)
+   for (i = 0; i < workers; i++)
+	 if ((waitpid (pid[i],&status,0) < 0) || !WIFEXITED (status) || (WEXITSTATUS (status) != EXIT_SUCCESS)) ok = FALSE;
+   took = monotime () - start;
+   for (i = 0; i < nummatches; i++) if (!arena->match[i].played) ok = FALSE;
+   if (!ok)
 	 {
-		getname (scores[NUMSCORES - 1].name);
-		scores[NUMSCORES - 1].score = score;
-		scores[NUMSCORES - 1].timestamp = tmp = time (NULL);
+		fprintf (stderr,"A worker failed\n");
+		exit (EXIT_FAILURE);
 	 }
-   qsort (scores,NUMSCORES,sizeof (score_t),cmpscores);
-   if ((handle = fopen (scorefile,"w")) == NULL) err2 ();
-   strcpy (header,SCORE_HEADER);
-   i = fwrite (header,strlen (SCORE_HEADER),1,handle);
-   if (i != 1) err2 ();
-   for (i = 0; i < NUMSCORES; i++)
+   /* add up the results and rate the policies */
+   memset (result,0,sizeof (result));
+   memset (sent,0,sizeof (sent));
+   memset (points,0,sizeof (points));
+   for (i = 0; i < nummatches; i++)
 	 {
-		j = fwrite (scores[i].name,strlen (scores[i].name) + 1,1,handle);
-		if (j != 1) err2 ();
-		j = fwrite (&(scores[i].score),sizeof (int),1,handle);
-		if (j != 1) err2 ();
-		j = fwrite (&(scores[i].timestamp),sizeof (time_t),1,handle);
-		if (j != 1) err2 ();
+		match = &arena->match[i];
+		for (j = i / games, a = 0; j >= numpolicies - 1 - a; j -= numpolicies - 1 - a, a++) ;
+		b = a + 1 + j;
+		pieces += match->pieces;
+		sent[a] += match->sent[0];
+		sent[b] += match->sent[1];
+		points[a][b] += match->winner < 0 ? 0.5 : match->winner == 0;
+		points[b][a] += match->winner < 0 ? 0.5 : match->winner == 1;
+		result[a][match->winner < 0 ? 1 : match->winner == 0 ? 0 : 2]++;
+		result[b][match->winner < 0 ? 1 : match->winner == 1 ? 0 : 2]++;
 	 }
-   fclose (handle);
-
-   fprintf (stderr,"%s",scoretitle);
-   i = 0;
-   while ((i < NUMSCORES) && (scores[i].score != -1))
+   arena_rate (rating,points,numpolicies,games);
+   printf ("%-16s %6s %5s %5s %6s %8s %10s %7s %7s %7s\n","policy","rating","won","drawn","lost","garbage","decisions","p50 us","p99 us","max us");
+   for (i = 0; i < numpolicies; i++)
 	 {
-		j = scores[i].timestamp == tmp ? '*' : ' ';
-		fprintf (stderr,"\t %2d%c %7d        %s\n",i + 1,j,scores[i].score,scores[i].name);
-		i++;
+		/* the decisions of the policy, from all workers */
+		hist = &arena->decisions[i];
+		for (j = 1; j < workers; j++) hist_merge (hist,&arena->decisions[j * numpolicies + i]);
+		printf ("%-16s %6.0f %5d %5d %6d %8d %10llu %7u %7u %7u\n",policies[i].name,rating[i],result[i][0],result[i][1],result[i][2],sent[i],
+				(unsigned long long) hist->count,hist_percentile (hist,0.5),hist_percentile (hist,0.99),hist->max);
 	 }
-   fprintf (stderr,"\n");
+   printf ("%d matches, %ld shapes in %.2f s with %d workers: %.1f matches/s, %.0f shapes/s\n",
+		   nummatches,pieces,took / 1e6,workers,nummatches * 1e6 / took,pieces * 1e6 / took);
+   munmap (arena,size);
+   exit (EXIT_SUCCESS);
 }
 
-          /***************************************************************************/
-          /***************************************************************************/
-          /***************************************************************************/
+/*
+ * Opening book search
+ */
 
-static void showhelp ()
+/* Boards kept after each shape, unless told otherwise */
+#define BOOK_BEAM	128
+
+/* A board the search reached, where the shape before it was put and the */
+/* board, one shape back, it was put on */
+typedef struct
 {
-   fprintf (stderr,"USAGE: tint [-h] [-l level] [-n] [-d] [-b char]\n");
-   fprintf (stderr,"  -h           Show this help message\n");
-   fprintf (stderr,"  -l <level>   Specify the starting level (%d-%d)\n",MINLEVEL,MAXLEVEL);
-   fprintf (stderr,"  -n           Draw next shape\n");
-   fprintf (stderr,"  -d           Draw vertical dotted lines\n");
-   fprintf (stderr,"  -b <char>    Use this character to draw blocks instead of spaces\n");
-   fprintf (stderr,"  -s           Draw shadow of shape\n");
-   exit (EXIT_FAILURE);
+   state_t state;
+   place_t place;
+   int parent;
+} booknode_t;
+
+/* A place a shape can be put, judged before the board it leaves is made */
+typedef struct
+{
+   double value;
+   uint64_t hash;
+   int parent;
+   place_t place;
+} bookmove_t;
+
+typedef struct
+{
+   engine_t engine;							/* the queue holds the order searched */
+   int beam;
+   booknode_t *node[TINTBOOK_SHAPES + 1];	/* boards kept after each number of shapes */
+   int count[TINTBOOK_SHAPES + 1];
+   bookmove_t *move;
+   int maxmoves;
+   uint64_t *seen;							/* hashes of the boards kept, open addressing */
+   int numseen;
+   tintbook_entry_t *entry;
+   double value;							/* sum of the values of the boards the bags end on */
+} booksearch_t;
+
+/* Compare places by value, best first, then by the board they leave */
+static int book_compare (const void *a,const void *b)
+{
+   const bookmove_t *x = a,*y = b;
+   if (x->value != y->value) return (x->value > y->value ? -1 : 1);
+   return (x->hash < y->hash ? -1 : x->hash > y->hash);
 }
 
-static void parse_options (int argc,char *argv[])
+/* Put the current shape of every board kept after k shapes everywhere it */
+/* can go, and keep the best boards that leaves, each once. Returns FALSE */
+/* if there is not enough memory */
+static bool book_expand (booksearch_t *b,int k)
 {
-   int i = 1;
-   while (i < argc)
+   const engine_t *engine = &b->engine;
+   finesse_t finesse;
+   state_t *state;
+   bookmove_t *move;
+   booknode_t *node;
+   undo_t undo;
+   uint64_t hash;
+   int i,j,x,n = 0;
+   for (i = 0; i < b->count[k]; i++)
 	 {
-		/* Help? */
-		if (strcmp (argv[i],"-h") == 0)
-		  showhelp ();
-		/* Level? */
-		else if (strcmp (argv[i],"-l") == 0)
-		  {
-			 i++;
-			 if (i >= argc || !str2int (&level,argv[i])) showhelp ();
-			 if ((level < MINLEVEL) || (level > MAXLEVEL))
-			   {
-				  fprintf (stderr,"You must specify a level between %d and %d\n",MINLEVEL,MAXLEVEL);
-				  exit (EXIT_FAILURE);
-			   }
-		  }
-		/* Show next? */
-		else if (strcmp (argv[i],"-n") == 0)
-		  shownext = TRUE;
-		else if(strcmp(argv[i],"-d")==0)
-		  dottedlines = TRUE;
-		else if(strcmp(argv[i], "-b")==0)
+		state = &b->node[k][i].state;
+		finesse_search (&finesse,engine,state,FALSE);
+		if (n + finesse.numplaces > b->maxmoves)
 		  {
-		    i++;
-		    if (i >= argc || strlen(argv[i]) < 1) showhelp();
-		    blockchar = argv[i][0];
+			 b->maxmoves = 2 * (n + finesse.numplaces);
+			 if ((move = realloc (b->move,b->maxmoves * sizeof (bookmove_t))) == NULL) return (FALSE);
+			 b->move = move;
 		  }
-		else if (strcmp (argv[i],"-s") == 0)
-            shadow = TRUE;
-		else
+		for (j = 0; j < finesse.numplaces; j++, n++)
 		  {
-			 fprintf (stderr,"Invalid option -- %s\n",argv[i]);
-			 showhelp ();
+			 engine_apply (engine,state,&finesse.place[j],&undo);
+			 for (x = 1, hash = 0; x < state->cols - 2; x++) hash = tintindex_mix (hash,state->column[x]);
+			 b->move[n].value = judgestate (state,state->lines);
+			 b->move[n].hash = hash | 1;
+			 b->move[n].parent = i;
+			 b->move[n].place = finesse.place[j];
+			 engine_undo (engine,state,&undo);
 		  }
-		i++;
 	 }
+   qsort (b->move,n,sizeof (bookmove_t),book_compare);
+   memset (b->seen,0,b->numseen * sizeof (uint64_t));
+   for (i = 0, b->count[k + 1] = 0; (i < n) && (b->count[k + 1] < b->beam); i++)
+	 {
+		move = &b->move[i];
+		for (j = move->hash & (b->numseen - 1); b->seen[j] && (b->seen[j] != move->hash); j = (j + 1) & (b->numseen - 1)) ;
+		if (b->seen[j]) continue;
+		b->seen[j] = move->hash;
+		node = &b->node[k + 1][b->count[k + 1]++];
+		memcpy (&node->state,&b->node[k][move->parent].state,sizeof (state_t));
+		engine_apply (engine,&node->state,&move->place,&undo);
+		node->place = move->place;
+		node->parent = move->parent;
+	 }
+   return (TRUE);
 }
 
-static void choose_level ()
+/* Search every order of the shapes after the first k, which are in the */
+/* queue already. Orders share the search of the shapes they start with, */
+/* and the first two shapes are shared out among the workers. Returns */
+/* FALSE if there is not enough memory */
+static bool book_search (booksearch_t *b,int k,unsigned used,int worker,int workers)
 {
-   char buf[NAMELEN];
-
-   do
+   tintbook_entry_t *entry;
+   const booknode_t *node;
+   int i,j,shape;
+   if (k == TINTBOOK_SHAPES)
 	 {
-		fprintf (stderr,"Choose a level to start [%d-%d]: ",MINLEVEL,MAXLEVEL);
-		fgets (buf,NAMELEN - 1,stdin);
-		buf[strlen (buf) - 1] = '\0';
+		/* the best board is the first one kept, and the way to it is */
+		/* followed back from there */
+		entry = &b->entry[tintbook_rank (b->engine.queue)];
+		entry->lines = b->node[k][0].state.lines;
+		b->value += judgestate (&b->node[k][0].state,entry->lines);
+		for (j = k, i = 0; j > 0; i = b->node[j--][i].parent)
+		  {
+			 node = &b->node[j][i];
+			 entry->place[j - 1].x = node->place.x;
+			 entry->place[j - 1].y = node->place.y;
+			 entry->place[j - 1].rotation = node->place.rotation;
+		  }
+		return (TRUE);
 	 }
-   while (!str2int (&level,buf) || level < MINLEVEL || level > MAXLEVEL);
+   for (shape = 0; shape < TINTBOOK_SHAPES; shape++)
+	 {
+		if ((used & (1 << shape)) || ((k == 1) && ((b->engine.queue[0] * TINTBOOK_SHAPES + shape) % workers != worker))) continue;
+		b->engine.queue[k] = shape;
+		for (i = 0; i < b->count[k]; i++) state_spawn (&b->engine,&b->node[k][i].state,shape);
+		if (!book_expand (b,k) || !book_search (b,k + 1,used | (1 << shape),worker,workers)) return (FALSE);
+	 }
+   return (TRUE);
 }
 
-static bool evaluate (engine_t *engine)
+/* Search the orders of a worker, writing their entries to the book. */
+/* Returns the sum of the values of the boards they end on, NAN if there */
+/* is not enough memory */
+static double book_worker (tintbook_entry_t *entry,int beam,int worker,int workers)
 {
-    bool finished = FALSE;
-    switch (engine_evaluate (engine))
-    {
-        /* game over (board full) */
-        case -1:
-            if ((level < MAXLEVEL) && ((engine->status.droppedlines / 10) > level)) level++;
-            finished = TRUE;
-            break;
-            /* shape at bottom, next one released */
-        case 0:
-            if ((level < MAXLEVEL) && ((engine->status.droppedlines / 10) > level))
-            {
-                level++;
-                in_timeout (DELAY);
-            }
-            shapecount[engine->curshape]++;
-            break;
-            /* shape moved down one line */
-        case 1:
-            break;
-    }
-    return finished;
+   booksearch_t b;
+   int k;
+   memset (&b,0,sizeof (b));
+   engine_init (&b.engine,score_function);
+   engine_pieces (&b.engine,pieces_builtin ("tetrominoes"));
+   memset (b.engine.queue,0,sizeof (b.engine.queue));
+   b.beam = beam;
+   b.entry = entry;
+   for (b.numseen = 1; b.numseen < 2 * beam; b.numseen <<= 1) ;
+   if ((b.seen = malloc (b.numseen * sizeof (uint64_t))) == NULL) return (NAN);
+   for (k = 0; k <= TINTBOOK_SHAPES; k++)
+	 if ((b.node[k] = malloc ((k ? beam : 1) * sizeof (booknode_t))) == NULL) return (NAN);
+   /* every bag starts on an empty board */
+   engine_snapshot (&b.engine,&b.node[0][0].state);
+   b.node[0][0].state.queuehead = 0;
+   b.count[0] = 1;
+   return (book_search (&b,0,0,worker,workers) ? b.value : NAN);
 }
 
-          /***************************************************************************/
-          /***************************************************************************/
-          /***************************************************************************/
+static void book_usage ()
+{
+   fprintf (stderr,"USAGE: tint-book -o file [-j workers] [-w beam]\n");
+   fprintf (stderr,"  -o <file>    Write the book to this file\n");
+   fprintf (stderr,"  -j <workers> Number of orders searched at the same time (default: one per processor)\n");
+   fprintf (stderr,"  -w <beam>    Boards kept after each shape (default %d, 1 plays like the bot)\n",BOOK_BEAM);
+   exit (EXIT_FAILURE);
+}
 
-int main (int argc,char *argv[])
+/*
+ * Opening book: every order of the first bag is searched shape by shape,
+ * keeping the boards the bot judges best after each, and the places that
+ * lead to the best board at the end of the bag are written to a table the
+ * game maps. Workers share the book in memory and each adds up the values
+ * of the boards it ends on
+ */
+int tintbook_main (int argc,char *argv[])
 {
-   bool finished;
-   int ch;
-   engine_t engine;
-   /* Initialize */
-   rand_init ();							/* must be called before engine_init () */
-   engine_init (&engine,score_function);	/* must be called before using engine.curshape */
-   finished = shownext = shadow = FALSE;
-   memset (shapecount,0,NUMSHAPES * sizeof (int));
-   shapecount[engine.curshape]++;
-   parse_options (argc,argv);				/* must be called after initializing variables */
-   engine.shadow = shadow;
-   if (level < MINLEVEL) choose_level ();
-   io_init ();
-   drawbackground ();
-   in_timeout (DELAY);
-   /* Main loop */
-   do
+   const char *filename = NULL;
+   tintbook_t *table;
+   tintbook_entry_t *entry;
+   pid_t pid[SIM_MAXWORKERS];
+   double *value,sum = 0;
+   size_t size;
+   int64_t start,took;
+   long lines = 0;
+   int i,status,workers = sysconf (_SC_NPROCESSORS_ONLN),beam = BOOK_BEAM;
+   FILE *fp;
+   bool ok = TRUE;
+   for (i = 1; i < argc; i++)
 	 {
-		/* draw shape */
-		showstatus (&engine);
-		drawboard (engine.board);
-		out_refresh ();
-		/* Check if user pressed a key */
-		if ((ch = in_getch ()) != ERR)
+		if ((strcmp (argv[i],"-o") == 0) && (i + 1 < argc)) filename = argv[++i];
+		else if ((strcmp (argv[i],"-j") == 0) && (i + 1 < argc))
 		  {
-			 switch (ch)
-			   {
-				case 'j':
-				case KEY_LEFT:
-				  engine_move (&engine,ACTION_LEFT);
-				  break;
-				case 'k':
-				case KEY_UP:
-				case '\n':
-				  engine_move (&engine,ACTION_ROTATE);
-				  break;
-				case 'l':
-				case KEY_RIGHT:
-				  engine_move (&engine,ACTION_RIGHT);
-				  break;
-				case KEY_DOWN:
-				  engine_move (&engine,ACTION_DROP);
-				  break;
-				case ' ':
-				  engine_move (&engine,ACTION_DROP);
-				  finished = evaluate(&engine);          /* prevent key press after drop */
-				  break;
-				  /* show next piece */
-				case 's':
-				  shownext = TRUE;
-				  break;
-				  /* toggle dotted lines */
-				case 'd':
-				  dottedlines = !dottedlines;
-				  break;
-				  /* next level */
-				case 'a':
-				  if (level < MAXLEVEL)
-					{
-					   level++;
-					   in_timeout (DELAY);
-					}
-				  else out_beep ();
-				  break;
-				  /* quit */
-				case 'q':
-				  finished = TRUE;
-				  break;
-				  /* pause */
-				case 'p':
-				  out_setcolor (COLOR_WHITE,COLOR_BLACK);
-				  out_gotoxy ((out_width () - 34) / 2,out_height () - 2);
-				  out_printf ("Paused - Press any key to continue");
-				  while ((ch = in_getch ()) == ERR) ;	/* Wait for a key to be pressed */
-				  in_flush ();							/* Clear keyboard buffer */
-				  out_gotoxy ((out_width () - 34) / 2,out_height () - 2);
-				  out_printf ("                                  ");
-				  break;
-				  /* unknown keypress */
-				default:
-				  out_beep ();
-			   }
-			 in_flush ();
+			 if (!str2int (&workers,argv[++i]) || (workers < 1) || (workers > SIM_MAXWORKERS)) book_usage ();
 		  }
-		else
-		  finished = evaluate(&engine);
+		else if ((strcmp (argv[i],"-w") == 0) && (i + 1 < argc))
+		  {
+			 if (!str2int (&beam,argv[++i]) || (beam < 1)) book_usage ();
+		  }
+		else book_usage ();
 	 }
-   while (!finished);
-   /* Restore console settings and exit */
-   io_close ();
-   /* Don't bother the player if he want's to quit */
-   if (ch != 'q')
+   if (filename == NULL) book_usage ();
+   /* the workers get an order of the first two shapes at least */
+   if (workers > TINTBOOK_SHAPES * (TINTBOOK_SHAPES - 1)) workers = TINTBOOK_SHAPES * (TINTBOOK_SHAPES - 1);
+   size = sizeof (tintbook_t) + TINTBOOK_ORDERS * sizeof (tintbook_entry_t) + workers * sizeof (double);
+   if ((table = mmap (NULL,size,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_ANONYMOUS,-1,0)) == MAP_FAILED)
 	 {
-		showplayerstats (&engine);
-		savescores (GETSCORE (engine.score));
+		fprintf (stderr,"Error sharing memory with the workers: %s\n",strerror (errno));
+		exit (EXIT_FAILURE);
+	 }
+   entry = table->entry;
+   value = (double *) (entry + TINTBOOK_ORDERS);
+   start = monotime ();
+   for (i = 0; i < workers; i++)
+	 {
+		if ((pid[i] = fork ()) == 0)
+		  {
+			 value[i] = book_worker (entry,beam,i,workers);
+			 _exit (isnan (value[i]) ? EXIT_FAILURE : EXIT_SUCCESS);
+		  }
+		if (pid[i] < 0)
+		  {
+			 fprintf (stderr,"Error starting a worker: %s\n",strerror (errno));
+			 exit (EXIT_FAILURE);
+		  }
+	 }
+   for (i = 0; i < workers; i++)
+	 if ((waitpid (pid[i],&status,0) < 0) || !WIFEXITED (status) || (WEXITSTATUS (status) != EXIT_SUCCESS)) ok = FALSE;
+   took = monotime () - start;
+   if (!ok)
+	 {
+		fprintf (stderr,"A worker failed\n");
+		exit (EXIT_FAILURE);
+	 }
+   memcpy (table->magic,TINTBOOK_MAGIC,8);
+   table->version = TINTBOOK_VERSION;
+   table->count = TINTBOOK_ORDERS;
+   table->width = NUMCOLS - 3;
+   table->height = NUMROWS - 3;
+   table->beam = beam;
+   memcpy (table->weights,botweights,sizeof (table->weights));
+   if ((fp = fopen (filename,"w")) != NULL)
+	 {
+		ok = fwrite (table,sizeof (tintbook_t) + TINTBOOK_ORDERS * sizeof (tintbook_entry_t),1,fp) == 1;
+		ok = (fclose (fp) == 0) && ok;
+	 }
+   if ((fp == NULL) || !ok)
+	 {
+		fprintf (stderr,"Error writing %s: %s\n",filename,strerror (errno));
+		unlink (filename);
+		exit (EXIT_FAILURE);
 	 }
+   for (i = 0; i < workers; i++) sum += value[i];
+   for (i = 0; i < TINTBOOK_ORDERS; i++) lines += entry[i].lines;
+   printf ("%d orders of the first bag in %.2f s with %d workers: on average %.3f lines cleared and a board judged %.3f\n",
+		   TINTBOOK_ORDERS,took / 1e6,workers,(double) lines / TINTBOOK_ORDERS,sum / TINTBOOK_ORDERS);
+   munmap (table,size);
    exit (EXIT_SUCCESS);
 }
 
+int main (int argc,char *argv[])
+{
+#ifdef TINTD
+   return (tintd_main (argc,argv));
+#elif defined(TINTSIM)
+   return (tintsim_main (argc,argv));
+#elif defined(TINTTUNE)
+   return (tinttune_main (argc,argv));
+#elif defined(TINTORACLE)
+   return (tintoracle_main (argc,argv));
+#elif defined(TINTINDEX)
+   return (tintindex_main (argc,argv));
+#elif defined(TINTARENA)
+   return (tintarena_main (argc,argv));
+#elif defined(TINTBOOK)
+   return (tintbook_main (argc,argv));
+#else
+   return (tint_main (argc,argv));
+#endif
+}
@@ -0,0 +1,108 @@
+/*
+ * Format of the opening book tint-book writes.
+ *
+ * The book holds where to put every shape of the first bag of a game, for
+ * every order the bag can come in. The board is empty when a game starts,
+ * so the places only depend on the order, and the book is a table of one
+ * entry for each of them, numbered as tintbook_rank() numbers the orders.
+ * Places are given as the engine numbers them: the column of the centre of
+ * rotation counting the left wall, its row counting the row above the board,
+ * and the rotation.
+ *
+ *    const tintbook_t *book = tintbook_open ("book");
+ *    if (book != NULL) ... book->entry[tintbook_rank (bag)].place[i].x ...
+ *    tintbook_close (book);
+ */
+
+#ifndef TINTBOOK_H
+#define TINTBOOK_H
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define TINTBOOK_MAGIC		"TINTBOK"
+#define TINTBOOK_VERSION	1
+
+/* Shapes in a bag, and the orders it can come in */
+#define TINTBOOK_SHAPES		7
+#define TINTBOOK_ORDERS		5040
+
+/* Features the boards are judged by */
+#define TINTBOOK_WEIGHTS	5
+
+typedef struct
+{
+   int8_t x,y;
+   uint8_t rotation;
+} tintbook_place_t;
+
+typedef struct
+{
+   tintbook_place_t place[TINTBOOK_SHAPES];	/* where each shape goes, in the order they come */
+   uint8_t lines;							/* lines the bag clears */
+   uint8_t reserved[2];
+} tintbook_entry_t;
+
+typedef struct
+{
+   char magic[8];
+   uint32_t version;
+   uint32_t count;							/* number of entries */
+   uint32_t width,height;					/* size of the board, without the walls */
+   uint32_t beam;							/* boards the search kept after each shape */
+   uint32_t reserved0;
+   double weights[TINTBOOK_WEIGHTS];		/* weights the boards were judged with */
+   uint8_t reserved[24];
+   tintbook_entry_t entry[];
+} tintbook_t;
+
+/* Number of an order of the shapes 0 to TINTBOOK_SHAPES - 1 */
+static inline uint32_t tintbook_rank (const int *bag)
+{
+   uint32_t rank = 0;
+   int i,j,smaller;
+   for (i = 0; i < TINTBOOK_SHAPES; i++)
+	 {
+		for (j = i + 1, smaller = 0; j < TINTBOOK_SHAPES; j++) smaller += bag[j] < bag[i];
+		rank = rank * (TINTBOOK_SHAPES - i) + smaller;
+	 }
+   return rank;
+}
+
+/* Map a book. Returns NULL if it can't be read or isn't one */
+static inline const tintbook_t *tintbook_open (const char *filename)
+{
+   const tintbook_t *book;
+   struct stat st;
+   void *p;
+   int fd;
+   if ((fd = open (filename,O_RDONLY)) < 0) return NULL;
+   if ((fstat (fd,&st) < 0) || (st.st_size < (off_t) sizeof (tintbook_t)))
+	 {
+		close (fd);
+		return NULL;
+	 }
+   p = mmap (NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+   close (fd);
+   if (p == MAP_FAILED) return NULL;
+   book = (const tintbook_t *) p;
+   if (memcmp (book->magic,TINTBOOK_MAGIC,8) || (book->version != TINTBOOK_VERSION) || (book->count != TINTBOOK_ORDERS) ||
+	   ((uint64_t) st.st_size != sizeof (tintbook_t) + book->count * sizeof (tintbook_entry_t)))
+	 {
+		munmap (p,st.st_size);
+		return NULL;
+	 }
+   return book;
+}
+
+/* Unmap a book */
+static inline void tintbook_close (const tintbook_t *book)
+{
+   if (book != NULL) munmap ((void *) book,sizeof (tintbook_t) + book->count * sizeof (tintbook_entry_t));
+}
+
+#endif	/* #ifndef TINTBOOK_H */
@@ -0,0 +1,187 @@
+/*
+ * Format of the index of positions tint-index writes.
+ *
+ * The index maps the board after every shape that came to rest in a set of
+ * replays to where it happened: the replay and the number of shapes placed
+ * in it so far. Positions are looked up by a hash of what is searched for,
+ * so nothing has to be played back:
+ *
+ *    TINTINDEX_BOARD      the board, cell for cell
+ *    TINTINDEX_SURFACE    the shape of the stack: how much higher each
+ *                         column is than the lowest one, whatever is below
+ *    TINTINDEX_TOPOUT     the height of the stack TINTINDEX_TOPOUTSHAPES
+ *                         shapes before a game was lost, indexed at the
+ *                         shape that lost it
+ *
+ * Boards are given as rows top to bottom, bit x set if column x (counting
+ * from 0) is taken. A file starts with a header, followed by the names of
+ * the replays, the buckets of the hash table and the entries, sorted by
+ * hash, so that all the entries of a hash are next to each other.
+ *
+ *    const tintindex_t *index = tintindex_open ("positions");
+ *    const tintindex_entry_t *entry;
+ *    size_t i,n = tintindex_find (index,tintindex_board (10,20,row),&entry);
+ *    for (i = 0; i < n; i++) ... tintindex_name (index,entry[i].game) ...
+ *    tintindex_close (index);
+ */
+
+#ifndef TINTINDEX_H
+#define TINTINDEX_H
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define TINTINDEX_MAGIC		"TINTIDX"
+#define TINTINDEX_VERSION	1
+
+/* What is hashed */
+#define TINTINDEX_BOARD		1
+#define TINTINDEX_SURFACE	2
+#define TINTINDEX_TOPOUT	3
+
+/* Shapes before the end of a lost game that the height of its stack is taken */
+#define TINTINDEX_TOPOUTSHAPES	10
+
+typedef struct
+{
+   uint64_t hash;
+   uint32_t game;							/* replay, numbered as in the names */
+   uint32_t piece;							/* shapes placed in it so far */
+} tintindex_entry_t;
+
+typedef struct
+{
+   char magic[8];
+   uint32_t version;
+   uint32_t numgames;
+   uint64_t numentries;
+   uint32_t bits;							/* the buckets are the top bits of the hash */
+   uint32_t reserved0;
+   uint64_t names;							/* offset of where each name starts, from the start of the file */
+   uint64_t buckets;						/* offset of the first entry of each bucket, and the number of entries */
+   uint64_t entries;						/* offset of the entries */
+   uint64_t size;							/* size of the file */
+   uint8_t reserved[8];
+} tintindex_t;
+
+/* Mix a value into a hash */
+static inline uint64_t tintindex_mix (uint64_t hash,uint64_t value)
+{
+   hash = (hash ^ value) * 0x9e3779b97f4a7c15ull;
+   return hash ^ (hash >> 31);
+}
+
+/* Hash of a board of the specified size */
+static inline uint64_t tintindex_board (int width,int height,const uint64_t *row)
+{
+   uint64_t hash = tintindex_mix (tintindex_mix (TINTINDEX_BOARD,width),height);
+   int y;
+   for (y = 0; y < height; y++) hash = tintindex_mix (hash,row[y]);
+   return tintindex_mix (hash,0);
+}
+
+/* Height of the stack on a board of the specified size */
+static inline int tintindex_height (int width,int height,const uint64_t *row)
+{
+   int y;
+   for (y = 0; (y < height) && !(row[y] & ((1ull << width) - 1)); y++) ;
+   return height - y;
+}
+
+/* Hash of the surface of the stack on a board of the specified size */
+static inline uint64_t tintindex_surface (int width,int height,const uint64_t *row)
+{
+   uint64_t hash = tintindex_mix (TINTINDEX_SURFACE,width);
+   int x,y,top[64],lowest = height;
+   for (x = 0; x < width; x++)
+	 {
+		for (y = 0; (y < height) && !(row[y] & (1ull << x)); y++) ;
+		top[x] = height - y;
+		if (top[x] < lowest) lowest = top[x];
+	 }
+   for (x = 0; x < width; x++) hash = tintindex_mix (hash,top[x] - lowest);
+   return tintindex_mix (hash,0);
+}
+
+/* Hash of the height of the stack a game on a board of the specified size */
+/* was lost from */
+static inline uint64_t tintindex_topout (int width,int height,int stack)
+{
+   return tintindex_mix (tintindex_mix (tintindex_mix (tintindex_mix (TINTINDEX_TOPOUT,width),height),stack),0);
+}
+
+/* Map an index. Returns NULL if it can't be read or isn't one */
+static inline const tintindex_t *tintindex_open (const char *filename)
+{
+   const tintindex_t *index;
+   const uint64_t *name;
+   struct stat st;
+   uint32_t i;
+   void *p;
+   int fd;
+   if ((fd = open (filename,O_RDONLY)) < 0) return NULL;
+   if ((fstat (fd,&st) < 0) || (st.st_size < (off_t) sizeof (tintindex_t)))
+	 {
+		close (fd);
+		return NULL;
+	 }
+   p = mmap (NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+   close (fd);
+   if (p == MAP_FAILED) return NULL;
+   index = (const tintindex_t *) p;
+   if (memcmp (index->magic,TINTINDEX_MAGIC,8) || (index->version != TINTINDEX_VERSION) || (index->bits > 40) ||
+	   (index->size != (uint64_t) st.st_size) || (index->names < sizeof (tintindex_t)) || (index->names > index->buckets) ||
+	   (index->buckets > index->entries) || (index->entries > index->size) ||
+	   (index->numentries > index->size / sizeof (tintindex_entry_t)) || (index->names + index->numgames * sizeof (uint64_t) > index->buckets) ||
+	   (index->buckets + ((1ull << index->bits) + 1) * sizeof (uint64_t) > index->entries) ||
+	   (index->entries + index->numentries * sizeof (tintindex_entry_t) != index->size) ||
+	   (index->names % 8) || (index->buckets % 8) || (index->entries % 8) ||
+	   (index->numgames && ((const char *) p)[index->buckets - 1]))
+	 {
+		munmap (p,st.st_size);
+		return NULL;
+	 }
+   /* every name starts after the table of names and ends before the buckets */
+   name = (const uint64_t *) ((const char *) p + index->names);
+   for (i = 0; i < index->numgames; i++)
+	 if ((name[i] < index->names + index->numgames * sizeof (uint64_t)) || (name[i] >= index->buckets))
+	   {
+		  munmap (p,st.st_size);
+		  return NULL;
+	   }
+   return index;
+}
+
+/* Name of a replay in an index, NULL if there is no such replay */
+static inline const char *tintindex_name (const tintindex_t *index,uint32_t game)
+{
+   if (game >= index->numgames) return NULL;
+   return ((const char *) index + ((const uint64_t *) ((const char *) index + index->names))[game]);
+}
+
+/* Find the entries of a hash in an index. Returns how many there are */
+static inline size_t tintindex_find (const tintindex_t *index,uint64_t hash,const tintindex_entry_t **found)
+{
+   const uint64_t *bucket = (const uint64_t *) ((const char *) index + index->buckets);
+   const tintindex_entry_t *entry = (const tintindex_entry_t *) ((const char *) index + index->entries);
+   uint64_t b = index->bits ? hash >> (64 - index->bits) : 0,i = bucket[b],end = bucket[b + 1],n;
+   /* a damaged bucket doesn't reach past the entries */
+   if (end > index->numentries) end = index->numentries;
+   if (i > end) i = end;
+   while ((i < end) && (entry[i].hash < hash)) i++;
+   for (n = 0; (i + n < end) && (entry[i + n].hash == hash); n++) ;
+   *found = entry + i;
+   return n;
+}
+
+/* Unmap an index */
+static inline void tintindex_close (const tintindex_t *index)
+{
+   if (index != NULL) munmap ((void *) index,index->size);
+}
+
+#endif	/* #ifndef TINTINDEX_H */
@@ -0,0 +1,98 @@
+/*
+ * tintpeek - show the state a running tint publishes in shared memory
+ *
+ * This is a demonstration of the reader API in tintshm.h. Start a game with
+ * tint --publish name, then run tintpeek name to follow it, or tintpeek -r
+ * name to see how fast snapshots can be taken.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+#include "tintshm.h"
+
+/* Time between two snapshots that are shown (in microseconds) */
+#define INTERVAL 200000
+
+static const char blocks[] = " RGYBMCW";
+
+/* Current time in microseconds */
+static int64_t now ()
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC,&ts);
+   return ((int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+/* Print the boards of a snapshot next to each other */
+static void show (const tintshm_snapshot_t *snap)
+{
+   int i,x,y,v;
+   printf ("\033[H\033[2Jtick %llu\n\n",(unsigned long long) snap->tick);
+   for (i = 0; i < snap->nboards; i++)
+	 printf ("level %-2d score %-7d",snap->board[i].level,snap->board[i].score);
+   printf ("\n");
+   for (i = 0; i < snap->nboards; i++)
+	 printf ("lines %-4d garbage %-3d ",snap->board[i].droppedlines,snap->board[i].garbage);
+   printf ("\n");
+   for (y = 1; y < TINTSHM_ROWS - 1; y++)
+	 {
+		for (i = 0; i < snap->nboards; i++)
+		  {
+			 for (x = 0; x < TINTSHM_COLS - 1; x++)
+			   {
+				  v = snap->board[i].board[x][y];
+				  putchar (v == TINTSHM_WALL ? '#' : v == TINTSHM_GARBAGE ? '=' : v < 8 ? blocks[v] : '?');
+			   }
+			 printf ("%s",snap->board[i].finished && y == 10 ? " GAME OVER  " : "            ");
+		  }
+		printf ("\n");
+	 }
+   fflush (stdout);
+}
+
+int main (int argc,char *argv[])
+{
+   const tintshm_t *shm;
+   tintshm_snapshot_t snap;
+   const char *name = argv[argc - 1];
+   int64_t start,end,worst = 0,t;
+   long reads = 0,failed = 0;
+   int rate = (argc == 3) && (strcmp (argv[1],"-r") == 0);
+   if ((argc != 2) && !rate)
+	 {
+		fprintf (stderr,"USAGE: tintpeek [-r] name\n");
+		fprintf (stderr,"  -r           Take snapshots as fast as possible for a second\n");
+		exit (EXIT_FAILURE);
+	 }
+   if ((shm = tintshm_open (name)) == NULL)
+	 {
+		fprintf (stderr,"No game is published as %s\n",name);
+		exit (EXIT_FAILURE);
+	 }
+   /* nothing is shown of a snapshot that couldn't be taken, but the game */
+   /* is taken to be running until one says otherwise */
+   memset (&snap,0,sizeof (snap));
+   snap.running = 1;
+   if (rate)
+	 {
+		start = now ();
+		for (end = start; end - start < 1000000; end = t)
+		  {
+			 if (tintshm_read (shm,&snap)) reads++; else failed++;
+			 t = now ();
+			 if (t - end > worst) worst = t - end;
+		  }
+		printf ("%ld snapshots in %.2f s (%.2f us each, worst %lld us), %ld failed, game at tick %llu\n",
+				reads,(end - start) / 1e6,(double) (end - start) / (reads + failed),(long long) worst,failed,
+				(unsigned long long) snap.tick);
+	 }
+   else
+	 do
+	   {
+		  if (tintshm_read (shm,&snap)) show (&snap);
+		  usleep (INTERVAL);
+	   }
+	 while (snap.running);
+   tintshm_close (shm);
+   exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,121 @@
+/*
+ * tintquery - find positions in an index of replays tint-index wrote
+ *
+ * A board is drawn the way it looks, the bottom rows of it at least: X (or
+ * any other character) for a block, a dot or a space for an empty cell.
+ * The longest row gives the width of the board. tintquery finds every time
+ * a shape came to rest and left the board like that, or with -s, left a
+ * stack of the same shape. With -t, it finds the games that were lost
+ * with the stack that high ten shapes before the end.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include "tintindex.h"
+
+/* Matches shown, unless told otherwise */
+#define MATCHES 20
+
+/* Largest board */
+#define MAXWIDTH	40
+#define MAXHEIGHT	61
+
+static void usage ()
+{
+   fprintf (stderr,"USAGE: tintquery [-n count] [-s] [-H height] index file\n");
+   fprintf (stderr,"       tintquery [-n count] [-W width] [-H height] -t height index\n");
+   fprintf (stderr,"  -n <count>   Show this many matches (default %d)\n",MATCHES);
+   fprintf (stderr,"  -s           Match the shape of the stack instead of the whole board\n");
+   fprintf (stderr,"  -W <width>   Width of the board (default 10)\n");
+   fprintf (stderr,"  -H <height>  Height of the board (default 20)\n");
+   fprintf (stderr,"  -t <height>  Find the games lost from a stack this high\n");
+   fprintf (stderr,"  file         File the board is drawn in, - for the standard input\n");
+   exit (EXIT_FAILURE);
+}
+
+/* Current time in microseconds */
+static int64_t now ()
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC,&ts);
+   return ((int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+/* Read a board drawn in a file, at the bottom of a board of the specified */
+/* height. Returns its width, 0 if it can't be read */
+static int readboard (const char *filename,int height,uint64_t *row)
+{
+   char line[256];
+   uint64_t drawn[MAXHEIGHT];
+   FILE *fp = strcmp (filename,"-") ? fopen (filename,"r") : stdin;
+   int x,n = 0,width = 0;
+   if (fp == NULL) return (0);
+   while (fgets (line,sizeof (line),fp) != NULL)
+	 {
+		if (n == height) return (0);
+		for (x = 0, drawn[n] = 0; line[x] && (line[x] != '\n') && (line[x] != '\r'); x++)
+		  {
+			 if (x == MAXWIDTH) return (0);
+			 if ((line[x] != '.') && (line[x] != ' ')) drawn[n] |= 1ull << x;
+		  }
+		if (x > width) width = x;
+		n++;
+	 }
+   if (fp != stdin) fclose (fp);
+   memset (row,0,height * sizeof (uint64_t));
+   memcpy (row + height - n,drawn,n * sizeof (uint64_t));
+   return (width);
+}
+
+int main (int argc,char *argv[])
+{
+   const tintindex_t *index;
+   const tintindex_entry_t *entry;
+   const char *name;
+   uint64_t row[MAXHEIGHT],hash;
+   int64_t start,took;
+   size_t i,n,games;
+   int j,width = 10,height = 20,stack = -1,matches = MATCHES;
+   int surface = 0;
+   for (j = 1; j < argc - 1; j++)
+	 {
+		if ((strcmp (argv[j],"-n") == 0) && (j + 1 < argc - 1)) matches = atoi (argv[++j]);
+		else if ((strcmp (argv[j],"-W") == 0) && (j + 1 < argc - 1)) width = atoi (argv[++j]);
+		else if ((strcmp (argv[j],"-H") == 0) && (j + 1 < argc - 1)) height = atoi (argv[++j]);
+		else if ((strcmp (argv[j],"-t") == 0) && (j + 1 < argc - 1)) stack = atoi (argv[++j]);
+		else if (strcmp (argv[j],"-s") == 0) surface = 1;
+		else break;
+	 }
+   if ((matches < 0) || (width < 1) || (width > MAXWIDTH) || (height < 1) || (height > MAXHEIGHT) ||
+	   (j != argc - (stack < 0 ? 2 : 1)) || ((stack >= 0) && surface))
+	 usage ();
+   if ((index = tintindex_open (argv[j])) == NULL)
+	 {
+		fprintf (stderr,"%s is not an index of replays\n",argv[j]);
+		exit (EXIT_FAILURE);
+	 }
+   if (stack >= 0) hash = tintindex_topout (width,height,stack);
+   else if (!(width = readboard (argv[j + 1],height,row)))
+	 {
+		fprintf (stderr,"Error reading a board of up to %d rows from %s\n",height,argv[j + 1]);
+		exit (EXIT_FAILURE);
+	 }
+   else hash = surface ? tintindex_surface (width,height,row) : tintindex_board (width,height,row);
+   start = now ();
+   n = tintindex_find (index,hash,&entry);
+   took = now () - start;
+   for (i = games = 0; i < n; i++)
+	 {
+		if ((name = tintindex_name (index,entry[i].game)) == NULL)
+		  {
+			 fprintf (stderr,"%s is damaged\n",argv[j]);
+			 exit (EXIT_FAILURE);
+		  }
+		if (!i || (entry[i].game != entry[i - 1].game)) games++;
+		if (i < (size_t) matches) printf ("%s: after shape %u\n",name,entry[i].piece);
+	 }
+   printf ("%zu positions in %zu games, found in %lld us\n",n,games,(long long) took);
+   tintindex_close (index);
+   exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,136 @@
+/*
+ * Reader API for the game state a running tint publishes in shared memory
+ * (tint --publish name).
+ *
+ * The game copies the state of every board into the segment once per tick,
+ * inside a seqlock: the sequence number is odd while the copy is made and
+ * goes up by two for every tick. A reader copies the state out and keeps it
+ * only if the sequence number was even and did not change meanwhile, so it
+ * never blocks the game and needs no system calls once the segment is mapped.
+ *
+ *    const tintshm_t *shm = tintshm_open ("tint");
+ *    tintshm_snapshot_t snap;
+ *    if (shm != NULL && tintshm_read (shm,&snap)) ... snap.board[0].score ...
+ *    tintshm_close (shm);
+ */
+
+#ifndef TINTSHM_H
+#define TINTSHM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define TINTSHM_MAGIC		"TINTSHM"
+#define TINTSHM_VERSION		1
+
+/* Size of a board, including the walls */
+#define TINTSHM_COLS		13
+#define TINTSHM_ROWS		23
+
+/* Value of a wall and of a garbage block on the board, 0 is empty and */
+/* anything else is the color of a block */
+#define TINTSHM_WALL		16
+#define TINTSHM_GARBAGE		17
+
+/* Most boards a game can have (versus mode) */
+#define TINTSHM_MAXBOARDS	4
+
+/* Times a reader tries again when the game was busy writing */
+#define TINTSHM_RETRIES		1000
+
+typedef struct
+{
+   int32_t curx,cury;						/* position of the current shape */
+   int32_t curshape,nextshape;				/* current & next shapes */
+   int32_t score;							/* score as shown */
+   int32_t level;							/* level */
+   int32_t moves;							/* status of the current shape */
+   int32_t rotations;
+   int32_t dropcount;
+   int32_t efficiency;
+   int32_t droppedlines;
+   int32_t currentdroppedlines;
+   int32_t garbage;						/* garbage rows waiting */
+   int32_t finished;						/* board is full */
+   int32_t board[TINTSHM_COLS][TINTSHM_ROWS];	/* board[x][y], (0,0) is top left */
+} tintshm_board_t;
+
+typedef struct
+{
+   uint64_t tick;							/* ticks published so far */
+   int32_t running;						/* 0 once the game has ended */
+   int32_t nboards;						/* number of boards */
+   tintshm_board_t board[TINTSHM_MAXBOARDS];
+} tintshm_snapshot_t;
+
+typedef struct
+{
+   char magic[8];
+   uint32_t version;
+   uint32_t size;							/* size of the segment */
+   int32_t pid;							/* process id of the game */
+   uint32_t seq;							/* seqlock, odd while being written */
+   tintshm_snapshot_t snapshot;
+} tintshm_t;
+
+/* Name of the segment as shm_open() wants it */
+static inline void tintshm_name (char *buf,size_t len,const char *name)
+{
+   snprintf (buf,len,"%s%s",name[0] == '/' ? "" : "/",name);
+}
+
+/* Map the segment a game publishes to. Returns NULL if there is none */
+static inline const tintshm_t *tintshm_open (const char *name)
+{
+   char path[256];
+   struct stat st;
+   void *p;
+   int fd;
+   tintshm_name (path,sizeof (path),name);
+   if ((fd = shm_open (path,O_RDONLY,0)) < 0) return NULL;
+   if ((fstat (fd,&st) < 0) || (st.st_size < (off_t) sizeof (tintshm_t)))
+	 {
+		close (fd);
+		return NULL;
+	 }
+   p = mmap (NULL,sizeof (tintshm_t),PROT_READ,MAP_SHARED,fd,0);
+   close (fd);
+   if (p == MAP_FAILED) return NULL;
+   if (memcmp (((const tintshm_t *) p)->magic,TINTSHM_MAGIC,8) || (((const tintshm_t *) p)->version != TINTSHM_VERSION))
+	 {
+		munmap (p,sizeof (tintshm_t));
+		return NULL;
+	 }
+   return (const tintshm_t *) p;
+}
+
+/* Copy a consistent snapshot of the game. Returns 1 if successful, 0 if */
+/* the game kept writing for TINTSHM_RETRIES tries */
+static inline int tintshm_read (const tintshm_t *shm,tintshm_snapshot_t *snap)
+{
+   uint32_t before,after;
+   int i;
+   for (i = 0; i < TINTSHM_RETRIES; i++)
+	 {
+		before = __atomic_load_n (&shm->seq,__ATOMIC_ACQUIRE);
+		if (before & 1) continue;
+		memcpy (snap,(const void *) &shm->snapshot,sizeof (tintshm_snapshot_t));
+		__atomic_thread_fence (__ATOMIC_ACQUIRE);
+		after = __atomic_load_n (&shm->seq,__ATOMIC_RELAXED);
+		if (before == after) return 1;
+	 }
+   return 0;
+}
+
+/* Unmap the segment */
+static inline void tintshm_close (const tintshm_t *shm)
+{
+   if (shm != NULL) munmap ((void *) shm,sizeof (tintshm_t));
+}
+
+#endif	/* #ifndef TINTSHM_H */
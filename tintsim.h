@@ -0,0 +1,88 @@
+/*
+ * Format of the training samples tint-sim --export writes.
+ *
+ * A file starts with a header and is followed by one sample for every shape
+ * a bot placed, all of the same size, so it can be mapped and indexed
+ * directly. The samples of a game are written in the order the shapes were
+ * placed, and a game's outcome is recorded in every sample of it.
+ *
+ *    const tintsim_t *sim = tintsim_open ("samples");
+ *    if (sim != NULL) ... sim->sample[i].rotation ...
+ *    tintsim_close (sim);
+ */
+
+#ifndef TINTSIM_H
+#define TINTSIM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define TINTSIM_MAGIC		"TINTSIM"
+#define TINTSIM_VERSION		1
+
+/* Size of the board, without the walls */
+#define TINTSIM_COLS		10
+#define TINTSIM_ROWS		20
+
+typedef struct
+{
+   uint16_t board[TINTSIM_ROWS];			/* rows top to bottom, bit x set if column x is taken */
+   uint32_t bag;							/* shapes left in the bag after the next one, a bit each */
+   uint16_t linesafter;					/* lines cleared from this shape to the end of the game */
+   uint16_t piecesleft;					/* shapes placed after this one */
+   uint8_t current,next;					/* shapes, numbered as in the set */
+   int8_t x,y;								/* where the centre of rotation came to rest */
+   uint8_t rotation;						/* rotation it came to rest in */
+   uint8_t lines;							/* lines this shape cleared */
+   uint8_t lost;							/* 1 if the game ended with a full board */
+   uint8_t reserved[9];
+} tintsim_sample_t;
+
+typedef struct
+{
+   char magic[8];
+   uint32_t version;
+   uint32_t stride;						/* size of a sample */
+   uint64_t count;							/* number of samples */
+   char pieces[16];						/* set of shapes the games were played with */
+   uint8_t reserved[24];
+   tintsim_sample_t sample[];
+} tintsim_t;
+
+/* Map a file of samples. Returns NULL if it can't be read or isn't one */
+static inline const tintsim_t *tintsim_open (const char *filename)
+{
+   const tintsim_t *sim;
+   struct stat st;
+   void *p;
+   int fd;
+   if ((fd = open (filename,O_RDONLY)) < 0) return NULL;
+   if ((fstat (fd,&st) < 0) || (st.st_size < (off_t) sizeof (tintsim_t)))
+	 {
+		close (fd);
+		return NULL;
+	 }
+   p = mmap (NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+   close (fd);
+   if (p == MAP_FAILED) return NULL;
+   sim = (const tintsim_t *) p;
+   if (memcmp (sim->magic,TINTSIM_MAGIC,8) || (sim->version != TINTSIM_VERSION) ||
+	   (sim->stride != sizeof (tintsim_sample_t)) || ((uint64_t) st.st_size != sizeof (tintsim_t) + sim->count * sim->stride))
+	 {
+		munmap (p,st.st_size);
+		return NULL;
+	 }
+   return sim;
+}
+
+/* Unmap a file of samples */
+static inline void tintsim_close (const tintsim_t *sim)
+{
+   if (sim != NULL) munmap ((void *) sim,sizeof (tintsim_t) + sim->count * sim->stride);
+}
+
+#endif	/* #ifndef TINTSIM_H */